@@ -20,6 +20,7 @@
 bool alive = false;
 u8 aboot_hint_present = 0;
 bool asilent = false;
+u32 aicache_size = 0; //0 : default
 
 void args_parse(char* cmdline)
 {
@@ -32,6 +33,8 @@ void args_parse(char* cmdline)
         {alive = true; aboot_hint_present = KERNEL_MODE_LIVE;}
         if(strcfirst("-silent", ndash) == 7)
         {asilent = true;}
+        if(strcfirst("-icache=", ndash) == 8)
+        {aicache_size = (u32) atoi((unsigned char*) ndash+8);}
         
         ndash = strchr(ndash+1, '-');
     }
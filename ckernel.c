@@ -45,6 +45,7 @@ void kmain(multiboot_info_t* mbt, void* stack_pointer)
     gdt_install(stack_pointer); //Install GDT : Null segment, Kernel code, Kernel data, User code, User data, TSS
     idt_install(); //TODO : ISRs ! (actually the handle isn't that bad but could be reaaally better)
     cpu_detect(); //TODO : Special handle INVALID_OPCODE
+    fpu_init(); //Enable FPU/SSE (lazy switching)
     vga_text_okmsg();
 
     kprintf("Setting up memory...");
@@ -61,6 +62,9 @@ void kmain(multiboot_info_t* mbt, void* stack_pointer)
     install_block_devices(); //Setup block devices (ATA, ATAPI,...)
 
     process_init(); //Init process array
+    smp_init(); //Start application processors
+    lapic_timer_install(); //Replace the PIT by the local APIC timer
+    workqueue_init(); //Start kernel workers (deferred work)
     scheduler_start();
 
     //DEBUG : printing kernel stack bottom / top ; code start/end
@@ -137,6 +141,8 @@ void kmain(multiboot_info_t* mbt, void* stack_pointer)
     u8 color = (mode == KERNEL_MODE_LIVE ? 0b00001111 : mode == KERNEL_MODE_INSTALLED ? 0b00001111 : 0b00001100);
     vga_text_spemsg(context, color);
 
+    pagecache_init(); //Reserve the page cache pool (file contents)
+
     //mounting root drive/part on /
     kprintf("Mounting root directory...");
     block_device_t* dev = block_devices[(u8) root_drive];
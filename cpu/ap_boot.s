@@ -0,0 +1,84 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2017 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+# APPLICATION PROCESSORS BOOTSTRAP CODE
+# Copied by the BSP at AP_TRAMPOLINE_ADDR (smp_init()) ; APs start here in real mode after the STARTUP IPI
+# Switch to protected mode, enable paging with the kernel page directory, and jump to higher-half entry point
+
+.equ AP_TRAMPOLINE_ADDR, 0x8000
+
+.section .text
+.align 4
+.global ap_trampoline_start
+.code16
+ap_trampoline_start:
+    cli
+    cld
+    xorw %ax, %ax
+    movw %ax, %ds
+
+    # load temporary GDT and enter protected mode
+    lgdtl (ap_gdt_pointer - ap_trampoline_start + AP_TRAMPOLINE_ADDR)
+    movl %cr0, %eax
+    orl $1, %eax
+    movl %eax, %cr0
+    ljmpl $0x08, $(ap_protected_mode - ap_trampoline_start + AP_TRAMPOLINE_ADDR)
+
+.code32
+ap_protected_mode:
+    movw $0x10, %ax
+    movw %ax, %ds
+    movw %ax, %es
+    movw %ax, %fs
+    movw %ax, %gs
+    movw %ax, %ss
+
+    # same paging features as the BSP (page size extension), and kernel page directory
+    movl (ap_trampoline_cr4 - ap_trampoline_start + AP_TRAMPOLINE_ADDR), %eax
+    movl %eax, %cr4
+    movl (ap_trampoline_cr3 - ap_trampoline_start + AP_TRAMPOLINE_ADDR), %eax
+    movl %eax, %cr3
+    movl %cr0, %eax
+    orl $0x80010000, %eax # paging, write protect (as the BSP)
+    movl %eax, %cr0
+
+    # setup stack and jump to higher-half
+    movl (ap_trampoline_stack - ap_trampoline_start + AP_TRAMPOLINE_ADDR), %esp
+    movl (ap_trampoline_entry - ap_trampoline_start + AP_TRAMPOLINE_ADDR), %eax
+    jmp *%eax
+
+.align 8
+ap_gdt:
+    .quad 0
+    .quad 0x00CF9A000000FFFF # code segment
+    .quad 0x00CF92000000FFFF # data segment
+ap_gdt_pointer:
+    .word ap_gdt_pointer - ap_gdt - 1
+    .long ap_gdt - ap_trampoline_start + AP_TRAMPOLINE_ADDR
+
+# parameters, set by the BSP before each STARTUP IPI
+.global ap_trampoline_cr3
+ap_trampoline_cr3: .long 0
+.global ap_trampoline_cr4
+ap_trampoline_cr4: .long 0
+.global ap_trampoline_stack
+ap_trampoline_stack: .long 0
+.global ap_trampoline_entry
+ap_trampoline_entry: .long 0
+
+.global ap_trampoline_end
+ap_trampoline_end:
@@ -0,0 +1,148 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2017 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Local APIC (one per processor) : used to send/receive inter-processor interrupts
+*/
+#include "cpu.h"
+#include "memory/mem.h"
+#include "time/time.h"
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE_ENABLE 0x800
+
+#define PIT_FREQUENCY 1193182
+#define PIT_CALIBRATION_MS 10
+
+u32 lapic_phys = 0;
+volatile u32* lapic_base = 0;
+u32 lapic_timer_frequency = 0;
+
+/*
+* Map the local APIC registers in kernel memory (called once, by the BSP)
+*/
+void lapic_install()
+{
+    //make sure the local APIC is globally enabled
+    u32 msr_lo, msr_hi;
+    asm volatile("rdmsr":"=a"(msr_lo), "=d"(msr_hi):"c"(IA32_APIC_BASE_MSR));
+    msr_lo |= IA32_APIC_BASE_ENABLE;
+    asm volatile("wrmsr"::"a"(msr_lo), "d"(msr_hi), "c"(IA32_APIC_BASE_MSR));
+
+    if(!lapic_phys) lapic_phys = msr_lo & 0xFFFFF000;
+    if(!lapic_phys) lapic_phys = LAPIC_DEFAULT_ADDRESS;
+
+    u32 vaddr = kvm_reserve_block(4096);
+    map_flexible(4096, lapic_phys, vaddr, kernel_page_directory);
+    lapic_base = (volatile u32*) vaddr;
+}
+
+/*
+* Enable the local APIC of the current cpu
+*/
+void lapic_enable()
+{
+    //accept every interrupt priority
+    lapic_write(LAPIC_REG_TPR, 0);
+    //software enable (bit 8), and set spurious interrupt vector
+    lapic_write(LAPIC_REG_SVR, 0x100 | LAPIC_SPURIOUS_VECTOR);
+}
+
+u32 lapic_read(u32 reg)
+{
+    return lapic_base[reg/4];
+}
+
+void lapic_write(u32 reg, u32 value)
+{
+    lapic_base[reg/4] = value;
+}
+
+/*
+* Tell the local APIC that we handled the interrupt
+*/
+void lapic_eoi()
+{
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+/*
+* Send an inter-processor interrupt to the cpu 'lapic_id'
+*/
+void lapic_send_ipi(u8 lapic_id, u32 icr)
+{
+    //the two ICR writes must not be separated by another IPI sent on this cpu
+    u32 flags = irq_save();
+
+    lapic_write(LAPIC_REG_ICR_HIGH, ((u32) lapic_id) << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, icr);
+
+    //wait for the IPI to be delivered
+    while(lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) asm volatile("pause":::"memory");
+
+    irq_restore(flags);
+}
+
+/*
+* Calibrate the local APIC timer (and the TSC, used as monotonic clock) against the PIT (called by kmain(), on the BSP)
+* Once done, the PIT interrupt is masked : each cpu programs its own timer in one-shot mode
+*/
+void lapic_timer_install()
+{
+    kprintf("Calibrating local APIC timer...");
+    if(!lapic_base || !cpu_tsc) {vga_text_skipmsg(); return;}
+
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+
+    //PIT channel 2 in mode 0 (interrupt on terminal count), with gate enabled and speaker disabled
+    u32 pit_count = (PIT_FREQUENCY*PIT_CALIBRATION_MS)/1000;
+    outb(0x61, (inb(0x61) & 0xFC) | 0x01);
+    outb(0x43, 0xB0);
+    outb(0x42, pit_count & 0xFF);
+    outb(0x42, (pit_count >> 8) & 0xFF);
+
+    u32 tsc_start, tsc_end, tsc_hi;
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0xFFFFFFFF);
+    asm volatile("rdtsc":"=a"(tsc_start), "=d"(tsc_hi));
+
+    //OUT2 (bit 5 of port 0x61) goes high when the count reaches 0
+    while(!(inb(0x61) & 0x20));
+
+    asm volatile("rdtsc":"=a"(tsc_end), "=d"(tsc_hi));
+    u32 lapic_elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURRENT);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, 0);
+
+    lapic_timer_frequency = lapic_elapsed / PIT_CALIBRATION_MS;
+    tsc_per_us = (tsc_end - tsc_start) / (PIT_CALIBRATION_MS*1000);
+    if(!lapic_timer_frequency || !tsc_per_us) {lapic_timer_frequency = tsc_per_us = 0; vga_text_failmsg(); return;}
+
+    //the PIT is not used anymore
+    outb(0x21, inb(0x21) | 0x01);
+
+    vga_text_okmsg();
+}
+
+/*
+* Program the local APIC timer of the current cpu to fire once in 'count' ticks (0 stops the timer)
+*/
+void lapic_timer_oneshot(u32 count)
+{
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, count);
+}
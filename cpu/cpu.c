@@ -28,6 +28,11 @@ bool cpu_e_support; //Does CPU support EXTENDED CPUID ?
 u32 cpu_max_ecpuid; //MAX extended CPUID instruction supported by processor
 
 bool cpu_pse = false;
+bool cpu_apic = false;
+bool cpu_tsc = false;
+bool cpu_fpu = false;
+bool cpu_fxsr = false;
+bool cpu_sse = false;
 
 void cpu_vendor_id()
 {
@@ -50,6 +55,11 @@ void cpu_features()
 
     //Special
     cpu_pse = (bool) (cpu_f_edx << 28 >> 31);
+    cpu_apic = (bool) (cpu_f_edx << 22 >> 31);
+    cpu_tsc = (bool) (cpu_f_edx << 27 >> 31);
+    cpu_fpu = (bool) (cpu_f_edx << 31 >> 31);
+    cpu_fxsr = (bool) (cpu_f_edx << 7 >> 31);
+    cpu_sse = (bool) (cpu_f_edx << 6 >> 31);
 
     if(CPU_MAX_CPUID >= 7)
     {
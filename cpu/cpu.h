@@ -18,6 +18,7 @@
 #ifndef CPU_HEAD
 #define CPU_HEAD
 #include "../system.h"
+#include "sync/sync.h"
 
 //CPU Informations
 extern char CPU_VENDOR[13]; //CPU Vendor : GenuineIntel for intel (as example)
@@ -28,6 +29,11 @@ extern bool cpu_e_support; //Does CPU support EXTENDED CPUID ?
 extern u32 cpu_max_ecpuid; //MAX extended CPUID instruction supported by processor
 
 extern bool cpu_pse;
+extern bool cpu_apic; //Does CPU have a local APIC ?
+extern bool cpu_tsc; //Does CPU have a time stamp counter ?
+extern bool cpu_fpu; //Does CPU have a x87 FPU ?
+extern bool cpu_fxsr; //Does CPU support FXSAVE/FXRSTOR ?
+extern bool cpu_sse; //Does CPU support SSE ?
 
 void cpu_detect(void);
 
@@ -64,11 +70,109 @@ typedef struct TSS_ENTRY
     u16 iomap_base;
 } __attribute__((packed)) tss_entry_t;
 
+#define CPU_MAX 8 //maximum number of processors supported
+#define GDT_TSS_BASE 5 //GDT index of the first TSS (one TSS per processor)
+#define GDT_TLS_INDEX (GDT_TSS_BASE+CPU_MAX) //GDT index of the TLS segment (its base is set on each thread switch)
+#define GDT_TLS_SELECTOR ((GDT_TLS_INDEX << 3) | 3)
+
 void gdt_install(void* stack_pointer);
-extern tss_entry_t TSS;
+void gdt_install_ap(u32 cpu_index);
+void gdt_set_tls(u32 cpu_index, u32 base);
+extern tss_entry_t TSS[CPU_MAX];
 
 //Interrupts
 void idt_install(void); //IDT
 void init_idt_desc(int index, u16 select, u32 offset, u16 type);
 
+//Local APIC
+#define LAPIC_DEFAULT_ADDRESS 0xFEE00000
+
+#define LAPIC_REG_ID 0x20
+#define LAPIC_REG_VERSION 0x30
+#define LAPIC_REG_TPR 0x80
+#define LAPIC_REG_EOI 0xB0
+#define LAPIC_REG_SVR 0xF0
+#define LAPIC_REG_ICR_LOW 0x300
+#define LAPIC_REG_ICR_HIGH 0x310
+#define LAPIC_REG_LVT_TIMER 0x320
+#define LAPIC_REG_LVT_LINT0 0x350
+#define LAPIC_REG_LVT_LINT1 0x360
+#define LAPIC_REG_LVT_ERROR 0x370
+#define LAPIC_REG_TIMER_INITIAL 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE 0x3E0
+
+#define LAPIC_ICR_FIXED 0x0
+#define LAPIC_ICR_INIT 0x500
+#define LAPIC_ICR_STARTUP 0x600
+#define LAPIC_ICR_PENDING 0x1000
+#define LAPIC_ICR_ASSERT 0x4000
+#define LAPIC_ICR_LEVEL 0x8000
+
+#define LAPIC_TIMER_DIVIDE_16 0x3
+#define LAPIC_LVT_MASKED 0x10000
+
+#define LAPIC_TIMER_VECTOR 0xEE
+#define LAPIC_SPURIOUS_VECTOR 0xEF
+#define IPI_SCHEDULE_VECTOR 0xF0
+
+extern u32 lapic_phys;
+extern volatile u32* lapic_base;
+extern u32 lapic_timer_frequency; //local APIC timer ticks per millisecond (0 : timer not calibrated, the PIT is used)
+
+void lapic_install(void);
+void lapic_enable(void);
+u32 lapic_read(u32 reg);
+void lapic_write(u32 reg, u32 value);
+void lapic_eoi(void);
+void lapic_send_ipi(u8 lapic_id, u32 icr);
+void lapic_timer_install(void);
+void lapic_timer_oneshot(u32 count);
+
+//SMP
+typedef struct CPU
+{
+    //the offsets of the first fields are used in assembly (scheduler.s)
+    struct PROCESS* current; //0x0 : process running on the cpu
+    struct PROCESS* idle; //0x4 : idle process of the cpu
+    tss_entry_t* tss; //0x8
+    u32 switch_stack; //0xC : stack used by the scheduler while switching processes
+    u32* page_directory; //0x10 : page directory currently loaded
+    u32 index;
+    u8 lapic_id;
+    volatile bool online;
+    //run queue of the cpu
+    queue_t* ready_queue;
+    u32 load; //number of processes waiting on the run queue
+    spinlock_t queue_lock;
+    //lazy FPU switching
+    struct THREAD* fpu_owner; //thread whose FPU state is loaded in the FPU registers
+    bool fpu_used; //the FPU is enabled (CR0.TS clear) : the owner state in registers is newer than the saved one
+    //cpu time accounting
+    struct THREAD* account_thread; //thread charged for the time spent on the cpu
+    u32 account_stamp; //time of the last charge (microseconds since boot)
+    bool account_user; //the thread is running in user mode
+    //kernel preemption
+    bool need_resched; //a switch was refused because the current thread disabled preemption
+} __attribute__((packed)) cpu_t;
+
+extern cpu_t cpus[CPU_MAX];
+extern u32 cpu_count; //number of processors online
+extern bool smp_enabled;
+
+cpu_t* get_current_cpu(void);
+void smp_init(void);
+void smp_broadcast_schedule(void);
+void smp_reschedule(cpu_t* cpu);
+
+//FPU/SSE
+#define FPU_STATE_SIZE 512 //size of the FXSAVE area
+#define FPU_NO_CPU 0xFFFFFFFF
+
+void fpu_init(void);
+void fpu_trap(void);
+void fpu_switch(cpu_t* cpu, struct THREAD* thread);
+void fpu_copy(struct THREAD* to, struct THREAD* from);
+void fpu_release(struct THREAD* thread);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,175 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2017 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cpu.h"
+#include "memory/mem.h"
+#include "tasking/task.h"
+
+/*
+* Lazy FPU/SSE context switching :
+* on a switch, CR0.TS is set, so the first FPU/SSE instruction of the new thread raises #NM (device not available)
+* and the FPU state of the thread is only loaded then ; threads that don't use the FPU never pay the cost
+* The state is saved on switch only if the FPU was used since it was loaded (it could be loaded on another cpu next)
+*/
+
+#define CR0_MP 0x2
+#define CR0_EM 0x4
+#define CR0_TS 0x8
+#define CR0_NE 0x20
+#define CR4_OSFXSR 0x200
+#define CR4_OSXMMEXCPT 0x400
+
+#define MXCSR_DEFAULT 0x1F80
+
+//the FXSAVE area must be aligned on 16 bytes
+#define FPU_STATE(thread) ((void*) ((((u32) (thread)->fpu_state) + 15) & ~((u32) 15)))
+
+static inline void fpu_set_ts()
+{
+    u32 cr0; asm volatile("mov %%cr0, %0":"=r"(cr0));
+    asm volatile("mov %0, %%cr0"::"r"(cr0 | CR0_TS));
+}
+
+/*
+* Enable the FPU and SSE on the current cpu (called on each cpu, by kmain() and ap_main())
+*/
+void fpu_init()
+{
+    if(!cpu_fpu) return;
+
+    //native FPU errors, no emulation, and trap on the first FPU instruction
+    u32 cr0; asm volatile("mov %%cr0, %0":"=r"(cr0));
+    cr0 = (cr0 & ~((u32) CR0_EM)) | CR0_MP | CR0_NE | CR0_TS;
+    asm volatile("mov %0, %%cr0"::"r"(cr0));
+
+    //FXSAVE/FXRSTOR and SSE exceptions
+    if(cpu_fxsr)
+    {
+        u32 cr4; asm volatile("mov %%cr4, %0":"=r"(cr4));
+        cr4 |= CR4_OSFXSR;
+        if(cpu_sse) cr4 |= CR4_OSXMMEXCPT;
+        asm volatile("mov %0, %%cr4"::"r"(cr4));
+    }
+
+    cpu_t* cpu = get_current_cpu();
+    cpu->fpu_owner = 0;
+    cpu->fpu_used = false;
+}
+
+static void fpu_store(thread_t* thread)
+{
+    if(cpu_fxsr) asm volatile("fxsave (%0)"::"r"(FPU_STATE(thread)):"memory");
+    else asm volatile("fnsave (%0) ; fwait"::"r"(FPU_STATE(thread)):"memory");
+}
+
+static void fpu_load(thread_t* thread)
+{
+    if(cpu_fxsr) asm volatile("fxrstor (%0)"::"r"(FPU_STATE(thread)):"memory");
+    else asm volatile("frstor (%0)"::"r"(FPU_STATE(thread)):"memory");
+}
+
+/*
+* Device not available (#NM) handler : give the FPU to the current thread (called by fault_handler(), interrupts disabled)
+*/
+void fpu_trap()
+{
+    cpu_t* cpu = get_current_cpu();
+    thread_t* thread = cpu->current->active_thread;
+    asm volatile("clts");
+
+    //the state of the previous owner was saved when it was switched out
+    if(!thread->fpu_state)
+    {
+        #ifdef MEMLEAK_DBG
+        thread->fpu_state = kmalloc(FPU_STATE_SIZE+16, "thread FPU state");
+        #else
+        thread->fpu_state = kmalloc(FPU_STATE_SIZE+16);
+        #endif
+        asm volatile("fninit");
+        if(cpu_sse) {u32 mxcsr = MXCSR_DEFAULT; asm volatile("ldmxcsr %0"::"m"(mxcsr));}
+    }
+    else fpu_load(thread);
+
+    thread->fpu_cpu = cpu->index;
+    cpu->fpu_owner = thread;
+    cpu->fpu_used = true;
+}
+
+/*
+* Switch the FPU state of the cpu to 'thread' (called by scheduler_switch_process(), on each switch)
+*/
+void fpu_switch(cpu_t* cpu, thread_t* thread)
+{
+    if(!cpu_fpu) return;
+
+    //the owner used the FPU : save its state, it may be loaded on another cpu next
+    if(cpu->fpu_used) {fpu_store(cpu->fpu_owner); cpu->fpu_used = false;}
+
+    //if the registers still hold the state of the thread, there is no need to trap
+    if((cpu->fpu_owner == thread) && (thread->fpu_cpu == cpu->index))
+    {
+        asm volatile("clts");
+        cpu->fpu_used = true;
+    }
+    else fpu_set_ts();
+}
+
+/*
+* Give 'to' a copy of the FPU state of 'from' (on fork())
+*/
+void fpu_copy(thread_t* to, thread_t* from)
+{
+    to->fpu_state = 0;
+    to->fpu_cpu = FPU_NO_CPU;
+    if(!from->fpu_state) return;
+
+    #ifdef MEMLEAK_DBG
+    to->fpu_state = kmalloc(FPU_STATE_SIZE+16, "thread FPU state");
+    #else
+    to->fpu_state = kmalloc(FPU_STATE_SIZE+16);
+    #endif
+
+    //the state of 'from' can be live in the registers of this cpu
+    u32 flags = irq_save();
+    cpu_t* cpu = get_current_cpu();
+    if(cpu->fpu_used && (cpu->fpu_owner == from)) fpu_store(from);
+    memcpy(FPU_STATE(to), FPU_STATE(from), FPU_STATE_SIZE);
+    irq_restore(flags);
+}
+
+/*
+* Free the FPU state of a thread (on thread exit, or exec() : the next FPU instruction gets a clean state)
+*/
+void fpu_release(thread_t* thread)
+{
+    u32 flags = irq_save();
+
+    u32 i;
+    for(i = 0; i < cpu_count; i++)
+    {
+        if(cpus[i].fpu_owner != thread) continue;
+        cpus[i].fpu_owner = 0;
+        //the thread is running on this cpu : next FPU instruction must trap
+        if(&cpus[i] == get_current_cpu()) {cpus[i].fpu_used = false; fpu_set_ts();}
+    }
+
+    if(thread->fpu_state) kfree(thread->fpu_state);
+    thread->fpu_state = 0;
+    thread->fpu_cpu = FPU_NO_CPU;
+
+    irq_restore(flags);
+}
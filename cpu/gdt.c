@@ -35,59 +35,64 @@ typedef struct
 	u32* base;
 } __attribute__((packed)) gdt_pointer_t;
 
-#define GDT_SIZE 6 //NULL, KERNEL_CODE, KERNEL_DATA, USER_CODE, USER_DATA, TSS
-gdt_desc_t GDT_ENTRIES[GDT_SIZE];
-gdt_pointer_t GDT_POINTER;
-tss_entry_t TSS = {0};
+#define GDT_SIZE (GDT_TLS_INDEX+1) //NULL, KERNEL_CODE, KERNEL_DATA, USER_CODE, USER_DATA, TSS (one per cpu), TLS
+//one GDT per cpu : the TLS descriptor holds the TLS of the thread running on the cpu
+gdt_desc_t GDT_ENTRIES[CPU_MAX][GDT_SIZE];
+gdt_pointer_t GDT_POINTER[CPU_MAX];
+tss_entry_t TSS[CPU_MAX] = {{0}};
 
-static void init_gdt_desc(u32 index, u32 base, u32 limite, u8 acces, u8 other)
+static void init_gdt_desc(u32 cpu_index, u32 index, u32 base, u32 limite, u8 acces, u8 other)
 {
+    gdt_desc_t* desc = &GDT_ENTRIES[cpu_index][index];
     #pragma GCC diagnostic push
     #pragma GCC diagnostic ignored "-Wconversion"
-	GDT_ENTRIES[index].lim0_15 = (limite & 0xffff);
-	GDT_ENTRIES[index].base0_15 = (base & 0xffff);
-	GDT_ENTRIES[index].base16_23 = (base & 0xff0000) >> 16;
-	GDT_ENTRIES[index].acces = acces;
-	GDT_ENTRIES[index].lim16_19 = (limite & 0xf0000) >> 16;
-	GDT_ENTRIES[index].other = (other & 0xf);
-	GDT_ENTRIES[index].base24_31 = (base & 0xff000000) >> 24;
+	desc->lim0_15 = (limite & 0xffff);
+	desc->base0_15 = (base & 0xffff);
+	desc->base16_23 = (base & 0xff0000) >> 16;
+	desc->acces = acces;
+	desc->lim16_19 = (limite & 0xf0000) >> 16;
+	desc->other = (other & 0xf);
+	desc->base24_31 = (base & 0xff000000) >> 24;
     #pragma GCC diagnostic pop
 	return;
 }
 
-static void tss_write(u32 index, u16 ss0, u32 esp0)
+static void tss_write(u32 cpu_index, u16 ss0, u32 esp0)
 {
+    tss_entry_t* tss = &TSS[cpu_index];
+
     // Firstly, let's compute the base and limit of our entry into the GDT.
-    u32 base = (u32)&TSS;
-    u32 limit = sizeof(TSS);
+    u32 base = (u32) tss;
+    u32 limit = sizeof(tss_entry_t);
 
     // Now, add our TSS descriptor's address to the GDT.
-    init_gdt_desc(index, base, limit, 0xE9, 0x00);
+    init_gdt_desc(cpu_index, GDT_TSS_BASE+cpu_index, base, limit, 0xE9, 0x00);
 
-    TSS.ss0  = ss0;  // Set the kernel stack segment.
-    TSS.esp0 = esp0; // Set the kernel stack pointer.
+    tss->ss0  = ss0;  // Set the kernel stack segment.
+    tss->esp0 = esp0; // Set the kernel stack pointer.
 
-    TSS.cs = 0x08; //0b
-    TSS.ss = TSS.ds = TSS.es = TSS.fs = TSS.gs = 0x10; //13
+    tss->cs = 0x08; //0b
+    tss->ss = tss->ds = tss->es = tss->fs = tss->gs = 0x10; //13
 }
 
 void gdt_install(void* stack_pointer)
 {
     //Setting up GDT limit and base address
-    GDT_POINTER.limit = GDT_SIZE * sizeof(gdt_desc_t);
-	GDT_POINTER.base = (u32*) &GDT_ENTRIES;
+    GDT_POINTER[0].limit = GDT_SIZE * sizeof(gdt_desc_t);
+	GDT_POINTER[0].base = (u32*) &GDT_ENTRIES[0];
 
 	/* Initializing descriptors */
-   	init_gdt_desc(0, 0, 0, 0, 0);                // NULL SEGMENT (0x0)
-	init_gdt_desc(1, 0, 0xFFFFFFFF, 0x9A, 0xCF); // KERNEL CODE SEGMENT (0x08)
-	init_gdt_desc(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // KERNEL DATA SEGMENT (0x10)
-	init_gdt_desc(3, 0, 0xFFFFFFFF, 0xFA, 0xCF); // USER CODE SEGMENT (0x18)
-	init_gdt_desc(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // USER DATA SEGMENT (0x20)
+   	init_gdt_desc(0, 0, 0, 0, 0, 0);                // NULL SEGMENT (0x0)
+	init_gdt_desc(0, 1, 0, 0xFFFFFFFF, 0x9A, 0xCF); // KERNEL CODE SEGMENT (0x08)
+	init_gdt_desc(0, 2, 0, 0xFFFFFFFF, 0x92, 0xCF); // KERNEL DATA SEGMENT (0x10)
+	init_gdt_desc(0, 3, 0, 0xFFFFFFFF, 0xFA, 0xCF); // USER CODE SEGMENT (0x18)
+	init_gdt_desc(0, 4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // USER DATA SEGMENT (0x20)
+	gdt_set_tls(0, 0);                              // TLS SEGMENT (GDT_TLS_SELECTOR)
 
-    tss_write(5, 0x10, (u32) stack_pointer); // TSS : Stack segment = 0x10 (kdata)
+    tss_write(0, 0x10, (u32) stack_pointer); // TSS of the BSP : Stack segment = 0x10 (kdata)
 
 	// loading register GDTR
-	asm("   lgdt (GDT_POINTER) \n");
+	asm("lgdt %0"::"m"(GDT_POINTER[0]));
 
 	// init segments
 	asm("   movw $0x10, %ax	\n \
@@ -102,3 +107,38 @@ void gdt_install(void* stack_pointer)
     asm("   mov $0x2B, %ax \n \
             ltr %ax \n  ");
 }
+
+/*
+* Load the GDT on an application processor, and its own TSS (esp0 is set by the scheduler)
+*/
+void gdt_install_ap(u32 cpu_index)
+{
+    //the AP gets its own copy of the BSP GDT
+    memcpy(GDT_ENTRIES[cpu_index], GDT_ENTRIES[0], sizeof(GDT_ENTRIES[0]));
+    GDT_POINTER[cpu_index].limit = GDT_SIZE * sizeof(gdt_desc_t);
+    GDT_POINTER[cpu_index].base = (u32*) &GDT_ENTRIES[cpu_index];
+    gdt_set_tls(cpu_index, 0);
+    tss_write(cpu_index, 0x10, 0);
+
+	asm("lgdt %0"::"m"(GDT_POINTER[cpu_index]));
+
+	asm("   movw $0x10, %ax	\n \
+            movw %ax, %ds	\n \
+            movw %ax, %es	\n \
+            movw %ax, %fs	\n \
+            movw %ax, %gs	\n \
+            movw %ax, %ss	\n \
+            ljmp $0x08, $1f	\n \
+        1:		\n");
+
+    u16 selector = (u16) (((GDT_TSS_BASE+cpu_index) << 3) | 3);
+    asm("ltr %0"::"r"(selector));
+}
+
+/*
+* Set the base of the TLS segment of a cpu (the selector must be reloaded for it to be used)
+*/
+void gdt_set_tls(u32 cpu_index, u32 base)
+{
+    init_gdt_desc(cpu_index, GDT_TLS_INDEX, base, 0xFFFFFFFF, 0xF2, 0xCF);
+}
@@ -118,6 +118,11 @@ void idt_install(void)
 	init_idt_desc(51, 0x08, (u32) _irq19, 0x8E00);
 	init_idt_desc(52, 0x08, (u32) _irq20, 0x8E00);
 	
+	//Initializing local APIC interrupts
+	init_idt_desc(LAPIC_SPURIOUS_VECTOR, 0x08, (u32) _spurious, 0x8E00);
+	init_idt_desc(IPI_SCHEDULE_VECTOR, 0x08, (u32) schedule_ipi, 0x8E00); //reschedule (sent by other cpus)
+	init_idt_desc(LAPIC_TIMER_VECTOR, 0x08, (u32) schedule_ipi, 0x8E00); //local APIC timer (one-shot)
+
 	//Initializing system calls
 	init_idt_desc(0x80, 0x08, (u32) SYSCALL_H, 0xEF00);
 
@@ -49,6 +49,8 @@ extern void _isr30();
 extern void _isr31();
 
 extern void schedule();
+extern void schedule_ipi();
+extern void _spurious();
 extern void _irq1();
 extern void _irq2();
 extern void _irq3();
@@ -144,6 +144,7 @@ isr_common:
 
 .global SYSCALL_H
 .extern system_calls
+.extern signal_syscall_exit
 SYSCALL_H:
     push %ds
     push %es
@@ -156,6 +157,13 @@ SYSCALL_H:
     pushl %ecx
     pushl %ebx
 
+    /* charge the time spent in user mode (restoring the arguments registers after the call) */
+    pushl %eax
+    call account_syscall_enter
+    popl %eax
+    movl 0x4(%esp), %ecx
+    movl 0x8(%esp), %edx
+
     push %ebx
     movl $system_calls, %ebx
     leal (%ebx, %eax, 4), %eax
@@ -165,6 +173,26 @@ SYSCALL_H:
     call *%eax
     add $0xC, %esp
 
+    /* charge the time spent in the kernel (eax/ecx hold the return values) */
+    pushl %eax
+    pushl %ecx
+    call account_syscall_exit
+    popl %ecx
+    popl %eax
+
+    /* finish a sigret and deliver pending signals (may rewrite the saved registers) */
+    pushl %ebx
+    pushl %edx
+    pushl %ecx
+    pushl %eax
+    pushl %esp
+    call signal_syscall_exit
+    add $0x4, %esp
+    popl %eax
+    popl %ecx
+    popl %edx
+    popl %ebx
+
     pop %ebp
     pop %edi
     pop %esi
@@ -174,3 +202,8 @@ SYSCALL_H:
     pop %ds
     # popa
     iret
+
+# spurious interrupts of the local APIC must not be acknowledged
+.global _spurious
+_spurious:
+    iret
@@ -42,10 +42,17 @@ static const char* const exceptionMessages[] =
 
 static void handle_user_fault(struct regs_int* r);
 static void handle_page_fault(struct regs_int* r);
+static bool handle_mmap_fault(struct regs_int* r);
 
 void fault_handler(struct regs_int * r)
 {
+	//device not available : lazy FPU switching
+	if(r->int_no == 7) {fpu_trap(); return;}
+
 	if(r->int_no == 8) _fatal_kernel_error("DOUBLE FAULT", "DOUBLE FAULT", "Unknown", 0);
+
+	//page fault on a memory mapping : the page is mapped now
+	if((r->int_no == 14) && handle_mmap_fault(r)) return;
 	
 	kprintf("%lFAULT in process 0x%X / %d\n", 2, current_process, current_process->pid);
 	//kprintf("Processes : ");
@@ -66,7 +73,7 @@ void fault_handler(struct regs_int * r)
 			u32 dr6 = 0; asm("movl %%dr6, %%eax":"=a"(dr6));
 			u32 dr7 = 0; asm("movl %%dr7, %%eax":"=a"(dr7));
 			kprintf("dr6 = 0x%X ; dr7 = 0x%X\n", dr6, dr7);
-			kprintf("tss trap = 0x%X\n", TSS.trap);
+			kprintf("tss trap = 0x%X\n", get_current_cpu()->tss->trap);
 			_fatal_kernel_error("Debug", "Unkown", "Unknown", 0);
 			break;
 		}
@@ -77,6 +84,7 @@ void fault_handler(struct regs_int * r)
 		case 13: handle_user_fault(r); break;
 		case 14: handle_page_fault(r); break;
 		case 16: handle_user_fault(r); break;
+		case 19: handle_user_fault(r); break;
 		default: _fatal_kernel_error("Unhandled exception", exceptionMessages[r->int_no], "Unknown", 0); break;
 	}
 }
@@ -94,6 +102,23 @@ static void handle_user_fault(struct regs_int* r)
 	_fatal_kernel_error("Kernel exception", "Kernel exception catched", "Unknown", 0);
 }
 
+/*
+* Fault in a page of a memory mapping of the current process (it can sleep, reading the file)
+*/
+static bool handle_mmap_fault(struct regs_int* r)
+{
+	u32 f_addr; asm("movl %%cr2, %0":"=r"(f_addr):);
+	if((f_addr >= 0xC0000000) || (!current_process->mmaps)) return false;
+
+	//the fault is served like a syscall, with interrupts enabled (if they were when it happened)
+	irq_restore(r->eflags);
+	if(mmap_fault(current_process, f_addr, (r->err_code & 2) != 0, r->cs == 0x1B)) return true;
+
+	//the page can't be served (SIGBUS) : the faulting instruction must not run again before the signal is handled
+	if(current_process->active_thread->sigfault) {signal_fault_exit(r); return true;}
+	return false;
+}
+
 static void handle_page_fault(struct regs_int* r)
 {
 	//get page fault address (in cr2)	
@@ -151,10 +176,30 @@ void irq_handler(u32 irq_number)
 
 #include "devices/keyboard.h"
 #include "io/io.h"
+
+//keycodes are read on the irq, and handled later by a worker (tty input echoes to the screen, and can send signals)
+#define KEYBOARD_BUFFER_SIZE 64
+static u8 keyboard_buffer[KEYBOARD_BUFFER_SIZE];
+static volatile u32 keyboard_head = 0;
+static volatile u32 keyboard_tail = 0;
+static void keyboard_work_handler(void* data);
+static work_t keyboard_work = WORK_INIT(keyboard_work_handler, 0);
+
 void keyboard_interrupt()
 {
 	u8 keycode = inb(0x60);
 
+	//if the buffer is full, the keycode is lost
+	if(keyboard_head - keyboard_tail >= KEYBOARD_BUFFER_SIZE) return;
+	keyboard_buffer[keyboard_head % KEYBOARD_BUFFER_SIZE] = keycode;
+	asm volatile("":::"memory");
+	keyboard_head++;
+
+	queue_work(&keyboard_work);
+}
+
+static void keyboard_handle(u8 keycode)
+{
 	//if ttys are'nt initilized, we return
 	if(!tty1 | !tty2 | !tty3) return;
 	
@@ -179,3 +224,15 @@ void keyboard_interrupt()
 	u8 ch = getchar(keycode);
 	if(ch) tty_input(current_tty, ch);
 }
+
+static void keyboard_work_handler(void* data)
+{
+	(void) data;
+	while(keyboard_tail != keyboard_head)
+	{
+		u8 keycode = keyboard_buffer[keyboard_tail % KEYBOARD_BUFFER_SIZE];
+		asm volatile("":::"memory");
+		keyboard_tail++;
+		keyboard_handle(keycode);
+	}
+}
@@ -0,0 +1,345 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2017 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Symmetric multiprocessing : detect the processors (ACPI MADT, or MP tables), and start the application processors
+*/
+#include "cpu.h"
+#include "memory/mem.h"
+#include "tasking/task.h"
+
+#define AP_TRAMPOLINE_ADDR 0x8000 //must match cpu/ap_boot.s
+
+cpu_t cpus[CPU_MAX] = {{.tss = &TSS[0], .page_directory = kernel_page_directory, .online = true}};
+u32 cpu_count = 1;
+bool smp_enabled = false;
+
+//local APIC ids of the processors found in the tables
+static u8 smp_lapic_ids[CPU_MAX];
+static u32 smp_lapic_count = 0;
+
+//application processors bootstrap code (cpu/ap_boot.s)
+extern u8 ap_trampoline_start[];
+extern u8 ap_trampoline_end[];
+extern u8 ap_trampoline_cr3[];
+extern u8 ap_trampoline_cr4[];
+extern u8 ap_trampoline_stack[];
+extern u8 ap_trampoline_entry[];
+
+static volatile u32 ap_booting = 0; //index of the cpu currently booting
+
+/*
+* Get the cpu we are running on (the task register holds the selector of the TSS of the cpu)
+*/
+cpu_t* get_current_cpu()
+{
+    u16 tr = 0;
+    asm volatile("str %0":"=r"(tr));
+    //GDT not installed yet
+    if(tr < (GDT_TSS_BASE << 3)) return &cpus[0];
+    return &cpus[(tr >> 3) - GDT_TSS_BASE];
+}
+
+/*
+* Make a cpu run the scheduler as soon as possible (it could be idle, with its timer stopped)
+*/
+void smp_reschedule(cpu_t* cpu)
+{
+    if(!lapic_base) return;
+    lapic_send_ipi(cpu->lapic_id, IPI_SCHEDULE_VECTOR);
+}
+
+/*
+* Tell every other cpu to schedule (called by the BSP on each PIT tick, when the local APIC timer is not used)
+*/
+void smp_broadcast_schedule()
+{
+    if(!smp_enabled) return;
+    u32 i;
+    for(i = 1; i < cpu_count; i++)
+        lapic_send_ipi(cpus[i].lapic_id, IPI_SCHEDULE_VECTOR);
+}
+
+static void smp_delay(u32 us)
+{
+    //a write on port 0x80 takes approximately 1 microsecond
+    while(us--) {outb(0x80, 0);}
+}
+
+static bool smp_checksum(u8* ptr, u32 length)
+{
+    u8 sum = 0;
+    u32 i;
+    for(i = 0; i < length; i++) sum = (u8) (sum + ptr[i]);
+    return !sum;
+}
+
+static bool smp_signature(u8* ptr, const char* signature, u32 length)
+{
+    u32 i;
+    for(i = 0; i < length; i++) if(ptr[i] != (u8) signature[i]) return false;
+    return true;
+}
+
+/*
+* Search 'signature' in low memory (0-1MiB), on 16 bytes boundaries
+*/
+static u8* smp_scan(u32 start, u32 length, const char* signature, u32 siglen, u32 checklen)
+{
+    u8* ptr = (u8*) (start + KERNEL_VIRTUAL_BASE);
+    u8* end = ptr + length;
+    for(; ptr < end; ptr += 16)
+        if(smp_signature(ptr, signature, siglen) && smp_checksum(ptr, checklen)) return ptr;
+    return 0;
+}
+
+/*
+* Map a physical table (that could be anywhere in memory) in kernel memory
+*/
+static u8* smp_map_table(u32 phys, u32 size)
+{
+    //low memory is already mapped
+    if(phys + size <= 0x400000) return (u8*) (phys + KERNEL_VIRTUAL_BASE);
+
+    u32 offset = phys % 4096;
+    u32 msize = size + offset; alignup(msize, 4096);
+    u32 vaddr = kvm_reserve_block(msize);
+    map_flexible(msize, phys - offset, vaddr, kernel_page_directory);
+    return (u8*) (vaddr + offset);
+}
+
+static void smp_unmap_table(u8* table, u32 size)
+{
+    u32 vaddr = (u32) table;
+    if(vaddr < KERNEL_VIRTUAL_BASE + 0x400000) return;
+
+    u32 offset = vaddr % 4096;
+    u32 msize = size + offset; alignup(msize, 4096);
+    unmap_flexible(msize, vaddr - offset, kernel_page_directory);
+    kvm_free_block(vaddr - offset);
+}
+
+static void smp_add_lapic(u8 lapic_id)
+{
+    if(smp_lapic_count < CPU_MAX) smp_lapic_ids[smp_lapic_count++] = lapic_id;
+}
+
+/*
+* Parse the ACPI MADT (Multiple APIC Description Table) to find the processors
+*/
+static bool smp_parse_madt()
+{
+    u16 ebda = *((u16*) (KERNEL_VIRTUAL_BASE + 0x40E));
+    u8* rsdp = smp_scan((u32) (ebda << 4), 1024, "RSD PTR ", 8, 20);
+    if(!rsdp) rsdp = smp_scan(0xE0000, 0x20000, "RSD PTR ", 8, 20);
+    if(!rsdp) return false;
+
+    //RSDT : header (36 bytes) followed by 32 bits pointers to other tables
+    u32 rsdt_phys = *((u32*) (rsdp + 16));
+    u8* rsdt = smp_map_table(rsdt_phys, 36);
+    u32 rsdt_length = *((u32*) (rsdt + 4));
+    smp_unmap_table(rsdt, 36);
+    rsdt = smp_map_table(rsdt_phys, rsdt_length);
+
+    bool found = false;
+    u32 i;
+    for(i = 36; (i + 4 <= rsdt_length) && !found; i += 4)
+    {
+        u32 table_phys = *((u32*) (rsdt + i));
+        u8* table = smp_map_table(table_phys, 36);
+        bool madt = smp_signature(table, "APIC", 4);
+        u32 length = *((u32*) (table + 4));
+        smp_unmap_table(table, 36);
+        if(!madt) continue;
+
+        //MADT : header, local APIC address, flags, then variable length entries
+        table = smp_map_table(table_phys, length);
+        if(smp_checksum(table, length))
+        {
+            found = true;
+            lapic_phys = *((u32*) (table + 36));
+            u32 j = 44;
+            while(j + 2 <= length)
+            {
+                u8 type = table[j];
+                u8 elength = table[j+1];
+                if(elength < 2) break;
+                //processor local APIC (flags bit 0 : processor enabled)
+                if((type == 0) && (table[j+4] & 1)) smp_add_lapic(table[j+3]);
+                //local APIC address override (64 bits)
+                else if(type == 5) lapic_phys = *((u32*) (table + j + 4));
+                j += elength;
+            }
+        }
+        smp_unmap_table(table, length);
+    }
+
+    smp_unmap_table(rsdt, rsdt_length);
+    return found && smp_lapic_count;
+}
+
+/*
+* Parse the Intel MultiProcessor Specification tables to find the processors (old machines, without ACPI)
+*/
+static bool smp_parse_mp()
+{
+    u16 ebda = *((u16*) (KERNEL_VIRTUAL_BASE + 0x40E));
+    u8* mpfp = smp_scan((u32) (ebda << 4), 1024, "_MP_", 4, 16);
+    if(!mpfp) mpfp = smp_scan(0x9FC00, 1024, "_MP_", 4, 16);
+    if(!mpfp) mpfp = smp_scan(0xF0000, 0x10000, "_MP_", 4, 16);
+    if(!mpfp) return false;
+
+    //no configuration table : default configuration, not supported
+    u32 config_phys = *((u32*) (mpfp + 4));
+    if(!config_phys) return false;
+
+    u8* config = smp_map_table(config_phys, 44);
+    u16 length = *((u16*) (config + 4));
+    smp_unmap_table(config, 44);
+    config = smp_map_table(config_phys, length);
+
+    if(!smp_signature(config, "PCMP", 4) || !smp_checksum(config, length)) {smp_unmap_table(config, length); return false;}
+
+    lapic_phys = *((u32*) (config + 36));
+    u16 entries = *((u16*) (config + 34));
+    u32 offset = 44;
+    u16 i;
+    for(i = 0; (i < entries) && (offset < length); i++)
+    {
+        //processor entry (20 bytes, flags bit 0 : processor enabled) ; other entries are 8 bytes long
+        if(config[offset] == 0)
+        {
+            if(config[offset+3] & 1) smp_add_lapic(config[offset+1]);
+            offset += 20;
+        }
+        else offset += 8;
+    }
+
+    smp_unmap_table(config, length);
+    return smp_lapic_count != 0;
+}
+
+/*
+* Entry point of the application processors (called by the trampoline code, on the cpu switch stack)
+*/
+static void ap_main()
+{
+    cpu_t* cpu = &cpus[ap_booting];
+
+    //from there, get_current_cpu() works
+    gdt_install_ap(cpu->index);
+    asm("lidt (IDT_POINTER)");
+    lapic_enable();
+    fpu_init();
+
+    cpu->online = true;
+
+    //start running the idle process (the cpu will be rescheduled on next IPI)
+    process_t* idle = cpu->idle;
+    __asm__ __volatile__("jmp schedule_switch"::"a"(idle->active_thread), "d"(idle));
+}
+
+/*
+* Start an application processor (INIT-SIPI-SIPI sequence) and wait for it to be online
+*/
+static bool smp_start_ap(cpu_t* cpu)
+{
+    u8* trampoline = (u8*) (AP_TRAMPOLINE_ADDR + KERNEL_VIRTUAL_BASE);
+    *((u32*) (trampoline + (ap_trampoline_stack - ap_trampoline_start))) = cpu->switch_stack;
+    ap_booting = cpu->index;
+
+    lapic_send_ipi(cpu->lapic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+    smp_delay(10000);
+
+    u32 i;
+    for(i = 0; i < 2; i++)
+    {
+        if(cpu->online) break;
+        lapic_send_ipi(cpu->lapic_id, LAPIC_ICR_STARTUP | LAPIC_ICR_ASSERT | (AP_TRAMPOLINE_ADDR >> 12));
+        smp_delay(200);
+    }
+
+    //wait for the cpu (~1s)
+    for(i = 0; (i < 1000) && !cpu->online; i++) smp_delay(1000);
+    return cpu->online;
+}
+
+/*
+* Detect the processors and start them (called by kmain(), after process_init())
+*/
+void smp_init()
+{
+    kprintf("Starting application processors...");
+
+    if(!cpu_apic) {vga_text_skipmsg(); return;}
+    bool tables = smp_parse_madt() || smp_parse_mp();
+
+    //the local APIC of the BSP is also used for its timer
+    lapic_install();
+    lapic_enable();
+    //virtual wire mode : legacy interrupts of the PIC are still delivered to the BSP
+    lapic_write(LAPIC_REG_LVT_LINT0, 0x700);
+    lapic_write(LAPIC_REG_LVT_LINT1, 0x400);
+    cpus[0].lapic_id = (u8) (lapic_read(LAPIC_REG_ID) >> 24);
+    if(!tables || (smp_lapic_count < 2)) {vga_text_skipmsg(); return;}
+
+    //copy bootstrap code in low memory (saving what was there), and identity map low memory while APs enable paging
+    u32 trampoline_size = (u32) (ap_trampoline_end - ap_trampoline_start);
+    u8* trampoline = (u8*) (AP_TRAMPOLINE_ADDR + KERNEL_VIRTUAL_BASE);
+    u8* backup = kmalloc(trampoline_size);
+    memcpy(backup, trampoline, trampoline_size);
+    memcpy(trampoline, ap_trampoline_start, trampoline_size);
+
+    u32 cr4 = 0; asm("mov %%cr4, %0":"=r"(cr4));
+    *((u32*) (trampoline + (ap_trampoline_cr3 - ap_trampoline_start))) = ((u32) kernel_page_directory) - KERNEL_VIRTUAL_BASE;
+    *((u32*) (trampoline + (ap_trampoline_cr4 - ap_trampoline_start))) = cr4;
+    *((u32*) (trampoline + (ap_trampoline_entry - ap_trampoline_start))) = (u32) ap_main;
+    kernel_page_directory[0] = kernel_page_directory[KERNEL_VIRTUAL_BASE >> 22];
+
+    u32 i;
+    for(i = 0; i < smp_lapic_count; i++)
+    {
+        if(smp_lapic_ids[i] == cpus[0].lapic_id) continue;
+
+        cpu_t* cpu = &cpus[cpu_count];
+        cpu->index = cpu_count;
+        cpu->lapic_id = smp_lapic_ids[i];
+        cpu->tss = &TSS[cpu_count];
+        cpu->page_directory = kernel_page_directory;
+        //if a cpu did not start, we re-use its structures for the next one
+        if(!cpu->ready_queue)
+        {
+            cpu->ready_queue = queue_init(10);
+            cpu->switch_stack = ((u32) kmalloc(4096)) + 4096;
+            cpu->idle = init_idle_process();
+            cpu->idle->cpu = cpu->index;
+            cpu->current = cpu->idle;
+        }
+
+        if(smp_start_ap(cpu)) cpu_count++;
+    }
+
+    //remove identity mapping and restore low memory
+    kernel_page_directory[0] = 0;
+    asm("mov %%cr3, %%eax ; mov %%eax, %%cr3":::"%eax");
+    memcpy(trampoline, backup, trampoline_size);
+    kfree(backup);
+
+    smp_enabled = (cpu_count > 1);
+    if(smp_enabled) vga_text_okmsg();
+    else vga_text_skipmsg();
+}
@@ -52,12 +52,17 @@ typedef u32 error_t;
 #define ERROR_IS_SESSION_LEADER 27 //the process is a session leader
 #define ERROR_IS_ANOTHER_SESSION 28 //the group is in another session
 #define ERROR_HAS_NO_CHILD 29 //the process has no child
+#define ERROR_INVALID_TID 30 //the thread id was invalid (no such thread in the process, or already joined)
 //sync errors
 #define ERROR_MUTEX_ALREADY_LOCKED 31 //trying to lock a mutex already locked
 #define ERROR_MUTEX_OWNED_BY_OTHER 32 //trying to unlock a mutex that you don't own
+#define ERROR_WOULD_BLOCK 33 //the futex value changed before the caller could sleep (try again)
 //memory errors
+#define ERROR_NO_MEMORY 34 //no room left (in the address space, or in memory) for a mapping
+#define ERROR_INVALID_ARGUMENT 35 //an argument is out of range (unaligned address, unknown flags, ...)
 #define ERROR_INVALID_PTR 36
 //other
+#define ERROR_BUSY 37 //the resource is in use (e.g. unmounting a mount point that has mounts under it)
 #define ERROR_PERMISSION 41 //no permission
 #define ERROR_NO_TTY 42 //the file is not a tty
 #define ERROR_NO_DEVICE 43 //the file is not a device
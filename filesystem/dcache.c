@@ -0,0 +1,237 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "system.h"
+#include "fs.h"
+#include "memory/mem.h"
+
+/*
+* Dentry cache : remembers the result of looking up a name in a directory, keyed on (parent node, name)
+* A lookup that found nothing is cached too (negative entry, node = 0), so missing files dont hit the disk either
+* Entries are chained on a hash bucket and on a LRU list ; when the cache is full, the least recently used entry is evicted
+* The filesystem nodes are owned by the filesystems inode caches (icache.c) : entries are invalidated before they go away
+*/
+
+#define DCACHE_BUCKETS 256
+#define DCACHE_MAX_ENTRIES 1024
+
+typedef struct dentry
+{
+    fsnode_t* parent;
+    fsnode_t* node; //0 for a negative entry
+    u32 hash;
+    struct dentry* hash_next;
+    struct dentry* lru_prev;
+    struct dentry* lru_next;
+    char name[];
+} dentry_t;
+
+static dentry_t* dcache_buckets[DCACHE_BUCKETS] = {0};
+static dentry_t* lru_head = 0; //most recently used
+static dentry_t* lru_tail = 0; //least recently used
+static u32 dcache_entries = 0;
+static u32 dcache_generation = 0; //bumped on every invalidation, so a lookup racing with one doesnt insert a stale entry
+static spinlock_t dcache_lock = {0};
+
+static inline char dcache_fold(fsnode_t* parent, char c)
+{
+    if((parent->file_system->flags & FS_FLAG_CASE_INSENSITIVE) && (c >= 'A') && (c <= 'Z')) return (char) (c + ('a' - 'A'));
+    return c;
+}
+
+static u32 dcache_hash(fsnode_t* parent, char* name)
+{
+    //FNV-1a on the name, mixed with the parent node address
+    u32 hash = 2166136261U ^ (((u32) parent) >> 4);
+    while(*name)
+    {
+        hash ^= (u8) dcache_fold(parent, *name);
+        hash *= 16777619U;
+        name++;
+    }
+    return hash;
+}
+
+static bool dcache_name_equals(fsnode_t* parent, char* a, char* b)
+{
+    while(*a && (dcache_fold(parent, *a) == dcache_fold(parent, *b))) {a++; b++;}
+    return dcache_fold(parent, *a) == dcache_fold(parent, *b);
+}
+
+static void lru_unlink(dentry_t* dentry)
+{
+    if(dentry->lru_prev) dentry->lru_prev->lru_next = dentry->lru_next;
+    else lru_head = dentry->lru_next;
+    if(dentry->lru_next) dentry->lru_next->lru_prev = dentry->lru_prev;
+    else lru_tail = dentry->lru_prev;
+}
+
+static void lru_push(dentry_t* dentry)
+{
+    dentry->lru_prev = 0;
+    dentry->lru_next = lru_head;
+    if(lru_head) lru_head->lru_prev = dentry;
+    else lru_tail = dentry;
+    lru_head = dentry;
+}
+
+/*
+* Find the entry of (parent, name) (dcache lock must be held)
+*/
+static dentry_t* dcache_find(fsnode_t* parent, char* name, u32 hash)
+{
+    dentry_t* dentry = dcache_buckets[hash % DCACHE_BUCKETS];
+    while(dentry)
+    {
+        if((dentry->hash == hash) && (dentry->parent == parent) && dcache_name_equals(parent, dentry->name, name)) return dentry;
+        dentry = dentry->hash_next;
+    }
+    return 0;
+}
+
+/*
+* Unlink an entry from its bucket and from the LRU list (dcache lock must be held) ; the caller frees it
+*/
+static void dcache_remove(dentry_t* dentry)
+{
+    dentry_t** ptr = &dcache_buckets[dentry->hash % DCACHE_BUCKETS];
+    while(*ptr != dentry) ptr = &(*ptr)->hash_next;
+    *ptr = dentry->hash_next;
+    lru_unlink(dentry);
+    dcache_entries--;
+}
+
+/*
+* Look (parent, name) up in the cache
+* Returns true on a hit, with the node in 'node', held (0 if the entry is negative : the file does not exist)
+* On a miss, 'generation' is filled with the value to give back to dcache_insert
+*/
+bool dcache_lookup(fsnode_t* parent, char* name, fsnode_t** node, u32* generation)
+{
+    u32 hash = dcache_hash(parent, name);
+
+    spin_lock(&dcache_lock);
+    dentry_t* dentry = dcache_find(parent, name, hash);
+    if(!dentry)
+    {
+        *generation = dcache_generation;
+        spin_unlock(&dcache_lock);
+        return false;
+    }
+
+    lru_unlink(dentry);
+    lru_push(dentry);
+    *node = dentry->node;
+    //held before the dcache lock is released : the inode cache can't evict it before dropping this entry
+    if(*node) icache_hold(*node);
+    spin_unlock(&dcache_lock);
+    return true;
+}
+
+/*
+* Cache the result of a lookup of (parent, name) done by the filesystem
+* Nothing is cached if an invalidation happened since the lookup missed (the result may already be stale)
+*/
+void dcache_insert(fsnode_t* parent, char* name, fsnode_t* node, u32 generation)
+{
+    u32 name_len = strlen(name);
+    u32 hash = dcache_hash(parent, name);
+
+    //allocate before taking the lock, kmalloc may need to expand the heap
+    dentry_t* dentry = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(sizeof(dentry_t)+name_len+1, "dentry");
+    #else
+    kmalloc(sizeof(dentry_t)+name_len+1);
+    #endif
+    dentry->parent = parent;
+    dentry->node = node;
+    dentry->hash = hash;
+    memcpy(dentry->name, name, name_len+1);
+
+    dentry_t* evicted = 0;
+    spin_lock(&dcache_lock);
+    if((generation != dcache_generation) || dcache_find(parent, name, hash))
+    {
+        spin_unlock(&dcache_lock);
+        kfree(dentry);
+        return;
+    }
+
+    if(dcache_entries >= DCACHE_MAX_ENTRIES)
+    {
+        evicted = lru_tail;
+        dcache_remove(evicted);
+    }
+
+    u32 bucket = hash % DCACHE_BUCKETS;
+    dentry->hash_next = dcache_buckets[bucket];
+    dcache_buckets[bucket] = dentry;
+    lru_push(dentry);
+    dcache_entries++;
+    spin_unlock(&dcache_lock);
+
+    if(evicted) kfree(evicted);
+}
+
+/*
+* Drop the entry of (parent, name), if any : the directory content changed under that name
+*/
+void dcache_invalidate(fsnode_t* parent, char* name)
+{
+    u32 hash = dcache_hash(parent, name);
+
+    spin_lock(&dcache_lock);
+    dcache_generation++;
+    dentry_t* dentry = dcache_find(parent, name, hash);
+    if(dentry) dcache_remove(dentry);
+    spin_unlock(&dcache_lock);
+
+    if(dentry) kfree(dentry);
+}
+
+/*
+* Drop every entry that resolves to 'node' or that is a child of 'node' : the node is about to be freed
+*/
+void dcache_invalidate_node(fsnode_t* node)
+{
+    dentry_t* freed = 0;
+
+    spin_lock(&dcache_lock);
+    dcache_generation++;
+    dentry_t* dentry = lru_head;
+    while(dentry)
+    {
+        dentry_t* next = dentry->lru_next;
+        if((dentry->node == node) || (dentry->parent == node))
+        {
+            dcache_remove(dentry);
+            //the entry is unlinked from everything : reuse its hash link to chain it for freeing
+            dentry->hash_next = freed;
+            freed = dentry;
+        }
+        dentry = next;
+    }
+    spin_unlock(&dcache_lock);
+
+    while(freed)
+    {
+        dentry_t* next = freed->hash_next;
+        kfree(freed);
+        freed = next;
+    }
+}
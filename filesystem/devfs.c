@@ -30,10 +30,12 @@ void devfs_init()
     devfs->partition = 0;
     devfs->fs_type = FS_TYPE_DEVFS;
     devfs->flags = 0;
+    devfs->inode_hash = 0; //no inode cache : the nodes live as long as their device
 
     /* setting up root directory node */
     fsnode_t* root_dir = kmalloc(sizeof(fsnode_t));
     root_dir->file_system = devfs;
+    root_dir->pages = 0;
     root_dir->length = DEVFS_DIR_SIZE_DEFAULT;
     root_dir->attributes = 0 | FILE_ATTR_DIR;
     root_dir->creation_time = get_current_time_utc();
@@ -50,6 +52,12 @@ void devfs_init()
 
     mount("/dev", devfs);
 
+    #ifdef LOCKSTAT
+    devfs_register_device(root_dir, "lockstat", 0, DEVFS_TYPE_LOCKSTAT, 0);
+    #endif
+    devfs_register_device(root_dir, "pagecache", 0, DEVFS_TYPE_PAGECACHE, 0);
+    devfs_register_device(root_dir, "icache", 0, DEVFS_TYPE_ICACHE, 0);
+
     vga_text_okmsg();
 }
 
@@ -133,6 +141,23 @@ error_t devfs_read_file(fd_t* fd, void* buffer, u64 count)
         io_stream_t* iostream = spe->device_struct;
         return iostream_read(buffer, (u32) count, iostream);
     }
+    #ifdef LOCKSTAT
+    else if(spe->device_type == DEVFS_TYPE_LOCKSTAT)
+    {
+        if(!lockstat_read((u32) fd->offset, buffer, (u32) count)) return ERROR_EOF;
+        return ERROR_NONE;
+    }
+    #endif
+    else if(spe->device_type == DEVFS_TYPE_PAGECACHE)
+    {
+        if(!pagecache_stat_read((u32) fd->offset, buffer, (u32) count)) return ERROR_EOF;
+        return ERROR_NONE;
+    }
+    else if(spe->device_type == DEVFS_TYPE_ICACHE)
+    {
+        if(!icache_stat_read((u32) fd->offset, buffer, (u32) count)) return ERROR_EOF;
+        return ERROR_NONE;
+    }
 
     return ERROR_FILE_FS_INTERNAL;
 }
@@ -170,6 +195,7 @@ fsnode_t* devfs_register_device(fsnode_t* dir, char* name, void* device, u32 dev
     /* setting up node */
     fsnode_t* node = kmalloc(sizeof(fsnode_t));
     node->file_system = devfs;
+    node->pages = 0;
     node->length = 0;
     node->attributes = 0;
     node->creation_time = get_current_time_utc();
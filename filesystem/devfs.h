@@ -39,6 +39,9 @@ typedef struct devfs_node_specific
 #define DEVFS_TYPE_BLOCKDEV_PART 3
 #define DEVFS_TYPE_TTY 4
 #define DEVFS_TYPE_IOSTREAM 5
+#define DEVFS_TYPE_LOCKSTAT 6
+#define DEVFS_TYPE_PAGECACHE 7
+#define DEVFS_TYPE_ICACHE 8
 
 #define DEVFS_DIR_SIZE_DEFAULT (sizeof(devfs_dirent_t)*10)
 
@@ -30,6 +30,7 @@
 */
 
 #include "ext2.h"
+#include "tasking/task.h"
 
 #define BLOCK_OFFSET(block) ((block)*(ext2->block_size/512))
 
@@ -46,6 +47,8 @@ static error_t ext2_create_dirent(u32 inode, char* name, fsnode_t* dir);
 
 static u32 ext2_block_alloc(file_system_t* fs);
 static void ext2_block_free(u32 block, file_system_t* fs);
+static bool ext2_block_tree_free(u32 block, u32 depth, u32 first, u32 count, file_system_t* fs);
+static void ext2_inode_free_blocks(fsnode_t* node, u64 length);
 static u32 ext2_inode_alloc(file_system_t* fs);
 static void ext2_inode_free(fsnode_t* node);
 static u32 ext2_bitmap_mark_first_zero_bit(u8* bitmap, u32 len);
@@ -86,20 +89,39 @@ file_system_t* ext2_init(block_device_t* drive, u8 partition)
         tr->flags |= FS_FLAG_READ_ONLY;
     }
 
-    tr->inode_cache = 0;
-    tr->inode_cache_size = 0;
-    tr->cache_mutex = kmalloc(sizeof(mutex_t));
-    tr->cache_mutex->locked_by = 0;
-    tr->cache_mutex->waiting = 0;
+    icache_init(tr);
 
     //allocating specific data struct
     ext2fs_specific_t* ext2spe = kmalloc(sizeof(ext2fs_specific_t));
     ext2spe->superblock = superblock;
     ext2spe->superblock_offset = start_offset;
     ext2spe->block_size = (u32)(1024 << superblock->block_size);
+    ext2spe->superblock_dirty = false;
     
     ext2spe->blockgroup_count = (superblock->blocks-superblock->superblock_number)/superblock->blocks_per_blockgroup;
     if((superblock->blocks-superblock->superblock_number)%superblock->blocks_per_blockgroup) ext2spe->blockgroup_count++;
+
+    //read the block group descriptor table ; the bitmaps are read when first needed
+    u32 bgd_size = ext2spe->blockgroup_count*sizeof(ext2_block_group_descriptor_t);
+    ext2spe->bgd_table = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(bgd_size, "ext2 block group descriptor table");
+    #else
+    kmalloc(bgd_size);
+    #endif
+    ext2fs_specific_t* ext2 = ext2spe; //(for BLOCK_OFFSET)
+    u32 block_group_descriptor_table = (ext2->block_size == 1024 ? 2:1);
+    block_read_flexible(start_offset+BLOCK_OFFSET(block_group_descriptor_table), 0, (u8*) ext2spe->bgd_table, bgd_size, drive);
+    ext2spe->bgd_dirty = false;
+    u32 groups_size = ext2spe->blockgroup_count*sizeof(ext2_group_cache_t);
+    ext2spe->groups = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(groups_size, "ext2 block group bitmaps");
+    #else
+    kmalloc(groups_size);
+    #endif
+    memset(ext2spe->groups, 0, groups_size);
+    memset(&ext2spe->alloc_lock, 0, sizeof(mutex_t));
     
     tr->specific = ext2spe;
 
@@ -238,7 +260,7 @@ error_t ext2_unlink(char* file_name, fsnode_t* dir)
 
     //remove dirent
     error_t direntop = ext2_remove_dirent(file_name, dir);
-    if(direntop != ERROR_NONE) return direntop;
+    if(direntop != ERROR_NONE) {icache_put(file); return direntop;}
 
     //after dirent removing, update inode (decreasing hardlinks count)
     file->hard_links--;
@@ -248,6 +270,7 @@ error_t ext2_unlink(char* file_name, fsnode_t* dir)
     }
     else ext2_std_inode_write(file);
 
+    icache_put(file);
     return ERROR_NONE;
 }
 
@@ -386,18 +409,8 @@ static fsnode_t* ext2_std_inode_read(u32 inode, file_system_t* fs)
     ext2fs_specific_t* ext2 = fs->specific;
 
     /* try to read inode from the cache */
-    if(fs->cache_mutex->locked_by) mutex_wait(fs->cache_mutex);
-
-    list_entry_t* iptr = fs->inode_cache;
-    u32 isize = fs->inode_cache_size;
-    while(iptr && isize)
-    {
-        fsnode_t* element = iptr->element;
-        ext2_node_specific_t* espe = element->specific;
-        if(espe->inode_nbr == inode) return element;
-        iptr = iptr->next;
-        isize--;
-    }
+    fsnode_t* cached = icache_get(fs, inode);
+    if(cached) return cached;
 
     /* the inode is not in the cache, we need to read it from disk*/
     //getting inode size from superblock or standard depending on ext2 version
@@ -432,6 +445,8 @@ static fsnode_t* ext2_std_inode_read(u32 inode, file_system_t* fs)
     fsnode_t* std_node = kmalloc(sizeof(fsnode_t));
 
     std_node->file_system = fs;
+    std_node->pages = 0;
+    std_node->number = inode;
     
     std_node->attributes = 0;
     if((ext2_inode.type_and_permissions >> 12) == 4) std_node->attributes |= FILE_ATTR_DIR;
@@ -456,33 +471,7 @@ static fsnode_t* ext2_std_inode_read(u32 inode, file_system_t* fs)
     std_node->specific = specific;
 
     /* now that we have a normalized fsnode_t*, we can cache it and return it */
-    mutex_lock(fs->cache_mutex);
-    if(!fs->inode_cache)
-    {
-        fs->inode_cache = kmalloc(sizeof(list_entry_t));
-        fs->inode_cache->element = std_node;
-        fs->inode_cache->next = 0;
-        fs->inode_cache_size++;
-    }
-    else
-    {
-        list_entry_t* ptr = fs->inode_cache;
-        list_entry_t* last = 0;
-        u32 size = fs->inode_cache_size;
-        while(ptr && size)
-        {
-            last = ptr;
-            ptr = ptr->next;
-            size--;
-        }
-        ptr = kmalloc(sizeof(list_entry_t));
-        ptr->element = std_node;
-        last->next = ptr;
-        fs->inode_cache_size++;
-    }
-    mutex_unlock(fs->cache_mutex);
-
-    return std_node;
+    return icache_add(std_node);
 }
 
 /*
@@ -685,6 +674,9 @@ static error_t ext2_inode_read_content(fsnode_t* node, u32 offset, u32 size, voi
         kfree(sib);
         //resetting block counter
         i -= (ext2->block_size/4);
+
+        //a big file can take a lot of indirect blocks : let the other threads run
+        cond_resched();
     }
 
     kfree(doubly_indirect_block);
@@ -753,6 +745,8 @@ static error_t ext2_inode_read_content(fsnode_t* node, u32 offset, u32 size, voi
             kfree(sib);
             //resetting block counter
             i -= (ext2->block_size/4);
+
+            cond_resched();
         }
 
         kfree(dib);
@@ -802,6 +796,7 @@ static void ext2_queue_read(ext2_read_request_t* requests, u32 sector, u32 count
 
 /*
 * This function writes the content of 'buffer' to an ext2 file/inode (fsnode_t)
+* If 'buffer' is 0, the blocks are only allocated (their content is left as it is on the disk)
 */
 static error_t ext2_inode_write_content(fsnode_t* inode_desc, u32 offset, u32 size, void* buffer)
 {
@@ -836,7 +831,7 @@ static error_t ext2_inode_write_content(fsnode_t* inode_desc, u32 offset, u32 si
             inode->direct_block_pointers[i] = block;
         }
 
-        block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(inode->direct_block_pointers[i]), offset, buffer+currentloc, size >= ext2->block_size ? ext2->block_size : size, fs->drive);
+        if(buffer) block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(inode->direct_block_pointers[i]), offset, buffer+currentloc, size >= ext2->block_size ? ext2->block_size : size, fs->drive);
         
         currentloc+=ext2->block_size;
         if(offset) offset = 0;
@@ -875,7 +870,7 @@ static error_t ext2_inode_write_content(fsnode_t* inode_desc, u32 offset, u32 si
             singly_indirect_block[i] = block;
         }
 
-        block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(singly_indirect_block[i]), offset, buffer+currentloc, size >= ext2->block_size ? ext2->block_size : size, fs->drive);
+        if(buffer) block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(singly_indirect_block[i]), offset, buffer+currentloc, size >= ext2->block_size ? ext2->block_size : size, fs->drive);
         
         currentloc+=ext2->block_size;
         if(offset) offset = 0;
@@ -935,7 +930,7 @@ static error_t ext2_inode_write_content(fsnode_t* inode_desc, u32 offset, u32 si
                 sib[i] = block;
             }
 
-            block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(sib[i]), offset, buffer+currentloc, size >= ext2->block_size ? ext2->block_size : size, fs->drive);
+            if(buffer) block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(sib[i]), offset, buffer+currentloc, size >= ext2->block_size ? ext2->block_size : size, fs->drive);
         
             currentloc+=ext2->block_size;
             if(offset) offset = 0;
@@ -1013,7 +1008,7 @@ static error_t ext2_inode_write_content(fsnode_t* inode_desc, u32 offset, u32 si
                     sib[j] = block;
                 }
 
-                block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(sib[i]), offset, buffer+currentloc, size >= ext2->block_size ? ext2->block_size : size, fs->drive);
+                if(buffer) block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(sib[i]), offset, buffer+currentloc, size >= ext2->block_size ? ext2->block_size : size, fs->drive);
         
                 currentloc+=ext2->block_size;
                 if(offset) offset = 0;
@@ -1139,6 +1134,83 @@ static error_t ext2_create_dirent(u32 inode, char* name, fsnode_t* dir)
     return writeop;
 }
 
+/*
+* Get the block (or inode) bitmap of the group, reading it on first use (allocation lock must be held)
+* Returns 0 if it can't be read
+*/
+static u8* ext2_group_bitmap(file_system_t* fs, u32 group, bool inodes)
+{
+    ext2fs_specific_t* ext2 = fs->specific;
+    ext2_group_cache_t* cache = &ext2->groups[group];
+    u8** bitmap = inodes ? &cache->inode_bitmap : &cache->block_bitmap;
+    if(*bitmap) return *bitmap;
+
+    u8* buffer = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(ext2->block_size, "ext2 cached bitmap");
+    #else
+    kmalloc(ext2->block_size);
+    #endif
+    ext2_block_group_descriptor_t* bg = &ext2->bgd_table[group];
+    u32 block = inodes ? bg->block_address_inode_usage : bg->block_address_block_usage;
+    error_t readop = block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(block), 0, buffer, ext2->block_size, fs->drive);
+    if(readop != ERROR_NONE) {kfree(buffer); return 0;}
+
+    *bitmap = buffer;
+    return buffer;
+}
+
+/*
+* Write back the allocation metadata changed since the last call : bitmaps, then group descriptors, then superblock
+* Returns the first error met (what failed stays dirty)
+*/
+error_t ext2_sync(file_system_t* fs)
+{
+    ext2fs_specific_t* ext2 = fs->specific;
+    error_t tr = ERROR_NONE;
+
+    while(mutex_lock(&ext2->alloc_lock) != ERROR_NONE) mutex_wait(&ext2->alloc_lock);
+
+    u32 i;
+    for(i = 0; i < ext2->blockgroup_count; i++)
+    {
+        ext2_group_cache_t* cache = &ext2->groups[i];
+        ext2_block_group_descriptor_t* bg = &ext2->bgd_table[i];
+        if(cache->block_bitmap_dirty)
+        {
+            error_t writeop = block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(bg->block_address_block_usage), 0, cache->block_bitmap, ext2->block_size, fs->drive);
+            if(writeop == ERROR_NONE) cache->block_bitmap_dirty = false;
+            else if(tr == ERROR_NONE) tr = writeop;
+        }
+        if(cache->inode_bitmap_dirty)
+        {
+            error_t writeop = block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(bg->block_address_inode_usage), 0, cache->inode_bitmap, ext2->block_size, fs->drive);
+            if(writeop == ERROR_NONE) cache->inode_bitmap_dirty = false;
+            else if(tr == ERROR_NONE) tr = writeop;
+        }
+    }
+
+    if(ext2->bgd_dirty)
+    {
+        u32 block_group_descriptor_table = (ext2->block_size == 1024 ? 2:1);
+        error_t writeop = block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(block_group_descriptor_table), 0,
+        (u8*) ext2->bgd_table, ext2->blockgroup_count*sizeof(ext2_block_group_descriptor_t), fs->drive);
+        if(writeop == ERROR_NONE) ext2->bgd_dirty = false;
+        else if(tr == ERROR_NONE) tr = writeop;
+    }
+
+    if(ext2->superblock_dirty)
+    {
+        error_t writeop = block_write_flexible(ext2->superblock_offset+2, 0,
+        (u8*) ext2->superblock, sizeof(ext2_superblock_t), fs->drive);
+        if(writeop == ERROR_NONE) ext2->superblock_dirty = false;
+        else if(tr == ERROR_NONE) tr = writeop;
+    }
+
+    mutex_unlock(&ext2->alloc_lock);
+    return tr;
+}
+
 /*
 * Allocates a new block
 */
@@ -1146,45 +1218,37 @@ static u32 ext2_block_alloc(file_system_t* fs)
 {
     ext2fs_specific_t* ext2 = fs->specific;
 
-    u32 block_group_descriptor_table = (ext2->block_size == 1024 ? 2:1);
+    while(mutex_lock(&ext2->alloc_lock) != ERROR_NONE) mutex_wait(&ext2->alloc_lock);
 
     u32 i = 0;
     for(;i<ext2->blockgroup_count;i++)
     {
-        //read bg_desc of blockgroup i
-        ext2_block_group_descriptor_t bg_desc;
-        block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(block_group_descriptor_table), i*sizeof(ext2_block_group_descriptor_t),
-        (u8*) &bg_desc, sizeof(ext2_block_group_descriptor_t), fs->drive);
-
-        //read block bitmap of blockgroup i
-        u8* bitmap_buffer = kmalloc(ext2->block_size);
-        block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(bg_desc.block_address_block_usage), 0, bitmap_buffer, ext2->block_size, fs->drive);
+        //block bitmap of blockgroup i
+        u8* bitmap = ext2_group_bitmap(fs, i, false);
+        if(!bitmap) continue;
 
         //find first free bit of bitmap
-        u32 first_zero_bit = ext2_bitmap_mark_first_zero_bit(bitmap_buffer, ext2->block_size);
-        if(first_zero_bit == ((u32)-1)) {kfree(bitmap_buffer); continue;} //this blockgroup has no free block
-        
-        //rewrite marked bitmap on disk
-        block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(bg_desc.block_address_block_usage), 0, bitmap_buffer, ext2->block_size, fs->drive);
-    
+        u32 first_zero_bit = ext2_bitmap_mark_first_zero_bit(bitmap, ext2->block_size);
+        if(first_zero_bit == ((u32)-1)) continue; //this blockgroup has no free block
+
         //calculate block to return
-        u32 first_block = i*ext2->superblock->blocks_per_blockgroup + bg_desc.starting_block_adress;
+        u32 first_block = i*ext2->superblock->blocks_per_blockgroup + ext2->bgd_table[i].starting_block_adress;
         u32 tr = first_block + first_zero_bit;
 
-        //update bg_desc and rewrite it
-        bg_desc.unallocated_blocks--;
-        block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(block_group_descriptor_table), i*sizeof(ext2_block_group_descriptor_t),
-        (u8*) &bg_desc, sizeof(ext2_block_group_descriptor_t), fs->drive);
-
-        //update superblock and rewrite it
+        //update bitmap, bg_desc and superblock (written back by ext2_sync)
+        ext2->groups[i].block_bitmap_dirty = true;
+        ext2->bgd_table[i].unallocated_blocks--;
+        ext2->bgd_dirty = true;
         ext2->superblock->unallocated_blocks--;
-        block_write_flexible(ext2->superblock_offset+2, 0,
-        (u8*) ext2->superblock, sizeof(ext2_superblock_t), fs->drive);
+        ext2->superblock_dirty = true;
+
+        mutex_unlock(&ext2->alloc_lock);
 
         //return the free block that we have marked
         return tr;
     }
 
+    mutex_unlock(&ext2->alloc_lock);
     return 0;
 }
 
@@ -1199,300 +1263,203 @@ static void ext2_block_free(u32 block, file_system_t* fs)
     u32 blocks_per_blockgroup = ext2->superblock->blocks_per_blockgroup;
     u32 block_group = (block) / blocks_per_blockgroup;
 
-    //calculating block_group_descriptor offset
-    u32 bg_read_offset = block_group*sizeof(ext2_block_group_descriptor_t);
-
-    //reading block group descriptor
-    ext2_block_group_descriptor_t bg;
-    u32 block_group_descriptor_table = (ext2->block_size == 1024 ? 2:1);
-    block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(block_group_descriptor_table), bg_read_offset, (u8*) &bg, sizeof(ext2_block_group_descriptor_t), fs->drive);
+    while(mutex_lock(&ext2->alloc_lock) != ERROR_NONE) mutex_wait(&ext2->alloc_lock);
 
-    //reading block bitmap
-    u8* bitmap_buffer = kmalloc(ext2->block_size);
-    block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(bg.block_address_block_usage), 0, bitmap_buffer, ext2->block_size, fs->drive);
+    //block bitmap of the group
+    u8* bitmap = ext2_group_bitmap(fs, block_group, false);
+    if(!bitmap) {mutex_unlock(&ext2->alloc_lock); return;}
 
     //marking bit free in bitmap
     u32 bit_to_mark = block - block_group*ext2->superblock->blocks_per_blockgroup;
-    ext2_bitmap_mark_bit_free(bitmap_buffer, bit_to_mark);
+    ext2_bitmap_mark_bit_free(bitmap, bit_to_mark);
 
-    //rewrite marked bitmap on disk
-    block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(bg.block_address_block_usage), 0, bitmap_buffer, ext2->block_size, fs->drive);
+    //update bitmap, bg_desc and superblock (written back by ext2_sync)
+    ext2->groups[block_group].block_bitmap_dirty = true;
+    ext2->bgd_table[block_group].unallocated_blocks++;
+    ext2->bgd_dirty = true;
+    ext2->superblock->unallocated_blocks++;
+    ext2->superblock_dirty = true;
+
+    mutex_unlock(&ext2->alloc_lock);
 }
 
 /*
-* Allocates a new inode
+* Free the blocks of the tree under 'block' (a data block if 'depth' is 0, an indirect block of 'depth' levels otherwise),
+* from the block 'first' of the tree ; 'count' blocks of the tree are in use
+* Returns true if the whole tree was freed (the pointer to it must be cleared)
 */
-static u32 ext2_inode_alloc(file_system_t* fs)
+static bool ext2_block_tree_free(u32 block, u32 depth, u32 first, u32 count, file_system_t* fs)
 {
     ext2fs_specific_t* ext2 = fs->specific;
 
-    u32 block_group_descriptor_table = (ext2->block_size == 1024 ? 2:1);
-
-    u32 i = 0;
-    for(;i<ext2->blockgroup_count;i++)
+    if(depth)
     {
-        //read bg_desc of blockgroup i
-        ext2_block_group_descriptor_t bg_desc;
-        block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(block_group_descriptor_table),  i*sizeof(ext2_block_group_descriptor_t),
-        (u8*) &bg_desc, sizeof(ext2_block_group_descriptor_t), fs->drive);
-
-        //read inode bitmap of blockgroup i
-        u8* bitmap_buffer = kmalloc(ext2->block_size);
-        block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(bg_desc.block_address_inode_usage), 0, bitmap_buffer, ext2->block_size, fs->drive);
-
-        //find first free bit of bitmap
-        u32 first_zero_bit = ext2_bitmap_mark_first_zero_bit(bitmap_buffer, ext2->block_size);
-        if(first_zero_bit == ((u32)-1)) {kfree(bitmap_buffer); continue;} //this blockgroup has no free inode
-
-        //rewrite marked bitmap on disk
-        block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(bg_desc.block_address_inode_usage), 0, bitmap_buffer, ext2->block_size, fs->drive);
-        
-        //calculate inode to return
-        u32 inode = i*ext2->superblock->inodes_per_blockgroup + first_zero_bit + 1;
+        u32 per_block = ext2->block_size/4;
+        u32 span = 1; //blocks under each pointer
+        u32 i;
+        for(i = 1; i < depth; i++) span *= per_block;
 
-        //update bg_desc and rewrite it
-        bg_desc.unallocated_inodes--;
-        block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(block_group_descriptor_table),  i*sizeof(ext2_block_group_descriptor_t),
-        (u8*) &bg_desc, sizeof(ext2_block_group_descriptor_t), fs->drive);
+        u32* pointers = kmalloc(ext2->block_size);
+        block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(block), 0, (u8*) pointers, ext2->block_size, fs->drive);
 
-        //update superblock and rewrite it
-        ext2->superblock->unallocated_inodes--;
-        block_write_flexible(ext2->superblock_offset+2, 0,
-        (u8*) ext2->superblock, sizeof(ext2_superblock_t), fs->drive);
+        bool changed = false;
+        u32 base = 0;
+        for(i = 0; (i < per_block) && (base < count); i++, base += span)
+        {
+            if((!pointers[i]) || (base + span <= first)) continue;
+            u32 sub_first = (first > base) ? first - base : 0;
+            u32 sub_count = (count - base < span) ? count - base : span;
+            if(ext2_block_tree_free(pointers[i], depth-1, sub_first, sub_count, fs)) {pointers[i] = 0; changed = true;}
+        }
 
-        //return the free block that we have marked
-        return inode;
+        //the blocks before 'first' are kept, so is this one
+        if(first && changed) block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(block), 0, (u8*) pointers, ext2->block_size, fs->drive);
+        kfree(pointers);
     }
 
-    return 0;
+    if(first) return false;
+    ext2_block_free(block, fs);
+    return true;
 }
 
 /*
-* Free an allocated inode
+* Free the blocks of the inode past 'length' bytes (the pointers are cleared, the inode is not written)
 */
-static void ext2_inode_free(fsnode_t* node)
+static void ext2_inode_free_blocks(fsnode_t* node, u64 length)
 {
-    //TODO debug this (size checks)
     file_system_t* fs = node->file_system;
     ext2fs_specific_t* ext2 = fs->specific;
     ext2_node_specific_t* inode = node->specific;
-    u32 inode_nbr = inode->inode_nbr;
-
-    /* freeing inode blocks */
-    u64 size = node->length;
-    u32 i = 0;
-    for(i=0;i<12;i++)
-    {
-        if(!size) goto free_inode;
-
-        //in case the pointer is invalid, but should not (inode size supposed to cover this area), we return fail
-        if(!inode->direct_block_pointers[i]) 
-        {
-            kprintf("%v[WARNING] [SEVERE] EXT2 Filesystem might be corrupted (direct block pointer %u ->0)\n", 0b00000110, i);
-            return;// ERROR_FILE_CORRUPTED_FS;
-        }
 
-        ext2_block_free(inode->direct_block_pointers[i], fs);
+    //(ext2 files are read and written with 32 bits offsets)
+    u32 used = ((u32) node->length) / ext2->block_size + ((((u32) node->length) % ext2->block_size) ? 1 : 0);
+    u32 keep = ((u32) length) / ext2->block_size + ((((u32) length) % ext2->block_size) ? 1 : 0);
+    if(keep >= used) return;
 
-        if(size >= ext2->block_size) size -= ext2->block_size;
-        else size = 0;
+    //direct blocks
+    u32 i;
+    for(i = keep; (i < 12) && (i < used); i++)
+    {
+        if(inode->direct_block_pointers[i]) ext2_block_free(inode->direct_block_pointers[i], fs);
+        inode->direct_block_pointers[i] = 0;
     }
 
-    if(!size) goto free_inode;
-    if(!inode->singly_indirect_block_pointer)
+    //then singly, doubly and triply indirect blocks
+    u32* indirect[3] = {&inode->singly_indirect_block_pointer, &inode->doubly_indirect_block_pointer, &inode->triply_indirect_block_pointer};
+    u32 per_block = ext2->block_size/4;
+    u32 base = 12;
+    u32 span = per_block;
+    for(i = 0; (i < 3) && (base < used); i++)
     {
-        kprintf("%v[WARNING] [SEVERE] EXT2 Filesystem might be corrupted (singly indirect pointer->0)\n", 0b00000110);
-        return;// ERROR_FILE_CORRUPTED_FS;
+        u32 count = (used - base < span) ? used - base : span;
+        u32 first = (keep > base) ? keep - base : 0;
+        if(*indirect[i] && (first < count) && ext2_block_tree_free(*indirect[i], i+1, first, count, fs)) *indirect[i] = 0;
+        base += span;
+        span *= per_block;
     }
-    u32* singly_indirect_block = kmalloc(ext2->block_size);
-    block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(inode->singly_indirect_block_pointer), 0, (u8*) singly_indirect_block, ext2->block_size, fs->drive);
+}
 
-    for(i=0;i<(ext2->block_size/4);i++)
-    {
-        if(!size) {kfree(singly_indirect_block); ext2_block_free(inode->singly_indirect_block_pointer, fs); goto free_inode;}
+/*
+* Truncate the file to 'length' bytes (that must not be past its end), freeing the blocks after it
+*/
+error_t ext2_truncate(fsnode_t* node, u64 length)
+{
+    if(node->file_system->flags & FS_FLAG_READ_ONLY) return ERROR_FILE_SYSTEM_READ_ONLY;
+    if(length > node->length) return ERROR_FILE_OUT;
 
-        //in case the pointer is invalid, but should not (inode size supposed to cover this area), we return fail
-        if(!singly_indirect_block[i]) 
-        {
-            kprintf("%v[WARNING] [SEVERE] EXT2 Filesystem might be corrupted (singly indirect pointer->direct block pointer->0)\n", 0b00000110);
-            kfree(singly_indirect_block);
-            return;// ERROR_FILE_CORRUPTED_FS;
-        }
+    ext2_inode_free_blocks(node, length);
+    node->length = length;
+    return ext2_std_inode_write(node);
+}
 
-        ext2_block_free(singly_indirect_block[i], fs);
+/*
+* Extend the file to 'length' bytes, allocating its blocks without writing them :
+* the caller writes the data through the page cache (the new space is not cleared on the disk)
+*/
+error_t ext2_extend(fsnode_t* node, u64 length)
+{
+    if(length > U32_MAX) return ERROR_FILE_OUT;
+    if(length <= node->length) return ERROR_NONE;
+    return ext2_inode_write_content(node, (u32) node->length, (u32) (length - node->length), 0);
+}
 
-        if(size >= ext2->block_size) size -= ext2->block_size;
-        else size = 0;
-    }
-        
-    kfree(singly_indirect_block);
-    ext2_block_free(inode->singly_indirect_block_pointer, fs);
+/*
+* Allocates a new inode
+*/
+static u32 ext2_inode_alloc(file_system_t* fs)
+{
+    ext2fs_specific_t* ext2 = fs->specific;
 
-    if(!size) goto free_inode;
+    while(mutex_lock(&ext2->alloc_lock) != ERROR_NONE) mutex_wait(&ext2->alloc_lock);
 
-    if(!inode->doubly_indirect_block_pointer)
-    {
-        kprintf("%v[WARNING] [SEVERE] EXT2 Filesystem might be corrupted (doubly indirect pointer->0)\n", 0b00000110);
-        return;// ERROR_FILE_CORRUPTED_FS;
-    }
-    u32* doubly_indirect_block = kmalloc(ext2->block_size);
-    block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(inode->doubly_indirect_block_pointer), 0, (u8*) doubly_indirect_block, ext2->block_size, fs->drive);
-    
-    u32 j;
-    for(j = 0;j<(ext2->block_size/4);j++)
+    u32 i = 0;
+    for(;i<ext2->blockgroup_count;i++)
     {
-        //in case the pointer is invalid, but should not (inode size supposed to cover this area), we return fail
-        if(!doubly_indirect_block[j]) 
-        {
-            kprintf("%v[WARNING] [SEVERE] EXT2 Filesystem might be corrupted (doubly indirect pointer->singly indirect pointer->0)\n", 0b00000110);
-            kfree(doubly_indirect_block);
-            return;// ERROR_FILE_CORRUPTED_FS;
-        }
-        u32* sib = kmalloc(ext2->block_size);
-        block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(doubly_indirect_block[j]), 0, (u8*) sib, ext2->block_size, fs->drive);
-
-        for(i=0;i<(ext2->block_size/4);i++)
-        {
-            if(!size) {kfree(sib); kfree(doubly_indirect_block); ext2_block_free(doubly_indirect_block[j], fs); ext2_block_free(inode->doubly_indirect_block_pointer, fs); goto free_inode;}
-
-            //in case the pointer is invalid, but should not (inode size supposed to cover this area), we return fail
-            if(!sib[i]) 
-            {
-                kprintf("%v[WARNING] [SEVERE] EXT2 Filesystem might be corrupted (doubly->singly->direct->0)\n", 0b00000110);
-                kfree(sib); kfree(doubly_indirect_block);
-                return;// ERROR_FILE_CORRUPTED_FS;
-            }
+        //inode bitmap of blockgroup i
+        u8* bitmap = ext2_group_bitmap(fs, i, true);
+        if(!bitmap) continue;
 
-            ext2_block_free(sib[i], fs);
+        //find first free bit of bitmap
+        u32 first_zero_bit = ext2_bitmap_mark_first_zero_bit(bitmap, ext2->block_size);
+        if(first_zero_bit == ((u32)-1)) continue; //this blockgroup has no free inode
 
-            if(size >= ext2->block_size) size -= ext2->block_size;
-            else size = 0;
-        }
+        //calculate inode to return
+        u32 inode = i*ext2->superblock->inodes_per_blockgroup + first_zero_bit + 1;
 
-        kfree(sib);
-        ext2_block_free(doubly_indirect_block[j], fs);
-    }
+        //update bitmap, bg_desc and superblock (written back by ext2_sync)
+        ext2->groups[i].inode_bitmap_dirty = true;
+        ext2->bgd_table[i].unallocated_inodes--;
+        ext2->bgd_dirty = true;
+        ext2->superblock->unallocated_inodes--;
+        ext2->superblock_dirty = true;
 
-    kfree(doubly_indirect_block);
-    ext2_block_free(inode->doubly_indirect_block_pointer, fs);
+        mutex_unlock(&ext2->alloc_lock);
 
-    if(!inode->triply_indirect_block_pointer)
-    {
-        kprintf("%v[WARNING] [SEVERE] EXT2 Filesystem might be corrupted (triply indirect pointer->0)\n", 0b00000110);
-        return;// ERROR_FILE_CORRUPTED_FS;
+        //return the free block that we have marked
+        return inode;
     }
-    u32* triply_indirect_block = kmalloc(ext2->block_size);
-    block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(inode->triply_indirect_block_pointer), 0, (u8*) triply_indirect_block, ext2->block_size, fs->drive);
-
-    u32 k;
-    for(k=0;k<(ext2->block_size/4);k++)
-    {
-        if(!triply_indirect_block[j]) 
-        {
-            kprintf("%v[WARNING] [SEVERE] EXT2 Filesystem might be corrupted (triply indirect pointer->doubly indirect pointer->0)\n", 0b00000110);
-            kfree(triply_indirect_block);
-            return;// ERROR_FILE_CORRUPTED_FS;
-        }
-        u32* dib = kmalloc(ext2->block_size);
-        block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(triply_indirect_block[j]), 0, (u8*) dib, ext2->block_size, fs->drive);
-
-        for(j=0;j<(ext2->block_size/4);j++)
-        {
-            //in case the pointer is invalid, but should not (inode size supposed to cover this area), we return fail
-            if(!dib[j]) 
-            {
-                kprintf("%v[WARNING] [SEVERE] EXT2 Filesystem might be corrupted (tip->dip->sip->0)\n", 0b00000110);
-                kfree(triply_indirect_block); kfree(dib);
-                return;// ERROR_FILE_CORRUPTED_FS;
-            }
-            u32* sib = kmalloc(ext2->block_size);
-            block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(dib[j]), 0, (u8*) sib, ext2->block_size, fs->drive);
-
-            for(i=0;i<(ext2->block_size/4);i++)
-            {
-                //in case the pointer is invalid, but should not (inode size supposed to cover this area), we return fail
-                if(!sib[i]) 
-                {
-                    kprintf("%v[WARNING] [SEVERE] EXT2 Filesystem might be corrupted (tip->dip->sip->direct->0)\n", 0b00000110);
-                    kfree(sib); kfree(dib); kfree(triply_indirect_block);
-                    return;// ERROR_FILE_CORRUPTED_FS;
-                }
-
-                ext2_block_free(sib[i], fs);
 
-                if(size >= ext2->block_size) size -= ext2->block_size;
-                else size = 0;
-            
-                if(!size) {kfree(sib); kfree(dib); kfree(triply_indirect_block); ext2_block_free(dib[j], fs); ext2_block_free(triply_indirect_block[k], fs); ext2_block_free(inode->triply_indirect_block_pointer, fs); goto free_inode;}
-            }
+    mutex_unlock(&ext2->alloc_lock);
+    return 0;
+}
 
-            kfree(sib);
-            ext2_block_free(dib[j], fs);
-        }
+/*
+* Free an allocated inode
+*/
+static void ext2_inode_free(fsnode_t* node)
+{
+    file_system_t* fs = node->file_system;
+    ext2fs_specific_t* ext2 = fs->specific;
+    ext2_node_specific_t* inode = node->specific;
+    u32 inode_nbr = inode->inode_nbr;
 
-        kfree(dib);
-        ext2_block_free(triply_indirect_block[k], fs);
-    }
+    /* the content is gone : drop the cached pages before their blocks can be given to another file */
+    pagecache_invalidate(node);
 
-    kfree(triply_indirect_block);
-    ext2_block_free(inode->triply_indirect_block_pointer, fs);
+    /* freeing inode blocks */
+    ext2_inode_free_blocks(node, 0);
 
     /* freeing the inode */
-    free_inode:
-    {
     //calculating inode block group
     u32 inodes_per_blockgroup = ext2->superblock->inodes_per_blockgroup;
     u32 inode_block_group = (inode_nbr - 1) / inodes_per_blockgroup;
 
-    //calculating block_group_descriptor offset
-    u32 bg_read_offset = inode_block_group*sizeof(ext2_block_group_descriptor_t);
-
-    //reading block group descriptor
-    ext2_block_group_descriptor_t inode_bg;
-    u32 block_group_descriptor_table = (ext2->block_size == 1024 ? 2:1);
-    block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(block_group_descriptor_table), bg_read_offset, (u8*) &inode_bg, sizeof(ext2_block_group_descriptor_t), fs->drive);
+    while(mutex_lock(&ext2->alloc_lock) != ERROR_NONE) mutex_wait(&ext2->alloc_lock);
 
-    //reading inode bitmap
-    u8* bitmap_buffer = kmalloc(ext2->block_size);
-    block_read_flexible(ext2->superblock_offset+BLOCK_OFFSET(inode_bg.block_address_inode_usage), 0, bitmap_buffer, ext2->block_size, fs->drive);
-
-    //marking bit free in bitmap
-    u32 bit_to_mark = inode_nbr - 1 - inode_block_group*ext2->superblock->inodes_per_blockgroup;
-    ext2_bitmap_mark_bit_free(bitmap_buffer, bit_to_mark);
-
-    //rewrite marked bitmap on disk
-    block_write_flexible(ext2->superblock_offset+BLOCK_OFFSET(inode_bg.block_address_inode_usage), 0, bitmap_buffer, ext2->block_size, fs->drive);
-
-    /* free inode from the cache */
-    //TODO: here we assume that inode we want to free is not the first in the cache (cause the first is theorically inode 2)
-    //this is a little risquy tho
-    mutex_lock(fs->cache_mutex);
-    list_entry_t* iptr = fs->inode_cache;
-    list_entry_t* last = 0;
-    u32 isize = fs->inode_cache_size;
-    while(iptr && isize)
+    //inode bitmap of the group
+    u8* bitmap = ext2_group_bitmap(fs, inode_block_group, true);
+    if(bitmap)
     {
-        fsnode_t* element = iptr->element;
-        ext2_node_specific_t* spe = element->specific;
-        
-        //we found our inode
-        if(spe->inode_nbr == inode_nbr) 
-        {
-            last->next = iptr->next;
-            kfree(element->specific);
-            kfree(element);
-            kfree(iptr);
-            fs->inode_cache_size--;
-            break;
-        }
-        
-        last = iptr;
-        iptr = iptr->next;
-        isize--;
+        //marking bit free in bitmap (written back by ext2_sync)
+        u32 bit_to_mark = inode_nbr - 1 - inode_block_group*ext2->superblock->inodes_per_blockgroup;
+        ext2_bitmap_mark_bit_free(bitmap, bit_to_mark);
+        ext2->groups[inode_block_group].inode_bitmap_dirty = true;
     }
-    mutex_unlock(fs->cache_mutex);
 
-    }
+    mutex_unlock(&ext2->alloc_lock);
+
+    /* the inode number can be reused : forget the node (it is freed when unused) */
+    icache_remove(node);
 }
 
 static u32 ext2_bitmap_mark_first_zero_bit(u8* bitmap, u32 len)
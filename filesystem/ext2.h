@@ -125,12 +125,26 @@ typedef struct ext2_node_specific
     u32 triply_indirect_block_pointer;
 } ext2_node_specific_t;
 
+typedef struct ext2_group_cache
+{
+    u8* block_bitmap; //read on first allocation/free in the group, 0 before
+    u8* inode_bitmap;
+    bool block_bitmap_dirty; //changed since the last ext2_sync()
+    bool inode_bitmap_dirty;
+} ext2_group_cache_t;
+
 typedef struct ext2fs_specific
 {
     struct EXT2_SUPERBLOCK* superblock;
     u32 superblock_offset;
     u32 block_size;
     u32 blockgroup_count;
+    bool superblock_dirty; //free counts changed since the last ext2_sync()
+    //allocation metadata, kept in memory and written back by ext2_sync()
+    ext2_block_group_descriptor_t* bgd_table; //block group descriptors, read at mount
+    bool bgd_dirty;
+    ext2_group_cache_t* groups; //bitmaps of each block group
+    mutex_t alloc_lock; //protects the superblock counters, the descriptors and the bitmaps
 } ext2fs_specific_t;
 
 typedef struct ext2_read_request
@@ -144,10 +158,13 @@ typedef struct ext2_read_request
 file_system_t* ext2_init(block_device_t* drive, u8 partition);
 fsnode_t* ext2_open(fsnode_t* dir, char* name);
 error_t ext2_write_file(fd_t* fd, void* buffer, u64 count);
+error_t ext2_truncate(fsnode_t* node, u64 length);
+error_t ext2_extend(fsnode_t* node, u64 length);
 error_t ext2_read_file(fd_t* fd, void* buffer, u64 count);
 error_t ext2_list_dir(list_entry_t* dest, fsnode_t* dir, u32* size);
 error_t ext2_unlink(char* file_name, fsnode_t* dir);
 error_t ext2_link(fsnode_t* src_file, char* file_name, fsnode_t* dir);
 fsnode_t* ext2_create_file(fsnode_t* dir, char* name, u8 attributes);
+error_t ext2_sync(file_system_t* fs);
 
 #endif
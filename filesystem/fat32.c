@@ -16,6 +16,7 @@
 */
 
 #include "fat32.h"
+#include "tasking/task.h"
 
 static u64 fat32fs_cluster_to_lba(file_system_t* fs, u32 cluster);
 static list_entry_t* fat32fs_get_cluster_chain(u32 fcluster, file_system_t* fs, u32* size);
@@ -81,14 +82,14 @@ file_system_t* fat32fs_init(block_device_t* drive, u8 partition)
 
 	spe->bpb = bpb;
 	spe->bpb_offset = offset;
+	spe->fat_dirty = false;
 
 	tr->fs_type = FS_TYPE_FAT32;
 	tr->flags = 0 | FS_FLAG_CASE_INSENSITIVE;
 	tr->drive = drive;
 	tr->partition = partition;
 
-	tr->inode_cache = 0;
-	tr->inode_cache_size = 0;
+	icache_init(tr);
 
 	//reading the FAT and caching it in memory
 	spe->fat_table = 
@@ -441,61 +442,38 @@ error_t fat32_write_file(fd_t* fd, void* buffer, u64 count)
 {
 	fsnode_t* file = fd->file;
 	fat32_node_specific_t* fspe = file->specific;
-	u64 count_bckp = count;
-	u32 cluster = fspe->cluster;
-	u64 offset = fd->offset;
 	file_system_t* fs = file->file_system;
 	fat32fs_specific_t* spe = (fat32fs_specific_t*) fs->specific;
+	u32 cluster_size = spe->bpb->sectors_per_cluster*512;
 
-	//get the cluster chain for this file
-	u64 cluss = 0;
-	list_entry_t* cluslist = fat32fs_get_cluster_chain(cluster, fs, (u32*) &cluss);
-	list_entry_t* clusbuffer = cluslist;
-
-	//get the first cluster to write
+	//get the first cluster to write (and the offset inside it)
+	u64 offset = fd->offset;
 	u32 fclus_tw = 0;
-	while(offset > spe->bpb->sectors_per_cluster*512) {offset = (u64) (offset - ((u64) spe->bpb->sectors_per_cluster*512)); fclus_tw++;}
+	while(offset >= cluster_size) {offset = (u64) (offset - cluster_size); fclus_tw++;}
 
 	//get the last cluster to write
+	u64 last_byte = offset + count - 1;
 	u32 lclus_tw = fclus_tw;
-	while(count > spe->bpb->sectors_per_cluster*512) {count = (u64) (count - ((u64) spe->bpb->sectors_per_cluster*512)); lclus_tw++;}
+	while(last_byte >= cluster_size) {last_byte = (u64) (last_byte - cluster_size); lclus_tw++;}
 
-	if(lclus_tw > cluss)
-	{
-		//expand file size
-		u32 needed_clusters = lclus_tw - fclus_tw;
-		if(!needed_clusters) needed_clusters++;
+	//get the cluster chain for this file
+	u32 cluss = 0;
+	list_entry_t* cluslist = fat32fs_get_cluster_chain(fspe->cluster, fs, &cluss);
+	list_entry_t* clusbuffer = cluslist;
 
-		u32 fnc = fat32fs_gm_free_clusters(needed_clusters, fs);
-		
+	if(lclus_tw >= cluss)
+	{
+		//expand file size : link the new clusters after the last one, then get the whole chain again
 		u32 clus_temp_i;
-		for(clus_temp_i = 0; clus_temp_i < cluss-1; clus_temp_i++) 
-		{
-			clusbuffer = clusbuffer->next;
-		}
-		u32* last_cluster = (u32*) clusbuffer->element;
-
-		u32* nclv = 
-		#ifdef MEMLEAK_DBG
-		kmalloc(sizeof(u32), "Cluster number, fat32.c:write_file"); 
-		#else
-		kmalloc(sizeof(u32)); 
-		#endif
-		*nclv = fnc; 
-
-		clusbuffer->next = 
-		#ifdef MEMLEAK_DBG
-		kmalloc(sizeof(list_entry_t), "new cluster list element, fat32.c:write_file"); 
-		#else 
-		kmalloc(sizeof(list_entry_t)); 
-		#endif
-		clusbuffer->next->element = nclv;
-		
-		cluss++;
+		for(clus_temp_i = 0; clus_temp_i < cluss-1; clus_temp_i++) clusbuffer = clusbuffer->next;
+		u32 last_cluster = *((u32*) clusbuffer->element);
+		list_free(cluslist, cluss);
 
-		spe->fat_table[*last_cluster] = fnc;
+		spe->fat_table[last_cluster] = fat32fs_gm_free_clusters(lclus_tw+1-cluss, fs);
+		//the fat is written back by fat32_sync()
+		spe->fat_dirty = true;
 
-		fat32fs_write_fat(fs);
+		cluslist = fat32fs_get_cluster_chain(fspe->cluster, fs, &cluss);
 	}
 
 	u32 i = fclus_tw;
@@ -503,22 +481,28 @@ error_t fat32_write_file(fd_t* fd, void* buffer, u64 count)
 	clusbuffer = cluslist;
 	while(i) {clusbuffer = clusbuffer->next; i--;}
 
+	u8* src = buffer;
+	u64 left = count;
 	for(i = fclus_tw; i <= lclus_tw; i++)
 	{
-		if(i == fclus_tw)
-			block_write_flexible(fat32fs_cluster_to_lba(fs, *((u32*)clusbuffer->element)), (u32) offset, buffer, (i == lclus_tw ? count : ((u64) spe->bpb->sectors_per_cluster*512)), fs->drive);
-		else
-			block_write_flexible(fat32fs_cluster_to_lba(fs, *((u32*)clusbuffer->element)), 0, buffer, (i == lclus_tw ? count : ((u64) spe->bpb->sectors_per_cluster*512)), fs->drive);
-		
-		clusbuffer = clusbuffer->next;	
+		u32 size = cluster_size - (u32) offset;
+		if(size > left) size = (u32) left;
+
+		error_t writeop = block_write_flexible(fat32fs_cluster_to_lba(fs, *((u32*)clusbuffer->element)), (u32) offset, src, size, fs->drive);
+		if(writeop != ERROR_NONE) {list_free(cluslist, cluss); return writeop;}
+
+		src += size;
+		left -= size;
+		offset = 0;
+		clusbuffer = clusbuffer->next;
 	}
 
 	//freeing the cluster list
-	list_free(cluslist, (u32) cluss);
+	list_free(cluslist, cluss);
 
-	if(count_bckp+fd->offset > file->length)
+	if(count+fd->offset > file->length)
 	{
-		file->length = count_bckp+fd->offset;
+		file->length = count+fd->offset;
 		//here we assume the function can't fail, because we wrote to the file so it obviously exists
 		fat32fs_update_dirent(file);
 	}
@@ -526,6 +510,82 @@ error_t fat32_write_file(fd_t* fd, void* buffer, u64 count)
 	return ERROR_NONE;
 }
 
+/*
+* This function truncates a file to 'length' bytes (that must not be past its end), freeing the clusters after it
+* (a file always keeps its first cluster)
+*/
+error_t fat32_truncate(fsnode_t* file, u64 length)
+{
+	fat32_node_specific_t* fspe = file->specific;
+	file_system_t* fs = file->file_system;
+	fat32fs_specific_t* spe = (fat32fs_specific_t*) fs->specific;
+	u32 cluster_size = spe->bpb->sectors_per_cluster*512;
+
+	if(length > file->length) return ERROR_FILE_OUT;
+
+	//find the last cluster to keep
+	u32 cluster = fspe->cluster;
+	u64 left = length;
+	while(left > cluster_size)
+	{
+		u32 next = spe->fat_table[cluster] & 0x0FFFFFFF;
+		if((next < 2) || (next >= 0x0FFFFFF7)) break;
+		cluster = next;
+		left = (u64) (left - cluster_size);
+	}
+
+	//cut the chain after it
+	u32 next = spe->fat_table[cluster] & 0x0FFFFFFF;
+	if((next >= 2) && (next < 0x0FFFFFF7))
+	{
+		spe->fat_table[cluster] = 0x0FFFFFFF;
+		fat32fs_free_cluster_chain(next, fs);
+	}
+
+	file->length = length;
+	return fat32fs_update_dirent(file);
+}
+
+/*
+* This function extends a file to 'length' bytes, allocating its clusters without writing them :
+* the caller writes the data through the page cache (the new space is not cleared on the disk)
+*/
+error_t fat32_extend(fsnode_t* file, u64 length)
+{
+	fat32_node_specific_t* fspe = file->specific;
+	file_system_t* fs = file->file_system;
+	fat32fs_specific_t* spe = (fat32fs_specific_t*) fs->specific;
+	u32 cluster_size = spe->bpb->sectors_per_cluster*512;
+
+	if(length <= file->length) return ERROR_NONE;
+
+	//get the last cluster needed
+	u64 last_byte = length - 1;
+	u32 lclus = 0;
+	while(last_byte >= cluster_size) {last_byte = (u64) (last_byte - cluster_size); lclus++;}
+
+	//find the end of the chain
+	u32 cluster = fspe->cluster;
+	u32 cluss = 1;
+	u32 next = spe->fat_table[cluster] & 0x0FFFFFFF;
+	while((next >= 2) && (next < 0x0FFFFFF7))
+	{
+		cluster = next;
+		cluss++;
+		next = spe->fat_table[cluster] & 0x0FFFFFFF;
+	}
+
+	if(lclus >= cluss)
+	{
+		spe->fat_table[cluster] = fat32fs_gm_free_clusters(lclus+1-cluss, fs);
+		//the fat is written back by fat32_sync()
+		spe->fat_dirty = true;
+	}
+
+	file->length = length;
+	return fat32fs_update_dirent(file);
+}
+
 /*
 * This function renames a file
 */
@@ -552,29 +612,20 @@ error_t fat32_rename(fsnode_t* src_file, char* src_file_name, char* new_file_nam
 error_t fat32_unlink(char* file_name, fsnode_t* dir)
 {
 	fsnode_t* file = fat32_open(dir, file_name);
+	if(!file) return ERROR_FILE_NOT_FOUND;
 	file_system_t* fs = file->file_system;
 	fat32_node_specific_t* fspe = file->specific;
 
 	error_t dirent = fat32fs_delete_dirent(file, dir);
-	if(dirent != ERROR_NONE) return dirent;
+	if(dirent != ERROR_NONE) {icache_put(file); return dirent;}
 
+	/* the content is gone : drop the cached pages before their clusters can be given to another file */
+	pagecache_invalidate(file);
 	fat32fs_free_cluster_chain(fspe->cluster, fs);
 
-	/* free node from the cache */
-    //TODO: here we assume that node we want to free is not the first in the cache (cause the first is theorically root dir)
-    //this is a little risquy tho
-	list_entry_t* iptr = fs->inode_cache;
-    list_entry_t* last = 0;
-    u32 isize = fs->inode_cache_size;
-    while(iptr && isize)
-    {
-        fsnode_t* element = iptr->element;
-        fat32_node_specific_t* spe = element->specific;
-        if(spe->cluster == fspe->cluster) {last->next = iptr->next; kfree(element->specific); kfree(element); kfree(iptr);}
-        last = iptr;
-        iptr = iptr->next;
-        isize--;
-    }
+	/* the cluster can be reused : forget the node (it is freed when unused) */
+	icache_remove(file);
+	icache_put(file);
 
 	return ERROR_NONE;
 }
@@ -587,43 +638,23 @@ fsnode_t* fat32_create_file(fsnode_t* dir, char* name, u8 attributes)
 	file_system_t* fs = dir->file_system;
 	fsnode_t* file = kmalloc(sizeof(fsnode_t));
 
-	/* cache the object */
-    if(!fs->inode_cache)
-    {
-        fs->inode_cache = kmalloc(sizeof(list_entry_t));
-        fs->inode_cache->element = file;
-        fs->inode_cache_size++;
-    }
-    else
-    {
-        list_entry_t* ptr = fs->inode_cache;
-        list_entry_t* last = 0;
-        u32 size = fs->inode_cache_size;
-        while(ptr && size)
-        {
-            last = ptr;
-            ptr = ptr->next;
-            size--;
-        }
-        ptr = kmalloc(sizeof(list_entry_t));
-        ptr->element = file;
-        last->next = ptr;
-        fs->inode_cache_size++;
-    }
-
 	/* fill the object informations */
 	file->file_system = fs;
+	file->pages = 0;
 	file->length = 0;
 	file->attributes = attributes;
 	file->hard_links = 0;
 	fat32_node_specific_t* specific = kmalloc(sizeof(fat32_node_specific_t));
 	specific->cluster = fat32fs_gm_free_clusters(1, fs);
+	specific->dir_cluster = ((fat32_node_specific_t*) dir->specific)->cluster;
 	file->specific = specific;
+	file->number = specific->cluster;
 
 	/* create dirent */
 	fat32fs_create_dirent(file, name, dir);
 
-	return file;
+	/* cache the object */
+	return icache_add(file);
 }
 
 /*
@@ -710,9 +741,8 @@ static void fat32fs_free_cluster_chain(u32 fcluster, file_system_t* fs)
 
 		cluster = cchain;
 	} while((cchain != 0) && !(cchain >= 0x0FFFFFF8));
-	spe->fat_table[cluster] = 0;
 
-	fat32fs_write_fat(fs);
+	spe->fat_dirty = true;
 }
 
 /*
@@ -742,6 +772,7 @@ static u32 fat32fs_gm_free_clusters(u32 nbr, file_system_t* fs)
 		active_cluster++;
 		nbr--;
 	}
+	spe->fat_dirty = true;
 	return last_free_cluster;
 }
 
@@ -858,13 +889,39 @@ static error_t fat32fs_read_fat(file_system_t* fs)
 
 /*
 * this function writes the cached fat on disk
+* (by chunks, with a preemption point between each : the fat can be several megabytes)
 */
+#define FAT32_WRITE_FAT_CHUNK 0x10000 //multiple of the sector size
 static error_t fat32fs_write_fat(file_system_t* fs)
 {
 	fat32fs_specific_t* spe = (fat32fs_specific_t*) fs->specific;
 	u32 fat_size = spe->bpb->fat_size * spe->bpb->bytes_per_sector;
 	u32 fat_sector = spe->bpb_offset + spe->bpb->reserved_sectors;
-	return block_write_flexible(fat_sector, 0, (u8*) spe->fat_table, fat_size, fs->drive);
+
+	u32 offset = 0;
+	while(offset < fat_size)
+	{
+		u32 chunk = (fat_size - offset > FAT32_WRITE_FAT_CHUNK) ? FAT32_WRITE_FAT_CHUNK : fat_size - offset;
+		error_t err = block_write_flexible(fat_sector + offset/512, 0, ((u8*) spe->fat_table)+offset, chunk, fs->drive);
+		if(err != ERROR_NONE) return err;
+		offset += chunk;
+		cond_resched();
+	}
+	return ERROR_NONE;
+}
+
+/*
+* This function writes the cached fat on disk if it was modified since the last sync
+*/
+error_t fat32_sync(file_system_t* fs)
+{
+	fat32fs_specific_t* spe = (fat32fs_specific_t*) fs->specific;
+	if(!spe->fat_dirty) return ERROR_NONE;
+
+	spe->fat_dirty = false;
+	error_t err = fat32fs_write_fat(fs);
+	if(err != ERROR_NONE) spe->fat_dirty = true;
+	return err;
 }
 
 /*
@@ -1125,8 +1182,8 @@ static error_t fat32fs_create_dirent(fsnode_t* file, char* name, fsnode_t* dir)
 	//free the dir entries buffer
 	kfree(dirents);
 	
-	//write the fat
-	fat32fs_write_fat(fs);
+	//the fat is written back by fat32_sync()
+	spe->fat_dirty = true;
 
 	file->hard_links++;
 
@@ -1434,22 +1491,19 @@ static fsnode_t* fat32_dirent_normalize_cache(fat32_dir_entry_t* dirent, u32 dir
 	u32 file_cluster = (((u32)dirent->first_cluster_high) << 16) | ((u32)dirent->first_cluster_low);
 	file_cluster &= 0x0FFFFFFF;
 
-	/* try to read node from the cache */
-    list_entry_t* iptr = fs->inode_cache;
-    u32 isize = fs->inode_cache_size;
-    while(iptr && isize)
-    {
-        fsnode_t* element = iptr->element;
-        fat32_node_specific_t* espe = element->specific;
-        if(espe->cluster == file_cluster) return element;
-        iptr = iptr->next;
-        isize--;
-    }
+	/* try to read node from the cache (an empty file has no cluster, so no number : it is never cached) */
+	if(file_cluster)
+	{
+		fsnode_t* cached = icache_get(fs, file_cluster);
+		if(cached) return cached;
+	}
 
 	/* parse inode from dirent */
 	fsnode_t* std_node = kmalloc(sizeof(fsnode_t));
 
 	std_node->file_system = fs;
+	std_node->pages = 0;
+	std_node->number = file_cluster;
 
 	std_node->hard_links = 1;
 
@@ -1491,28 +1545,5 @@ static fsnode_t* fat32_dirent_normalize_cache(fat32_dir_entry_t* dirent, u32 dir
 	std_node->specific = spe;
 
 	/* cache the object */
-    if(!fs->inode_cache)
-    {
-        fs->inode_cache = kmalloc(sizeof(list_entry_t));
-        fs->inode_cache->element = std_node;
-        fs->inode_cache_size++;
-    }
-    else
-    {
-        list_entry_t* ptr = fs->inode_cache;
-        list_entry_t* last = 0;
-        u32 size = fs->inode_cache_size;
-        while(ptr && size)
-        {
-            last = ptr;
-            ptr = ptr->next;
-            size--;
-        }
-        ptr = kmalloc(sizeof(list_entry_t));
-        ptr->element = std_node;
-        last->next = ptr;
-        fs->inode_cache_size++;
-    }
-
-    return std_node;
+	return icache_add(std_node);
 }
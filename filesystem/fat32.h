@@ -106,6 +106,7 @@ typedef struct fat32fs_specific
     struct BPB* bpb;
     u32 bpb_offset;
     u32* fat_table;
+    bool fat_dirty; //the cached fat changed since the last fat32_sync()
 } fat32fs_specific_t;
 
 file_system_t* fat32fs_init(block_device_t* drive, u8 partition);
@@ -113,8 +114,11 @@ fsnode_t* fat32_open(fsnode_t* dir, char* name);
 error_t fat32_list_dir(list_entry_t* tr, fsnode_t* dir, u32* size);
 error_t fat32_read_file(fd_t* fd, void* buffer, u64 count);
 error_t fat32_write_file(fd_t* fd, void* buffer, u64 count);
+error_t fat32_truncate(fsnode_t* file, u64 length);
+error_t fat32_extend(fsnode_t* file, u64 length);
 error_t fat32_unlink(char* file_name, fsnode_t* dir);
 error_t fat32_rename(fsnode_t* src_file, char* src_file_name, char* new_file_name, fsnode_t* dir);
 fsnode_t* fat32_create_file(fsnode_t* dir, char* name, u8 attributes);
+error_t fat32_sync(file_system_t* fs);
 
 #endif
\ No newline at end of file
@@ -43,6 +43,14 @@ typedef struct fsnode
     time_t last_access_time;
     time_t last_modification_time;
     void* specific;
+    radix_tree_t* pages; //page cache (pagecache.c) : cached pages of the file content, 0 if none
+    //inode cache (icache.c)
+    u32 number; //key in the cache of the filesystem (inode, first cluster, extent), 0 if none
+    u32 refs; //users : open files, mount points, lookups in progress (unused nodes can be evicted)
+    bool hashed; //can be found by its number
+    struct fsnode* hash_next;
+    struct fsnode* lru_prev; //unused nodes only
+    struct fsnode* lru_next;
 } fsnode_t;
 
 typedef struct dirent
@@ -58,6 +66,16 @@ typedef struct fd
     u64 offset;
     u32 instances;
     char* path;
+    //readahead state (access pattern of the file through this descriptor)
+    u64 ra_next; //offset right after the last read : a read starting there is sequential
+    u32 ra_window; //readahead window in pages (0 : random access, no readahead)
+    u32 ra_end; //first page not requested yet
+    //directory cursor (getdents) : the offset is the index of the next entry, in a listing taken when the cursor was at 0
+    list_entry_t* dir_list;
+    u32 dir_size;
+    list_entry_t* dir_next; //element of dir_list at index dir_next_index, to continue without walking the list again
+    u32 dir_next_index;
+    mutex_t dir_lock; //protects the cursor and the listing (threads of the process share the descriptor)
 } fd_t;
 
 #define FS_FLAG_CASE_INSENSITIVE 1
@@ -70,9 +88,18 @@ typedef struct file_system
     u8 fs_type;
     u8 flags;
     struct fsnode* root_dir;
-    list_entry_t* inode_cache;
-    mutex_t* cache_mutex;
-    u32 inode_cache_size;
+    //inode cache (icache.c) : 0 inode_hash if the filesystem has none (devfs : its nodes live as long as their device)
+    struct fsnode** inode_hash;
+    spinlock_t cache_lock;
+    struct fsnode* lru_head; //unused nodes, most recently used first
+    struct fsnode* lru_tail;
+    struct fsnode* released; //unused nodes out of the hash, to free
+    u32 inode_cache_size; //unused nodes kept at most
+    u32 inode_count; //nodes in the hash
+    u32 inode_unused; //nodes on the LRU list
+    u32 inode_hits;
+    u32 inode_misses;
+    u32 inode_evictions;
     void* specific;
 } file_system_t;
 
@@ -81,13 +108,16 @@ typedef struct mount_point
 {
     char* path;
     file_system_t* fs;
+    struct fsnode* dir; //directory covered by the mount (0 for the root point)
     struct mount_point* next;
 } mount_point_t;
 extern mount_point_t* root_point;
 extern u16 current_mount_points;
+extern rwlock_t mount_lock; //protects the mount points list
 u8 detect_fs_type(block_device_t* drive, u8 partition);
 u8 mount_volume(char* path, block_device_t* drive, u8 partition);
 void mount(char* path, file_system_t* fs);
+error_t unmount(char* path);
 
 #define OPEN_MODE_R 0 //read-only, at the beginning of the file
 #define OPEN_MODE_W 1 //write-only, at the beginning of the file, creating it if doesnt exist, erasing if exists
@@ -102,11 +132,62 @@ void close_file(fd_t* file);
 u64 flength(fd_t* file);
 error_t read_file(fd_t* file, void* buffer, u64 count);
 error_t write_file(fd_t* file, void* buffer, u64 count);
+error_t truncate_file(fd_t* file, u64 length);
 error_t rename(char* src_path, char* dest_name);
 error_t link(char* oldpath, char* newpath);
 error_t unlink(char* path);
 error_t read_directory(fd_t* directory, list_entry_t* dest, u32* size);
+dirent_t* read_dirent(fd_t* directory, error_t* error);
 error_t list_directory(char* path, list_entry_t* dest, u32* size);
 fsnode_t* create_file(char* path, u8 attributes);
+error_t fsync_file(fd_t* file);
+error_t sync_metadata();
+error_t sync();
+
+//page cache
+#define PAGE_LOCKED 1 //being read from the disk
+#define PAGE_UPTODATE 2 //content is valid
+#define PAGE_DIRTY 4 //modified, not written back to the disk yet
+typedef struct cached_page
+{
+    fsnode_t* node; //0 if the page is free, or was invalidated while held
+    u32 index; //offset in the file / PAGE_SIZE
+    void* data; //page aligned
+    u32 flags;
+    u32 refs; //held pages can't be reclaimed
+    u32 dirtied; //uptime (ms) when the page became dirty
+    struct cached_page* lru_prev;
+    struct cached_page* lru_next;
+} cached_page_t;
+void pagecache_init();
+cached_page_t* pagecache_get(fsnode_t* node, u32 index, error_t* err);
+void pagecache_put(cached_page_t* page);
+void pagecache_set_dirty(cached_page_t* page);
+void pagecache_wait_page();
+error_t pagecache_read(fsnode_t* node, u64 offset, u64 count, void* buffer);
+error_t pagecache_write(fsnode_t* node, u64 offset, u64 count, void* buffer);
+void pagecache_update(fsnode_t* node, u64 offset, u64 count, void* buffer);
+error_t pagecache_writeback(fsnode_t* node);
+void pagecache_invalidate(fsnode_t* node);
+void pagecache_truncate(fsnode_t* node, u64 length);
+#define READAHEAD_MIN_PAGES 4 //window on the first sequential read
+#define READAHEAD_MAX_PAGES 32 //the window doubles up to that
+void pagecache_readahead(fsnode_t* node, u32 index, u32 count);
+u32 pagecache_stat_read(u32 offset, void* buffer, u32 count);
+
+//inode cache
+void icache_init(file_system_t* fs);
+fsnode_t* icache_get(file_system_t* fs, u32 number);
+fsnode_t* icache_add(fsnode_t* node);
+void icache_hold(fsnode_t* node);
+void icache_put(fsnode_t* node);
+void icache_remove(fsnode_t* node);
+u32 icache_stat_read(u32 offset, void* buffer, u32 count);
+
+//dentry cache
+bool dcache_lookup(fsnode_t* parent, char* name, fsnode_t** node, u32* generation);
+void dcache_insert(fsnode_t* parent, char* name, fsnode_t* node, u32 generation);
+void dcache_invalidate(fsnode_t* parent, char* name);
+void dcache_invalidate_node(fsnode_t* node);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,348 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "system.h"
+#include "fs.h"
+#include "memory/mem.h"
+#include "tasking/task.h"
+
+/*
+* Inode cache : the nodes of each filesystem, hashed on their number (ext2 inode, fat32 first cluster, iso9660 extent)
+* Each node counts its users (open files, mount points, lookups in progress) ; when the last one lets it go,
+* the node goes on the LRU list of its filesystem, where a later lookup can take it back
+* The unused nodes beyond inode_cache_size are evicted by a worker : their dirty pages are written back first,
+* then the dentries and pages pointing to them are dropped, and they are freed
+* Nodes without a number (or removed by their filesystem) are not in the hash : they are freed when they get unused
+*/
+
+#define INODE_CACHE_BUCKETS 256
+#define INODE_CACHE_DEFAULT_SIZE 512 //unused nodes kept by each filesystem, unless -icache=<n> is given at boot
+
+static void trim_work_handler(void* data);
+static work_t trim_work = WORK_INIT(trim_work_handler, 0);
+
+/*
+* Setup the (empty) inode cache of the filesystem
+*/
+void icache_init(file_system_t* fs)
+{
+    fs->inode_hash = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(INODE_CACHE_BUCKETS*sizeof(fsnode_t*), "inode cache buckets");
+    #else
+    kmalloc(INODE_CACHE_BUCKETS*sizeof(fsnode_t*));
+    #endif
+    memset(fs->inode_hash, 0, INODE_CACHE_BUCKETS*sizeof(fsnode_t*));
+    memset(&fs->cache_lock, 0, sizeof(spinlock_t));
+    fs->lru_head = 0;
+    fs->lru_tail = 0;
+    fs->released = 0;
+    fs->inode_cache_size = aicache_size ? aicache_size : INODE_CACHE_DEFAULT_SIZE;
+    fs->inode_count = 0;
+    fs->inode_unused = 0;
+    fs->inode_hits = 0;
+    fs->inode_misses = 0;
+    fs->inode_evictions = 0;
+}
+
+static void lru_unlink(file_system_t* fs, fsnode_t* node)
+{
+    if(node->lru_prev) node->lru_prev->lru_next = node->lru_next;
+    else fs->lru_head = node->lru_next;
+    if(node->lru_next) node->lru_next->lru_prev = node->lru_prev;
+    else fs->lru_tail = node->lru_prev;
+    fs->inode_unused--;
+}
+
+static void lru_push(file_system_t* fs, fsnode_t* node)
+{
+    node->lru_prev = 0;
+    node->lru_next = fs->lru_head;
+    if(fs->lru_head) fs->lru_head->lru_prev = node;
+    else fs->lru_tail = node;
+    fs->lru_head = node;
+    fs->inode_unused++;
+}
+
+/*
+* The released list holds the unused nodes that are not in the hash anymore, waiting to be freed
+*/
+static void released_unlink(file_system_t* fs, fsnode_t* node)
+{
+    if(node->lru_prev) node->lru_prev->lru_next = node->lru_next;
+    else fs->released = node->lru_next;
+    if(node->lru_next) node->lru_next->lru_prev = node->lru_prev;
+}
+
+static void released_push(file_system_t* fs, fsnode_t* node)
+{
+    node->lru_prev = 0;
+    node->lru_next = fs->released;
+    if(fs->released) fs->released->lru_prev = node;
+    fs->released = node;
+}
+
+static void hash_remove(file_system_t* fs, fsnode_t* node)
+{
+    fsnode_t** ptr = &fs->inode_hash[node->number % INODE_CACHE_BUCKETS];
+    while(*ptr != node) ptr = &(*ptr)->hash_next;
+    *ptr = node->hash_next;
+    node->hashed = false;
+    fs->inode_count--;
+}
+
+/*
+* Find the node 'number' of the filesystem in the cache, and hold it (icache_put() when done)
+* Returns 0 on a miss : the filesystem reads the node, and gives it to icache_add()
+*/
+fsnode_t* icache_get(file_system_t* fs, u32 number)
+{
+    spin_lock(&fs->cache_lock);
+    fsnode_t* node = fs->inode_hash[number % INODE_CACHE_BUCKETS];
+    while(node && (node->number != number)) node = node->hash_next;
+    if(!node)
+    {
+        fs->inode_misses++;
+        spin_unlock(&fs->cache_lock);
+        return 0;
+    }
+
+    if(!node->refs) lru_unlink(fs, node);
+    node->refs++;
+    fs->inode_hits++;
+    spin_unlock(&fs->cache_lock);
+    return node;
+}
+
+/*
+* Cache a node just read by its filesystem (node->number set, 0 if it has none), held by the caller
+* If another thread cached the same node meanwhile, this one is freed and the cached one is returned instead
+*/
+fsnode_t* icache_add(fsnode_t* node)
+{
+    file_system_t* fs = node->file_system;
+    node->refs = 1;
+    node->hashed = false;
+    node->hash_next = 0;
+    node->lru_prev = 0;
+    node->lru_next = 0;
+    if(!node->number) return node;
+
+    u32 bucket = node->number % INODE_CACHE_BUCKETS;
+    spin_lock(&fs->cache_lock);
+    fsnode_t* cached = fs->inode_hash[bucket];
+    while(cached && (cached->number != node->number)) cached = cached->hash_next;
+    if(cached)
+    {
+        if(!cached->refs) lru_unlink(fs, cached);
+        cached->refs++;
+        spin_unlock(&fs->cache_lock);
+        kfree(node->specific);
+        kfree(node);
+        return cached;
+    }
+
+    node->hash_next = fs->inode_hash[bucket];
+    fs->inode_hash[bucket] = node;
+    node->hashed = true;
+    fs->inode_count++;
+    spin_unlock(&fs->cache_lock);
+    return node;
+}
+
+/*
+* Take one more reference on a node already held (or reachable from a dentry)
+*/
+void icache_hold(fsnode_t* node)
+{
+    file_system_t* fs = node->file_system;
+    if(!fs->inode_hash) return;
+
+    spin_lock(&fs->cache_lock);
+    if((!node->refs) && node->hashed) lru_unlink(fs, node);
+    else if(!node->refs) released_unlink(fs, node);
+    node->refs++;
+    spin_unlock(&fs->cache_lock);
+}
+
+/*
+* Release a reference on the node ; this does not sleep, the eviction is left to a worker
+*/
+void icache_put(fsnode_t* node)
+{
+    file_system_t* fs = node->file_system;
+    if(!fs->inode_hash) return;
+
+    bool trim = false;
+    spin_lock(&fs->cache_lock);
+    node->refs--;
+    if(!node->refs)
+    {
+        if(node->hashed)
+        {
+            lru_push(fs, node);
+            trim = (fs->inode_unused > fs->inode_cache_size);
+        }
+        else
+        {
+            //not findable anymore : free it
+            released_push(fs, node);
+            trim = true;
+        }
+    }
+    spin_unlock(&fs->cache_lock);
+
+    if(trim) queue_io_work(&trim_work);
+}
+
+/*
+* The filesystem freed the node on the disk : the number can be given to another node, forget this one
+* It is freed once its current users (the caller is one) let it go
+*/
+void icache_remove(fsnode_t* node)
+{
+    file_system_t* fs = node->file_system;
+    spin_lock(&fs->cache_lock);
+    if(node->hashed) hash_remove(fs, node);
+    spin_unlock(&fs->cache_lock);
+}
+
+/*
+* Free an unused node (cache lock must be held, and the node must not be on the LRU list)
+* The dirty pages are written back before the node leaves the hash, so that a lookup meanwhile finds it
+* and does not read a stale content from the disk ; such a lookup keeps the node
+* The node is pinned until its dentries are dropped : a dentry lookup meanwhile keeps it too (it is freed on its release)
+* Returns false if the node was taken back meanwhile
+*/
+static bool node_release(file_system_t* fs, fsnode_t* node)
+{
+    node->refs++;
+    spin_unlock(&fs->cache_lock);
+    if(node->pages) pagecache_writeback(node);
+    spin_lock(&fs->cache_lock);
+    if(node->refs > 1) {node->refs--; return false;}
+
+    //unhashed before dropping the dentries : a lookup can't find it anymore to cache a new dentry
+    if(node->hashed) {hash_remove(fs, node); fs->inode_evictions++;}
+    spin_unlock(&fs->cache_lock);
+    dcache_invalidate_node(node);
+    spin_lock(&fs->cache_lock);
+    node->refs--;
+    if(node->refs) return false;
+
+    spin_unlock(&fs->cache_lock);
+    pagecache_invalidate(node);
+    kfree(node->specific);
+    kfree(node);
+    spin_lock(&fs->cache_lock);
+    return true;
+}
+
+/*
+* Free the released nodes of the filesystem, and evict the least recently used nodes beyond inode_cache_size
+*/
+static void icache_trim(file_system_t* fs)
+{
+    spin_lock(&fs->cache_lock);
+    while(fs->released)
+    {
+        fsnode_t* node = fs->released;
+        released_unlink(fs, node);
+        node_release(fs, node);
+    }
+    while(fs->inode_unused > fs->inode_cache_size)
+    {
+        fsnode_t* node = fs->lru_tail;
+        lru_unlink(fs, node);
+        node_release(fs, node);
+    }
+    spin_unlock(&fs->cache_lock);
+}
+
+static void trim_work_handler(void* data)
+{
+    (void) data;
+    read_lock(&mount_lock);
+    mount_point_t* point = root_point;
+    while(point)
+    {
+        if(point->fs->inode_hash) icache_trim(point->fs);
+        point = point->next;
+    }
+    read_unlock(&mount_lock);
+}
+
+/*
+* Copy the statistics report (a line per mounted filesystem), starting at offset ; returns the number of bytes copied
+*/
+u32 icache_stat_read(u32 offset, void* buffer, u32 count)
+{
+    char* names[6] = {" hits ", " misses ", " evictions ", " nodes ", " unused ", " max "};
+    char number[12];
+
+    read_lock(&mount_lock);
+    u32 size = 1;
+    mount_point_t* point = root_point;
+    while(point)
+    {
+        size += strlen(point->path) + 6*(12+12);
+        point = point->next;
+    }
+    char* report = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(size, "inode cache statistics report");
+    #else
+    kmalloc(size);
+    #endif
+    *report = 0;
+
+    point = root_point;
+    while(point)
+    {
+        file_system_t* fs = point->fs;
+        if(!fs->inode_hash) {point = point->next; continue;}
+
+        spin_lock(&fs->cache_lock);
+        u32 stats[6] = {fs->inode_hits, fs->inode_misses, fs->inode_evictions, fs->inode_count, fs->inode_unused, fs->inode_cache_size};
+        spin_unlock(&fs->cache_lock);
+
+        strcat(report, point->path);
+        u32 i;
+        for(i = 0; i < 6; i++)
+        {
+            strcat(report, names[i]);
+            utoa(stats[i], (unsigned char*) number);
+            strcat(report, number);
+        }
+        strcat(report, "\n");
+        point = point->next;
+    }
+    read_unlock(&mount_lock);
+
+    u32 length = strlen(report);
+    u32 copied = 0;
+    if(offset < length)
+    {
+        copied = length - offset;
+        if(copied > count) copied = count;
+        memcpy(buffer, report+offset, copied);
+    }
+    kfree(report);
+    //terminate the text for readers that don't check the count
+    if(copied < count) memset(((u8*) buffer)+copied, 0, count-copied);
+    return copied;
+}
@@ -33,8 +33,7 @@ file_system_t* iso9660fs_init(block_device_t* drive)
     tr->fs_type = FS_TYPE_ISO9660;
     tr->flags = 0 | FS_FLAG_CASE_INSENSITIVE | FS_FLAG_READ_ONLY;
 
-    tr->inode_cache = 0;
-    tr->inode_cache_size = 0;
+    icache_init(tr);
 
     //reading primary volume descriptor
     iso9660_primary_volume_descriptor_t pvd;
@@ -187,16 +186,8 @@ error_t iso9660_read_file(fd_t* fd, void* buffer, u64 count)
 static fsnode_t* iso9660_dirent_normalize_cache(iso9660_dir_entry_t* dirent, file_system_t* fs)
 {
     /* try to read node from the cache */
-    list_entry_t* iptr = fs->inode_cache;
-    u32 isize = fs->inode_cache_size;
-    while(iptr && isize)
-    {
-        fsnode_t* element = iptr->element;
-        iso9660_node_specific_t* espe = element->specific;
-        if(espe->extent_start == dirent->extent_start_lsb) return element;
-        iptr = iptr->next;
-        isize--;
-    }
+    fsnode_t* cached = icache_get(fs, dirent->extent_start_lsb);
+    if(cached) return cached;
 
     /* parse inode from dirent */
     fsnode_t* std_node = kmalloc(sizeof(fsnode_t));
@@ -204,6 +195,8 @@ static fsnode_t* iso9660_dirent_normalize_cache(iso9660_dir_entry_t* dirent, fil
     std_node->hard_links = 1;
 
     std_node->file_system = fs;
+    std_node->pages = 0;
+    std_node->number = dirent->extent_start_lsb;
     std_node->length = dirent->extent_size_lsb;
 
     //parse time (check for year-100)
@@ -222,28 +215,5 @@ static fsnode_t* iso9660_dirent_normalize_cache(iso9660_dir_entry_t* dirent, fil
     std_node->specific = spe;
 
     /* cache the object */
-    if(!fs->inode_cache)
-    {
-        fs->inode_cache = kmalloc(sizeof(list_entry_t));
-        fs->inode_cache->element = std_node;
-        fs->inode_cache_size++;
-    }
-    else
-    {
-        list_entry_t* ptr = fs->inode_cache;
-        list_entry_t* last = 0;
-        u32 size = fs->inode_cache_size;
-        while(ptr && size)
-        {
-            last = ptr;
-            ptr = ptr->next;
-            size--;
-        }
-        ptr = kmalloc(sizeof(list_entry_t));
-        ptr->element = std_node;
-        last->next = ptr;
-        fs->inode_cache_size++;
-    }
-
-    return std_node;
+    return icache_add(std_node);
 }
@@ -0,0 +1,881 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "system.h"
+#include "fs.h"
+#include "error/error.h"
+#include "memory/mem.h"
+#include "tasking/task.h"
+#include "time/time.h"
+
+#include "fat32.h"
+#include "ext2.h"
+#include "iso9660.h"
+
+/*
+* Page cache : the content of regular files is read from the disk 4KiB at a time into cached pages,
+* indexed by file offset in a radix tree attached to each fsnode_t
+* The pages come from a pool reserved at boot (a fraction of the free memory) : when it is exhausted,
+* the least recently used page that nobody holds is reclaimed
+* A page being read from the disk is locked ; other threads wanting it sleep until the read is done
+* Readahead requests are queued and served by a kernel worker, that reads each run of missing pages in one transfer
+* Writes inside a file only dirty the cached pages : a flusher thread writes them back once they are old enough
+* (or sooner when too much of the pool is dirty), each run of consecutive dirty pages in one transfer
+*/
+
+#define PAGECACHE_MEMORY_DIVISOR 8 //the pool takes 1/8 of the free memory at boot...
+#define PAGECACHE_MIN_PAGES 64 //...but at least 256KiB...
+#define PAGECACHE_MAX_PAGES 4096 //...and at most 16MiB
+
+static cached_page_t* pagecache_pages = 0;
+static u32 pagecache_size = 0;
+static cached_page_t* free_pages = 0; //chained on lru_next
+static cached_page_t* lru_head = 0; //most recently used
+static cached_page_t* lru_tail = 0; //least recently used
+static spinlock_t pagecache_lock = {0};
+static wait_queue_t pagecache_queue = {0}; //threads waiting for a page read (or a readahead) to complete
+
+//readahead requests (pagecache lock)
+#define READAHEAD_QUEUE_SIZE 32
+typedef struct readahead
+{
+    fsnode_t* node;
+    u32 index;
+    u32 count;
+} readahead_t;
+static readahead_t readahead_queue[READAHEAD_QUEUE_SIZE];
+static u32 readahead_head = 0;
+static u32 readahead_count = 0;
+static fsnode_t* readahead_node = 0; //node the worker is reading ahead
+static void readahead_work_handler(void* data);
+static work_t readahead_work = WORK_INIT(readahead_work_handler, 0);
+
+//write back
+#define WRITEBACK_INTERVAL 1000 //the flusher wakes up every second...
+#define WRITEBACK_EXPIRE 5000 //...to write back the pages dirty for 5 seconds, and the filesystems metadata
+#define WRITEBACK_DIRTY_DIVISOR 4 //when more than 1/4 of the pool is dirty, every dirty page is written back
+#define WRITEBACK_MAX_PAGES 32 //pages written in one transfer
+#define PAGECACHE_WAIT_INTERVAL 10 //sleep between two tries of pagecache_wait_page() callers
+static mutex_t writeback_mutex = {0}; //one writeback at a time (they share the buffer)
+static u8* writeback_buffer = 0;
+static fsnode_t* writeback_node = 0; //node being written back (pagecache lock)
+static u32 pagecache_dirty = 0; //number of dirty pages (pagecache lock)
+static void writeback_work_handler(void* data);
+static work_t writeback_work = WORK_INIT(writeback_work_handler, 0);
+static void flusher_main(void* data);
+
+//statistics (pagecache lock)
+static u32 pagecache_hits = 0;
+static u32 pagecache_misses = 0;
+static u32 pagecache_reclaims = 0;
+static u32 pagecache_used = 0;
+static u32 pagecache_readaheads = 0; //pages read ahead
+static u32 pagecache_written = 0; //pages written back
+
+void pagecache_init()
+{
+    u32 pages = (get_free_mem() / PAGECACHE_MEMORY_DIVISOR) / PAGE_SIZE;
+    if(pages < PAGECACHE_MIN_PAGES) pages = PAGECACHE_MIN_PAGES;
+    if(pages > PAGECACHE_MAX_PAGES) pages = PAGECACHE_MAX_PAGES;
+
+    //the frames are page aligned, so that they can be mapped as is
+    u32 frames = (u32)
+    #ifdef MEMLEAK_DBG
+    kmalloc(pages*PAGE_SIZE+PAGE_SIZE, "page cache frames");
+    #else
+    kmalloc(pages*PAGE_SIZE+PAGE_SIZE);
+    #endif
+    frames = (frames + PAGE_SIZE - 1) & ~((u32) (PAGE_SIZE - 1));
+
+    pagecache_pages = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(pages*sizeof(cached_page_t), "page cache descriptors");
+    #else
+    kmalloc(pages*sizeof(cached_page_t));
+    #endif
+
+    u32 i;
+    for(i = 0; i < pages; i++)
+    {
+        cached_page_t* page = &pagecache_pages[i];
+        page->node = 0;
+        page->index = 0;
+        page->data = (void*) (frames + i*PAGE_SIZE);
+        page->flags = 0;
+        page->refs = 0;
+        page->lru_prev = 0;
+        page->lru_next = free_pages;
+        free_pages = page;
+    }
+    pagecache_size = pages;
+
+    writeback_buffer = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(WRITEBACK_MAX_PAGES*PAGE_SIZE, "page cache writeback buffer");
+    #else
+    kmalloc(WRITEBACK_MAX_PAGES*PAGE_SIZE);
+    #endif
+    lock_set_class(&writeback_mutex, "page cache writeback");
+    create_kernel_process(flusher_main, 0);
+}
+
+static void lru_unlink(cached_page_t* page)
+{
+    if(page->lru_prev) page->lru_prev->lru_next = page->lru_next;
+    else lru_head = page->lru_next;
+    if(page->lru_next) page->lru_next->lru_prev = page->lru_prev;
+    else lru_tail = page->lru_prev;
+}
+
+static void lru_push(cached_page_t* page)
+{
+    page->lru_prev = 0;
+    page->lru_next = lru_head;
+    if(lru_head) lru_head->lru_prev = page;
+    else lru_tail = page;
+    lru_head = page;
+}
+
+static void free_page(cached_page_t* page)
+{
+    page->node = 0;
+    page->flags = 0;
+    page->lru_prev = 0;
+    page->lru_next = free_pages;
+    free_pages = page;
+    pagecache_used--;
+}
+
+/*
+* Take a page out of its file tree and of the LRU list (pagecache lock must be held)
+* A page still held by someone is only orphaned : it is freed by the last pagecache_put()
+*/
+static void page_detach(cached_page_t* page)
+{
+    fsnode_t* node = page->node;
+    //the file is going away (or changed under the cache) : its dirty content is dropped
+    if(page->flags & PAGE_DIRTY) {page->flags &= ~((u32) PAGE_DIRTY); pagecache_dirty--;}
+    radix_tree_delete(node->pages, page->index);
+    if(!node->pages->height) {kfree(node->pages); node->pages = 0;}
+    lru_unlink(page);
+
+    if(!page->refs) free_page(page);
+    else page->node = 0;
+}
+
+/*
+* Get a free page, reclaiming the least recently used one if needed (pagecache lock must be held)
+* Dirty pages are not reclaimed before they are written back
+* Returns 0 if every page is held or dirty
+*/
+static cached_page_t* page_alloc()
+{
+    if(!free_pages)
+    {
+        cached_page_t* victim = lru_tail;
+        while(victim && (victim->refs || (victim->flags & (PAGE_LOCKED | PAGE_DIRTY)))) victim = victim->lru_prev;
+        if(!victim) return 0;
+        page_detach(victim);
+        pagecache_reclaims++;
+    }
+
+    cached_page_t* page = free_pages;
+    free_pages = page->lru_next;
+    pagecache_used++;
+    return page;
+}
+
+/*
+* Read 'size' bytes of the file at 'offset' from the filesystem, bypassing the cache
+*/
+static error_t pagecache_fill(fsnode_t* node, u64 offset, u32 size, void* buffer)
+{
+    fd_t fd;
+    memset(&fd, 0, sizeof(fd_t));
+    fd.file = node;
+    fd.offset = offset;
+    fd.instances = 1;
+
+    switch(node->file_system->fs_type)
+    {
+        case FS_TYPE_FAT32: return fat32_read_file(&fd, buffer, size);
+        case FS_TYPE_EXT2: return ext2_read_file(&fd, buffer, size);
+        case FS_TYPE_ISO9660: return iso9660_read_file(&fd, buffer, size);
+    }
+    return ERROR_FILE_UNSUPPORTED_FILE_SYSTEM;
+}
+
+/*
+* Write 'size' bytes to the file at 'offset' with the filesystem, bypassing the cache
+*/
+static error_t pagecache_store(fsnode_t* node, u64 offset, u32 size, void* buffer)
+{
+    fd_t fd;
+    memset(&fd, 0, sizeof(fd_t));
+    fd.file = node;
+    fd.offset = offset;
+    fd.instances = 1;
+
+    switch(node->file_system->fs_type)
+    {
+        case FS_TYPE_FAT32: return fat32_write_file(&fd, buffer, size);
+        case FS_TYPE_EXT2: return ext2_write_file(&fd, buffer, size);
+    }
+    return ERROR_FILE_UNSUPPORTED_FILE_SYSTEM;
+}
+
+/*
+* Mark the page dirty, unless it already is or was invalidated (pagecache lock must be held)
+*/
+static void page_dirty(cached_page_t* page)
+{
+    if((!page->node) || (page->flags & PAGE_DIRTY)) return;
+    page->flags |= PAGE_DIRTY;
+    page->dirtied = get_uptime_ms();
+    pagecache_dirty++;
+}
+
+/*
+* Read the content of a page from the disk (the page is locked, so only we touch it)
+*/
+static error_t page_read(cached_page_t* page, fsnode_t* node)
+{
+    u64 offset = ((u64) page->index) << PAGE_SHIFT;
+    u32 size = 0;
+    if(offset < node->length) size = (node->length - offset > PAGE_SIZE) ? PAGE_SIZE : (u32) (node->length - offset);
+
+    error_t tr = ERROR_NONE;
+    if(size) tr = pagecache_fill(node, offset, size, page->data);
+    //past the end of the file, the page reads as zeroes
+    if(size < PAGE_SIZE) memset(((u8*) page->data)+size, 0, PAGE_SIZE-size);
+    return tr;
+}
+
+/*
+* Create the (locked, held) page 'index' of the file, to be read by the caller (pagecache lock must be held)
+* Returns 0 if every page of the cache is held
+*/
+static cached_page_t* page_new(fsnode_t* node, u32 index)
+{
+    cached_page_t* page = page_alloc();
+    if(!page) return 0;
+
+    page->node = node;
+    page->index = index;
+    page->flags = PAGE_LOCKED;
+    page->refs = 1;
+    if(!node->pages)
+    {
+        node->pages = 
+        #ifdef MEMLEAK_DBG
+        kmalloc(sizeof(radix_tree_t), "page cache tree");
+        #else
+        kmalloc(sizeof(radix_tree_t));
+        #endif
+        node->pages->root = 0;
+        node->pages->height = 0;
+    }
+    radix_tree_insert(node->pages, index, page);
+    lru_push(page);
+    return page;
+}
+
+/*
+* The read of a page created by page_new() is over : unlock it, or drop it if the read failed (pagecache lock must be held)
+* Returns false if the page was dropped (it is not held anymore)
+*/
+static bool page_done(cached_page_t* page, error_t readop)
+{
+    page->flags &= ~((u32) PAGE_LOCKED);
+    if(readop == ERROR_NONE) {page->flags |= PAGE_UPTODATE; return true;}
+
+    page->refs--;
+    if(page->node) page_detach(page);
+    else if(!page->refs) free_page(page);
+    return false;
+}
+
+/*
+* Get page 'index' of the file, up to date, reading it if it is not cached
+* The page is held until pagecache_put() (it can't be reclaimed meanwhile)
+* Returns 0 either on error ('err' set) or if every page of the cache is held ('err' is ERROR_NONE) :
+* then the caller has to read the disk directly
+*/
+cached_page_t* pagecache_get(fsnode_t* node, u32 index, error_t* err)
+{
+    *err = ERROR_NONE;
+
+    spin_lock(&pagecache_lock);
+    cached_page_t* page = node->pages ? radix_tree_lookup(node->pages, index) : 0;
+    if(page)
+    {
+        pagecache_hits++;
+        page->refs++;
+        lru_unlink(page);
+        lru_push(page);
+
+        //someone is reading it from the disk : wait for the read to complete
+        while(page->flags & PAGE_LOCKED)
+        {
+            spin_unlock(&pagecache_lock);
+            wait_prepare(&pagecache_queue, false, THREAD_STATUS_ASLEEP_IO);
+            if(page->flags & PAGE_LOCKED) wait_sleep();
+            else wait_cancel(&pagecache_queue);
+            spin_lock(&pagecache_lock);
+        }
+
+        if(!(page->flags & PAGE_UPTODATE))
+        {
+            //the read failed : drop the page so that the next access retries
+            *err = ERROR_IO;
+            page->refs--;
+            if(page->node) page_detach(page);
+            else if(!page->refs) free_page(page);
+            spin_unlock(&pagecache_lock);
+            return 0;
+        }
+        spin_unlock(&pagecache_lock);
+        return page;
+    }
+
+    pagecache_misses++;
+    page = page_new(node, index);
+    spin_unlock(&pagecache_lock);
+    if(!page) return 0;
+
+    error_t readop = page_read(page, node);
+
+    spin_lock(&pagecache_lock);
+    if(!page_done(page, readop)) {*err = readop; page = 0;}
+    spin_unlock(&pagecache_lock);
+    wake_up_all(&pagecache_queue);
+
+    return page;
+}
+
+/*
+* Release a page obtained with pagecache_get()
+*/
+void pagecache_put(cached_page_t* page)
+{
+    spin_lock(&pagecache_lock);
+    page->refs--;
+    //the page was invalidated while we held it
+    if((!page->refs) && (!page->node)) free_page(page);
+    spin_unlock(&pagecache_lock);
+}
+
+/*
+* Read 'count' bytes of the file at 'offset' through the cache
+*/
+error_t pagecache_read(fsnode_t* node, u64 offset, u64 count, void* buffer)
+{
+    u8* dest = buffer;
+    while(count)
+    {
+        u32 index = (u32) (offset >> PAGE_SHIFT);
+        u32 page_offset = (u32) (offset & (PAGE_SIZE-1));
+        u32 size = PAGE_SIZE - page_offset;
+        if(size > count) size = (u32) count;
+
+        error_t err;
+        cached_page_t* page = pagecache_get(node, index, &err);
+        if(page)
+        {
+            memcpy(dest, ((u8*) page->data)+page_offset, size);
+            pagecache_put(page);
+        }
+        else if(err != ERROR_NONE) return err;
+        else
+        {
+            //no page available : go to the disk directly
+            err = pagecache_fill(node, offset, size, dest);
+            if(err != ERROR_NONE) return err;
+        }
+
+        dest += size;
+        offset += size;
+        count -= size;
+    }
+    return ERROR_NONE;
+}
+
+/*
+* Write 'count' bytes of 'buffer' to the file at 'offset' through the cache : the pages are only marked dirty,
+* the flusher writes them back later (the range must be inside the file : write_file() extends it first)
+*/
+error_t pagecache_write(fsnode_t* node, u64 offset, u64 count, void* buffer)
+{
+    u8* src = buffer;
+    while(count)
+    {
+        u32 index = (u32) (offset >> PAGE_SHIFT);
+        u32 page_offset = (u32) (offset & (PAGE_SIZE-1));
+        u32 size = PAGE_SIZE - page_offset;
+        if(size > count) size = (u32) count;
+
+        //the whole page is overwritten : if it is not cached, no need to read it first
+        cached_page_t* page = 0;
+        bool created = false;
+        if(size == PAGE_SIZE)
+        {
+            spin_lock(&pagecache_lock);
+            if(!(node->pages && radix_tree_lookup(node->pages, index)))
+            {
+                page = page_new(node, index);
+                if(page) {created = true; pagecache_misses++;}
+            }
+            spin_unlock(&pagecache_lock);
+        }
+
+        error_t err = ERROR_NONE;
+        if(!created) page = pagecache_get(node, index, &err);
+        if(err != ERROR_NONE) return err;
+
+        if(page)
+        {
+            //the buffer may be user memory, that can fault : copy before taking the lock (the page is held)
+            //a writeback meanwhile may write part of it, the page is dirtied after the copy so it is written again
+            memcpy(((u8*) page->data)+page_offset, src, size);
+            spin_lock(&pagecache_lock);
+            if(created) page->flags = PAGE_UPTODATE;
+            //the page may have been invalidated while we held it
+            page_dirty(page);
+            page->refs--;
+            if((!page->refs) && (!page->node)) free_page(page);
+            spin_unlock(&pagecache_lock);
+            if(created) wake_up_all(&pagecache_queue);
+        }
+        else
+        {
+            //no page available : go to the disk directly
+            err = pagecache_store(node, offset, size, src);
+            if(err != ERROR_NONE) return err;
+            pagecache_update(node, offset, size, src);
+        }
+
+        src += size;
+        offset += size;
+        count -= size;
+    }
+
+    //too much of the pool is dirty : don't wait for the flusher
+    if(pagecache_dirty > pagecache_size / WRITEBACK_DIRTY_DIVISOR) queue_io_work(&writeback_work);
+    return ERROR_NONE;
+}
+
+/*
+* Mark a held page dirty (it was written through a shared memory mapping)
+*/
+void pagecache_set_dirty(cached_page_t* page)
+{
+    spin_lock(&pagecache_lock);
+    page_dirty(page);
+    spin_unlock(&pagecache_lock);
+}
+
+/*
+* Every page of the cache is held or dirty (pagecache_get() returned 0) : start writing back the dirty ones,
+* and sleep a bit before the caller tries again (for the callers that can't go to the disk directly)
+*/
+void pagecache_wait_page()
+{
+    queue_io_work(&writeback_work);
+    scheduler_wait_thread(current_process, current_process->active_thread, SLEEP_TIME, 0, PAGECACHE_WAIT_INTERVAL);
+}
+
+/*
+* Keep the cached pages coherent after 'count' bytes of 'buffer' were written to the file at 'offset' (bypassing the cache)
+*/
+void pagecache_update(fsnode_t* node, u64 offset, u64 count, void* buffer)
+{
+    u8* src = buffer;
+    spin_lock(&pagecache_lock);
+    while(count && node->pages)
+    {
+        u32 index = (u32) (offset >> PAGE_SHIFT);
+        u32 page_offset = (u32) (offset & (PAGE_SIZE-1));
+        u32 size = PAGE_SIZE - page_offset;
+        if(size > count) size = (u32) count;
+
+        cached_page_t* page = radix_tree_lookup(node->pages, index);
+        //a page being read could get the old content : drop it instead
+        if(page && (page->flags & PAGE_LOCKED)) page_detach(page);
+        else if(page)
+        {
+            //the buffer may be user memory, that can fault : hold the page and copy without the lock
+            page->refs++;
+            spin_unlock(&pagecache_lock);
+            memcpy(((u8*) page->data)+page_offset, src, size);
+            spin_lock(&pagecache_lock);
+            page->refs--;
+            if((!page->refs) && (!page->node)) free_page(page);
+        }
+
+        src += size;
+        offset += size;
+        count -= size;
+    }
+    spin_unlock(&pagecache_lock);
+}
+
+/*
+* Queue the asynchronous read of 'count' pages of the file from page 'index' (best effort : dropped if the queue is full)
+*/
+void pagecache_readahead(fsnode_t* node, u32 index, u32 count)
+{
+    if(!count) return;
+
+    spin_lock(&pagecache_lock);
+    //extend the last request if this one follows it
+    if(readahead_count)
+    {
+        readahead_t* last = &readahead_queue[(readahead_head+readahead_count-1) % READAHEAD_QUEUE_SIZE];
+        if((last->node == node) && (last->index+last->count == index))
+        {
+            last->count += count;
+            spin_unlock(&pagecache_lock);
+            return;
+        }
+    }
+    if(readahead_count == READAHEAD_QUEUE_SIZE) {spin_unlock(&pagecache_lock); return;}
+
+    readahead_t* request = &readahead_queue[(readahead_head+readahead_count) % READAHEAD_QUEUE_SIZE];
+    request->node = node;
+    request->index = index;
+    request->count = count;
+    readahead_count++;
+    spin_unlock(&pagecache_lock);
+
+    queue_io_work(&readahead_work);
+}
+
+/*
+* Read the missing pages among 'count' pages of the file from 'index', each run of consecutive missing pages in one transfer
+*/
+static void readahead_pages(fsnode_t* node, u32 index, u32 count)
+{
+    //no page past the end of the file
+    u32 file_pages = (u32) ((node->length + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    if(index >= file_pages) return;
+    if(count > file_pages - index) count = file_pages - index;
+
+    while(count)
+    {
+        cached_page_t* run[READAHEAD_MAX_PAGES];
+        u32 run_size = 0;
+
+        spin_lock(&pagecache_lock);
+        while(count && (run_size < READAHEAD_MAX_PAGES))
+        {
+            if(node->pages && radix_tree_lookup(node->pages, index))
+            {
+                //already cached : the run stops here
+                if(run_size) break;
+                index++; count--;
+                continue;
+            }
+            cached_page_t* page = page_new(node, index);
+            if(!page) break;
+            run[run_size++] = page;
+            index++; count--;
+        }
+        pagecache_readaheads += run_size;
+        spin_unlock(&pagecache_lock);
+        if(!run_size) return;
+
+        u64 offset = ((u64) run[0]->index) << PAGE_SHIFT;
+        u32 size = run_size*PAGE_SIZE;
+        if(offset+size > node->length) size = (u32) (node->length - offset);
+
+        u8* buffer = 
+        #ifdef MEMLEAK_DBG
+        kmalloc(run_size*PAGE_SIZE, "readahead buffer");
+        #else
+        kmalloc(run_size*PAGE_SIZE);
+        #endif
+        error_t readop = pagecache_fill(node, offset, size, buffer);
+        if(readop == ERROR_NONE)
+        {
+            memset(buffer+size, 0, run_size*PAGE_SIZE-size);
+            u32 i;
+            for(i = 0; i < run_size; i++) memcpy(run[i]->data, buffer+i*PAGE_SIZE, PAGE_SIZE);
+        }
+        kfree(buffer);
+
+        spin_lock(&pagecache_lock);
+        u32 i;
+        for(i = 0; i < run_size; i++)
+        {
+            if(!page_done(run[i], readop)) continue;
+            run[i]->refs--;
+            //it was invalidated meanwhile, and nobody else holds it
+            if((!run[i]->refs) && (!run[i]->node)) free_page(run[i]);
+        }
+        spin_unlock(&pagecache_lock);
+        wake_up_all(&pagecache_queue);
+    }
+}
+
+static void readahead_work_handler(void* data)
+{
+    (void) data;
+    while(1)
+    {
+        spin_lock(&pagecache_lock);
+        if(!readahead_count) {spin_unlock(&pagecache_lock); return;}
+        readahead_t request = readahead_queue[readahead_head];
+        readahead_head = (readahead_head+1) % READAHEAD_QUEUE_SIZE;
+        readahead_count--;
+        readahead_node = request.node;
+        spin_unlock(&pagecache_lock);
+
+        readahead_pages(request.node, request.index, request.count);
+
+        spin_lock(&pagecache_lock);
+        readahead_node = 0;
+        spin_unlock(&pagecache_lock);
+        wake_up_all(&pagecache_queue);
+    }
+}
+
+/*
+* Drop the cached pages of the file from page 'first' (pagecache lock must be held)
+*/
+static void drop_pages(fsnode_t* node, u32 first)
+{
+    //cancel the queued readahead of the node, and wait for the one in progress
+    u32 i, kept = 0;
+    for(i = 0; i < readahead_count; i++)
+    {
+        readahead_t* request = &readahead_queue[(readahead_head+i) % READAHEAD_QUEUE_SIZE];
+        if(request->node != node) readahead_queue[(readahead_head+kept++) % READAHEAD_QUEUE_SIZE] = *request;
+    }
+    readahead_count = kept;
+    //same for the writeback in progress
+    while((readahead_node == node) || (writeback_node == node))
+    {
+        spin_unlock(&pagecache_lock);
+        wait_prepare(&pagecache_queue, false, THREAD_STATUS_ASLEEP_IO);
+        if((readahead_node == node) || (writeback_node == node)) wait_sleep();
+        else wait_cancel(&pagecache_queue);
+        spin_lock(&pagecache_lock);
+    }
+
+    for(i = 0; (i < pagecache_size) && node->pages; i++)
+    {
+        if((pagecache_pages[i].node == node) && (pagecache_pages[i].index >= first)) page_detach(&pagecache_pages[i]);
+    }
+}
+
+/*
+* Drop every cached page of the file (before the node is freed, or when its content changed under the cache)
+*/
+void pagecache_invalidate(fsnode_t* node)
+{
+    spin_lock(&pagecache_lock);
+    drop_pages(node, 0);
+    spin_unlock(&pagecache_lock);
+}
+
+/*
+* The file is truncated to 'length' : drop the cached pages past it, and clear the end of the last one
+*/
+void pagecache_truncate(fsnode_t* node, u64 length)
+{
+    u32 first = (u32) ((length + PAGE_SIZE - 1) >> PAGE_SHIFT);
+    u32 tail = (u32) (length & (PAGE_SIZE-1));
+
+    spin_lock(&pagecache_lock);
+    drop_pages(node, first);
+    if(tail)
+    {
+        cached_page_t* last = node->pages ? radix_tree_lookup(node->pages, first-1) : 0;
+        //a page being read could get the old content : drop it too
+        if(last && (last->flags & PAGE_UPTODATE)) memset(((u8*) last->data)+tail, 0, PAGE_SIZE-tail);
+        else if(last) page_detach(last);
+    }
+    spin_unlock(&pagecache_lock);
+}
+
+/*
+* Write back the dirty pages of the file (or of every file if 'node' is 0) : only the ones dirty for WRITEBACK_EXPIRE
+* unless 'all' ; each run of consecutive dirty pages goes to the disk in one transfer (writeback mutex must be held)
+* Returns the first error met (the pages that failed stay dirty)
+*/
+static error_t writeback_pages(fsnode_t* only, bool all)
+{
+    error_t tr = ERROR_NONE;
+    u32 i;
+    for(i = 0; i < pagecache_size; i++)
+    {
+        cached_page_t* run[WRITEBACK_MAX_PAGES];
+        u32 run_size = 0;
+
+        spin_lock(&pagecache_lock);
+        cached_page_t* page = &pagecache_pages[i];
+        fsnode_t* node = page->node;
+        if((!(page->flags & PAGE_DIRTY)) || (only && (node != only)) || ((!all) && (get_uptime_ms() - page->dirtied < WRITEBACK_EXPIRE)))
+        {
+            spin_unlock(&pagecache_lock);
+            continue;
+        }
+
+        //the run can start before this page...
+        u32 first = page->index;
+        while(first && (page->index - first < WRITEBACK_MAX_PAGES - 1))
+        {
+            cached_page_t* prev = radix_tree_lookup(node->pages, first-1);
+            if((!prev) || (!(prev->flags & PAGE_DIRTY))) break;
+            first--;
+        }
+        //...and takes every following dirty page ; they are held, and clean from now (a write meanwhile dirties them again)
+        while(run_size < WRITEBACK_MAX_PAGES)
+        {
+            cached_page_t* next = radix_tree_lookup(node->pages, first+run_size);
+            if((!next) || (!(next->flags & PAGE_DIRTY))) break;
+            next->flags &= ~((u32) PAGE_DIRTY);
+            next->refs++;
+            run[run_size++] = next;
+        }
+        pagecache_dirty -= run_size;
+        writeback_node = node;
+        spin_unlock(&pagecache_lock);
+
+        //copy the pages (one at a time, writers copy under the lock too)
+        u32 j;
+        for(j = 0; j < run_size; j++)
+        {
+            spin_lock(&pagecache_lock);
+            memcpy(writeback_buffer+j*PAGE_SIZE, run[j]->data, PAGE_SIZE);
+            spin_unlock(&pagecache_lock);
+        }
+
+        u64 offset = ((u64) first) << PAGE_SHIFT;
+        u32 size = run_size*PAGE_SIZE;
+        error_t writeop = ERROR_NONE;
+        if(offset < node->length)
+        {
+            if(offset+size > node->length) size = (u32) (node->length - offset);
+            writeop = pagecache_store(node, offset, size, writeback_buffer);
+        }
+
+        spin_lock(&pagecache_lock);
+        for(j = 0; j < run_size; j++)
+        {
+            cached_page_t* done = run[j];
+            if(writeop != ERROR_NONE) page_dirty(done);
+            done->refs--;
+            if((!done->refs) && (!done->node)) free_page(done);
+        }
+        if(writeop == ERROR_NONE) pagecache_written += run_size;
+        else if(tr == ERROR_NONE) tr = writeop;
+        writeback_node = 0;
+        spin_unlock(&pagecache_lock);
+        wake_up_all(&pagecache_queue);
+    }
+    return tr;
+}
+
+/*
+* Take the writeback mutex, waiting for the current writeback to complete
+*/
+static void writeback_lock()
+{
+    while(mutex_lock(&writeback_mutex) != ERROR_NONE)
+    {
+        mutex_wait(&writeback_mutex);
+    }
+}
+
+/*
+* Write back every dirty page of the file (or of every file if 'node' is 0), now (fsync/sync)
+*/
+error_t pagecache_writeback(fsnode_t* node)
+{
+    writeback_lock();
+    error_t tr = writeback_pages(node, true);
+    mutex_unlock(&writeback_mutex);
+    return tr;
+}
+
+static void writeback_work_handler(void* data)
+{
+    (void) data;
+    pagecache_writeback(0);
+}
+
+/*
+* Flusher thread : writes back the pages that are dirty for too long, then the filesystems metadata
+*/
+static void flusher_main(void* data)
+{
+    (void) data;
+    u32 ticks = 0;
+    while(1)
+    {
+        scheduler_wait_thread(current_process, current_process->active_thread, SLEEP_TIME, 0, WRITEBACK_INTERVAL);
+
+        if(pagecache_dirty)
+        {
+            writeback_lock();
+            writeback_pages(0, false);
+            mutex_unlock(&writeback_mutex);
+        }
+
+        if(++ticks == WRITEBACK_EXPIRE/WRITEBACK_INTERVAL)
+        {
+            ticks = 0;
+            sync_metadata();
+        }
+    }
+}
+
+/*
+* Copy the statistics report, starting at offset ; returns the number of bytes copied
+*/
+u32 pagecache_stat_read(u32 offset, void* buffer, u32 count)
+{
+    spin_lock(&pagecache_lock);
+    u32 stats[8] = {pagecache_hits, pagecache_misses, pagecache_readaheads, pagecache_reclaims, pagecache_written, pagecache_dirty, pagecache_used, pagecache_size};
+    spin_unlock(&pagecache_lock);
+
+    char* names[8] = {"hits ", "misses ", "readahead ", "reclaims ", "written_back ", "pages_dirty ", "pages_used ", "pages_total "};
+    char report[224];
+    char number[12];
+    *report = 0;
+    u32 i;
+    for(i = 0; i < 8; i++)
+    {
+        strcat(report, names[i]);
+        utoa(stats[i], (unsigned char*) number);
+        strcat(report, number);
+        strcat(report, "\n");
+    }
+
+    u32 length = strlen(report);
+    u32 copied = 0;
+    if(offset < length)
+    {
+        copied = length - offset;
+        if(copied > count) copied = count;
+        memcpy(buffer, report+offset, copied);
+    }
+    //terminate the text for readers that don't check the count
+    if(copied < count) memset(((u8*) buffer)+copied, 0, count-copied);
+    return copied;
+}
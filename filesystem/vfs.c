@@ -32,8 +32,114 @@
 
 mount_point_t* root_point = 0;
 u16 current_mount_points = 0;
+rwlock_t mount_lock = {0};
 
-static fsnode_t* do_open_fs(char* path, mount_point_t* mp);
+/*
+* The mount points are also indexed by a trie of path components, so that finding the filesystem owning a path
+* costs one step per component, whatever the number of mounts ; the list above is kept for enumeration
+*/
+typedef struct mount_node
+{
+    char* name; //path component
+    mount_point_t* mount; //filesystem mounted at this path, or 0 if the node is only on the way to one
+    struct mount_node* parent;
+    struct mount_node* children;
+    struct mount_node* sibling;
+} mount_node_t;
+
+static mount_node_t mount_tree = {0}; //'/'
+
+static fsnode_t* do_open_fs(char* path, fsnode_t* root);
+static fsnode_t* lookup(fsnode_t* dir, char* name);
+static void readahead(fd_t* fd, u64 count);
+static void release_dirents(fd_t* directory);
+static error_t sync_fs(file_system_t* fs);
+
+/*
+* Get the next component of 'path' (skipping the slashes), with its length in 'len'
+*/
+static char* path_component(char* path, u32* len)
+{
+    while(*path == '/') path++;
+    u32 l = 0;
+    while(path[l] && (path[l] != '/')) l++;
+    *len = l;
+    return path;
+}
+
+static mount_node_t* mount_node_child(mount_node_t* node, char* name, u32 len)
+{
+    mount_node_t* child = node->children;
+    while(child)
+    {
+        if((strcfirst(child->name, name) == len) && (!child->name[len])) return child;
+        child = child->sibling;
+    }
+    return 0;
+}
+
+/*
+* Find the trie node of 'path', creating the missing ones if 'create' is set (mount lock must be held)
+*/
+static mount_node_t* mount_node_get(char* path, bool create)
+{
+    mount_node_t* node = &mount_tree;
+    u32 len;
+    char* component = path_component(path, &len);
+    while(len)
+    {
+        mount_node_t* child = mount_node_child(node, component, len);
+        if(!child)
+        {
+            if(!create) return 0;
+            child = 
+            #ifdef MEMLEAK_DBG
+            kmalloc(sizeof(mount_node_t), "Mount trie node");
+            #else
+            kmalloc(sizeof(mount_node_t));
+            #endif
+            child->name = kmalloc(len+1);
+            strncpy(child->name, component, len);
+            child->name[len] = 0;
+            child->mount = 0;
+            child->parent = node;
+            child->children = 0;
+            child->sibling = node->children;
+            node->children = child;
+        }
+        node = child;
+        component = path_component(component+len, &len);
+    }
+    return node;
+}
+
+/*
+* Find the mount point owning 'path' (the deepest one on its way), and the path relative to it in 'relative'
+* Returns the root directory of its filesystem, held before the mount lock is released (icache_put() when done) :
+* the mount point itself can be unmounted and freed right after
+*/
+static fsnode_t* mount_find(char* path, char** relative)
+{
+    read_lock(&mount_lock);
+    mount_node_t* node = &mount_tree;
+    mount_point_t* best = root_point;
+    *relative = path;
+
+    u32 len;
+    char* component = path_component(path, &len);
+    while(len)
+    {
+        node = mount_node_child(node, component, len);
+        if(!node) break;
+        if(node->mount) {best = node->mount; *relative = component+len;}
+        component = path_component(component+len, &len);
+    }
+    fsnode_t* root = best->fs->root_dir;
+    icache_hold(root);
+    read_unlock(&mount_lock);
+
+    return root;
+}
 
 u8 detect_fs_type(block_device_t* drive, u8 partition)
 {
@@ -136,16 +242,22 @@ void mount(char* path, file_system_t* fs)
     if(root_point == 0)
     {
         //we are mounting root point
-        root_point = 
+        mount_point_t* point = 
         #ifdef MEMLEAK_DBG
         kmalloc(sizeof(mount_point_t), "Mount point (root '/') struct");
         #else
         kmalloc(sizeof(mount_point_t));
         #endif
-        root_point->path = path;
-        root_point->fs = fs;
-        root_point->next = 0;
+        point->path = path;
+        point->fs = fs;
+        point->dir = 0;
+        point->next = 0;
+        lock_set_class(&mount_lock, "mount table");
+        write_lock(&mount_lock);
+        root_point = point;
+        mount_tree.mount = point;
         current_mount_points++;
+        write_unlock(&mount_lock);
         return;
     }
 
@@ -167,15 +279,116 @@ void mount(char* path, file_system_t* fs)
     #endif
     next_point->path = path;
     next_point->fs = fs;
+    next_point->dir = mf->file;
     next_point->next = 0;
+    //the covered directory must stay in memory (with its mount point attribute) while mounted
+    icache_hold(next_point->dir);
+    close_file(mf);
     
+    write_lock(&mount_lock);
     mount_point_t* last = root_point;
     while(last->next)
     {
         last = last->next;
     }
     last->next = next_point;
+    mount_node_get(path, true)->mount = next_point;
     current_mount_points++;
+    write_unlock(&mount_lock);
+}
+
+/*
+* Unmount the filesystem mounted at 'path'
+* The filesystem structures are not freed (the drivers have no teardown yet), so files still open on it stay valid
+*/
+error_t unmount(char* path)
+{
+    write_lock(&mount_lock);
+    mount_node_t* node = mount_node_get(path, false);
+    if((!node) || (!node->mount)) {write_unlock(&mount_lock); return ERROR_FILE_NOT_FOUND;}
+    if(node == &mount_tree) {write_unlock(&mount_lock); return ERROR_PERMISSION;}
+    //nodes only exist on the way to a mount point : a child means something is mounted under this one
+    if(node->children) {write_unlock(&mount_lock); return ERROR_BUSY;}
+
+    mount_point_t* point = node->mount;
+    mount_point_t* prev = root_point;
+    while(prev->next != point) prev = prev->next;
+    prev->next = point->next;
+    current_mount_points--;
+
+    //prune the branch that only led to this mount point
+    node->mount = 0;
+    while((node != &mount_tree) && (!node->mount) && (!node->children))
+    {
+        mount_node_t* parent = node->parent;
+        mount_node_t** ptr = &parent->children;
+        while(*ptr != node) ptr = &(*ptr)->sibling;
+        *ptr = node->sibling;
+        kfree(node->name);
+        kfree(node);
+        node = parent;
+    }
+    write_unlock(&mount_lock);
+
+    //nothing cached for this filesystem may stay behind
+    pagecache_writeback(0);
+    sync_fs(point->fs);
+
+    point->dir->attributes &= (u8) ~DIR_ATTR_MOUNTPOINT;
+    icache_put(point->dir);
+    kfree(point);
+    return ERROR_NONE;
+}
+
+/*
+* Write back the metadata the filesystem driver keeps in memory (fat, ext2 bitmaps, group descriptors and superblock)
+*/
+static error_t sync_fs(file_system_t* fs)
+{
+    switch(fs->fs_type)
+    {
+        case FS_TYPE_FAT32: return fat32_sync(fs);
+        case FS_TYPE_EXT2: return ext2_sync(fs);
+    }
+    return ERROR_NONE;
+}
+
+/*
+* Write back the metadata of every mounted filesystem
+*/
+error_t sync_metadata()
+{
+    error_t tr = ERROR_NONE;
+    read_lock(&mount_lock);
+    mount_point_t* point = root_point;
+    while(point)
+    {
+        error_t err = sync_fs(point->fs);
+        if(tr == ERROR_NONE) tr = err;
+        point = point->next;
+    }
+    read_unlock(&mount_lock);
+    return tr;
+}
+
+/*
+* Write back the dirty pages of the file, then the metadata of its filesystem
+*/
+error_t fsync_file(fd_t* file)
+{
+    error_t tr = pagecache_writeback(file->file);
+    error_t err = sync_fs(file->file->file_system);
+    return (tr != ERROR_NONE) ? tr : err;
+}
+
+/*
+* Write back everything cached : the dirty pages of every file, then every filesystem metadata
+*/
+error_t sync()
+{
+    error_t tr = pagecache_writeback(0);
+    error_t err = sync_metadata();
+    return (tr != ERROR_NONE) ? tr : err;
 }
 
 fd_t* open_file(char* path, u8 mode)
@@ -188,41 +401,33 @@ fd_t* open_file(char* path, u8 mode)
         file_system_t* fs = root_point->fs;
         fd_t* tr = kmalloc(sizeof(fd_t));
         tr->file = fs->root_dir;
+        icache_hold(tr->file);
         tr->offset = 0;
         tr->instances = 1;
+        tr->ra_next = 0; tr->ra_window = 0; tr->ra_end = 0;
+        tr->dir_list = 0; tr->dir_size = 0; tr->dir_next = 0; tr->dir_next_index = 0; memset(&tr->dir_lock, 0, sizeof(mutex_t));
         return tr;
     }
 
-    //we are already into a filesystem that contains a dir that is a mount point
-    //looking on the list for the mount point
-    u32 i = 0;
-    u16 chars = 0; mount_point_t* best = root_point;
-    mount_point_t* current = root_point;
-    while(i < current_mount_points)
-    {
-        u16 cc = strcfirst(current->path, path);
-        if(cc > chars)
-        {
-            best = current;
-            chars = cc;
-        }
-        current = current->next;
-        i++;
-    }
+    //find the filesystem owning the path : the deepest mount point on the way
+    char* relative;
+    fsnode_t* root = mount_find(path, &relative);
 
-    //if we want the root directory of the root point
-    if(!strcmp(path, best->path))
+    //if we want the root directory of the mount point
+    u32 rlen;
+    path_component(relative, &rlen);
+    if(!rlen)
     {
         fd_t* tr = kmalloc(sizeof(fd_t));
-        tr->file = best->fs->root_dir;
+        tr->file = root;
         tr->offset = 0;
         tr->instances = 1;
+        tr->ra_next = 0; tr->ra_window = 0; tr->ra_end = 0;
+        tr->dir_list = 0; tr->dir_size = 0; tr->dir_next = 0; tr->dir_next_index = 0; memset(&tr->dir_lock, 0, sizeof(mutex_t));
         return tr;
     }
 
-    if(!best) {fatal_kernel_error("Failed to find mount point ? WTF?", "OPEN_FILE"); return 0;}
-
-    fsnode_t* node = do_open_fs(path+strlen(best->path), best);
+    fsnode_t* node = do_open_fs(relative, root);
 
     if((!node) && ((mode == OPEN_MODE_R) | (mode == OPEN_MODE_RP))) return 0;
     
@@ -230,6 +435,8 @@ fd_t* open_file(char* path, u8 mode)
     tr->file = node;
     tr->offset = 0;
     tr->instances = 1;
+    tr->ra_next = 0; tr->ra_window = 0; tr->ra_end = 0;
+    tr->dir_list = 0; tr->dir_size = 0; tr->dir_next = 0; tr->dir_next_index = 0; memset(&tr->dir_lock, 0, sizeof(mutex_t));
     tr->path = kmalloc(path_len+1);
     strncpy(tr->path, path, path_len);
     *(tr->path+path_len) = 0;
@@ -241,9 +448,7 @@ fd_t* open_file(char* path, u8 mode)
         if(node == 0) {tr->file = create_file(path, 0); if(!tr->file) {kfree(tr); return 0;}}
         if((mode == OPEN_MODE_W) | (mode == OPEN_MODE_WP))
         {
-            u8* zero_buffer = kmalloc((u32) flength(tr)); memset(zero_buffer, 0, (size_t) flength(tr));
-            write_file(tr, zero_buffer, flength(tr));
-            tr->file->length = 0;
+            truncate_file(tr, 0);
         }
         if((mode == OPEN_MODE_A) | (mode == OPEN_MODE_AP))
         {
@@ -257,7 +462,12 @@ fd_t* open_file(char* path, u8 mode)
 void close_file(fd_t* file)
 {
     file->instances--;
-    if(!file->instances) kfree(file);
+    if(!file->instances)
+    {
+        release_dirents(file);
+        icache_put(file->file);
+        kfree(file);
+    }
 }
 
 error_t list_directory(char* path, list_entry_t* dest, u32* size)
@@ -289,6 +499,58 @@ error_t read_directory(fd_t* directory, list_entry_t* dest, u32* size)
     return tr;
 }
 
+/*
+* Get the directory entry at the cursor of the descriptor (directory->offset, an entry index), without moving the cursor
+* The listing is taken once when the cursor is at 0 (open, rewind) and kept in the descriptor for the next calls
+* Returns 0 at the end of the directory, or on error (then set in *error) ; the caller holds directory->dir_lock
+*/
+dirent_t* read_dirent(fd_t* directory, error_t* error)
+{
+    *error = ERROR_NONE;
+    if(!(directory->file->attributes & FILE_ATTR_DIR)) {*error = ERROR_FILE_IS_NOT_DIRECTORY; return 0;}
+
+    //cursor at the start : take a new listing, so that a rewind sees the entries added/removed since
+    if((!directory->offset) | (!directory->dir_list))
+    {
+        release_dirents(directory);
+        list_entry_t* list = 
+        #ifdef MEMLEAK_DBG
+        kmalloc(sizeof(list_entry_t), "read_dirent directory listing");
+        #else
+        kmalloc(sizeof(list_entry_t));
+        #endif
+        u32 size = 0;
+        *error = read_directory(directory, list, &size);
+        if(*error != ERROR_NONE) {list_free(list, size); return 0;}
+        directory->dir_list = list;
+        directory->dir_size = size;
+        directory->dir_next = list;
+        directory->dir_next_index = 0;
+    }
+
+    if(directory->offset >= directory->dir_size) return 0;
+    u32 index = (u32) directory->offset;
+
+    //the cursor usually moved forward by a few entries since last call : continue from there
+    if(index < directory->dir_next_index) {directory->dir_next = directory->dir_list; directory->dir_next_index = 0;}
+    while(directory->dir_next_index < index) {directory->dir_next = directory->dir_next->next; directory->dir_next_index++;}
+
+    return directory->dir_next->element;
+}
+
+/*
+* Free the directory listing kept in the descriptor by read_dirent()
+*/
+static void release_dirents(fd_t* directory)
+{
+    if(!directory->dir_list) return;
+    list_free(directory->dir_list, directory->dir_size);
+    directory->dir_list = 0;
+    directory->dir_size = 0;
+    directory->dir_next = 0;
+    directory->dir_next_index = 0;
+}
+
 u64 flength(fd_t* file)
 {
     return file->file->length;
@@ -311,13 +573,10 @@ error_t read_file(fd_t* fd, void* buffer, u64 count)
     switch(inode->file_system->fs_type)
     {
         case FS_TYPE_FAT32:
-            tr = fat32_read_file(fd, buffer, count);
-            break;
         case FS_TYPE_ISO9660:
-            tr = iso9660_read_file(fd, buffer, count);
-            break;
         case FS_TYPE_EXT2:
-            tr = ext2_read_file(fd, buffer, count);
+            tr = pagecache_read(inode, fd->offset, count, buffer);
+            if(tr == ERROR_NONE) readahead(fd, count);
             break;
         case FS_TYPE_DEVFS:
             tr = devfs_read_file(fd, buffer, count);
@@ -327,6 +586,91 @@ error_t read_file(fd_t* fd, void* buffer, u64 count)
     return tr;
 }
 
+/*
+* Update the access pattern of the descriptor after a read of 'count' bytes at fd->offset,
+* and keep the pages after the read requested : the window doubles on sequential reads, and collapses on random ones
+*/
+static void readahead(fd_t* fd, u64 count)
+{
+    if(fd->offset != fd->ra_next)
+    {
+        fd->ra_window = 0;
+        fd->ra_end = 0;
+        fd->ra_next = fd->offset+count;
+        return;
+    }
+    fd->ra_next = fd->offset+count;
+
+    u32 next_page = (u32) ((fd->offset+count+PAGE_SIZE-1) >> PAGE_SHIFT);
+    if(!fd->ra_window) fd->ra_window = READAHEAD_MIN_PAGES;
+    //the reader entered the window requested last time : request the next one, twice as large
+    else if(next_page + fd->ra_window/2 >= fd->ra_end)
+    {
+        fd->ra_window *= 2;
+        if(fd->ra_window > READAHEAD_MAX_PAGES) fd->ra_window = READAHEAD_MAX_PAGES;
+    }
+    else return;
+
+    u32 start = (fd->ra_end > next_page) ? fd->ra_end : next_page;
+    u32 end = next_page + fd->ra_window;
+    if(end <= start) return;
+    pagecache_readahead(fd->file, start, end - start);
+    fd->ra_end = end;
+}
+
+/*
+* Set the length of the file : the space past 'length' is freed, or the file is extended with zeroes
+*/
+error_t truncate_file(fd_t* file, u64 length)
+{
+    fsnode_t* node = file->file;
+    if(node->attributes & FILE_ATTR_DIR) return ERROR_FILE_IS_DIRECTORY;
+    if(node->file_system->flags & FS_FLAG_READ_ONLY) return ERROR_FILE_SYSTEM_READ_ONLY;
+    if(length == node->length) return ERROR_NONE;
+
+    if(length > node->length)
+    {
+        //extend the file with zeroes, a page at a time (through a descriptor of our own, the offset of 'file' does not move)
+        fd_t fd;
+        memset(&fd, 0, sizeof(fd_t));
+        fd.file = node;
+        fd.offset = node->length;
+        fd.instances = 1;
+        u8* zero_buffer = kmalloc(PAGE_SIZE);
+        memset(zero_buffer, 0, PAGE_SIZE);
+        error_t tr = ERROR_NONE;
+        while((tr == ERROR_NONE) && (fd.offset < length))
+        {
+            u32 size = (length - fd.offset > PAGE_SIZE) ? PAGE_SIZE : (u32) (length - fd.offset);
+            tr = write_file(&fd, zero_buffer, size);
+        }
+        kfree(zero_buffer);
+        return tr;
+    }
+
+    //the cache must not write back the pages past the new end
+    pagecache_truncate(node, length);
+    switch(node->file_system->fs_type)
+    {
+        case FS_TYPE_FAT32: return fat32_truncate(node, length);
+        case FS_TYPE_EXT2: return ext2_truncate(node, length);
+    }
+    return ERROR_FILE_UNSUPPORTED_FILE_SYSTEM;
+}
+
+/*
+* Allocate the space of the file up to 'length' and set its length (the data is written by the caller, through the cache)
+*/
+static error_t extend_file(fsnode_t* node, u64 length)
+{
+    switch(node->file_system->fs_type)
+    {
+        case FS_TYPE_FAT32: return fat32_extend(node, length);
+        case FS_TYPE_EXT2: return ext2_extend(node, length);
+    }
+    return ERROR_FILE_UNSUPPORTED_FILE_SYSTEM;
+}
+
 error_t write_file(fd_t* fd, void* buffer, u64 count)
 {
     fsnode_t* inode = fd->file;
@@ -334,8 +678,18 @@ error_t write_file(fd_t* fd, void* buffer, u64 count)
     if((inode->attributes & FILE_ATTR_DIR) == FILE_ATTR_DIR) return ERROR_FILE_IS_DIRECTORY;
     if(count == 0) return 0;
 
+    //writes are buffered in the page cache ; the ones extending the file allocate its space first (the data is written back later)
+    //a write past the end would leave a hole, that the cache does not clear : it goes to the filesystem
+    bool buffered = (fd->offset <= inode->length) && ((inode->file_system->fs_type == FS_TYPE_FAT32) || (inode->file_system->fs_type == FS_TYPE_EXT2));
+
     error_t tr = ERROR_FILE_UNSUPPORTED_FILE_SYSTEM;
-    switch(inode->file_system->fs_type)
+    if(buffered)
+    {
+        tr = ERROR_NONE;
+        if(fd->offset+count > inode->length) tr = extend_file(inode, fd->offset+count);
+        if(tr == ERROR_NONE) tr = pagecache_write(inode, fd->offset, count, buffer);
+    }
+    else switch(inode->file_system->fs_type)
     {
         case FS_TYPE_FAT32:
             tr = fat32_write_file(fd, buffer, count);
@@ -347,7 +701,11 @@ error_t write_file(fd_t* fd, void* buffer, u64 count)
             tr = ext2_write_file(fd, buffer, count);
             break;
     }
-    if(tr == ERROR_NONE) fd->offset += count;
+    if(tr == ERROR_NONE)
+    {
+        if(!buffered) pagecache_update(inode, fd->offset, count, buffer);
+        fd->offset += count;
+    }
     return tr;
 }
 
@@ -371,6 +729,12 @@ error_t unlink(char* path)
     if(!directory) return ERROR_FILE_NOT_FOUND;
     if(!(directory->file->attributes & FILE_ATTR_DIR)) {close_file(directory); return ERROR_FILE_IS_NOT_DIRECTORY;}
 
+    //the filesystem may free the node : every dentry pointing to it (or in it) must go first
+    //(its cached pages are dropped by the filesystem, only if the node is freed : other links or descriptors may still use it)
+    fsnode_t* node = lookup(directory->file, name);
+    if(node) dcache_invalidate_node(node);
+    dcache_invalidate(directory->file, name);
+
     error_t tr = ERROR_FILE_UNSUPPORTED_FILE_SYSTEM;
     switch(directory->file->file_system->fs_type)
     {
@@ -382,6 +746,8 @@ error_t unlink(char* path)
             break;
     }
 
+    dcache_invalidate(directory->file, name);
+    if(node) icache_put(node);
     close_file(directory);
 
     return tr;
@@ -421,6 +787,7 @@ error_t link(char* src_path, char* dest_path)
             tr = ext2_link(source_file->file, dest_name, dest_directory->file);
             break;
     }
+    dcache_invalidate(dest_directory->file, dest_name);
 
     close_file(dest_directory);
     close_file(source_file);
@@ -454,6 +821,8 @@ error_t rename(char* src_path, char* dest_name)
             tr = fat32_rename(source_file->file, src_name, dest_name, dest_directory->file);
             break;
     }
+    dcache_invalidate(dest_directory->file, src_name);
+    dcache_invalidate(dest_directory->file, dest_name);
 
     close_file(dest_directory);
     close_file(source_file);
@@ -461,7 +830,10 @@ error_t rename(char* src_path, char* dest_name)
     return tr;
 }
 
-static fsnode_t* do_open_fs(char* path, mount_point_t* mp)
+/*
+* Walk 'path' from the (held) root directory of a filesystem ; the reference on 'root' is given to the walk
+*/
+static fsnode_t* do_open_fs(char* path, fsnode_t* root)
 {
     if(*path == '/') path++;
 
@@ -471,23 +843,20 @@ static fsnode_t* do_open_fs(char* path, mount_point_t* mp)
 	char** spath = strsplit(path, '/', &split_size);
     
     /* Step 2 : iterate from the root directory and continue on as we found dirs/files on the list (splitted) */
-    fsnode_t* node = mp->fs->root_dir;
+    //each node on the way is held until the next one is found
+    fsnode_t* node = root;
     while(i < split_size)
     {
-        switch(mp->fs->fs_type)
-        {
-            case FS_TYPE_FAT32: {node = fat32_open(node, spath[i]); break;}
-            case FS_TYPE_EXT2: {node = ext2_open(node, spath[i]); break;}
-            case FS_TYPE_ISO9660: {node = iso9660_open(node, spath[i]); break;}
-            case FS_TYPE_DEVFS: {node = devfs_open(node, spath[i]); break;}
-        }
+        fsnode_t* child = lookup(node, spath[i]);
+        icache_put(node);
+        node = child;
         if(!node) return 0;
 
         //this is the last entry we needed : we found our file !
         if((i+1) == split_size) return node;
         
         //we need to continue iterating, but an element on the path is not a directory...
-        if(!(node->attributes & FILE_ATTR_DIR)) return 0;
+        if(!(node->attributes & FILE_ATTR_DIR)) {icache_put(node); return 0;}
 
         i++;
     }
@@ -496,6 +865,33 @@ static fsnode_t* do_open_fs(char* path, mount_point_t* mp)
     return 0;
 }
 
+/*
+* Find 'name' in directory 'dir', going to the filesystem only if the dentry cache doesnt know the answer
+* devfs is not cached : it lives in memory, and devices appear without going through create_file
+* The node found is held (icache_put() when done)
+*/
+static fsnode_t* lookup(fsnode_t* dir, char* name)
+{
+    fsnode_t* node = 0;
+    u32 generation = 0;
+    u8 fs_type = dir->file_system->fs_type;
+    if((fs_type != FS_TYPE_DEVFS) && dcache_lookup(dir, name, &node, &generation)) return node;
+
+    switch(fs_type)
+    {
+        case FS_TYPE_FAT32: {node = fat32_open(dir, name); break;}
+        case FS_TYPE_EXT2: {node = ext2_open(dir, name); break;}
+        case FS_TYPE_ISO9660: {node = iso9660_open(dir, name); break;}
+        case FS_TYPE_DEVFS: {return devfs_open(dir, name);}
+    }
+
+    dcache_insert(dir, name, node, generation);
+    return node;
+}
+
+/*
+* Create the file at 'path' ; the node returned is held (icache_put() when done)
+*/
 fsnode_t* create_file(char* path, u8 attributes)
 {
     //kprintf("%lCREATE_FILE(%s, %u)\n", 3, path, attributes);
@@ -524,6 +920,7 @@ fsnode_t* create_file(char* path, u8 attributes)
             tr = fat32_create_file(directory->file, name, attributes);
             break;
     }
+    dcache_invalidate(directory->file, name);
 
     close_file(directory);
 
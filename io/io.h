@@ -6,6 +6,7 @@
 #include "filesystem/devfs.h"
 #include "memory/mem.h"
 #include "termios.h"
+#include "sync/sync.h"
 
 // I/O Streams
 typedef struct IOSTREAM
@@ -15,7 +16,7 @@ typedef struct IOSTREAM
     u32 buffer_size;
     u32 attributes;
     fsnode_t* file;
-    list_entry_t* waiting_processes;
+    wait_queue_t waiters;
 } io_stream_t;
 
 #define IOSTREAM_ATTR_BLOCKING_READ 1
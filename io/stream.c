@@ -33,10 +33,11 @@ io_stream_t* iostream_alloc()
     tr->buffer = kmalloc(tr->buffer_size);
     tr->count = 0;
     tr->attributes = IOSTREAM_ATTR_BLOCKING_READ | IOSTREAM_ATTR_AUTOEXPAND;
-    tr->waiting_processes = 0;
+    memset(&tr->waiters, 0, sizeof(wait_queue_t));
 
     tr->file = kmalloc(sizeof(fsnode_t));
     tr->file->file_system = devfs;
+    tr->file->pages = 0;
     tr->file->length = 0;
     tr->file->attributes = 0;
     tr->file->hard_links = 0;
@@ -146,34 +147,15 @@ error_t iostream_read(u8* buffer, u32 count, io_stream_t* iostream)
 
 static void iostream_wait(io_stream_t* iostream)
 {
-    //pointer to the list
-    list_entry_t** ptr = &iostream->waiting_processes;
-    //while there are elements in the list, we iterate through
-    while(*ptr) ptr = &((*ptr)->next);
-    //we allocate space and set entry data (our iostream and associated process)
-    (*ptr) = kmalloc(sizeof(list_entry_t));
-    (*ptr)->next = 0;
-    void** element = kmalloc(sizeof(void*)*2);
-    element[0] = current_process;
-    element[1] = current_process->active_thread;
-    (*ptr)->element = element;
-
-    //we remove current thread from scheduler
-    current_process->active_thread->status = THREAD_STATUS_ASLEEP_IO;
-    scheduler_remove_thread(current_process, current_process->active_thread);
+    wait_prepare(&iostream->waiters, false, THREAD_STATUS_ASLEEP_IO);
+
+    //data could have been written before we were queued
+    if(iostream->count) {wait_cancel(&iostream->waiters); return;}
+
+    wait_sleep();
 }
 
 static void iostream_wake(io_stream_t* iostream)
 {
-    list_entry_t* ptr = iostream->waiting_processes;
-    while(ptr)
-    {
-        void** element = ptr->element;
-        scheduler_add_thread(element[0], element[1]);
-        list_entry_t* tfree = ptr;
-        ptr = ptr->next;
-        kfree(tfree);
-    }
-
-    iostream->waiting_processes = 0;
+    wake_up_all(&iostream->waiters);
 }
\ No newline at end of file
@@ -76,7 +76,7 @@ start:
     mov %eax, %cr3
     # enable paging
     mov %cr0, %eax
-    or $0x80000001, %eax # 80000001 looks better than 80000000 (set pe bit if wasnt)
+    or $0x80010001, %eax # 80000001 looks better than 80000000 (set pe bit if wasnt) ; 0x10000 : write protect, even for the kernel (copy on write)
     mov %eax, %cr0
     # jump to higher half code
     lea (_high), %ecx
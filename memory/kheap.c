@@ -33,8 +33,11 @@ u32 KHEAP_BASE_START = 0xC0800000;//(u32) &_kernel_end;
 u32 KHEAP_BASE_END = 0xC0800000 + KHEAP_BASE_SIZE;; //(u32) &_kernel_end + KHEAP_BASE_SIZE;
 u32 kheap_page_table[1024] __attribute__((aligned(4096)));
 
+spinlock_t kheap_lock = {0};
+spinlock_t kheap_expand_lock = {0}; //only one cpu expands the heap at a time
+
 static void merge_free_blocks();
-static void kheap_expand();
+static void kheap_expand(u32 heap_end);
 
 void kheap_install()
 {
@@ -66,6 +69,7 @@ void* kmalloc(u32 size)
 
     u32 i;
 
+    spin_lock(&kheap_lock);
     i = KHEAP_BASE_START;
     while(i < KHEAP_BASE_END)
     {
@@ -110,13 +114,16 @@ void* kmalloc(u32 size)
 
             //Return the block
             //kprintf("[ALLOC] [MALLOC] Returned block %X (size %d)\n", ((u32)currentBlock), currentBlock->size);
+            spin_unlock(&kheap_lock);
             return ((void*) ((u32)currentBlock)+sizeof(block_header_t));
         }
         //The current block did not match, skipping to next block
         i += (currentBlock->size+sizeof(block_header_t));
     }
-    //Heap is full : expand
-    kheap_expand();
+    //Heap is full : expand (without the lock : mapping memory needs kmalloc())
+    u32 heap_end = KHEAP_BASE_END;
+    spin_unlock(&kheap_lock);
+    kheap_expand(heap_end);
     #ifdef MEMLEAK_DBG
     return kmalloc(size, comment);
     #else
@@ -131,6 +138,7 @@ void kfree(void* pointer)
     block_header_t* blockHeader = (block_header_t*) (pointer - sizeof(block_header_t));
     if(blockHeader->magic != BLOCK_HEADER_MAGIC) 
         fatal_kernel_error(UNKNOWN_BLOCK_ERRMSG, "Pointer freeing");
+    spin_lock(&kheap_lock);
     blockHeader->status = 0;
     #ifdef MEMLEAK_DBG
     blockHeader->comment = 0;
@@ -139,6 +147,7 @@ void kfree(void* pointer)
     //kprintf("[ALLOC] [FREE] Block %X is now free\n", blockHeader);
 
     merge_free_blocks();
+    spin_unlock(&kheap_lock);
 }
 
 u32 kheap_get_size(void* ptr)
@@ -205,8 +214,18 @@ static void merge_free_blocks()
     }
 }
 
-static void kheap_expand()
+static void kheap_expand_process(process_t* process, void* arg)
+{
+    (void) arg;
+    map_memory(0x400000, KHEAP_BASE_END, process->page_directory);
+}
+
+static void kheap_expand(u32 heap_end)
 {
+    spin_lock(&kheap_expand_lock);
+    //another cpu expanded the heap while we were waiting
+    if(KHEAP_BASE_END != heap_end) {spin_unlock(&kheap_expand_lock); return;}
+
     if(KHEAP_BASE_END >= FREE_KVM_START) fatal_kernel_error("Kernel heap full ! How ?", "KHEAP_EXPAND");
     
     //we need to EXPAND heap in ALL CURRENT PAGES DIRS (all processes page dirs)
@@ -217,17 +236,15 @@ static void kheap_expand()
     #endif
     
     map_memory(0x400000, KHEAP_BASE_END, kernel_page_directory);
-    u32 i = 1;
-    for(;i<processes_size;i++)
-    {
-        process_t* process = processes[i];
-        if(process) map_memory(0x400000, KHEAP_BASE_END, process->page_directory);
-    }
+    pid_for_each(kheap_expand_process, 0);
 
+    spin_lock(&kheap_lock);
     block_header_t* base_block = (block_header_t*) KHEAP_BASE_END;
     base_block->magic = BLOCK_HEADER_MAGIC;
     base_block->size = 0x400000 - sizeof(block_header_t);
     base_block->status = 0;
     KHEAP_BASE_END += 0x400000;
     merge_free_blocks();
+    spin_unlock(&kheap_lock);
+    spin_unlock(&kheap_expand_lock);
 }
\ No newline at end of file
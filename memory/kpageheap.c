@@ -18,6 +18,7 @@
 #include "system.h"
 #include "mem.h"
 #include "error/error.h"
+#include "sync/sync.h"
 
 /*
 * This is the kernel page heap, used when we have to allocate a new PAGE_TABLE or a new PAGE_DIRECTORY
@@ -32,6 +33,7 @@
 #define KPHEAP_VIRT_BASE 0xC0400000
 
 u8 kpheap_blocks[1024] = {0};
+spinlock_t kpheap_lock = {0};
 u32 kpheap_page_table[1024] __attribute__((aligned(4096)));
 
 void install_page_heap()
@@ -50,15 +52,18 @@ void install_page_heap()
 u32* pt_alloc()
 {
     unsigned int i;
+    spin_lock(&kpheap_lock);
     for(i=0;i<1024;i++)
     {
         if(kpheap_blocks[i] == KPHEAP_BLOCK_FREE)
 	    {
 		    kpheap_blocks[i] = KPHEAP_BLOCK_USED;
+            spin_unlock(&kpheap_lock);
             memset((u32*) (KPHEAP_VIRT_BASE+KPHEAP_BLOCK_SIZE*i), 0, KPHEAP_BLOCK_SIZE);
 		    return ((u32*) (KPHEAP_VIRT_BASE+KPHEAP_BLOCK_SIZE*i));
 	    }
     }
+    spin_unlock(&kpheap_lock);
     fatal_kernel_error("Page heap is full. How did you do this ?", "PT_ALLOC");
     return 0;
 }
@@ -66,5 +71,7 @@ u32* pt_alloc()
 void pt_free(u32* pt)
 {
     u32 index = (((u32) pt) - KPHEAP_VIRT_BASE)/KPHEAP_BLOCK_SIZE;
+    spin_lock(&kpheap_lock);
     kpheap_blocks[index] = KPHEAP_BLOCK_FREE;
+    spin_unlock(&kpheap_lock);
 }
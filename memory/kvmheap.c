@@ -18,6 +18,7 @@
 #include "system.h"
 #include "mem.h"
 #include "error/error.h"
+#include "sync/sync.h"
 
 typedef struct VM_BLOCK
 {
@@ -29,6 +30,7 @@ typedef struct VM_BLOCK
 } vm_block_t;
 
 vm_block_t* vm_first_block = 0;
+spinlock_t kvm_lock = {0};
 
 void kvmheap_install()
 {
@@ -48,16 +50,18 @@ void kvmheap_install()
 u32 kvm_reserve_block(u32 size)
 {
     alignup(size, 4096);
+    //the new block is allocated before taking the lock (kmalloc() could need to reserve virtual memory)
+    vm_block_t* newblock = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(sizeof(vm_block_t), "virtual memory new block (kvm_reserve_block)");
+    #else
+    kmalloc(sizeof(vm_block_t));
+    #endif
+    spin_lock(&kvm_lock);
     vm_block_t* curr = vm_first_block;
     while(curr)
     {
         if((curr->status) | (curr->size < size)) {curr = curr->next; continue;}
-        vm_block_t* newblock = 
-        #ifdef MEMLEAK_DBG
-        kmalloc(sizeof(vm_block_t), "virtual memory new block (kvm_reserve_block)");
-        #else
-        kmalloc(sizeof(vm_block_t));
-        #endif
         vm_block_t* next = curr->next;
         newblock->vaddr = curr->vaddr+size;
         newblock->size = curr->size-size;
@@ -68,14 +72,17 @@ u32 kvm_reserve_block(u32 size)
         curr->size = size;
         curr->next = newblock;
         curr->status = 1;
+        spin_unlock(&kvm_lock);
         return curr->vaddr;
     }
+    spin_unlock(&kvm_lock);
     fatal_kernel_error("Trying to reserve more virtual memory than available", "KVM_RESERVE_BLOCK");
     return 0;
 }
 
 void kvm_free_block(u32 base_addr)
 {
+    spin_lock(&kvm_lock);
     vm_block_t* curr = vm_first_block;
     while(curr)
     {
@@ -102,9 +109,11 @@ void kvm_free_block(u32 base_addr)
                 kfree(m);
                 m = curr->next;
             }
+            spin_unlock(&kvm_lock);
             return;
         }
         curr = curr->next;
     }
+    spin_unlock(&kvm_lock);
     fatal_kernel_error("Trying to free an unknown block", "KVM_FREE_BLOCK");
 }
@@ -82,6 +82,8 @@ void free_block(u32 base_addr);
 p_block_t* get_block(u32 some_addr);
 
 //Paging
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
 extern u32 kernel_page_directory[1024];
 extern u32 kernel_page_table[1024];
 void finish_paging();
@@ -95,6 +97,13 @@ void map_flexible(u32 size, u32 physical, u32 virt_addr, u32* page_directory);
 void unmap_flexible(u32 size, u32 virt_addr, u32* page_directory);
 bool is_mapped(u32 virt_addr, u32* page_directory);
 u32 get_physical(u32 virt_addr, u32* page_directory);
+//page table entries bits
+#define PTE_PRESENT 0x1
+#define PTE_WRITE 0x2
+#define PTE_USER 0x4
+#define PTE_DIRTY 0x40 //set by the cpu on the first write through the entry
+u32* get_page_entry(u32 virt_addr, u32* page_directory, bool create);
+void invalidate_page(u32 virt_addr);
 
 //Virtual memory heap
 #define FREE_KVM_START 0xE0800000
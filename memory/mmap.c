@@ -0,0 +1,607 @@
+/*
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "system.h"
+#include "error/error.h"
+#include "mem.h"
+#include "tasking/task.h"
+#include "tasking/processes/syscalls.h"
+#include "filesystem/fs.h"
+
+/*
+* Memory mappings of files : the pages are faulted in lazily, from the page cache
+* Shared mappings map the cache pages themselves, so writes land in the cache (they are written back on msync/munmap) ;
+* private mappings map them read-only, and get their own copy of a page on the first write
+* Anonymous mappings (no file) get zeroed frames, given back to the physical allocator on munmap/madvise
+*/
+
+#define MMAP_BASE 0x40000000 //mappings without a fixed address go between MMAP_BASE and MMAP_END
+#define MMAP_END 0xA0000000 //(the heap is below, the stacks are above)
+#define PAGE_FRAME_MASK 0xFFFFF000
+#define MMAP_SHARED_WAIT_TRIES 100 //a shared page fault waits up to a second for a cache page (pagecache_wait_page() sleeps 10ms)
+
+static void area_lock(process_t* process)
+{
+    while(mutex_lock(&process->mmap_lock) != ERROR_NONE)
+    {
+        mutex_wait(&process->mmap_lock);
+    }
+}
+
+/*
+* Find the area containing 'address' (mmap lock must be held)
+*/
+static vm_area_t* area_find(process_t* process, u32 address)
+{
+    vm_area_t* area = process->mmaps;
+    while(area && (area->start <= address))
+    {
+        if(address < area->end) return area;
+        area = area->next;
+    }
+    return 0;
+}
+
+/*
+* Check that nothing is mapped in [start, end[ (mmap lock must be held)
+* Returns 0 if the range is free, otherwise the first address after what is in the way
+*/
+static u32 range_used(process_t* process, u32 start, u32 end)
+{
+    vm_area_t* area = process->mmaps;
+    while(area && (area->start < end))
+    {
+        if(area->end > start) return area->end;
+        area = area->next;
+    }
+
+    u32 addr;
+    for(addr = start; addr < end; addr += PAGE_SIZE)
+        if(is_mapped(addr, process->page_directory)) return addr + PAGE_SIZE;
+    return 0;
+}
+
+/*
+* Find room for 'length' bytes between MMAP_BASE and MMAP_END (first fit), trying 'hint' first
+* Returns 0 if there is none (mmap lock must be held)
+*/
+static u32 area_place(process_t* process, u32 hint, u32 length)
+{
+    if(hint && (!(hint & (PAGE_SIZE-1))) && (hint >= MMAP_BASE) && (hint < MMAP_END) && (length <= MMAP_END - hint))
+        if(!range_used(process, hint, hint+length)) return hint;
+
+    u32 addr = MMAP_BASE;
+    while(length <= MMAP_END - addr)
+    {
+        u32 next = range_used(process, addr, addr+length);
+        if(!next) return addr;
+        addr = next;
+    }
+    return 0;
+}
+
+/*
+* Insert the area in the sorted list (mmap lock must be held)
+*/
+static void area_insert(process_t* process, vm_area_t* area)
+{
+    vm_area_t** link = &process->mmaps;
+    while(*link && ((*link)->start < area->start)) link = &(*link)->next;
+    area->next = *link;
+    *link = area;
+}
+
+/*
+* Physical address of the frame of a cache page (the frames are on the kernel heap)
+*/
+static u32 page_frame(cached_page_t* page)
+{
+    return get_physical((u32) page->data, kernel_page_directory);
+}
+
+/*
+* Index in the file of the page at 'address'
+*/
+static u32 area_file_index(vm_area_t* area, u32 address)
+{
+    return (u32) ((area->offset + (address - area->start)) >> PAGE_SHIFT);
+}
+
+/*
+* Unmap the pages of the area in [from, to[, releasing the cache pages or freeing the private frames
+* A shared page the process wrote to is marked dirty in the cache ; returns true if there was one
+*/
+static bool area_unmap_pages(process_t* process, vm_area_t* area, u32 from, u32 to)
+{
+    bool dirty = false;
+    u32 addr = from;
+    while(addr < to)
+    {
+        u32* entry = get_page_entry(addr, process->page_directory, false);
+        if(!entry)
+        {
+            //no page table : skip to the next one
+            u32 next = (addr & 0xFFC00000) + 0x400000;
+            if(next < addr) break;
+            addr = next;
+            continue;
+        }
+
+        u32 pte = *entry;
+        if(pte)
+        {
+            *entry = 0;
+            invalidate_page(addr);
+
+            cached_page_t* page = radix_tree_delete(&area->pages, addr >> PAGE_SHIFT);
+            if(page)
+            {
+                if((area->flags & VK_MAP_SHARED) && (pte & PTE_DIRTY))
+                {
+                    pagecache_set_dirty(page);
+                    dirty = true;
+                }
+                pagecache_put(page);
+            }
+            else free_block(pte & PAGE_FRAME_MASK);
+        }
+
+        addr += PAGE_SIZE;
+    }
+    return dirty;
+}
+
+/*
+* Remove the mappings in [start, end[, trimming or splitting the areas that are only partly covered
+* If 'writeback', the dirty pages of the shared areas are written back to the disk (mmap lock must be held)
+*/
+static void areas_unmap(process_t* process, u32 start, u32 end, bool writeback)
+{
+    vm_area_t** link = &process->mmaps;
+    while(*link)
+    {
+        vm_area_t* area = *link;
+        if(area->end <= start) {link = &area->next; continue;}
+        if(area->start >= end) break;
+
+        u32 from = (area->start > start) ? area->start : start;
+        u32 to = (area->end < end) ? area->end : end;
+        if(area_unmap_pages(process, area, from, to) && writeback) pagecache_writeback(area->file->file);
+
+        if((from == area->start) && (to == area->end))
+        {
+            *link = area->next;
+            if(area->file) close_file(area->file);
+            kfree(area);
+            continue;
+        }
+
+        if(from == area->start)
+        {
+            //the pages are indexed by address, only the file offset moves
+            area->offset += to - area->start;
+            area->start = to;
+        }
+        else if(to == area->end) area->end = from;
+        else
+        {
+            //hole in the middle : the end of the area becomes a new one
+            vm_area_t* tail =
+            #ifdef MEMLEAK_DBG
+            kmalloc(sizeof(vm_area_t), "mmap area");
+            #else
+            kmalloc(sizeof(vm_area_t));
+            #endif
+            memcpy(tail, area, sizeof(vm_area_t));
+            tail->start = to;
+            tail->offset = area->offset + (to - area->start);
+            tail->pages.root = 0;
+            tail->pages.height = 0;
+            if(tail->file) tail->file->instances++;
+
+            u32 addr;
+            for(addr = to; addr < area->end; addr += PAGE_SIZE)
+            {
+                cached_page_t* page = radix_tree_delete(&area->pages, addr >> PAGE_SHIFT);
+                if(page) radix_tree_insert(&tail->pages, addr >> PAGE_SHIFT, page);
+            }
+
+            area->end = from;
+            area->next = tail;
+        }
+        link = &area->next;
+    }
+}
+
+/*
+* Map a zeroed frame at 'address' (not present), for an anonymous area
+*/
+static bool area_fault_zero(process_t* process, vm_area_t* area, u32 address)
+{
+    u32* entry = get_page_entry(address, process->page_directory, true);
+    if(!entry) return false;
+
+    //the frame is cleared through a kernel-only mapping, so that user threads can't see its old content
+    u32 frame = reserve_block(PAGE_SIZE, PHYS_USER_BLOCK_TYPE);
+    *entry = frame | PTE_PRESENT | PTE_WRITE;
+    invalidate_page(address);
+    memset((void*) address, 0, PAGE_SIZE);
+
+    *entry = frame | PTE_PRESENT | PTE_USER;
+    if(area->prot & VK_PROT_WRITE) *entry |= PTE_WRITE;
+    invalidate_page(address);
+    return true;
+}
+
+/*
+* Map a page of the area at 'address' (not present), from the page cache
+* A shared mapping needs the cache page itself : if every one is held, the fault waits for one ;
+* after MMAP_SHARED_WAIT_TRIES, a fault from user mode fails with SIGBUS instead (the kernel can't fail its access, it keeps waiting)
+*/
+static bool area_fault_in(process_t* process, vm_area_t* area, u32 address, bool write, bool user)
+{
+    if(!area->file) return area_fault_zero(process, area, address);
+
+    fsnode_t* node = area->file->file;
+    u32 index = area_file_index(area, address);
+    u32* entry = get_page_entry(address, process->page_directory, true);
+    if(!entry) return false;
+
+    error_t err = ERROR_NONE;
+    cached_page_t* page = pagecache_get(node, index, &err);
+    u32 tries = 0;
+    while((!page) && (err == ERROR_NONE) && (area->flags & VK_MAP_SHARED))
+    {
+        if(user && (tries++ == MMAP_SHARED_WAIT_TRIES)) {process->active_thread->sigfault = SIGBUS; return false;}
+        pagecache_wait_page();
+        page = pagecache_get(node, index, &err);
+    }
+    if((!page) && (err != ERROR_NONE)) return false;
+    //another thread of the process mapped it while we were reading
+    if(*entry) {if(page) pagecache_put(page); return true;}
+
+    if(page && ((area->flags & VK_MAP_SHARED) || (!write)))
+    {
+        //map the cache page itself (read-only for private mappings : a write copies it)
+        u32 flags = PTE_PRESENT | PTE_USER;
+        if((area->flags & VK_MAP_SHARED) && (area->prot & VK_PROT_WRITE)) flags |= PTE_WRITE;
+        radix_tree_insert(&area->pages, address >> PAGE_SHIFT, page);
+        *entry = page_frame(page) | flags;
+        invalidate_page(address);
+        return true;
+    }
+
+    //private copy of the page ; it is filled through a kernel-only mapping, so that user threads can't see it before
+    u32 frame = reserve_block(PAGE_SIZE, PHYS_USER_BLOCK_TYPE);
+    *entry = frame | PTE_PRESENT | PTE_WRITE;
+    invalidate_page(address);
+
+    if(page)
+    {
+        memcpy((void*) address, page->data, PAGE_SIZE);
+        pagecache_put(page);
+    }
+    else
+    {
+        //every cache page is held : read the file directly
+        u64 offset = ((u64) index) << PAGE_SHIFT;
+        u32 size = 0;
+        if(offset < node->length) size = (node->length - offset > PAGE_SIZE) ? PAGE_SIZE : (u32) (node->length - offset);
+        if(size && (pagecache_read(node, offset, size, (void*) address) != ERROR_NONE))
+        {
+            *entry = 0;
+            invalidate_page(address);
+            free_block(frame);
+            return false;
+        }
+        memset((void*) (address+size), 0, PAGE_SIZE-size);
+    }
+
+    *entry = frame | PTE_PRESENT | PTE_USER;
+    if(area->prot & VK_PROT_WRITE) *entry |= PTE_WRITE;
+    invalidate_page(address);
+    return true;
+}
+
+/*
+* Write to a present read-only page of a private area : copy the cache page
+*/
+static bool area_copy_on_write(process_t* process, vm_area_t* area, u32 address)
+{
+    u32* entry = get_page_entry(address, process->page_directory, false);
+    cached_page_t* page = radix_tree_lookup(&area->pages, address >> PAGE_SHIFT);
+    //another thread already did it
+    if(!page) return true;
+
+    u32 frame = reserve_block(PAGE_SIZE, PHYS_USER_BLOCK_TYPE);
+    *entry = frame | PTE_PRESENT | PTE_WRITE;
+    invalidate_page(address);
+    memcpy((void*) address, page->data, PAGE_SIZE);
+    *entry |= PTE_USER;
+    invalidate_page(address);
+
+    radix_tree_delete(&area->pages, address >> PAGE_SHIFT);
+    pagecache_put(page);
+    return true;
+}
+
+/*
+* Serve a page fault of the (current) process on a mapping
+* Returns false if the address is not mapped, or if the access is not allowed : the fault is a real one
+* ('user' : the fault happened in user mode, not in the kernel accessing a user buffer)
+*/
+bool mmap_fault(process_t* process, u32 address, bool write, bool user)
+{
+    if(!process->mmaps) return false;
+    address &= PAGE_FRAME_MASK;
+
+    area_lock(process);
+    vm_area_t* area = area_find(process, address);
+    bool tr = false;
+    if(area && (!(write && (!(area->prot & VK_PROT_WRITE)))))
+    {
+        u32* entry = get_page_entry(address, process->page_directory, false);
+        if((!entry) || (!*entry)) tr = area_fault_in(process, area, address, write, user);
+        else if(write && (!(*entry & PTE_WRITE))) tr = area_copy_on_write(process, area, address);
+        //already mapped by another thread
+        else tr = true;
+    }
+    mutex_unlock(&process->mmap_lock);
+    return tr;
+}
+
+/*
+* Check if 'address' is in a mapping of the process (even if its page was not faulted in yet)
+*/
+bool mmap_contains(process_t* process, u32 address)
+{
+    if(!process->mmaps) return false;
+    area_lock(process);
+    bool tr = (area_find(process, address) != 0);
+    mutex_unlock(&process->mmap_lock);
+    return tr;
+}
+
+/*
+* Map 'length' bytes of the file, from 'offset' (page aligned), in the process address space
+* With VK_MAP_ANONYMOUS, there is no file ('file' and 'offset' are ignored) : the mapping reads as zeroes
+* Returns the address of the mapping, or 0 on error ('err' set)
+*/
+u32 mmap(process_t* process, u32 addr, u32 length, u32 prot, u32 flags, fd_t* file, u32 offset, error_t* err)
+{
+    u32 type = flags & (VK_MAP_SHARED | VK_MAP_PRIVATE);
+    if((!length) || (offset & (PAGE_SIZE-1)) || ((type != VK_MAP_SHARED) && (type != VK_MAP_PRIVATE)))
+    {*err = ERROR_INVALID_ARGUMENT; return 0;}
+    if(length > MMAP_END - MMAP_BASE) {*err = ERROR_NO_MEMORY; return 0;}
+    length = (length + PAGE_SIZE-1) & PAGE_FRAME_MASK;
+
+    if(flags & VK_MAP_ANONYMOUS)
+    {
+        //fork copies the address space, so an anonymous mapping can't stay shared with the child
+        if(type == VK_MAP_SHARED) {*err = ERROR_INVALID_ARGUMENT; return 0;}
+        file = 0;
+        offset = 0;
+    }
+    else
+    {
+        //only regular files of the filesystems using the page cache can be mapped
+        fsnode_t* node = file->file;
+        if(node->attributes & FILE_ATTR_DIR) {*err = ERROR_FILE_IS_DIRECTORY; return 0;}
+        u8 fs_type = node->file_system->fs_type;
+        if((fs_type != FS_TYPE_FAT32) && (fs_type != FS_TYPE_EXT2) && (fs_type != FS_TYPE_ISO9660))
+        {*err = ERROR_FILE_UNSUPPORTED_FILE_SYSTEM; return 0;}
+        if((type == VK_MAP_SHARED) && (prot & VK_PROT_WRITE) && (node->file_system->flags & FS_FLAG_READ_ONLY))
+        {*err = ERROR_FILE_SYSTEM_READ_ONLY; return 0;}
+    }
+
+    area_lock(process);
+    if(flags & VK_MAP_FIXED)
+    {
+        if((addr & (PAGE_SIZE-1)) || (addr >= 0xC0000000) || (length > 0xC0000000 - addr))
+        {mutex_unlock(&process->mmap_lock); *err = ERROR_INVALID_ARGUMENT; return 0;}
+
+        //the mappings there are replaced, but not the rest of the address space (heap, stacks, ...)
+        areas_unmap(process, addr, addr+length, true);
+        if(range_used(process, addr, addr+length))
+        {mutex_unlock(&process->mmap_lock); *err = ERROR_NO_MEMORY; return 0;}
+    }
+    else addr = area_place(process, addr, length);
+
+    if(!addr) {mutex_unlock(&process->mmap_lock); *err = ERROR_NO_MEMORY; return 0;}
+
+    vm_area_t* area =
+    #ifdef MEMLEAK_DBG
+    kmalloc(sizeof(vm_area_t), "mmap area");
+    #else
+    kmalloc(sizeof(vm_area_t));
+    #endif
+    area->start = addr;
+    area->end = addr+length;
+    area->prot = prot;
+    area->flags = flags & ~((u32) VK_MAP_FIXED);
+    area->file = file;
+    if(file) file->instances++;
+    area->offset = offset;
+    area->pages.root = 0;
+    area->pages.height = 0;
+    area_insert(process, area);
+    mutex_unlock(&process->mmap_lock);
+
+    *err = ERROR_NONE;
+    return addr;
+}
+
+/*
+* Remove the mappings of [addr, addr+length[ ; the dirty pages of shared mappings are written back
+*/
+error_t munmap(process_t* process, u32 addr, u32 length)
+{
+    if((addr & (PAGE_SIZE-1)) || (!length) || (addr >= 0xC0000000) || (length > 0xC0000000 - addr)) return ERROR_INVALID_ARGUMENT;
+    length = (length + PAGE_SIZE-1) & PAGE_FRAME_MASK;
+
+    area_lock(process);
+    areas_unmap(process, addr, addr+length, true);
+    mutex_unlock(&process->mmap_lock);
+    return ERROR_NONE;
+}
+
+/*
+* Advice on the use of [addr, addr+length[ : with VK_MADV_DONTNEED, the pages are unmapped right away
+* (anonymous frames are freed, and read as zeroes again ; file pages are faulted in again from the file),
+* with VK_MADV_WILLNEED the file pages are read ahead ; the other advices are accepted and ignored
+*/
+error_t madvise(process_t* process, u32 addr, u32 length, u32 advice)
+{
+    if((addr & (PAGE_SIZE-1)) || (advice > VK_MADV_DONTNEED) || (addr >= 0xC0000000) || (length > 0xC0000000 - addr)) return ERROR_INVALID_ARGUMENT;
+    if((advice != VK_MADV_DONTNEED) && (advice != VK_MADV_WILLNEED)) return ERROR_NONE;
+    u32 end = (addr + length + PAGE_SIZE-1) & PAGE_FRAME_MASK;
+    if(end < addr) end = 0xC0000000;
+
+    area_lock(process);
+    vm_area_t* area = process->mmaps;
+    while(area && (area->start < end))
+    {
+        if(area->end <= addr) {area = area->next; continue;}
+
+        u32 from = (area->start > addr) ? area->start : addr;
+        u32 to = (area->end < end) ? area->end : end;
+        if(advice == VK_MADV_DONTNEED) area_unmap_pages(process, area, from, to);
+        else if(area->file) pagecache_readahead(area->file->file, area_file_index(area, from), (to - from) >> PAGE_SHIFT);
+        area = area->next;
+    }
+    mutex_unlock(&process->mmap_lock);
+    return ERROR_NONE;
+}
+
+/*
+* Flush the writes of the process to the shared mappings of [addr, addr+length[ into the page cache
+* With VK_MS_SYNC, the dirty pages are written back to the disk before returning (VK_MS_ASYNC leaves them to the flusher)
+*/
+error_t msync(process_t* process, u32 addr, u32 length, u32 flags)
+{
+    if((addr & (PAGE_SIZE-1)) || ((flags & VK_MS_SYNC) && (flags & VK_MS_ASYNC)) || (length > 0xC0000000 - addr)) return ERROR_INVALID_ARGUMENT;
+    u32 end = addr+length;
+
+    error_t tr = ERROR_NONE;
+    area_lock(process);
+    vm_area_t* area = process->mmaps;
+    while(area && (area->start < end))
+    {
+        if((area->end <= addr) || (!(area->flags & VK_MAP_SHARED)) || (!area->file)) {area = area->next; continue;}
+
+        u32 from = (area->start > addr) ? area->start : addr;
+        u32 to = (area->end < end) ? area->end : end;
+        bool dirty = false;
+        u32 page_addr;
+        for(page_addr = from; page_addr < to; page_addr += PAGE_SIZE)
+        {
+            cached_page_t* page = radix_tree_lookup(&area->pages, page_addr >> PAGE_SHIFT);
+            if(!page) continue;
+            u32* entry = get_page_entry(page_addr, process->page_directory, false);
+            if(!(*entry & PTE_DIRTY)) continue;
+
+            //clear the dirty bit first : a write from now on sets it again
+            *entry &= ~((u32) PTE_DIRTY);
+            invalidate_page(page_addr);
+            pagecache_set_dirty(page);
+            dirty = true;
+        }
+
+        if(dirty && (flags & VK_MS_SYNC))
+        {
+            error_t err = pagecache_writeback(area->file->file);
+            if(tr == ERROR_NONE) tr = err;
+        }
+        area = area->next;
+    }
+    mutex_unlock(&process->mmap_lock);
+    return tr;
+}
+
+/*
+* Give the child of a fork the mappings of the parent
+* The address space was copied before : the pages of the cache are mapped again in place of their copies,
+* so that shared mappings stay shared and private ones keep sharing the pages they did not write to
+*/
+void mmap_fork(process_t* parent, process_t* child)
+{
+    area_lock(parent);
+    vm_area_t** link = &child->mmaps;
+    vm_area_t* area = parent->mmaps;
+    while(area)
+    {
+        vm_area_t* copy =
+        #ifdef MEMLEAK_DBG
+        kmalloc(sizeof(vm_area_t), "mmap area");
+        #else
+        kmalloc(sizeof(vm_area_t));
+        #endif
+        memcpy(copy, area, sizeof(vm_area_t));
+        copy->pages.root = 0;
+        copy->pages.height = 0;
+        if(copy->file) copy->file->instances++;
+        copy->next = 0;
+        *link = copy;
+        link = &copy->next;
+
+        u32 addr;
+        for(addr = area->start; addr < area->end; addr += PAGE_SIZE)
+        {
+            u32* entry = get_page_entry(addr, child->page_directory, false);
+            if((!entry) || (!*entry)) continue;
+            u32* parent_entry = get_page_entry(addr, parent->page_directory, false);
+
+            cached_page_t* page = radix_tree_lookup(&area->pages, addr >> PAGE_SHIFT);
+            fsnode_t* node = page ? page->node : 0;
+            cached_page_t* held = 0;
+            error_t err = ERROR_NONE;
+            if(node) held = pagecache_get(node, page->index, &err);
+
+            if(held && (held == page))
+            {
+                free_block(*entry & PAGE_FRAME_MASK);
+                *entry = page_frame(page) | (*parent_entry & (PTE_PRESENT | PTE_WRITE | PTE_USER));
+                radix_tree_insert(&copy->pages, addr >> PAGE_SHIFT, page);
+                continue;
+            }
+            if(held) pagecache_put(held);
+
+            //the child keeps its own copy (the copy is writable)
+            if(!(area->prot & VK_PROT_WRITE)) *entry &= ~((u32) PTE_WRITE);
+        }
+        area = area->next;
+    }
+    mutex_unlock(&parent->mmap_lock);
+}
+
+/*
+* Remove every mapping of the process (exec/exit) ; this does not sleep, so the dirty pages are only marked dirty
+* in the cache, for the flusher to write them back
+*/
+void mmap_release(process_t* process)
+{
+    vm_area_t* area = process->mmaps;
+    while(area)
+    {
+        vm_area_t* next = area->next;
+        area_unmap_pages(process, area, area->start, area->end);
+        if(area->file) close_file(area->file);
+        kfree(area);
+        area = next;
+    }
+    process->mmaps = 0;
+}
@@ -19,6 +19,7 @@
 #include "error/error.h"
 #include "mem.h"
 #include "cpu/cpu.h"
+#include "tasking/task.h"
 
 /*
 * This file provides function to map physical memory at virtual adresses
@@ -31,7 +32,7 @@
 u32 kernel_page_directory[1024] __attribute__((aligned(4096))) = {0};
 u32 kernel_page_table[1024] __attribute__((aligned(4096))) = {0};
 
-u32* current_page_directory = kernel_page_directory;
+#define current_page_directory (get_current_cpu()->page_directory) //page directory loaded on the current cpu
 
 static void map_page(u32 phys_addr, u32 virt_addr, u32* page_directory);
 static void map_page_table(u32 phys_addr, u32 virt_addr, u32* page_directory);
@@ -84,11 +85,21 @@ u32* copy_adress_space(u32* page_directory)
             
             void* kbuffer = kmalloc(0x400000);
             
-            pd_switch(page_directory);
-            memcpy(kbuffer, (void*) (i << 22), 0x400000);
-            pd_switch(tr);
-            memcpy((void*) (i << 22), kbuffer, 0x400000);
-            pd_switch(cpd);
+            //we must not be scheduled while on another page directory (but interrupts can be served)
+            //the big page is copied 4K at a time, with a preemption point between each
+            u32 off;
+            for(off = 0; off < 0x400000; off += 4096)
+            {
+                preempt_disable();
+                pd_switch(page_directory);
+                memcpy(((u8*) kbuffer)+off, (void*) ((i << 22)+off), 4096);
+                pd_switch(tr);
+                memcpy((void*) ((i << 22)+off), ((u8*) kbuffer)+off, 4096);
+                pd_switch(cpd);
+                preempt_enable();
+                cond_resched();
+            }
+            kfree(kbuffer);
         }
         else
         {
@@ -106,13 +117,16 @@ u32* copy_adress_space(u32* page_directory)
                 
                 void* kbuffer = kmalloc(4096);
 
+                preempt_disable();
                 pd_switch(page_directory);
                 memcpy(kbuffer, (void*) ((i << 22)+(j<<12)), 4096);
                 pd_switch(tr);
                 memcpy((void*) ((i << 22)+(j<<12)), kbuffer, 4096);
                 pd_switch(cpd);
+                preempt_enable();
 
                 kfree(kbuffer);
+                cond_resched();
             }
         }
     }
@@ -431,3 +445,33 @@ bool is_mapped(u32 virt_addr, u32* page_directory)
     if(*page) return true;
     else return false;
 }
+
+/*
+* Get the page table entry of a user virtual address, creating its page table if needed and 'create' is set
+* Returns 0 if there is no page table, or if the address is in a 4MiB page
+*/
+u32* get_page_entry(u32 virt_addr, u32* page_directory, bool create)
+{
+    u32 pd_index = virt_addr >> 22;
+    u32 pt_index = virt_addr >> 12 & 0x03FF;
+
+    u32 page_table = page_directory[pd_index];
+    if(!page_table)
+    {
+        if(!create) return 0;
+        page_table = ((u32) pt_alloc()) - KERNEL_VIRTUAL_BASE;
+        memset((void*) (page_table + KERNEL_VIRTUAL_BASE), 0, 4096);
+        page_directory[pd_index] = page_table | 7; //present, read/write, user
+    }
+    else if(page_table & PD_BIT_4KB_PAGE) return 0;
+
+    return ((u32*) ((page_table & PD_ADDRESS_MASK) + KERNEL_VIRTUAL_BASE)) + pt_index;
+}
+
+/*
+* Flush the TLB entry of a virtual address (of the current page directory)
+*/
+void invalidate_page(u32 virt_addr)
+{
+    asm volatile("invlpg (%0)"::"r"(virt_addr):"memory");
+}
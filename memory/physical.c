@@ -18,6 +18,7 @@
 #include "system.h"
 #include "mem.h"
 #include "error/error.h"
+#include "sync/sync.h"
 
 /*
 * This file has the goal to trace the physical memory and to gets avaible blocks of it
@@ -26,6 +27,7 @@
 p_block_t* first_block = 0;
 u64 detected_memory = 0;
 u32 detected_memory_below32;
+spinlock_t physmem_lock = {0};
 
 void physmem_get(multiboot_info_t* mbt)
 {
@@ -96,18 +98,20 @@ u32 get_free_mem()
 u32 reserve_block(u32 size, u8 type)
 {
     alignup(size, 4096);
+    //the new block is allocated before taking the lock (kmalloc() could need to expand the heap, so to reserve physical memory)
+    p_block_t* newblock = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(sizeof(p_block_t), "physical memory new block (reserve_block)");
+    #else
+    kmalloc(sizeof(p_block_t));
+    #endif
+    spin_lock(&physmem_lock);
     p_block_t* curr = first_block;
     while(curr)
     {
         if(curr->base_addr >= 0x100000 && curr->type == PHYS_FREE_BLOCK_TYPE)
         {
             if(curr->size < size) {curr = curr->next; continue;}
-            p_block_t* newblock = 
-            #ifdef MEMLEAK_DBG
-            kmalloc(sizeof(p_block_t), "physical memory new block (reserve_block)");
-            #else
-            kmalloc(sizeof(p_block_t));
-            #endif
             p_block_t* next = curr->next;
             newblock->base_addr = curr->base_addr+size;
             newblock->size = curr->size-size;
@@ -118,10 +122,12 @@ u32 reserve_block(u32 size, u8 type)
             curr->size = size;
             curr->next = newblock;
             curr->type = type;
+            spin_unlock(&physmem_lock);
             return curr->base_addr;
         }
         curr = curr->next;
     }
+    spin_unlock(&physmem_lock);
     fatal_kernel_error("Trying to reserve more physical memory than available", "RESERVE_BLOCK");
     return 0;
 }
@@ -201,6 +207,7 @@ u32 reserve_specific(u32 addr, u32 size, u8 type)
 
 void free_block(u32 base_addr)
 {
+    spin_lock(&physmem_lock);
     p_block_t* curr = first_block;
     while(curr)
     {
@@ -233,10 +240,12 @@ void free_block(u32 base_addr)
                 kfree(m);
                 m = curr->next;
             }
+            spin_unlock(&physmem_lock);
             return;
         }
         curr = curr->next;
     }
+    spin_unlock(&physmem_lock);
     fatal_kernel_error("Trying to free an unknown block", "FREE_BLOCK");
 }
 
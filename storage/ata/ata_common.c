@@ -295,6 +295,7 @@ static block_device_t* ata_identify_drive(u16 base_port, u16 control_port, u16 b
 	/* init device mutex */
 	current->mutex = kmalloc(sizeof(mutex_t));
 	memset(current->mutex, 0, sizeof(mutex_t));
+	lock_set_class(current->mutex, "ata drive");
 
 	return current_top;
 }
@@ -0,0 +1,177 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sync.h"
+#include "tasking/task.h"
+#include "memory/mem.h"
+
+/*
+* Futexes : a user thread sleeps until another one wakes it up on the same memory word
+* The waiters are keyed by the physical address of the word (so processes sharing the page share the futex),
+* and queued (by their thread wait node) on a bucket chosen by hashing the key
+* Userland only calls the kernel on contention : the uncontended path is an atomic operation on the word
+*/
+
+#define FUTEX_BUCKETS 64
+#define FUTEX_HASH(key) ((((key) >> 2) ^ ((key) >> 12)) % FUTEX_BUCKETS)
+#define FUTEX_NODE_THREAD(node) ((thread_t*) (((u8*) (node)) - __builtin_offsetof(thread_t, wait)))
+
+static wait_queue_t futex_buckets[FUTEX_BUCKETS] = {{0}};
+
+/*
+* Get the key of a futex of the current process (0 if the address is invalid)
+* A page of a memory mapping may not be there yet, or still be shared copy-on-write (the next write moves the word
+* to a private frame) : it is faulted in writable first, so that the key is the frame the word lives in
+*/
+static u32 futex_key(u32* uaddr)
+{
+    if(((u32) uaddr) % sizeof(u32)) return 0;
+    if(((u32) uaddr) >= 0xC0000000) return 0;
+
+    process_t* process = current_process;
+    //a read-only mapping can't be written by anyone through it : its page is the key
+    if(process->mmaps && (!mmap_fault(process, (u32) uaddr, true, false))) mmap_fault(process, (u32) uaddr, false, false);
+    return get_physical((u32) uaddr, process->page_directory);
+}
+
+/*
+* Sleep on the futex if it still contains 'value'
+* Returns ERROR_WOULD_BLOCK if the value changed
+*/
+error_t futex_wait(u32* uaddr, u32 value)
+{
+    u32 key = futex_key(uaddr);
+    if(!key) return ERROR_INVALID_PTR;
+    wait_queue_t* bucket = &futex_buckets[FUTEX_HASH(key)];
+
+    process_t* process = current_process;
+    thread_t* thread = process->active_thread;
+
+    //the value is checked under the bucket lock : the waker changes it before taking the lock, so the wakeup can't be lost
+    spin_lock(&bucket->lock);
+    if(*((volatile u32*) uaddr) != value) {spin_unlock(&bucket->lock); return ERROR_WOULD_BLOCK;}
+
+    thread->futex_key = key;
+    thread->wait.process = process;
+    thread->wait.exclusive = true;
+    wait_link(bucket, &thread->wait, 0);
+    thread->status = THREAD_STATUS_ASLEEP_FUTEX;
+    spin_unlock(&bucket->lock);
+
+    scheduler_remove_thread(process, thread);
+    wait_remove(&thread->wait);
+    return ERROR_NONE;
+}
+
+/*
+* Unlink up to 'count' waiters of 'key' from the bucket, and chain them on 'woken' (bucket lock must be held)
+*/
+static u32 futex_collect(wait_queue_t* bucket, u32 key, u32 count, wait_node_t** woken)
+{
+    u32 tr = 0;
+    wait_node_t* node = bucket->head;
+    while(node && (tr < count))
+    {
+        wait_node_t* next = node->next;
+        if(FUTEX_NODE_THREAD(node)->futex_key == key)
+        {
+            wait_unlink(bucket, node);
+            node->next = *woken;
+            *woken = node;
+            tr++;
+        }
+        node = next;
+    }
+    return tr;
+}
+
+/*
+* Wake up the threads chained by futex_collect()
+*/
+static void futex_wake_chain(wait_node_t* woken)
+{
+    while(woken)
+    {
+        wait_node_t* next = woken->next;
+        scheduler_add_thread(woken->process, FUTEX_NODE_THREAD(woken));
+        woken = next;
+    }
+}
+
+/*
+* Wake up to 'count' threads waiting on the futex
+* Returns the number of threads woken up
+*/
+u32 futex_wake(u32* uaddr, u32 count)
+{
+    u32 key = futex_key(uaddr);
+    if(!key) return 0;
+    wait_queue_t* bucket = &futex_buckets[FUTEX_HASH(key)];
+
+    wait_node_t* woken = 0;
+    spin_lock(&bucket->lock);
+    u32 tr = futex_collect(bucket, key, count, &woken);
+    spin_unlock(&bucket->lock);
+
+    futex_wake_chain(woken);
+    return tr;
+}
+
+/*
+* Wake up to 'count' threads waiting on the futex, and move up to 'requeue' other waiters to 'uaddr2'
+* (so that a condition variable broadcast does not wake up every waiter just to have them sleep on the mutex)
+*/
+error_t futex_requeue(u32* uaddr, u32 count, u32* uaddr2, u32 requeue, u32* woken_count)
+{
+    u32 key = futex_key(uaddr);
+    u32 key2 = futex_key(uaddr2);
+    if((!key) || (!key2)) return ERROR_INVALID_PTR;
+    wait_queue_t* bucket = &futex_buckets[FUTEX_HASH(key)];
+    wait_queue_t* bucket2 = &futex_buckets[FUTEX_HASH(key2)];
+
+    //buckets are always locked in the same order
+    wait_queue_t* first = (bucket < bucket2) ? bucket : bucket2;
+    wait_queue_t* second = (bucket < bucket2) ? bucket2 : bucket;
+    spin_lock(&first->lock);
+    if(second != first) spin_lock(&second->lock);
+
+    wait_node_t* woken = 0;
+    *woken_count = futex_collect(bucket, key, count, &woken);
+
+    //move the remaining waiters to the second futex
+    wait_node_t* node = bucket->head;
+    while(node && requeue)
+    {
+        wait_node_t* next = node->next;
+        thread_t* thread = FUTEX_NODE_THREAD(node);
+        if(thread->futex_key == key)
+        {
+            wait_unlink(bucket, node);
+            thread->futex_key = key2;
+            node->exclusive = true;
+            wait_link(bucket2, node, 0);
+            requeue--;
+        }
+        node = next;
+    }
+
+    if(second != first) spin_unlock(&second->lock);
+    spin_unlock(&first->lock);
+
+    futex_wake_chain(woken);
+    return ERROR_NONE;
+}
@@ -0,0 +1,190 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sync.h"
+#include "time/time.h"
+#include "cpu/cpu.h"
+#include "memory/mem.h"
+
+/*
+* Lock statistics : every lock class counts its acquisitions and contentions, and sums the time
+* spent waiting for and holding its locks (exported in /dev/lockstat)
+* Only built with LOCKSTAT, so that normal kernels don't pay for the timestamps
+*/
+
+#ifdef LOCKSTAT
+
+#define LOCKSTAT_LINE_SIZE 128
+
+static lock_class_t* lock_classes = 0;
+static spinlock_t lock_classes_lock = {0};
+
+/*
+* Get the current lockstat clock value (TSC cycles, or microseconds if the TSC is not calibrated)
+*/
+u64 lockstat_now(void)
+{
+    if(!tsc_per_us) return get_uptime_us();
+
+    u64 tsc;
+    asm volatile("rdtsc":"=A"(tsc));
+    return tsc;
+}
+
+/*
+* Add the class to the exported list the first time one of its locks is used
+*/
+static void lockstat_register(lock_class_t* class)
+{
+    if(class->registered) return;
+
+    u32 flags = spin_lock_irqsave(&lock_classes_lock);
+    if(!class->registered)
+    {
+        class->next = lock_classes;
+        lock_classes = class;
+        class->registered = true;
+    }
+    spin_unlock_irqrestore(&lock_classes_lock, flags);
+}
+
+/*
+* A lock of the class was acquired
+*/
+void lockstat_acquire(lock_class_t* class)
+{
+    if(!class) return;
+    lockstat_register(class);
+
+    u32 flags = spin_lock_irqsave(&class->lock);
+    class->acquisitions++;
+    spin_unlock_irqrestore(&class->lock, flags);
+}
+
+/*
+* A lock of the class was found taken
+*/
+void lockstat_contend(lock_class_t* class)
+{
+    if(!class) return;
+    lockstat_register(class);
+
+    u32 flags = spin_lock_irqsave(&class->lock);
+    class->contentions++;
+    spin_unlock_irqrestore(&class->lock, flags);
+}
+
+/*
+* Account the time waited since start (a lockstat_now() value) for a lock of the class
+*/
+void lockstat_wait(lock_class_t* class, u64 start)
+{
+    if(!class) return;
+    u64 now = lockstat_now();
+    u64 elapsed = (now > start) ? (now - start) : 0; //the clock changes unit when the TSC gets calibrated
+
+    u32 flags = spin_lock_irqsave(&class->lock);
+    class->wait_total += elapsed;
+    if(elapsed > class->wait_max) class->wait_max = elapsed;
+    spin_unlock_irqrestore(&class->lock, flags);
+}
+
+/*
+* Account the time a lock of the class was held since start
+*/
+void lockstat_hold(lock_class_t* class, u64 start)
+{
+    if(!class) return;
+    u64 now = lockstat_now();
+    u64 elapsed = (now > start) ? (now - start) : 0;
+
+    u32 flags = spin_lock_irqsave(&class->lock);
+    class->hold_total += elapsed;
+    if(elapsed > class->hold_max) class->hold_max = elapsed;
+    spin_unlock_irqrestore(&class->lock, flags);
+}
+
+/*
+* Append a value of the lockstat clock to the line, in microseconds
+*/
+static void lockstat_put_time(char* line, u64 value)
+{
+    char number[12];
+    u32 us = tsc_per_us ? time_div64(value, tsc_per_us, 0) : (u32) value;
+    utoa(us, (unsigned char*) number);
+    strcat(line, " ");
+    strcat(line, number);
+}
+
+/*
+* Copy the report (one line per class : name, acquisitions, contentions, total/max wait and total/max hold in us),
+* starting at offset ; returns the number of bytes copied
+*/
+u32 lockstat_read(u32 offset, void* buffer, u32 count)
+{
+    u32 classes = 1;
+    u32 flags = spin_lock_irqsave(&lock_classes_lock);
+    lock_class_t* class = lock_classes;
+    while(class) {classes++; class = class->next;}
+    spin_unlock_irqrestore(&lock_classes_lock, flags);
+
+    //classes are never removed, so the list can be walked without the lock once counted
+    char* report =
+    #ifdef MEMLEAK_DBG
+    kmalloc(classes*LOCKSTAT_LINE_SIZE, "lockstat report");
+    #else
+    kmalloc(classes*LOCKSTAT_LINE_SIZE);
+    #endif
+    strcpy(report, "class acquisitions contentions wait_total wait_max hold_total hold_max\n");
+    class = lock_classes;
+    u32 i;
+    for(i = 1; (i < classes) && class; i++, class = class->next)
+    {
+        char line[LOCKSTAT_LINE_SIZE];
+        char number[12];
+        strcpy(line, class->name);
+
+        flags = spin_lock_irqsave(&class->lock);
+        lock_class_t snap = *class;
+        spin_unlock_irqrestore(&class->lock, flags);
+
+        utoa(snap.acquisitions, (unsigned char*) number); strcat(line, " "); strcat(line, number);
+        utoa(snap.contentions, (unsigned char*) number); strcat(line, " "); strcat(line, number);
+        lockstat_put_time(line, snap.wait_total);
+        lockstat_put_time(line, snap.wait_max);
+        lockstat_put_time(line, snap.hold_total);
+        lockstat_put_time(line, snap.hold_max);
+        strcat(line, "\n");
+        strcat(report, line);
+    }
+
+    u32 length = strlen(report);
+    u32 copied = 0;
+    if(offset < length)
+    {
+        copied = length - offset;
+        if(copied > count) copied = count;
+        memcpy(buffer, report+offset, copied);
+    }
+    //terminate the text for readers that don't check the count
+    if(copied < count) memset(((u8*) buffer)+copied, 0, count-copied);
+
+    kfree(report);
+    return copied;
+}
+
+#endif
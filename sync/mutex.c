@@ -18,31 +18,62 @@
 #include "sync.h"
 #include "tasking/task.h"
 
+/*
+* Get the thread running on the current cpu, used as the mutex owner (called by mutex_lock()/mutex_unlock())
+*/
+thread_t* mutex_current_thread(void)
+{
+    process_t* process = current_process;
+    return process ? process->active_thread : 0;
+}
+
+/*
+* Put the current thread to sleep until the mutex is released
+* The caller must then try to lock the mutex again
+*/
 void mutex_wait(mutex_t* mutex)
 {
-    //adding to the waiting list
-    list_entry_t** ptr = &mutex->waiting;
-    while(*(ptr)) ptr = &(*ptr)->next;
-    (*ptr) = kmalloc(sizeof(list_entry_t));
-    void** element = kmalloc(sizeof(void*)*2);
-    element[0] = current_process;
-    element[0] = current_process->active_thread;
-    (*ptr)->element = element;
-    (*ptr)->next = 0;
-
-    current_process->active_thread->status = THREAD_STATUS_ASLEEP_MUTEX;
-    scheduler_remove_thread(current_process, current_process->active_thread);
+    #ifdef LOCKSTAT
+    u64 start = lockstat_now();
+    #endif
+
+    //exclusive wait : only one waiter is woken up on release
+    wait_prepare(&mutex->waiting, true, THREAD_STATUS_ASLEEP_MUTEX);
+
+    //the mutex was released before we were queued, no need to sleep
+    if(!mutex->locked_by) wait_cancel(&mutex->waiting);
+    else wait_sleep();
+
+    #ifdef LOCKSTAT
+    lockstat_wait(mutex->class, start);
+    #endif
 }
 
+/*
+* Release the mutex and wake up the first thread waiting for it (called by mutex_unlock())
+*/
 void mutex_unlock_wakeup(mutex_t* mutex)
 {
-    //waking up first waiting list element and removing it from list
-    if(!mutex->waiting) return;
-    
-    void** tw = mutex->waiting->element;
-    list_entry_t* ptr = mutex->waiting;
-    mutex->waiting = mutex->waiting->next;
-    kfree(ptr);
-
-    scheduler_add_thread(tw[0], tw[1]);
+    #ifdef LOCKSTAT
+    lockstat_hold(mutex->class, mutex->stamp);
+    #endif
+
+    mutex->locked_by = 0;
+    wake_up_one(&mutex->waiting);
+}
+
+#ifdef LOCKSTAT
+/*
+* Statistics hooks, called by mutex_lock() (asm)
+*/
+void lockstat_mutex_acquired(mutex_t* mutex)
+{
+    mutex->stamp = lockstat_now();
+    lockstat_acquire(mutex->class);
+}
+
+void lockstat_mutex_contended(mutex_t* mutex)
+{
+    lockstat_contend(mutex->class);
 }
+#endif
@@ -15,55 +15,59 @@
     along with VK.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-.extern current_process
+.extern mutex_current_thread
 .extern mutex_unlock_wakeup
+.ifdef LOCKSTAT
+.extern lockstat_mutex_acquired
+.extern lockstat_mutex_contended
+.endif
 .global mutex_lock
 mutex_lock:
-    /* get argument (mutex pointer) into eax */
-    mov 4(%esp), %eax
-    
-    /* clear interrupts to lock the mutex, and cache flags in edx */
-    pushf
-    popl %edx
-    cli
-    movl (%eax), %ecx # move the process into ecx
-    
-    /* check if mutex is already locked by current process, if so return good */
-    cmp %ecx, current_process
-    je lock_end
+    /* get current thread into ecx */
+    call mutex_current_thread
+    movl %eax, %ecx
 
-    /* check if mutex is locked by another process (!=0), if so return bad */
-    test %ecx, %ecx
-    jnz lock_end_bad
+    /* get argument (mutex pointer) into edx */
+    mov 4(%esp), %edx
 
-    /* lock the mutex : put current process addr in struct */
-    movl current_process, %ecx
-    movl %ecx, (%eax)
+    /* atomically lock the mutex if it is free : put current thread addr in struct */
+    xorl %eax, %eax
+    lock cmpxchgl %ecx, (%edx)
+    jz lock_acquired
 
-    lock_end:
-    test $0x200, %edx
-    jz no_int
+    /* check if mutex is already locked by current thread (eax = owner), if so return good */
+    cmpl %eax, %ecx
+    je lock_end
 
-    sti
-    
-    no_int:
-    movl $0, %eax
+    /* mutex is locked by another thread, return bad */
+.ifdef LOCKSTAT
+    pushl %edx
+    call lockstat_mutex_contended
+    addl $0x4, %esp
+.endif
+    movl $31, %eax
     ret
 
-    lock_end_bad:
-    sti
-    movl $31, %eax 
+    /* mutex was free and is now ours : start the hold time */
+    lock_acquired:
+.ifdef LOCKSTAT
+    pushl %edx
+    call lockstat_mutex_acquired
+    addl $0x4, %esp
+.endif
+    lock_end:
+    movl $0, %eax
     ret
 
 .global mutex_unlock
 mutex_unlock:
+    call mutex_current_thread
+    movl %eax, %ecx
     mov 4(%esp), %eax
-    movl (%eax), %ecx
-    cmpl %ecx, current_process
+    cmpl (%eax), %ecx
     jne unlock_end_bad
-    movl $0, (%eax)
 
-    # waking up other processes
+    # releasing the mutex and waking up other threads
     pushl %eax
     call mutex_unlock_wakeup
     addl $0x4, %esp
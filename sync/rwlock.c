@@ -0,0 +1,164 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sync.h"
+#include "tasking/task.h"
+
+/*
+* Reader-writer locks : readers share the lock, a writer holds it alone
+* Writers have preference : once a writer waits, new readers wait behind it (so rare writes can't starve)
+* The lock can sleep, so it must not be taken in interrupt handlers ; read sections must not nest
+*/
+
+/*
+* Can a reader take the lock now ? (rwlock->lock must be held)
+*/
+static bool read_blocked(rwlock_t* rwlock)
+{
+    return rwlock->writer || rwlock->writers_waiting;
+}
+
+/*
+* Can a writer take the lock now ? (rwlock->lock must be held)
+*/
+static bool write_blocked(rwlock_t* rwlock)
+{
+    return rwlock->writer || rwlock->readers;
+}
+
+/*
+* Take the lock for reading
+*/
+void read_lock(rwlock_t* rwlock)
+{
+    #ifdef LOCKSTAT
+    bool contended = false;
+    u64 start = 0;
+    #endif
+
+    while(1)
+    {
+        spin_lock(&rwlock->lock);
+        if(!read_blocked(rwlock))
+        {
+            #ifdef LOCKSTAT
+            //read hold time goes from the first reader in to the last reader out
+            if(!rwlock->readers) rwlock->stamp = lockstat_now();
+            #endif
+            rwlock->readers++;
+            spin_unlock(&rwlock->lock);
+
+            #ifdef LOCKSTAT
+            lockstat_acquire(rwlock->class);
+            if(contended) lockstat_wait(rwlock->class, start);
+            #endif
+            return;
+        }
+        spin_unlock(&rwlock->lock);
+
+        #ifdef LOCKSTAT
+        if(!contended) {contended = true; start = lockstat_now(); lockstat_contend(rwlock->class);}
+        #endif
+
+        //queue before checking again, so that the wakeup can't be lost
+        wait_prepare(&rwlock->read_queue, false, THREAD_STATUS_ASLEEP_MUTEX);
+        spin_lock(&rwlock->lock);
+        bool blocked = read_blocked(rwlock);
+        spin_unlock(&rwlock->lock);
+        if(blocked) wait_sleep();
+        else wait_cancel(&rwlock->read_queue);
+    }
+}
+
+/*
+* Release the lock taken for reading ; the last reader lets a waiting writer in
+*/
+void read_unlock(rwlock_t* rwlock)
+{
+    spin_lock(&rwlock->lock);
+    rwlock->readers--;
+    bool wake = (!rwlock->readers) && rwlock->writers_waiting;
+    #ifdef LOCKSTAT
+    bool last = !rwlock->readers;
+    u64 stamp = rwlock->stamp;
+    #endif
+    spin_unlock(&rwlock->lock);
+
+    #ifdef LOCKSTAT
+    if(last) lockstat_hold(rwlock->class, stamp);
+    #endif
+
+    if(wake) wake_up_one(&rwlock->write_queue);
+}
+
+/*
+* Take the lock for writing
+*/
+void write_lock(rwlock_t* rwlock)
+{
+    spin_lock(&rwlock->lock);
+    rwlock->writers_waiting++;
+
+    #ifdef LOCKSTAT
+    bool contended = write_blocked(rwlock);
+    u64 start = lockstat_now();
+    if(contended) lockstat_contend(rwlock->class);
+    #endif
+
+    while(write_blocked(rwlock))
+    {
+        spin_unlock(&rwlock->lock);
+
+        wait_prepare(&rwlock->write_queue, true, THREAD_STATUS_ASLEEP_MUTEX);
+        spin_lock(&rwlock->lock);
+        bool blocked = write_blocked(rwlock);
+        spin_unlock(&rwlock->lock);
+        if(blocked) wait_sleep();
+        else wait_cancel(&rwlock->write_queue);
+
+        spin_lock(&rwlock->lock);
+    }
+    rwlock->writers_waiting--;
+    rwlock->writer = true;
+    #ifdef LOCKSTAT
+    rwlock->stamp = lockstat_now();
+    #endif
+    spin_unlock(&rwlock->lock);
+
+    #ifdef LOCKSTAT
+    lockstat_acquire(rwlock->class);
+    if(contended) lockstat_wait(rwlock->class, start);
+    #endif
+}
+
+/*
+* Release the lock taken for writing : the next writer goes first, else every waiting reader
+*/
+void write_unlock(rwlock_t* rwlock)
+{
+    #ifdef LOCKSTAT
+    lockstat_hold(rwlock->class, rwlock->stamp);
+    #endif
+
+    spin_lock(&rwlock->lock);
+    rwlock->writer = false;
+    bool writers = (rwlock->writers_waiting != 0);
+    spin_unlock(&rwlock->lock);
+
+    if(writers) wake_up_one(&rwlock->write_queue);
+    else wake_up_all(&rwlock->read_queue);
+}
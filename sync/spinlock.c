@@ -0,0 +1,101 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sync.h"
+#include "cpu/cpu.h"
+
+/*
+* Ticket spinlocks : each cpu takes a ticket (next++) and waits for owner to reach it,
+* so the lock is granted in order and a cpu can't starve
+* Interrupts are disabled while the lock is held, so that we can't be scheduled
+* (or interrupted by a handler that wants the same lock) on this cpu
+*/
+
+/*
+* Take a spinlock, returning the interrupt flag state to restore on unlock
+*/
+u32 spin_lock_irqsave(spinlock_t* lock)
+{
+    u32 flags = irq_save();
+    u32 self = get_current_cpu()->index + 1;
+    if(lock->holder == self) fatal_kernel_error("Spinlock already held by this cpu", "SPIN_LOCK");
+
+    u32 ticket = atomic_xadd(&lock->next, 1);
+    while(lock->owner != ticket) asm volatile("pause":::"memory");
+
+    lock->holder = self;
+    return flags;
+}
+
+/*
+* Release a spinlock taken with spin_lock_irqsave(), restoring interrupt flag as it was
+*/
+void spin_unlock_irqrestore(spinlock_t* lock, u32 flags)
+{
+    lock->holder = 0;
+    //only the holder writes owner : no need for a locked instruction (x86 stores are not reordered with older ones)
+    asm volatile("":::"memory");
+    lock->owner = lock->owner + 1;
+    irq_restore(flags);
+}
+
+/*
+* Take a spinlock (the interrupt flag state is kept in the lock)
+*/
+void spin_lock(spinlock_t* lock)
+{
+    u32 flags = spin_lock_irqsave(lock);
+    lock->flags = flags;
+}
+
+/*
+* Release a spinlock, restoring interrupt flag as it was on spin_lock()
+*/
+void spin_unlock(spinlock_t* lock)
+{
+    spin_unlock_irqrestore(lock, lock->flags);
+}
+
+/*
+* Take a spinlock only if it is free, without waiting (the interrupt flag state is kept in the lock)
+*/
+bool spin_trylock(spinlock_t* lock)
+{
+    u32 flags = irq_save();
+    u32 ticket = lock->owner;
+    if(atomic_cmpxchg(&lock->next, ticket, ticket + 1) != ticket) {irq_restore(flags); return false;}
+
+    lock->holder = get_current_cpu()->index + 1;
+    lock->flags = flags;
+    return true;
+}
+
+/*
+* Is the spinlock held by the current cpu ?
+*/
+bool spin_is_held(spinlock_t* lock)
+{
+    return lock->holder == (get_current_cpu()->index + 1);
+}
+
+/*
+* Panic if the spinlock is not held by the current cpu (use spin_assert_held())
+*/
+void _spin_assert_held(spinlock_t* lock, char* file, u32 line)
+{
+    if(!spin_is_held(lock)) _fatal_kernel_error("Spinlock is not held", "SPIN_ASSERT_HELD", file, line);
+}
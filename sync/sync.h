@@ -2,14 +2,128 @@
 #define SYNC_HEAD
 #include "system.h"
 
+//interrupt flag save/restore (for short critical sections on the local cpu)
+static inline u32 irq_save(void) {u32 flags; asm volatile("pushf ; pop %0 ; cli":"=r"(flags)::"memory"); return flags;}
+static inline void irq_restore(u32 flags) {if(flags & 0x200) asm volatile("sti":::"memory");}
+
+//atomic operations (lock prefixed, so they are also full memory barriers)
+static inline u32 atomic_cmpxchg(volatile u32* ptr, u32 old, u32 new) {asm volatile("lock cmpxchgl %2, %1":"+a"(old), "+m"(*ptr):"r"(new):"memory"); return old;}
+static inline u32 atomic_xadd(volatile u32* ptr, u32 value) {asm volatile("lock xaddl %0, %1":"+r"(value), "+m"(*ptr)::"memory"); return value;}
+static inline u32 atomic_xchg(volatile u32* ptr, u32 value) {asm volatile("xchgl %0, %1":"+r"(value), "+m"(*ptr)::"memory"); return value;}
+static inline void atomic_or(volatile u32* ptr, u32 value) {asm volatile("lock orl %1, %0":"+m"(*ptr):"r"(value):"memory");}
+static inline void memory_barrier(void) {asm volatile("lock orl $0, (%%esp)":::"memory");}
+
+//spinlocks (ticket based so cpus get the lock in order, busy-waiting, interrupts disabled while held)
+typedef struct spinlock
+{
+    volatile u32 next; //next ticket to give
+    volatile u32 owner; //ticket of the cpu allowed to hold the lock
+    u32 flags; //interrupt flag state saved by spin_lock()
+    u32 holder; //index+1 of the cpu holding the lock (0 : free)
+} spinlock_t;
+
+void spin_lock(spinlock_t* lock);
+void spin_unlock(spinlock_t* lock);
+u32 spin_lock_irqsave(spinlock_t* lock);
+void spin_unlock_irqrestore(spinlock_t* lock, u32 flags);
+bool spin_trylock(spinlock_t* lock);
+bool spin_is_held(spinlock_t* lock);
+void _spin_assert_held(spinlock_t* lock, char* file, u32 line);
+#define spin_assert_held(lock) _spin_assert_held(lock, __FILE__, __LINE__)
+
+//wait queues (threads sleeping until an event ; the nodes are embedded in the threads, so waiting never allocates)
+typedef struct wait_node
+{
+    struct wait_node* next;
+    struct wait_node* prev;
+    struct wait_queue* queue; //queue the node is on (0 : not waiting)
+    struct PROCESS* process; //process of the waiting thread
+    bool exclusive; //exclusive waiters are woken up one at a time
+} wait_node_t;
+
+typedef struct wait_queue
+{
+    wait_node_t* head; //non-exclusive waiters first, then exclusive ones
+    wait_node_t* tail;
+    spinlock_t lock;
+} wait_queue_t;
+
+void wait_prepare(wait_queue_t* queue, bool exclusive, u32 status);
+void wait_sleep(void);
+void wait_cancel(wait_queue_t* queue);
+bool wait_remove(wait_node_t* node);
+void wait_link(wait_queue_t* queue, wait_node_t* node, wait_node_t* before);
+void wait_unlink(wait_queue_t* queue, wait_node_t* node);
+u32 wake_up(wait_queue_t* queue, u32 count);
+#define wake_up_one(queue) wake_up(queue, 1)
+#define wake_up_all(queue) wake_up(queue, 0)
+
+//lock statistics, per lock class (only collected when built with LOCKSTAT, see makefile)
+typedef struct lock_class
+{
+    const char* name;
+    u32 acquisitions;
+    u32 contentions; //attempts that found the lock taken
+    u64 wait_total; //time spent waiting for the lock, in cycles
+    u64 wait_max;
+    u64 hold_total; //time the lock was held, in cycles
+    u64 hold_max;
+    spinlock_t lock;
+    bool registered;
+    struct lock_class* next;
+} lock_class_t;
+
+#ifdef LOCKSTAT
+//every lock initialized at the same place shares the same class
+#define lock_set_class(lck, cname) do {static lock_class_t __lock_class = {.name = (cname)}; (lck)->class = &__lock_class;} while(0)
+u64 lockstat_now(void);
+void lockstat_acquire(lock_class_t* class);
+void lockstat_contend(lock_class_t* class);
+void lockstat_wait(lock_class_t* class, u64 start);
+void lockstat_hold(lock_class_t* class, u64 start);
+u32 lockstat_read(u32 offset, void* buffer, u32 count);
+#else
+#define lock_set_class(lck, cname)
+#endif
+
+//mutexes (sleeping)
 typedef struct mutex
 {
-    struct PROCESS* locked_by;
-    list_entry_t* waiting;
+    struct THREAD* locked_by; //owning thread (threads of a same process do not share the mutex)
+    wait_queue_t waiting;
+    #ifdef LOCKSTAT
+    lock_class_t* class;
+    u64 stamp; //time of acquisition
+    #endif
 } mutex_t;
 
 error_t mutex_lock(mutex_t* mutex);
 error_t mutex_unlock(mutex_t* mutex);
 void mutex_wait(mutex_t* mutex);
 
+//futexes (user space waits on a memory word, keyed by its physical address)
+error_t futex_wait(u32* uaddr, u32 value);
+u32 futex_wake(u32* uaddr, u32 count);
+error_t futex_requeue(u32* uaddr, u32 count, u32* uaddr2, u32 requeue, u32* woken);
+
+//reader-writer locks (sleeping, many readers or one writer ; waiting writers block new readers)
+typedef struct rwlock
+{
+    spinlock_t lock; //protects the counters
+    u32 readers; //number of readers holding the lock
+    bool writer; //a writer holds the lock
+    u32 writers_waiting;
+    wait_queue_t read_queue;
+    wait_queue_t write_queue;
+    #ifdef LOCKSTAT
+    lock_class_t* class;
+    u64 stamp; //time the lock went from free to held
+    #endif
+} rwlock_t;
+
+void read_lock(rwlock_t* rwlock);
+void read_unlock(rwlock_t* rwlock);
+void write_lock(rwlock_t* rwlock);
+void write_unlock(rwlock_t* rwlock);
+
 #endif
\ No newline at end of file
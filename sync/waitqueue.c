@@ -0,0 +1,165 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sync.h"
+#include "tasking/task.h"
+
+/*
+* Wait queues : a thread waiting for an event links the node embedded in its thread_t to the queue
+* To avoid lost wakeups, a waiter must :
+* - call wait_prepare() (the thread is queued and marked asleep)
+* - check the condition it waits for : if it is already true, call wait_cancel()
+* - else call wait_sleep() ; if the event happened in between, the thread won't sleep
+*/
+
+#define WAIT_NODE_THREAD(node) ((thread_t*) (((u8*) (node)) - __builtin_offsetof(thread_t, wait)))
+
+/*
+* Link a node in the queue, before 'before' (at the tail if 0) ; the queue lock must be held
+*/
+void wait_link(wait_queue_t* queue, wait_node_t* node, wait_node_t* before)
+{
+    spin_assert_held(&queue->lock);
+    node->queue = queue;
+    node->next = before;
+    node->prev = before ? before->prev : queue->tail;
+    if(node->prev) node->prev->next = node;
+    else queue->head = node;
+    if(before) before->prev = node;
+    else queue->tail = node;
+}
+
+/*
+* Unlink a node from the queue ; the queue lock must be held
+*/
+void wait_unlink(wait_queue_t* queue, wait_node_t* node)
+{
+    spin_assert_held(&queue->lock);
+    if(node->prev) node->prev->next = node->next;
+    else queue->head = node->next;
+    if(node->next) node->next->prev = node->prev;
+    else queue->tail = node->prev;
+    node->next = node->prev = 0;
+    node->queue = 0;
+}
+
+/*
+* Queue the current thread and mark it asleep with 'status' (it keeps running until wait_sleep())
+* Exclusive waiters are queued at the tail, the others at the head
+*/
+void wait_prepare(wait_queue_t* queue, bool exclusive, u32 status)
+{
+    process_t* process = current_process;
+    thread_t* thread = process->active_thread;
+    wait_node_t* node = &thread->wait;
+
+    spin_lock(&queue->lock);
+    node->process = process;
+    node->exclusive = exclusive;
+    wait_link(queue, node, exclusive ? 0 : queue->head);
+    thread->status = status;
+    spin_unlock(&queue->lock);
+
+    //the waker must see us queued before we check the condition (pairs with wake_up())
+    memory_barrier();
+}
+
+/*
+* Sleep until the current thread is woken up (after wait_prepare())
+*/
+void wait_sleep()
+{
+    process_t* process = current_process;
+    thread_t* thread = process->active_thread;
+    scheduler_remove_thread(process, thread);
+
+    //we could have been woken up by something else than the queue
+    wait_remove(&thread->wait);
+}
+
+/*
+* Don't sleep after all (after wait_prepare(), if the condition became true)
+*/
+void wait_cancel(wait_queue_t* queue)
+{
+    thread_t* thread = current_process->active_thread;
+
+    spin_lock(&queue->lock);
+    if(thread->wait.queue == queue) wait_unlink(queue, &thread->wait);
+    thread->status = THREAD_STATUS_RUNNING;
+    spin_unlock(&queue->lock);
+}
+
+/*
+* Remove a node from the queue it is on, if any
+* Returns true if the node was removed, false if it was not queued (or got woken up meanwhile)
+*/
+bool wait_remove(wait_node_t* node)
+{
+    wait_queue_t* queue;
+    while((queue = node->queue))
+    {
+        spin_lock(&queue->lock);
+        //the node could have been woken up (or moved to another queue) meanwhile
+        bool tr = (node->queue == queue);
+        if(tr) wait_unlink(queue, node);
+        spin_unlock(&queue->lock);
+        if(tr) return true;
+    }
+    return false;
+}
+
+/*
+* Wake up every non-exclusive waiter, and 'count' exclusive ones (all of them if 'count' is 0)
+* Returns the number of threads woken up
+*/
+u32 wake_up(wait_queue_t* queue, u32 count)
+{
+    //the condition must be visible before we look for waiters (pairs with wait_prepare())
+    memory_barrier();
+    if(!queue->head) return 0;
+
+    //unlink the nodes to wake up under the lock, and keep them in a local list
+    wait_node_t* woken = 0;
+    u32 exclusive_woken = 0;
+    spin_lock(&queue->lock);
+    wait_node_t* node = queue->head;
+    while(node)
+    {
+        //the exclusive waiters are at the tail : nothing more to wake up
+        if(node->exclusive && count && (exclusive_woken >= count)) break;
+        if(node->exclusive) exclusive_woken++;
+
+        wait_node_t* next = node->next;
+        wait_unlink(queue, node);
+        node->next = woken;
+        woken = node;
+        node = next;
+    }
+    spin_unlock(&queue->lock);
+
+    u32 tr = 0;
+    while(woken)
+    {
+        //the thread may wait again as soon as it is woken up
+        wait_node_t* next = woken->next;
+        scheduler_add_thread(woken->process, WAIT_NODE_THREAD(woken));
+        woken = next;
+        tr++;
+    }
+    return tr;
+}
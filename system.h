@@ -80,6 +80,7 @@ extern bool alive;
 extern char aroot_dir[5];
 extern u8 aboot_hint_present;
 extern bool asilent;
+extern u32 aicache_size; //unused nodes kept in each inode cache (-icache=<n>)
 
 typedef struct g_regs
 {
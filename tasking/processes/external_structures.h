@@ -51,4 +51,57 @@ typedef struct stat
     u32 st_blocks;
 } stat_t;
 
+typedef struct tms
+{
+    u32 tms_utime; //user time (clock ticks)
+    u32 tms_stime; //system time
+    u32 tms_cutime; //user time of waited children
+    u32 tms_cstime; //system time of waited children
+} tms_t;
+
+typedef struct timeval
+{
+    time_t tv_sec;
+    u32 tv_usec;
+} timeval_t;
+
+typedef struct rusage
+{
+    timeval_t ru_utime; //user time
+    timeval_t ru_stime; //system time
+} rusage_t;
+
+typedef struct futex_requeue
+{
+    u32 wake; //number of waiters to wake up
+    u32* uaddr2; //futex to move the other waiters to
+    u32 requeue; //maximum number of waiters to move
+} futex_requeue_t;
+
+typedef struct waitid_info
+{
+    u32 options; //VK_WNOHANG, VK_WNOWAIT
+    int pid; //pid of the child (0 if none exited, with VK_WNOHANG)
+    u32 status; //exit code, or signal number
+    u32 code; //VK_CLD_EXITED or VK_CLD_KILLED
+} waitid_info_t;
+
+typedef struct mmap_args
+{
+    u32 addr; //hint, or exact address with VK_MAP_FIXED
+    u32 length;
+    u32 prot; //VK_PROT_*
+    u32 flags; //VK_MAP_*
+    int fd; //ignored with VK_MAP_ANONYMOUS
+    u32 offset; //page aligned
+} mmap_args_t;
+
+typedef struct getdents_entry
+{
+    u32 d_ino;
+    u16 d_reclen; //size of the whole record (4 bytes aligned) : the next one starts d_reclen bytes after this one
+    u16 d_namlen; //name length, without the terminating 0
+    char d_name[]; //null terminated
+} getdents_entry_t;
+
 #endif
\ No newline at end of file
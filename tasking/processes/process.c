@@ -19,33 +19,36 @@
 #include "filesystem/fs.h"
 #include "memory/mem.h"
 #include "cpu/cpu.h"
+#include "syscalls.h"
 
 #define PROCESS_DEFAULT_THREADS_SIZE 3
 
-#define PROCESSES_ARRAY_SIZE 20
-process_t** processes = 0;
-u32 processes_size = 0;
+//pids : a bitmap of used pids, searched from a cursor (so that freed pids are not reused right away),
+//and a pid -> process hash table chained through process->pid_next
+#define PID_HASH_SIZE 256
+#define pid_hash(pid) (((u32) (pid)) & (PID_HASH_SIZE-1))
+static u32 pid_bitmap[PID_MAX/32] = {1}; //pid 0 is reserved
+static u32 pid_cursor = 1;
+static process_t* pid_table[PID_HASH_SIZE];
+static spinlock_t pid_lock = {0};
 
 process_t* kernel_process = 0;
-process_t* idle_process = 0;
 
 static process_t* init_process();
+static void sibling_link(process_t* parent, process_t* child);
+static void reparent_children(process_t* process, process_t* new_parent);
+static process_t* zombie_queue(process_t* process);
 
 /* init the process layer (called by kmain()) */
 void process_init()
 {
     kprintf("Initializing process layer...");
     
-    processes_size = PROCESSES_ARRAY_SIZE;
-    processes = kmalloc(processes_size*sizeof(process_t*));
-    memset(processes, 0, processes_size*sizeof(process_t*));
-
-    signals_init();
     groups_init();
 
     scheduler_init(); //Init scheduler
     init_kernel_process(); //Add kernel process as current_process (kernel init is not done yet)
-    init_idle_process(); //Add idle_process to the queue, so that if there is no process the kernel don't crash
+    idle_process = init_idle_process(); //Set idle_process of the BSP, so that if there is no process the kernel don't crash
 
     vga_text_okmsg();
 }
@@ -69,7 +72,7 @@ error_t load_executable(process_t* process, fd_t* executable, int argc, char** a
     {kfree(data_loc); return UNKNOWN_ERROR;}
 
     //that part is critical, we dont want the process to be scheduled from here
-    asm("cli");
+    u32 flags = irq_save();
 
     //TODO: check if this area isnt already mapped by elf code/data
     //URGENT : occurred while tweaking libc functions, 0xBFFFE000-0xC0000000 cannot always be the stack segment...
@@ -165,13 +168,14 @@ error_t load_executable(process_t* process, fd_t* executable, int argc, char** a
     process->active_thread->gregs.edi = process->active_thread->gregs.esi = process->active_thread->ebp = 0;
     process->active_thread->sregs.ds = process->active_thread->sregs.es = process->active_thread->sregs.fs = process->active_thread->sregs.gs = process->active_thread->sregs.ss = 0x23;
     process->active_thread->sregs.cs = 0x1B;
+    process->active_thread->tls_base = 0;
 
     //executable stack and code
     process->active_thread->esp = (u32) stack_offset;
     process->active_thread->eip = (u32) code_offset;
 
-    //re-enabling interrupts at end of critical part
-    asm("sti");
+    //restoring interrupts at end of critical part
+    irq_restore(flags);
 
     return ERROR_NONE;
 }
@@ -183,9 +187,10 @@ void exit_process(process_t* process, u32 exitcode)
     if(process->pid == 1) fatal_kernel_error("Init exited.", "EXIT_PROCESS");
 
     //we don't want the process to be scheduled on exiting.
-    asm("cli");
+    u32 flags = irq_save();
 
-    //TODO : remove non-handled signals from siglist
+    //forget the default actions that were not run yet
+    signal_cancel(process);
 
     free_process_memory(process);
 
@@ -196,20 +201,12 @@ void exit_process(process_t* process, u32 exitcode)
         if(process->files[i]) close_file(process->files[i]);
     }
 
-    //free process page directory
+    //free process page directory (switching to kernel one : another cpu could re-use it right now)
+    pd_switch(kernel_page_directory);
     pt_free(process->page_directory);
 
-    //free process children list
-    list_entry_t* cptr = process->children;
-    while(cptr)
-    {
-        process_t* cp = cptr->element;
-        cp->parent = processes[1]; //all children processes get attached to INIT
-
-        list_entry_t* tf = cptr;
-        cptr = cptr->next;
-        kfree(tf);
-    }
+    //all children processes get attached to INIT
+    if(process->children) reparent_children(process, get_process(1));
 
     //TODO : if process session leader, detach controling term + SIGHUP...
 
@@ -236,30 +233,29 @@ void exit_process(process_t* process, u32 exitcode)
     }
 
     /* we put retcode in EAX and the process is zombie */
-    process->status = PROCESS_STATUS_ZOMBIE;
-    process->active_thread->status = THREAD_STATUS_ZOMBIE;
     process->active_thread->gregs.eax = exitcode;
+    process->active_thread->status = THREAD_STATUS_ZOMBIE;
+    process->status = PROCESS_STATUS_ZOMBIE;
+
+    //killed by another one (it is already switched out) : take it off the schedulers now,
+    //the parent may reap and free it as soon as it is queued
+    bool self = (process == current_process);
+    if(!self) scheduler_remove_process(process);
     
-    if(process->parent)
+    //queue on the parent zombie list, then send SIGCHLD and wake up the parent if wait()
+    //(exiting itself, the process is kept alive by on_cpu until the scheduler switched out of it : wait() waits for that)
+    process_t* parent = zombie_queue(process);
+    if(parent)
     {
-        //send SIGCHLD to parent
-        send_signal(process->parent->pid, SIGCHLD);
-
-        //wake up parent if wait()
-        list_entry_t* wptr = process->parent->waiting_threads;
-        while(wptr)
-        {
-            thread_t* thread = wptr->element;
-            if(thread->status == THREAD_STATUS_ASLEEP_CHILD)
-                {scheduler_add_thread(process->parent, thread); break;}
-        }
+        send_signal(parent->pid, SIGCHLD);
+        wake_up_all(&parent->child_queue);
     }
 
-    //free process kernel stack
-    kfree((void*) process->active_thread->base_kstack);
+    //process kernel stack is freed by the scheduler, once switched out of it
+    if(self) scheduler_remove_process(process);
 
-    //remove process from schedulers
-    scheduler_remove_process(process);
+    //the process was killed by another one (we did not switch out)
+    irq_restore(flags);
 }
 
 /* free all memory used by a process (for exec() or exit()) */
@@ -280,6 +276,19 @@ void free_process_memory(process_t* process)
         waiting = waiting->next;
         kfree(tf);
     }
+    process->waiting_threads = 0;
+
+    //only the active thread remains
+    thread = process->threads;
+    while(thread)
+    {
+        thread_t* next = thread->next_thread;
+        if(thread != process->active_thread) kfree(thread);
+        thread = next;
+    }
+    process->threads = process->active_thread;
+    if(process->active_thread) process->active_thread->next_thread = 0;
+    process->thread_count = process->active_thread ? 1 : 0;
 
     //mark all data/code blocks reserved for the process as free
     if(process->data_loc)
@@ -309,6 +318,9 @@ void free_process_memory(process_t* process)
     kprintf("%lFREE_PROCESS_MEM: unmapping if 0x%X (size 0x%X).\n", 3, process->heap_addr, process->heap_size);
     #endif
     if(process->heap_size) unmap_memory_if_mapped(process->heap_size, process->heap_addr, process->page_directory);
+
+    //remove the memory mappings
+    mmap_release(process);
 }
 
 /* expands process allocated memory (heap) */
@@ -328,15 +340,27 @@ u32 sbrk(process_t* process, u32 incr)
     return old_last_addr; //return previous program break (specs)
 }
 
-/* create a new process by copying the current one */
+/* create a new process by copying the current one (returns 0 if no pid is left) */
 process_t* fork(process_t* old_process, u32 old_esp)
 {
     process_t* tr = init_process();
+    if(!tr) return 0;
 
     u32 base_kstack = tr->active_thread->base_kstack;
     //copy active thread from old process
     memcpy(tr->active_thread, old_process->active_thread, sizeof(thread_t));
     tr->active_thread->base_kstack = base_kstack;
+    fpu_copy(tr->active_thread, old_process->active_thread);
+    tr->active_thread->utime = tr->active_thread->stime = 0;
+    //the child only has a copy of the calling thread
+    tr->active_thread->next_thread = 0;
+    tr->active_thread->joined = false;
+    //pending signals are not inherited (the blocked mask is)
+    tr->active_thread->sigpending = 0;
+    tr->active_thread->sigreturn = 0;
+    memset(&tr->active_thread->join_queue, 0, sizeof(wait_queue_t));
+    tr->threads = tr->active_thread;
+    tr->next_tid = old_process->next_tid;
 
     //get own copy of data_loc
     tr->flags = old_process->flags;
@@ -355,6 +379,7 @@ process_t* fork(process_t* old_process, u32 old_esp)
     //get own adress space
     u32* page_directory = copy_adress_space(old_process->page_directory);
     tr->page_directory = page_directory;
+    mmap_fork(old_process, tr);
 
     //copy kernel stack
     memcpy((void*) base_kstack, (void*) old_process->active_thread->base_kstack, PROCESS_KSTACK_SIZE_DEFAULT);
@@ -379,6 +404,10 @@ process_t* fork(process_t* old_process, u32 old_esp)
         
         fd_t* toadd = kmalloc(sizeof(fd_t));
         memcpy(toadd, tocopy, sizeof(fd_t));
+        //the directory listing stays with the parent descriptor : the child takes its own at its next getdents
+        toadd->dir_list = 0; toadd->dir_size = 0; toadd->dir_next = 0; toadd->dir_next_index = 0; memset(&toadd->dir_lock, 0, sizeof(mutex_t));
+        toadd->instances = 1; //the copy is only in this slot
+        icache_hold(toadd->file);
         tr->files[i] = toadd;
     }
     
@@ -387,34 +416,31 @@ process_t* fork(process_t* old_process, u32 old_esp)
     return tr;
 }
 
-/* init a basic process_t, registering it in process list, and setting base signals */
+/* init a basic process_t, registering it in process list, and setting base signals (returns 0 if no pid is left) */
 static process_t* init_process()
 {
+    //register process in process list first : nothing else is set up if there is no pid left
+    //(the process is cleared before, as it can be found by its pid from now on)
     process_t* tr = kmalloc(sizeof(process_t));
+    memset(tr, 0, sizeof(process_t));
+    if(pid_alloc(tr) == PROCESS_INVALID_PID) {kfree(tr); return 0;}
+
     tr->status = PROCESS_STATUS_INIT;
+    tr->cpu = get_current_cpu()->index;
+    tr->on_cpu = tr->queued = false;
+    memset(&tr->lock, 0, sizeof(spinlock_t));
+    tr->utime = tr->stime = tr->cutime = tr->cstime = 0;
 
     //process main thread
     tr->running_threads = queue_init(PROCESS_DEFAULT_THREADS_SIZE);
     tr->active_thread = 0;
     tr->waiting_threads = 0;
     thread_t* t = init_thread();
+    tr->threads = t;
+    tr->thread_count = 1;
+    tr->next_tid = 1;
     scheduler_add_thread(tr, t);
 
-    //register process in process list
-    tr->pid = PROCESS_INVALID_PID;
-    int j = 1; // pid 0 is reserved
-    for(;j<(int) processes_size;j++)
-    {
-        if(!processes[j]) {processes[j] = tr; tr->pid = j; break;}
-    }
-
-    if(tr->pid == PROCESS_INVALID_PID)
-    {
-        processes_size*=2;
-        processes = krealloc(processes, processes_size*sizeof(process_t*));
-        processes[j+1] = tr; tr->pid = (j+1);
-    }
-
     //register process in a group and session
     if((current_process) && (current_process != kernel_process)) 
     {
@@ -429,21 +455,285 @@ static process_t* init_process()
     }
 
     //register as children of current process
-    tr->children = 0;
+    tr->children = tr->zombies = tr->zombies_tail = 0;
+    tr->sibling_next = tr->sibling_prev = tr->zombie_next = tr->zombie_prev = 0;
+    tr->exited_children = 0;
+    tr->sigpending = tr->sigdefault = 0;
+    tr->signal_next = 0;
+    tr->signal_queued = false;
+    memset(&tr->children_lock, 0, sizeof(spinlock_t));
+    memset(&tr->child_queue, 0, sizeof(wait_queue_t));
+    tr->parent = 0;
+    tr->mmaps = 0;
+    memset(&tr->mmap_lock, 0, sizeof(mutex_t));
+    lock_set_class(&tr->mmap_lock, "process mappings");
     if(current_process && current_process != kernel_process)
     {
-        list_entry_t** child = &current_process->children;
-        while(*(child)) child = &(*child)->next;
-        (*child) = kmalloc(sizeof(list_entry_t));
-        (*child)->element = tr;
-        (*child)->next = 0;
-        tr->parent = current_process;
+        u32 cflags = spin_lock_irqsave(&current_process->children_lock);
+        sibling_link(current_process, tr);
+        spin_unlock_irqrestore(&current_process->children_lock, cflags);
     }
-    else tr->parent = 0;
 
     return tr;
 }
 
+/* Children and zombies */
+
+/*
+* Add the child in front of the parent children list (parent->children_lock must be held)
+*/
+static void sibling_link(process_t* parent, process_t* child)
+{
+    child->parent = parent;
+    child->sibling_prev = 0;
+    child->sibling_next = parent->children;
+    if(parent->children) parent->children->sibling_prev = child;
+    parent->children = child;
+}
+
+/*
+* Remove the child from the parent children list (parent->children_lock must be held)
+*/
+static void sibling_unlink(process_t* parent, process_t* child)
+{
+    if(child->sibling_prev) child->sibling_prev->sibling_next = child->sibling_next;
+    else parent->children = child->sibling_next;
+    if(child->sibling_next) child->sibling_next->sibling_prev = child->sibling_prev;
+    child->sibling_next = child->sibling_prev = 0;
+}
+
+/*
+* Add the child at the end of the parent zombie list (parent->children_lock must be held)
+*/
+static void zombie_link(process_t* parent, process_t* child)
+{
+    child->zombie_next = 0;
+    child->zombie_prev = parent->zombies_tail;
+    if(parent->zombies_tail) parent->zombies_tail->zombie_next = child;
+    else parent->zombies = child;
+    parent->zombies_tail = child;
+    parent->exited_children++;
+}
+
+/*
+* Remove the child from the parent zombie list (parent->children_lock must be held)
+*/
+static void zombie_unlink(process_t* parent, process_t* child)
+{
+    if(child->zombie_prev) child->zombie_prev->zombie_next = child->zombie_next;
+    else parent->zombies = child->zombie_next;
+    if(child->zombie_next) child->zombie_next->zombie_prev = child->zombie_prev;
+    else parent->zombies_tail = child->zombie_prev;
+    child->zombie_next = child->zombie_prev = 0;
+}
+
+/*
+* Queue the exiting process on its parent zombie list ; returns the parent to notify (0 if none)
+*/
+static process_t* zombie_queue(process_t* process)
+{
+    while(1)
+    {
+        process_t* parent = process->parent;
+        if(!parent) return 0;
+
+        u32 flags = spin_lock_irqsave(&parent->children_lock);
+        //the parent exited meanwhile, and gave us to INIT
+        if(process->parent != parent) {spin_unlock_irqrestore(&parent->children_lock, flags); continue;}
+        zombie_link(parent, process);
+        spin_unlock_irqrestore(&parent->children_lock, flags);
+        return parent;
+    }
+}
+
+/*
+* Give every child of an exiting process to new_parent (zombies stay waitable)
+*/
+static void reparent_children(process_t* process, process_t* new_parent)
+{
+    bool zombies = false;
+
+    //lock order : the exiting process, then INIT (that never exits)
+    u32 flags = spin_lock_irqsave(&process->children_lock);
+    spin_lock(&new_parent->children_lock);
+    while(process->children)
+    {
+        process_t* child = process->children;
+        sibling_unlink(process, child);
+        bool zombie = child->zombie_prev || (process->zombies == child);
+        if(zombie) zombie_unlink(process, child);
+        sibling_link(new_parent, child);
+        if(zombie) {zombie_link(new_parent, child); zombies = true;}
+    }
+    spin_unlock(&new_parent->children_lock);
+    spin_unlock_irqrestore(&process->children_lock, flags);
+
+    if(zombies) wake_up_all(&new_parent->child_queue);
+}
+
+/*
+* Does the child match the wait() target ? (VK_P_ALL, VK_P_PID pid or VK_P_PGID gid)
+*/
+static bool wait_match(process_t* child, u32 idtype, int id)
+{
+    if(idtype == VK_P_PID) return child->pid == id;
+    if(idtype == VK_P_PGID) return child->group && (child->group->gid == id);
+    return true;
+}
+
+/*
+* Wait for a child of the process matching (idtype, id) to exit, and reap it (unless VK_WNOWAIT)
+* With VK_WNOHANG, *pid is 0 if no matching child exited yet
+*/
+error_t process_wait(process_t* process, u32 idtype, int id, u32 options, int* pid, u32* status)
+{
+    while(1)
+    {
+        u32 flags = spin_lock_irqsave(&process->children_lock);
+
+        //check that there is something to wait for
+        bool has_child = false;
+        if(idtype == VK_P_ALL) has_child = (process->children != 0);
+        else if(idtype == VK_P_PID)
+        {
+            process_t* child = get_process(id);
+            has_child = child && (child->parent == process);
+        }
+        else
+        {
+            process_t* child = process->children;
+            while(child && !wait_match(child, idtype, id)) child = child->sibling_next;
+            has_child = (child != 0);
+        }
+        if(!has_child)
+        {
+            spin_unlock_irqrestore(&process->children_lock, flags);
+            return (idtype == VK_P_PID) ? ERROR_PERMISSION : ERROR_HAS_NO_CHILD;
+        }
+
+        //take the oldest matching zombie
+        process_t* zombie = process->zombies;
+        while(zombie && !wait_match(zombie, idtype, id)) zombie = zombie->zombie_next;
+        if(zombie && !(options & VK_WNOWAIT))
+        {
+            zombie_unlink(process, zombie);
+            sibling_unlink(process, zombie);
+        }
+        u32 exited = process->exited_children;
+        spin_unlock_irqrestore(&process->children_lock, flags);
+
+        if(zombie)
+        {
+            *pid = zombie->pid;
+            *status = zombie->active_thread->gregs.eax;
+            if(options & VK_WNOWAIT) return ERROR_NONE;
+
+            //completely remove zombie process
+            account_reap(process, zombie);
+            pid_free(zombie);
+            kfree(zombie->active_thread);
+            kfree(zombie);
+            return ERROR_NONE;
+        }
+
+        if(options & VK_WNOHANG) {*pid = 0; return ERROR_NONE;}
+
+        //queue before checking again, so that an exit can't be missed
+        wait_prepare(&process->child_queue, false, THREAD_STATUS_ASLEEP_CHILD);
+        if(process->exited_children != exited) wait_cancel(&process->child_queue);
+        else wait_sleep();
+    }
+}
+
+/* PID allocation and lookup */
+
+/*
+* Allocate a free pid to the process, and register it in the pid table
+* Returns the pid, or PROCESS_INVALID_PID if every pid is used
+*/
+int pid_alloc(process_t* process)
+{
+    process->pid = PROCESS_INVALID_PID;
+    process->pid_next = 0;
+
+    u32 flags = spin_lock_irqsave(&pid_lock);
+    u32 pid = pid_cursor;
+    u32 scanned = 0;
+    while(scanned <= PID_MAX)
+    {
+        //ignore the pids under the cursor in its word
+        u32 word = pid_bitmap[pid/32] | ((1U << (pid%32))-1);
+        if(word != 0xFFFFFFFF)
+        {
+            u32 bit;
+            asm("bsf %1, %0":"=r"(bit):"r"(~word));
+            pid = (pid & ~31U) + bit;
+
+            pid_bitmap[pid/32] |= (1U << bit);
+            pid_cursor = (pid+1 < PID_MAX) ? pid+1 : 1;
+            process->pid = (int) pid;
+            process->pid_next = pid_table[pid_hash(pid)];
+            pid_table[pid_hash(pid)] = process;
+            break;
+        }
+        scanned += 32 - (pid%32);
+        pid = (pid & ~31U) + 32;
+        if(pid >= PID_MAX) pid = 0;
+    }
+    spin_unlock_irqrestore(&pid_lock, flags);
+
+    return process->pid;
+}
+
+/*
+* Unregister the process from the pid table, and release its pid
+*/
+void pid_free(process_t* process)
+{
+    if((process->pid <= 0) || (process->pid >= PID_MAX)) return;
+    u32 pid = (u32) process->pid;
+
+    u32 flags = spin_lock_irqsave(&pid_lock);
+    process_t** ptr = &pid_table[pid_hash(pid)];
+    while(*ptr)
+    {
+        if(*ptr == process) {*ptr = process->pid_next; break;}
+        ptr = &(*ptr)->pid_next;
+    }
+    pid_bitmap[pid/32] &= ~(1U << (pid%32));
+    spin_unlock_irqrestore(&pid_lock, flags);
+}
+
+/*
+* Get the process that has this pid (0 if there is none)
+*/
+process_t* get_process(int pid)
+{
+    if((pid <= 0) || (pid >= PID_MAX)) return 0;
+
+    u32 flags = spin_lock_irqsave(&pid_lock);
+    process_t* process = pid_table[pid_hash(pid)];
+    while(process && (process->pid != pid)) process = process->pid_next;
+    spin_unlock_irqrestore(&pid_lock, flags);
+
+    return process;
+}
+
+/*
+* Call action(process, arg) on every process that has a pid (the pid table is locked meanwhile)
+*/
+void pid_for_each(void (*action)(process_t* process, void* arg), void* arg)
+{
+    u32 flags = spin_lock_irqsave(&pid_lock);
+    u32 i;
+    for(i = 0; i < PID_HASH_SIZE; i++)
+    {
+        process_t* process = pid_table[i];
+        while(process) {action(process, arg); process = process->pid_next;}
+    }
+    spin_unlock_irqrestore(&pid_lock, flags);
+}
+
 /* INIT, KERNEL and IDLE processes */
 
 error_t spawn_init_process()
@@ -453,6 +743,7 @@ error_t spawn_init_process()
     if(!init_file) return ERROR_FILE_NOT_FOUND;
 
     process_t* tr = init_process();
+    if(!tr) {close_file(init_file); return ERROR_BUSY;}
 
     //allocate page directory
     u32* page_directory = get_kernel_pd_clone();
@@ -511,7 +802,7 @@ error_t spawn_init_process()
     tty1->foreground_processes = group;
 
     //init stdin, stdout, stderr
-    fd_t* std = kmalloc(sizeof(fd_t)); std->offset = 0; std->file = tty1->pointer;
+    fd_t* std = kmalloc(sizeof(fd_t)); memset(std, 0, sizeof(fd_t)); std->file = tty1->pointer;
     std->instances = 3;
     tr->files[0] = std; //stdin
     tr->files[1] = std; //stdout
@@ -539,31 +830,80 @@ jmp idle_loop\n");
 
 process_t* init_idle_process()
 {
-    idle_process = 
+    process_t* tr = 
     #ifdef MEMLEAK_DBG
     kmalloc(sizeof(process_t), "idle process");
     #else
     kmalloc(sizeof(process_t));
     #endif
-    idle_process->status = PROCESS_STATUS_INIT;
-    idle_process->pid = PROCESS_IDLE_PID;
-    idle_process->active_thread = kmalloc(sizeof(thread_t));
-    idle_process->running_threads = queue_init(1);
-    idle_process->flags = 0; asm("pushf; pop %%eax":"=a"(idle_process->flags):);
-    idle_process->active_thread->gregs.eax = idle_process->active_thread->gregs.ebx = idle_process->active_thread->gregs.ecx = idle_process->active_thread->gregs.edx = 0;
-    idle_process->active_thread->gregs.edi = idle_process->active_thread->gregs.esi = idle_process->active_thread->ebp = 0;
-    idle_process->active_thread->sregs.ds = idle_process->active_thread->sregs.es = idle_process->active_thread->sregs.fs = idle_process->active_thread->sregs.gs = idle_process->active_thread->sregs.ss = 0x10;
-    idle_process->active_thread->sregs.cs = 0x08;
-    idle_process->active_thread->eip = (u32) idle_loop; //IDLE LOOP
-    idle_process->active_thread->esp = idle_process->active_thread->kesp = 
+    tr->status = PROCESS_STATUS_INIT;
+    tr->cpu = get_current_cpu()->index;
+    tr->on_cpu = tr->queued = false;
+    memset(&tr->lock, 0, sizeof(spinlock_t));
+    tr->pid = PROCESS_IDLE_PID;
+    tr->active_thread = kmalloc(sizeof(thread_t));
+    memset(tr->active_thread, 0, sizeof(thread_t));
+    tr->running_threads = queue_init(1);
+    tr->threads = tr->active_thread;
+    tr->thread_count = 1;
+    tr->next_tid = 1;
+    tr->flags = 0; asm("pushf; pop %%eax":"=a"(tr->flags):);
+    tr->active_thread->gregs.eax = tr->active_thread->gregs.ebx = tr->active_thread->gregs.ecx = tr->active_thread->gregs.edx = 0;
+    tr->active_thread->gregs.edi = tr->active_thread->gregs.esi = tr->active_thread->ebp = 0;
+    tr->active_thread->sregs.ds = tr->active_thread->sregs.es = tr->active_thread->sregs.fs = tr->active_thread->sregs.gs = tr->active_thread->sregs.ss = 0x10;
+    tr->active_thread->sregs.cs = 0x08;
+    tr->active_thread->eip = (u32) idle_loop; //IDLE LOOP
+    tr->active_thread->fpu_cpu = FPU_NO_CPU;
+    tr->active_thread->esp = tr->active_thread->kesp = 
     #ifdef MEMLEAK_DBG
     ((u32) kmalloc(1024, "idle process kernel stack"))+1024;
     #else
     ((u32) kmalloc(1024))+1024;
     #endif
-    idle_process->active_thread->base_stack = idle_process->active_thread->base_kstack = idle_process->active_thread->kesp - 1024;
-    idle_process->page_directory = kernel_page_directory;
-    return idle_process;
+    tr->active_thread->base_stack = tr->active_thread->base_kstack = tr->active_thread->kesp - 1024;
+    tr->page_directory = kernel_page_directory;
+    tr->mmaps = 0;
+    return tr;
+}
+
+/*
+* Create a kernel thread, in its own process, that runs 'entry(arg)' (it must never return)
+* Kernel processes are not registered in the process list : they can't receive signals
+*/
+process_t* create_kernel_process(void (*entry)(void*), void* arg)
+{
+    process_t* tr = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(sizeof(process_t), "kernel thread process");
+    #else
+    kmalloc(sizeof(process_t));
+    #endif
+    memset(tr, 0, sizeof(process_t));
+    tr->status = PROCESS_STATUS_INIT;
+    tr->cpu = get_current_cpu()->index;
+    tr->pid = PROCESS_KERNEL_PID;
+    tr->page_directory = kernel_page_directory;
+    tr->flags = 0x202;
+    tr->running_threads = queue_init(1);
+
+    thread_t* thread = init_thread();
+    tr->threads = thread;
+    tr->thread_count = 1;
+    tr->next_tid = 1;
+    thread->eip = (uintptr_t) entry;
+
+    //setup stack : return address (none) then argument
+    u32* kesp = (u32*) thread->kesp;
+    kesp -= 0x10;
+    kesp[1] = (uintptr_t) arg;
+    thread->esp = (uintptr_t) kesp;
+
+    thread->sregs.cs = 0x08; thread->sregs.ss = 0x10;
+    thread->sregs.ds = thread->sregs.es = thread->sregs.fs = thread->sregs.gs = 0x10;
+
+    scheduler_add_thread(tr, thread);
+    scheduler_add_process(tr);
+    return tr;
 }
 
 process_t* init_kernel_process()
@@ -575,10 +915,21 @@ process_t* init_kernel_process()
     kmalloc(sizeof(process_t));
     #endif
     kernel_process->active_thread = kmalloc(sizeof(thread_t));
+    memset(kernel_process->active_thread, 0, sizeof(thread_t));
+    kernel_process->active_thread->fpu_cpu = FPU_NO_CPU;
     kernel_process->running_threads = queue_init(1);
     kernel_process->pid = PROCESS_KERNEL_PID;
     kernel_process->page_directory = kernel_page_directory;
     kernel_process->status = PROCESS_STATUS_RUNNING;
+    kernel_process->cpu = 0;
+    kernel_process->on_cpu = true;
+    kernel_process->queued = false;
+    memset(&kernel_process->lock, 0, sizeof(spinlock_t));
+    kernel_process->utime = kernel_process->stime = kernel_process->cutime = kernel_process->cstime = 0;
+    kernel_process->threads = kernel_process->active_thread;
+    kernel_process->thread_count = 1;
+    kernel_process->next_tid = 1;
+    kernel_process->mmaps = 0;
 
     current_process = kernel_process;
 
@@ -17,6 +17,14 @@
 
 #include "tasking/task.h"
 #include "sync/sync.h"
+#include "syscalls.h"
+
+/*
+* Signals are pending bits in the process (or thread) sigset_t
+* Signals that have a user handler are delivered by the thread itself, when it goes back to user mode :
+* a signal frame (saved registers and mask) is pushed on the user stack, and the handler returns on sigret
+* Default actions (exit, stop, continue) can hit a process that is asleep in the kernel, so a worker runs them
+*/
 
 static void handle_signal(process_t* process, int sig);
 
@@ -24,44 +32,56 @@ static void handle_signal(process_t* process, int sig);
 //SIGCONT is set to IGNORE because CONTINUE action will always be executed
 static int default_action[] = {2, 1, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 4, 1, 4, 4, 4, 1, 1, 1, 1, 1, 1, 2, 1, 1, 1};
 
-list_entry_t* signal_list = 0;
-mutex_t* signal_mutex = 0;
+//processes that have default actions to run (linked through process->signal_next)
+static process_t* signal_list = 0;
+static spinlock_t signal_lock = {0};
+static void signal_work_handler(void* data);
+static work_t signal_work = WORK_INIT(signal_work_handler, 0);
 
-void signals_init()
+#define sigmask(sig) (1U << (sig))
+#define SIGNALS_UNBLOCKABLE (sigmask(SIGKILL) | sigmask(SIGSTOP))
+#define SIGNAL_EFLAGS_USER 0xCD5 //CF PF AF ZF SF DF OF : the flags a signal frame can restore
+
+//registers saved on the user stack while a handler runs
+typedef struct signal_frame
 {
-    signal_mutex = kmalloc(sizeof(mutex_t));
-    memset(signal_mutex, 0, sizeof(mutex_t));
-}
+    u32 eax, ecx, edx, ebx, esi, edi, ebp;
+    u32 eip, eflags, esp;
+    sigset_t blocked; //mask of the thread before the handler
+} __attribute__((packed)) signal_frame_t;
 
-/*
-* This method is called by the scheduler every schedule
-* It looks at the signal queue and handle every signal in it
-*/
-void handle_signals()
+//stack of SYSCALL_H when signal_syscall_exit() is called
+typedef struct syscall_frame
 {
-    if(!signal_list) return;
+    u32 eax, ecx, edx, ebx;
+    u32 ebp, edi, esi;
+    u32 gs, fs, es, ds;
+    u32 eip, cs, eflags, esp, ss;
+} __attribute__((packed)) syscall_frame_t;
 
-    list_entry_t* ptr = signal_list;
-    while(ptr)
-    {
-        u32* element = ptr->element;
-        //kprintf("handle_signal... ");
-        handle_signal((process_t*) element[0], (int) element[1]);
-        //kprintf(" ..handled.\n");
+//stack of schedule() when signal_interrupt_exit() is called (pushal then interrupt frame)
+typedef struct interrupt_frame
+{
+    u32 edi, esi, ebp, kesp, ebx, edx, ecx, eax;
+    u32 eip, cs, eflags, esp, ss;
+} __attribute__((packed)) interrupt_frame_t;
 
-        if(mutex_lock(signal_mutex) != ERROR_NONE) mutex_wait(signal_mutex);
-        list_entry_t* tofree = ptr;
-        ptr = ptr->next;
-        kfree(tofree->element);
-        kfree(tofree);
-        signal_list = ptr;
-        mutex_unlock(signal_mutex);
-    }
-}
+//stack of fault_handler() when signal_fault_exit() is called (segments, pushal, exception number and code, then interrupt frame)
+typedef struct fault_frame
+{
+    u32 gs, fs, es, ds;
+    u32 edi, esi, ebp, kesp, ebx, edx, ecx, eax;
+    u32 int_no, err_code;
+    u32 eip, cs, eflags, esp, ss;
+} __attribute__((packed)) fault_frame_t;
 
+/*
+* Code copied on the user stack under the signal frame : the handler returns here, and it calls sigret(frame)
+*/
 asm(".global sighandler_end \n \
 sighandler_end: \n \
-mov $21, %eax \n \
+mov %esp, %ebx /* frame is right above the signal number */ \n \
+mov $39, %eax /* SYSCALL_SIGRET */ \n \
 int $0x80 \n \
 sighandler_end_end: \n \
 .global sighandler_end_end");
@@ -69,7 +89,101 @@ extern void sighandler_end();
 extern void sighandler_end_end();
 
 /*
-* Handle a signal
+* Atomically clear the signal bit in the set ; returns true if it was set
+*/
+static bool signal_take(volatile sigset_t* set, int sig)
+{
+    while(1)
+    {
+        sigset_t old = *set;
+        if(!(old & sigmask(sig))) return false;
+        if(atomic_cmpxchg(set, old, old & ~sigmask(sig)) == old) return true;
+    }
+}
+
+/*
+* Queue a default action for the process (run later by the signal worker)
+*/
+static void signal_queue_default(process_t* process, int sig)
+{
+    atomic_or(&process->sigdefault, sigmask(sig));
+
+    u32 flags = spin_lock_irqsave(&signal_lock);
+    if(!process->signal_queued)
+    {
+        process->signal_next = signal_list;
+        signal_list = process;
+        process->signal_queued = true;
+    }
+    spin_unlock_irqrestore(&signal_lock, flags);
+
+    queue_work(&signal_work);
+}
+
+/*
+* This method is run by a kernel worker, when signals are sent
+* It runs the default actions queued for every process of the list
+*/
+void handle_signals()
+{
+    u32 flags = spin_lock_irqsave(&signal_lock);
+    process_t* process = signal_list;
+    signal_list = 0;
+    process_t* ptr = process;
+    while(ptr) {ptr->signal_queued = false; ptr = ptr->signal_next;}
+    spin_unlock_irqrestore(&signal_lock, flags);
+
+    while(process)
+    {
+        process_t* next = process->signal_next;
+        sigset_t pending = atomic_xchg(&process->sigdefault, 0);
+        int sig;
+        for(sig = 1; sig < NSIG; sig++)
+            if(pending & sigmask(sig)) handle_signal(process, sig);
+        process = next;
+    }
+}
+
+/*
+* Forget the default actions queued for an exiting process
+*/
+void signal_cancel(process_t* process)
+{
+    u32 flags = spin_lock_irqsave(&signal_lock);
+    if(process->signal_queued)
+    {
+        process_t** ptr = &signal_list;
+        while(*ptr != process) ptr = &(*ptr)->signal_next;
+        *ptr = process->signal_next;
+        process->signal_queued = false;
+    }
+    process->sigdefault = 0;
+    spin_unlock_irqrestore(&signal_lock, flags);
+}
+
+static void signal_work_handler(void* data)
+{
+    (void) data;
+    handle_signals();
+}
+
+/*
+* Terminate a process because of a signal (we are in a worker, so never the process itself)
+*/
+static void signal_exit(process_t* process, int sig)
+{
+    //the process must not be scheduled anymore : remove it and wait for it to be switched out of its cpu
+    spin_lock(&process->lock);
+    process->status = PROCESS_STATUS_ASLEEP_SIGNAL;
+    spin_unlock(&process->lock);
+    scheduler_remove_process(process);
+    while(process->on_cpu) asm volatile("pause":::"memory");
+
+    exit_process(process, EXIT_CONDITION_SIGNAL | ((u8) sig));
+}
+
+/*
+* Run the default action of a signal (or hand it to the threads, if a handler was set meanwhile)
 */
 static void handle_signal(process_t* process, int sig)
 {
@@ -79,80 +193,243 @@ static void handle_signal(process_t* process, int sig)
     if(sig == SIGCONT) if(process->status == PROCESS_STATUS_ASLEEP_SIGNAL) scheduler_add_process(process);
 
     /* SIG_DFL */
-    if(!handler)
+    if((!handler) || (sig == SIGKILL) || (sig == SIGSTOP))
     {
         if(default_action[sig] == 1)
         {
             if(process->pid != 1)
             {
-                //exit_process(process, EXIT_CONDITION_SIGNAL | ((u8) sig));
-                //setup thread
-                thread_t* thread = init_thread();
-                thread->eip = (uintptr_t) exit_process;
-                
-                //setup stack
-                //aligndown(thread->kesp, 0x10);
-                u32* kesp = (u32*) thread->kesp;
-                kesp -= 0x10;
-
-                //push exit_process() args
-                *((u32*) (((u32)kesp)+8)) = EXIT_CONDITION_SIGNAL | ((u8) sig);
-                *((u32*) (((u32)kesp)+4)) = (uintptr_t) process;
-
-                //setup registers
-                thread->esp = (uintptr_t) kesp;
-                thread->sregs.cs = 0x08; thread->sregs.ss = 0x10;
-                thread->sregs.ds = thread->sregs.es = thread->sregs.fs = thread->sregs.gs = 0x10;
-                //add thread
-                scheduler_add_thread(process, thread);
+                signal_exit(process, sig);
             }
         }
         else if(default_action[sig] == 2) return;
         else if(default_action[sig] == 4)
         {
             //TODO : find a good way to suspend processes (even if they are already suspended waiting)
-            if(process != current_process)
-            {
-                if(process->status == PROCESS_STATUS_RUNNING)
-                {
-                    process->status = PROCESS_STATUS_ASLEEP_SIGNAL;
-                    scheduler_remove_process(process);
-                }
-            }
-            //else : TODO
+            //if the process is running on another cpu, it won't be put back in queue when switched out
+            spin_lock(&process->lock);
+            bool stop = (process->status == PROCESS_STATUS_RUNNING);
+            if(stop) process->status = PROCESS_STATUS_ASLEEP_SIGNAL;
+            spin_unlock(&process->lock);
+            if(stop) scheduler_remove_process(process);
         }
     }
     /* SIG_IGN */
     else if(((uintptr_t) handler) == 1) return;
-    /* custom signal handling function */
-    else
+    /* custom signal handling function : the threads will run it */
+    else atomic_or(&process->sigpending, sigmask(sig));
+}
+
+/*
+* Check that the kernel can access the user page at 'address' (for a write if 'write')
+* Pages of the memory mappings are faulted in like the thread would, if we can sleep ('can_fault') :
+* else one that is not there yet (or still copy-on-write) can't be touched now
+*/
+static bool signal_user_page(process_t* process, u32 address, bool write, bool can_fault)
+{
+    if(address >= 0xC0000000) return false;
+    if(can_fault && process->mmaps && mmap_fault(process, address, write, false)) return true;
+
+    u32* entry = get_page_entry(address, process->page_directory, false);
+    if((!entry) || (!(*entry & PTE_PRESENT))) return false;
+    return (!write) || (*entry & PTE_WRITE);
+}
+
+/*
+* Push a signal frame on the user stack of the thread and make its context (eip, esp) run the handler
+* Returns false if no signal must be delivered (the context is unchanged)
+* The page directory of the process must be the current one ; 'can_fault' tells if we can sleep to fault in the stack
+*/
+static bool signal_setup_frame(process_t* process, thread_t* thread, signal_frame_t* context, bool can_fault)
+{
+    sigset_t deliverable = (process->sigpending | thread->sigpending) & ~thread->sigblocked;
+    if(!deliverable) return false;
+
+    int sig = 1;
+    while(!(deliverable & sigmask(sig))) sig++;
+    if(!signal_take(&thread->sigpending, sig))
+        if(!signal_take(&process->sigpending, sig)) return false; //another thread took it
+
+    //the handler was reset since the signal was sent
+    void* handler = process->signal_handlers[sig];
+    if(((uintptr_t) handler) <= 1)
+    {
+        if(!handler) signal_queue_default(process, sig);
+        return false;
+    }
+
+    //build the frame : trampoline code, saved registers, then the handler argument and return address
+    u32 code_size = (u32) sighandler_end_end - (u32) sighandler_end;
+    u32 esp = (context->esp - ((code_size + 3) & ~3U)) & ~3U;
+    u32 code = esp;
+    esp -= sizeof(signal_frame_t);
+    u32 frame = esp;
+    esp -= 8;
+
+    //the stack must be user memory (else the process can't handle signals anymore : it gets a SIGSEGV)
+    u32 page;
+    for(page = esp & ~0xFFFU; page < context->esp; page += 0x1000)
+    {
+        if(!signal_user_page(process, page, true, can_fault))
+        {
+            //it may be a mapping we can't fault in from here : the next return to user mode that can will deliver it
+            if((!can_fault) && (page < 0xC0000000) && process->mmaps)
+            {
+                atomic_or(&thread->sigpending, sigmask(sig));
+                return false;
+            }
+            process->signal_handlers[SIGSEGV] = 0;
+            signal_queue_default(process, SIGSEGV);
+            return false;
+        }
+    }
+
+    memcpy((void*) code, sighandler_end, code_size);
+    context->blocked = thread->sigblocked;
+    memcpy((void*) frame, context, sizeof(signal_frame_t));
+    ((u32*) esp)[0] = code;
+    ((u32*) esp)[1] = (u32) sig;
+
+    //the signal is blocked while its handler runs
+    thread->sigblocked |= sigmask(sig);
+    context->eip = (u32) handler;
+    context->esp = esp;
+    return true;
+}
+
+/*
+* Restore the registers saved in the signal frame given to sigret ; returns false if the frame is invalid
+*/
+static bool signal_restore_frame(process_t* process, thread_t* thread, signal_frame_t* context)
+{
+    u32 frame = thread->sigreturn;
+    thread->sigreturn = 0;
+
+    if((frame >= 0xC0000000 - sizeof(signal_frame_t)) || (!signal_user_page(process, frame, false, true))
+        || (!signal_user_page(process, frame + sizeof(signal_frame_t) - 1, false, true))) return false;
+
+    signal_frame_t* saved = (signal_frame_t*) frame;
+    u32 eflags = context->eflags;
+    memcpy(context, saved, sizeof(signal_frame_t));
+    context->eflags = (eflags & ~((u32) SIGNAL_EFLAGS_USER)) | (saved->eflags & SIGNAL_EFLAGS_USER);
+    thread->sigblocked = saved->blocked & ~SIGNALS_UNBLOCKABLE;
+    return true;
+}
+
+/*
+* Return-to-user hook of SYSCALL_H : finish a sigret, then deliver a pending signal to the thread
+*/
+void signal_syscall_exit(syscall_frame_t* frame)
+{
+    process_t* process = current_process;
+    thread_t* thread = process->active_thread;
+    if((!thread->sigreturn) && (!((process->sigpending | thread->sigpending) & ~thread->sigblocked))) return;
+
+    signal_frame_t context = {frame->eax, frame->ecx, frame->edx, frame->ebx, frame->esi, frame->edi, frame->ebp,
+        frame->eip, frame->eflags, frame->esp, 0};
+    bool changed = false;
+    if(thread->sigreturn)
+    {
+        if(!signal_restore_frame(process, thread, &context)) {process->signal_handlers[SIGSEGV] = 0; signal_queue_default(process, SIGSEGV); return;}
+        changed = true;
+    }
+    if(signal_setup_frame(process, thread, &context, true)) changed = true;
+    if(!changed) return;
+
+    frame->eax = context.eax; frame->ecx = context.ecx; frame->edx = context.edx; frame->ebx = context.ebx;
+    frame->esi = context.esi; frame->edi = context.edi; frame->ebp = context.ebp;
+    frame->eip = context.eip; frame->eflags = context.eflags; frame->esp = context.esp;
+}
+
+/*
+* Return-to-user hook of schedule(), when the interrupted thread keeps running
+*/
+void signal_interrupt_exit(interrupt_frame_t* frame)
+{
+    if(frame->cs != 0x1B) return;
+    process_t* process = current_process;
+    thread_t* thread = process->active_thread;
+    if(!((process->sigpending | thread->sigpending) & ~thread->sigblocked)) return;
+
+    signal_frame_t context = {frame->eax, frame->ecx, frame->edx, frame->ebx, frame->esi, frame->edi, frame->ebp,
+        frame->eip, frame->eflags, frame->esp, 0};
+    if(!signal_setup_frame(process, thread, &context, false)) return;
+
+    frame->eax = context.eax; frame->ecx = context.ecx; frame->edx = context.edx; frame->ebx = context.ebx;
+    frame->esi = context.esi; frame->edi = context.edi; frame->ebp = context.ebp;
+    frame->eip = context.eip; frame->esp = context.esp;
+}
+
+/*
+* Return-to-user hook of scheduler_switch_process() : the thread context is saved in the thread struct
+* (the page directory is switched to the process one early, to write on its stack)
+*/
+void signal_switch_exit(process_t* process, thread_t* thread)
+{
+    if(thread->sregs.cs != 0x1B) return;
+    if(!((process->sigpending | thread->sigpending) & ~thread->sigblocked)) return;
+
+    pd_switch(process->page_directory);
+    signal_frame_t context = {thread->gregs.eax, thread->gregs.ecx, thread->gregs.edx, thread->gregs.ebx, thread->gregs.esi, thread->gregs.edi, thread->ebp,
+        thread->eip, process->flags, thread->esp, 0};
+    if(!signal_setup_frame(process, thread, &context, false)) return;
+
+    thread->gregs.eax = context.eax; thread->gregs.ecx = context.ecx; thread->gregs.edx = context.edx; thread->gregs.ebx = context.ebx;
+    thread->gregs.esi = context.esi; thread->gregs.edi = context.edi; thread->ebp = context.ebp;
+    thread->eip = context.eip; thread->esp = context.esp;
+}
+
+/*
+* Return-to-user hook of a fault that raised a signal (thread->sigfault) : returning to the faulting instruction
+* would only fault again, so the handler frame is built right now
+* If the signal can't be handled (no handler, ignored or blocked), the process is terminated (this does not return)
+*/
+void signal_fault_exit(void* frame)
+{
+    fault_frame_t* f = frame;
+    process_t* process = current_process;
+    thread_t* thread = process->active_thread;
+    int sig = thread->sigfault;
+    thread->sigfault = 0;
+
+    void* handler = process->signal_handlers[sig];
+    if((((uintptr_t) handler) > 1) && (!(thread->sigblocked & sigmask(sig))))
     {
-        //TODO
+        atomic_or(&thread->sigpending, sigmask(sig));
+        signal_frame_t context = {f->eax, f->ecx, f->edx, f->ebx, f->esi, f->edi, f->ebp,
+            f->eip, f->eflags, f->esp, 0};
+        //each try takes a pending signal : another one can come first, or be gone meanwhile
+        while(thread->sigpending & sigmask(sig)) if(signal_setup_frame(process, thread, &context, true))
+        {
+            f->eax = context.eax; f->ecx = context.ecx; f->edx = context.edx; f->ebx = context.ebx;
+            f->esi = context.esi; f->edi = context.edi; f->ebp = context.ebp;
+            f->eip = context.eip; f->esp = context.esp;
+            return;
+        }
     }
+
+    exit_process(process, EXIT_CONDITION_SIGNAL | ((u8) sig));
 }
 
 /*
 * Send a signal to a process
-* This method only registers the signal in the list, it will be handled later
+* Signals with a user handler are left pending for its threads, default actions are queued to the worker
 */
 void send_signal(int pid, int sig)
 {
-    process_t* process = processes[pid];
+    process_t* process = get_process(pid);
+    if(!process) return;
 
     if(process->status == PROCESS_STATUS_ZOMBIE) return;
     if((sig <= 0) | (sig >= NSIG)) return;
 
-    /* adding the signal to the list */
-    while(mutex_lock(signal_mutex) != ERROR_NONE) mutex_wait(signal_mutex);
-    list_entry_t** listptr = &signal_list;
-    while(*listptr) listptr = &((*listptr)->next);
-    (*listptr) = kmalloc(sizeof(list_entry_t));
-    u32* element = kmalloc(sizeof(u32)*2);
-    element[0] = (uintptr_t) process;
-    element[1] = (u32) sig;
-    (*listptr)->element = element;
-    (*listptr)->next = 0;
-    mutex_unlock(signal_mutex);
+    void* handler = process->signal_handlers[sig];
+    if((sig == SIGKILL) || (sig == SIGSTOP) || (sig == SIGCONT) || (!handler))
+    {
+        if((default_action[sig] == 2) && (sig != SIGCONT)) return;
+        signal_queue_default(process, sig);
+    }
+    else if(((uintptr_t) handler) != 1) atomic_or(&process->sigpending, sigmask(sig));
 }
 
 /*
@@ -172,4 +449,17 @@ void send_signal_to_group(int gid, int sig)
         send_signal(prc->pid, sig);
         ptr = ptr->next;
     }
-}
\ No newline at end of file
+}
+
+/*
+* Change the blocked signals of the thread (how : VK_SIG_BLOCK, VK_SIG_UNBLOCK or VK_SIG_SETMASK) ; returns the old mask
+*/
+sigset_t signal_mask(thread_t* thread, u32 how, sigset_t set)
+{
+    sigset_t old = thread->sigblocked;
+    set &= ~SIGNALS_UNBLOCKABLE;
+    if(how == VK_SIG_BLOCK) thread->sigblocked |= set;
+    else if(how == VK_SIG_UNBLOCK) thread->sigblocked &= ~set;
+    else if(how == VK_SIG_SETMASK) thread->sigblocked = set;
+    return old;
+}
@@ -24,16 +24,20 @@
 #include "filesystem/ext2.h"
 #include "filesystem/iso9660.h"
 
+//constants given to the syscall asm stubs
+#define SYSCALL_XSTR(x) #x
+#define SYSCALL_STR(x) SYSCALL_XSTR(x)
+
 static bool ptr_validate(u32 ptr, u32* page_directory);
 
 void* system_calls[] = {0, syscall_open, syscall_close, syscall_read, syscall_write, 
 syscall_link, syscall_unlink, syscall_seek, syscall_stat, syscall_rename, syscall_finfo, 
 syscall_mount, syscall_umount, syscall_mkdir, syscall_readdir, syscall_openio, syscall_dup, syscall_fsinfo,
-0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+syscall_fsync, syscall_sync, syscall_ftruncate, syscall_getdents, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 syscall_fork, syscall_exit, syscall_exec, syscall_wait, syscall_getpinfo, syscall_setpinfo, 
-syscall_sig, syscall_sigaction, syscall_sigret, syscall_sbrk,
-0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-syscall_ioctl};
+syscall_sig, syscall_sigaction, syscall_sigret, syscall_sbrk, syscall_times, syscall_getrusage,
+syscall_futex, syscall_thread_create, syscall_thread_exit, syscall_thread_join, syscall_set_tls, syscall_waitid, syscall_sigprocmask, syscall_mmap,
+syscall_ioctl, syscall_munmap, syscall_msync, syscall_madvise};
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -264,7 +268,10 @@ void syscall_mount(u32 ebx, u32 ecx, u32 edx)
 
 void syscall_umount(u32 ebx, u32 ecx, u32 edx)
 {
+    if(!ptr_validate(ebx, current_process->page_directory)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
 
+    error_t err = unmount((char*) ebx);
+    asm("mov %0, %%eax ; mov %0, %%ecx"::"g"(err):"%eax", "%ecx");
 }
 
 void syscall_mkdir(u32 ebx, u32 ecx, u32 edx)
@@ -286,7 +293,7 @@ void syscall_mkdir(u32 ebx, u32 ecx, u32 edx)
 
     fsnode_t* node = create_file(path, FILE_ATTR_DIR);
     if(!node) asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(UNKNOWN_ERROR):"%eax", "%ecx");
-    else asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_NONE):"%eax", "%ecx");
+    else {icache_put(node); asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_NONE):"%eax", "%ecx");}
 }
 
 void syscall_readdir(u32 ebx, u32 ecx, u32 edx)
@@ -329,7 +336,8 @@ void syscall_openio(u32 ebx, u32 ecx, u32 edx)
 {
     io_stream_t* iostream = iostream_alloc();
     fd_t* file = kmalloc(sizeof(fd_t));
-    file->file = iostream->file; file->offset = 0;
+    memset(file, 0, sizeof(fd_t));
+    file->file = iostream->file; file->instances = 1;
 
     if(current_process->files_count == current_process->files_size)
     {current_process->files_size*=2; current_process->files = krealloc(current_process->files, current_process->files_size*sizeof(fd_t));}
@@ -410,6 +418,7 @@ void syscall_fsinfo(u32 ebx, u32 ecx, u32 edx)
         }
         case VK_FSINFO_MOUNTED_FS_ALL:
         {
+            read_lock(&mount_lock);
             mount_point_t* ptr = root_point;
             while(ptr)
             {
@@ -433,6 +442,7 @@ void syscall_fsinfo(u32 ebx, u32 ecx, u32 edx)
                 dest++;
                 ptr = ptr->next;
             }
+            read_unlock(&mount_lock);
             asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(current_mount_points), "N"(ERROR_NONE):"%eax", "%ecx"); return;
         }
     }
@@ -440,6 +450,71 @@ void syscall_fsinfo(u32 ebx, u32 ecx, u32 edx)
     asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(UNKNOWN_ERROR):"%eax", "%ecx"); 
 }
 
+void syscall_fsync(u32 ebx, u32 ecx, u32 edx)
+{
+    if((current_process->files_size <= ebx) || (!current_process->files[ebx])) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_FILE_NOT_FOUND):"%eax", "%ecx"); return;}
+
+    error_t err = fsync_file(current_process->files[ebx]);
+    asm("mov %0, %%eax ; mov %0, %%ecx"::"g"(err):"%eax", "%ecx");
+}
+
+void syscall_sync(u32 ebx, u32 ecx, u32 edx)
+{
+    error_t err = sync();
+    asm("mov %0, %%eax ; mov %0, %%ecx"::"g"(err):"%eax", "%ecx");
+}
+
+void syscall_ftruncate(u32 ebx, u32 ecx, u32 edx)
+{
+    if((current_process->files_size <= ebx) || (!current_process->files[ebx])) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_FILE_NOT_FOUND):"%eax", "%ecx"); return;}
+
+    error_t err = truncate_file(current_process->files[ebx], ecx);
+    asm("mov %0, %%eax ; mov %0, %%ecx"::"g"(err):"%eax", "%ecx");
+}
+
+/*
+* Fill the buffer (ecx, edx bytes) with as many packed getdents_entry_t as fit, from the directory cursor of the descriptor ebx
+* Returns the number of bytes filled (0 at the end of the directory) ; seek to 0 to read the directory again
+*/
+void syscall_getdents(u32 ebx, u32 ecx, u32 edx)
+{
+    if((current_process->files_size <= ebx) || (!current_process->files[ebx])) {asm("mov $0, %%eax ; mov %0, %%ecx"::"N"(ERROR_FILE_NOT_FOUND):"%eax", "%ecx"); return;}
+    if(!edx) {asm("mov $0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_ARGUMENT):"%eax", "%ecx"); return;}
+    if((!ptr_validate(ecx, current_process->page_directory)) | (!ptr_validate(ecx+edx-1, current_process->page_directory)))
+    {asm("mov $0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
+
+    fd_t* directory = current_process->files[ebx];
+    u8* buffer = (u8*) ecx;
+    u32 filled = 0;
+    error_t err = ERROR_NONE;
+
+    //another thread may read or rewind the same descriptor : the listing is freed on rewind
+    while(mutex_lock(&directory->dir_lock) != ERROR_NONE) mutex_wait(&directory->dir_lock);
+
+    dirent_t* dirent;
+    while((dirent = read_dirent(directory, &err)))
+    {
+        u32 reclen = (sizeof(getdents_entry_t)+dirent->name_len+1+3) & ~((u32) 3);
+        if(filled+reclen > edx) break;
+
+        getdents_entry_t* entry = (getdents_entry_t*) (buffer+filled);
+        entry->d_ino = dirent->inode;
+        entry->d_reclen = (u16) reclen;
+        entry->d_namlen = (u16) dirent->name_len;
+        memcpy(entry->d_name, dirent->name, dirent->name_len);
+        entry->d_name[dirent->name_len] = 0;
+
+        filled += reclen;
+        directory->offset++;
+    }
+
+    //not even one entry fits in the buffer
+    if(dirent && !filled) err = ERROR_INVALID_ARGUMENT;
+    mutex_unlock(&directory->dir_lock);
+
+    asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(filled), "g"(err):"%eax", "%ecx");
+}
+
 void syscall_exit(u32 ebx, u32 ecx, u32 edx)
 {
     exit_process(current_process, EXIT_CONDITION_USER | ((u8) ebx));
@@ -523,138 +598,34 @@ void syscall_wait(u32 ebx, u32 ecx, u32 edx)
     int* wstatus = (int*) ecx;
     if(wstatus) if(!ptr_validate((uintptr_t) wstatus, current_process->page_directory)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
 
-    if((!current_process->children) || (!current_process->children->element)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_HAS_NO_CHILD)); return;}
+    u32 idtype = VK_P_ALL; int id = 0;
+    if(pid < -1) {idtype = VK_P_PGID; id = -pid;}
+    else if(pid == 0) {idtype = VK_P_PGID; id = current_process->group->gid;}
+    else if(pid > 0) {idtype = VK_P_PID; id = pid;}
 
-    wait_start:
-    if(pid < -1)
-    {
-        list_entry_t* ptr = current_process->children;
-        list_entry_t* prev = 0;
-        while(ptr)
-        {
-            process_t* element = ptr->element;
-            if((element->status == PROCESS_STATUS_ZOMBIE) && (element->group->gid == -pid))
-            {
-                int trpid = element->pid;
-                int retcode = (int) element->active_thread->gregs.eax;
-                
-                processes[element->pid] = 0;
-                kfree(element->active_thread);
-                kfree(element);
-
-                //remove zombie process from parent's children list
-                if(prev) prev->next = ptr->next;
-                else current_process->children = 0;
-                kfree(ptr);
-
-                if(wstatus) *wstatus = retcode;
-                asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(trpid), "N"(ERROR_NONE));
-                return;
-            }
-            prev = ptr;
-            ptr = ptr->next;
-        }
-    }
-    else if(pid == -1)
-    {
-        //waiting for any child processes
-        list_entry_t* prev = 0;
-        list_entry_t* ptr = current_process->children;
-        while(ptr)
-        {
-            process_t* element = ptr->element;
-            if((element->status == PROCESS_STATUS_ZOMBIE))
-            {
-                //get zombie process pid and return code
-                int trpid = element->pid;
-                int retcode = (int) element->active_thread->gregs.eax;
-                
-                //completely remove zombie process from process list
-                processes[element->pid] = 0;
-                kfree(element->active_thread);
-                kfree(element);
-
-                //remove zombie process from parent's children list
-                if(prev) prev->next = ptr->next;
-                else current_process->children = 0;
-                kfree(ptr);
-
-                if(wstatus) *wstatus = retcode;
-                asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(trpid), "N"(ERROR_NONE));
-                return;
-            }
-            prev = ptr;
-            ptr = ptr->next;
-        }
-    }
-    else if(pid == 0)
-    {
-        list_entry_t* ptr = current_process->children;
-        list_entry_t* prev = 0;
-        while(ptr)
-        {
-            process_t* element = ptr->element;
-            if((element->status == PROCESS_STATUS_ZOMBIE) && (element->group->gid == current_process->group->gid))
-            {
-                int trpid = element->pid;
-                int retcode = (int) element->active_thread->gregs.eax;
-                
-                processes[element->pid] = 0;
-                kfree(element->active_thread);
-                kfree(element);
-
-                //remove zombie process from parent's children list
-                if(prev) prev->next = ptr->next;
-                else current_process->children = 0;
-                kfree(ptr);
-
-                if(wstatus) *wstatus = retcode;
-                asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(trpid), "N"(ERROR_NONE));
-                return;
-            }
-            prev = ptr;
-            ptr = ptr->next;
-        }
-    }
-    else if(pid > 0)
-    {
-        list_entry_t* ptr = current_process->children;
-        list_entry_t* prev = 0;
-        bool element_found = false;
-        while(ptr)
-        {
-            process_t* element = ptr->element;
-            if(element->pid == pid)
-            {
-                element_found = true;
-                if(element->status == PROCESS_STATUS_ZOMBIE)
-                {
-                    int trpid = element->pid;
-                    int retcode = (int) element->active_thread->gregs.eax;
-                    
-                    processes[element->pid] = 0;
-                    kfree(element->active_thread);
-                    kfree(element);
-
-                    //remove zombie process from parent's children list
-                    if(prev) prev->next = ptr->next;
-                    else current_process->children = 0;
-                    kfree(ptr);
-
-                    if(wstatus) *wstatus = retcode;
-                    asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(trpid), "N"(ERROR_NONE));
-                    return;
-                }
-            }
-            prev = ptr;
-            ptr = ptr->next;
-        }
-        if(!element_found) asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_PERMISSION));
-    }
+    int trpid = 0; u32 status = 0;
+    error_t err = process_wait(current_process, idtype, id, edx & VK_WNOHANG, &trpid, &status);
+    if(err != ERROR_NONE) {asm("mov %0, %%eax ; mov %0, %%ecx"::"g"(err):"%eax", "%ecx"); return;}
 
-    current_process->active_thread->status = THREAD_STATUS_ASLEEP_CHILD;
-    scheduler_remove_thread(current_process, current_process->active_thread);
-    goto wait_start;
+    if(wstatus && trpid) *wstatus = (int) status;
+    asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(trpid), "N"(ERROR_NONE):"%eax", "%ecx");
+}
+
+void syscall_waitid(u32 ebx, u32 ecx, u32 edx)
+{
+    waitid_info_t* info = (waitid_info_t*) edx;
+    if(!ptr_validate(edx, current_process->page_directory)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
+    if(ebx > VK_P_PGID) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(UNKNOWN_ERROR):"%eax", "%ecx"); return;}
+
+    int trpid = 0; u32 status = 0;
+    error_t err = process_wait(current_process, ebx, (int) ecx, info->options, &trpid, &status);
+    if(err != ERROR_NONE) {asm("mov %0, %%eax ; mov %0, %%ecx"::"g"(err):"%eax", "%ecx"); return;}
+
+    info->pid = trpid;
+    info->status = status & 0xFF;
+    info->code = (status & EXIT_CONDITION_SIGNAL) ? VK_CLD_KILLED : VK_CLD_EXITED;
+    if(!trpid) info->status = info->code = 0;
+    asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_NONE):"%eax", "%ecx");
 }
 
 void syscall_getpinfo(u32 ebx, u32 ecx, u32 edx)
@@ -662,11 +633,11 @@ void syscall_getpinfo(u32 ebx, u32 ecx, u32 edx)
     if(!ptr_validate(edx, current_process->page_directory)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
     
     int pid = (int) ebx;
-    if((pid < 0) | (pid > (int) processes_size)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PID):"%eax", "%ecx"); return;}
+    if((pid < 0) | (pid >= PID_MAX)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PID):"%eax", "%ecx"); return;}
 
     process_t* process = 0;
     if(!ebx) process = current_process;
-    else process = processes[ebx];
+    else process = get_process(pid);
 
     //check if we are trying to access current or child process. if not, no permission
     if((!process) | ((process != current_process) && (process->parent != current_process)))
@@ -687,11 +658,11 @@ void syscall_getpinfo(u32 ebx, u32 ecx, u32 edx)
 void syscall_setpinfo(u32 ebx, u32 ecx, u32 edx)
 {
     int pid = (int) ebx;
-    if((pid < 0) | (pid > (int) processes_size)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PID):"%eax", "%ecx"); return;}
+    if((pid < 0) | (pid >= PID_MAX)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PID):"%eax", "%ecx"); return;}
 
     process_t* process = 0;
     if(!ebx) process = current_process;
-    else process = processes[ebx];
+    else process = get_process(pid);
 
     //check if we are trying to access current or child process. if not, no permission
     if((!process) | ((process != current_process) && (process->parent != current_process)))
@@ -728,8 +699,8 @@ void syscall_setpinfo(u32 ebx, u32 ecx, u32 edx)
 void syscall_sig(u32 ebx, u32 ecx, u32 edx)
 {
     int pid = (int) ebx;
-    if((pid == 0) | (pid > (int) processes_size)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PID):"%eax", "%ecx"); return;}
-    if(pid > 0) if(!processes[pid]) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PID):"%eax", "%ecx"); return;}
+    if((pid == 0) | (pid >= PID_MAX)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PID):"%eax", "%ecx"); return;}
+    if(pid > 0) if(!get_process(pid)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PID):"%eax", "%ecx"); return;}
 
     int sig = (int) ecx;
     if((sig <= 0) | (sig >= NSIG)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_SIGNAL):"%eax", "%ecx"); return;}
@@ -754,7 +725,15 @@ void syscall_sigaction(u32 ebx, u32 ecx, u32 edx)
 
 void syscall_sigret(u32 ebx, u32 ecx, u32 edx)
 {
-    
+    //the frame is above the signal number (ebx = user esp, set by the return trampoline) ; it is restored on the way back to user mode
+    current_process->active_thread->sigreturn = ebx + 4;
+}
+
+void syscall_sigprocmask(u32 ebx, u32 ecx, u32 edx)
+{
+    if(ebx > VK_SIG_SETMASK) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(UNKNOWN_ERROR):"%eax", "%ecx"); return;}
+    sigset_t old = signal_mask(current_process->active_thread, ebx, ecx);
+    asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(old), "N"(ERROR_NONE):"%eax", "%ecx");
 }
 
 void syscall_sbrk(u32 ebx, u32 ecx, u32 edx)
@@ -763,6 +742,140 @@ void syscall_sbrk(u32 ebx, u32 ecx, u32 edx)
     asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(tr), "N"(ERROR_NONE):"%eax", "%ecx");
 }
 
+void syscall_mmap(u32 ebx, u32 ecx, u32 edx)
+{
+    if(!ptr_validate(ebx, current_process->page_directory)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
+    mmap_args_t args;
+    memcpy(&args, (void*) ebx, sizeof(mmap_args_t));
+
+    fd_t* file = 0;
+    if(!(args.flags & VK_MAP_ANONYMOUS))
+    {
+        u32 fd = (u32) args.fd;
+        if((current_process->files_size <= fd) || (!current_process->files[fd])) {asm("mov $0, %%eax ; mov %0, %%ecx"::"N"(ERROR_FILE_NOT_FOUND):"%eax", "%ecx"); return;}
+        file = current_process->files[fd];
+    }
+
+    error_t err = ERROR_NONE;
+    u32 addr = mmap(current_process, args.addr, args.length, args.prot, args.flags, file, args.offset, &err);
+    asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(addr), "g"(err):"%eax", "%ecx");
+}
+
+void syscall_munmap(u32 ebx, u32 ecx, u32 edx)
+{
+    error_t err = munmap(current_process, ebx, ecx);
+    asm("mov %0, %%eax ; mov %0, %%ecx"::"g"(err):"%eax", "%ecx");
+}
+
+void syscall_msync(u32 ebx, u32 ecx, u32 edx)
+{
+    error_t err = msync(current_process, ebx, ecx, edx);
+    asm("mov %0, %%eax ; mov %0, %%ecx"::"g"(err):"%eax", "%ecx");
+}
+
+void syscall_madvise(u32 ebx, u32 ecx, u32 edx)
+{
+    error_t err = madvise(current_process, ebx, ecx, edx);
+    asm("mov %0, %%eax ; mov %0, %%ecx"::"g"(err):"%eax", "%ecx");
+}
+
+void syscall_times(u32 ebx, u32 ecx, u32 edx)
+{
+    if(!ptr_validate(ebx, current_process->page_directory)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
+
+    //charge the current time slice before reading the counters
+    account_update();
+
+    u32 us_per_tick = 1000000/VK_CLOCKS_PER_SEC;
+    tms_t* tms = (tms_t*) ebx;
+    tms->tms_utime = time_div64(current_process->utime, us_per_tick, 0);
+    tms->tms_stime = time_div64(current_process->stime, us_per_tick, 0);
+    tms->tms_cutime = time_div64(current_process->cutime, us_per_tick, 0);
+    tms->tms_cstime = time_div64(current_process->cstime, us_per_tick, 0);
+
+    //return value : elapsed real time, in clock ticks
+    u32 ticks = get_uptime_ms()/(1000/VK_CLOCKS_PER_SEC);
+    asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(ticks), "N"(ERROR_NONE):"%eax", "%ecx");
+}
+
+void syscall_getrusage(u32 ebx, u32 ecx, u32 edx)
+{
+    if(!ptr_validate(ecx, current_process->page_directory)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
+
+    u64 utime, stime;
+    switch((int) ebx)
+    {
+        case VK_RUSAGE_SELF: {account_update(); utime = current_process->utime; stime = current_process->stime; break;}
+        case VK_RUSAGE_CHILDREN: {utime = current_process->cutime; stime = current_process->cstime; break;}
+        default: {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(UNKNOWN_ERROR):"%eax", "%ecx"); return;}
+    }
+
+    rusage_t* usage = (rusage_t*) ecx;
+    usage->ru_utime.tv_sec = (time_t) time_div64(utime, 1000000, &usage->ru_utime.tv_usec);
+    usage->ru_stime.tv_sec = (time_t) time_div64(stime, 1000000, &usage->ru_stime.tv_usec);
+
+    asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_NONE):"%eax", "%ecx");
+}
+
+/*
+* futex(uaddr, op, arg) : WAIT sleeps if *uaddr == arg, WAKE wakes up to arg waiters,
+* REQUEUE wakes/moves waiters as described by the futex_requeue_t pointed by arg
+* Userland only calls it on contention : the uncontended lock/unlock is an atomic operation on the word
+*/
+void syscall_futex(u32 ebx, u32 ecx, u32 edx)
+{
+    if(!ptr_validate(ebx, current_process->page_directory)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
+
+    u32 tr = 0;
+    error_t err = ERROR_NONE;
+    switch(ecx)
+    {
+        case VK_FUTEX_WAIT: {err = futex_wait((u32*) ebx, edx); break;}
+        case VK_FUTEX_WAKE: {tr = futex_wake((u32*) ebx, edx); break;}
+        case VK_FUTEX_REQUEUE:
+        {
+            if(!ptr_validate(edx, current_process->page_directory)) {err = ERROR_INVALID_PTR; break;}
+            futex_requeue_t* args = (futex_requeue_t*) edx;
+            if(!ptr_validate((u32) args->uaddr2, current_process->page_directory)) {err = ERROR_INVALID_PTR; break;}
+            err = futex_requeue((u32*) ebx, args->wake, args->uaddr2, args->requeue, &tr);
+            break;
+        }
+        default: {err = UNKNOWN_ERROR; break;}
+    }
+
+    asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(tr), "g"(err):"%eax", "%ecx");
+}
+
+void syscall_thread_create(u32 ebx, u32 ecx, u32 edx)
+{
+    if(ebx >= 0xC0000000) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
+
+    int tid = thread_create(current_process, ebx, ecx, edx);
+    asm("mov %0, %%eax ; mov %1, %%ecx"::"g"(tid), "N"(ERROR_NONE):"%eax", "%ecx");
+}
+
+void syscall_thread_exit(u32 ebx, u32 ecx, u32 edx)
+{
+    thread_exit(current_process, current_process->active_thread, ebx);
+}
+
+void syscall_thread_join(u32 ebx, u32 ecx, u32 edx)
+{
+    if(ecx && !ptr_validate(ecx, current_process->page_directory)) {asm("mov %0, %%eax ; mov %0, %%ecx"::"N"(ERROR_INVALID_PTR):"%eax", "%ecx"); return;}
+
+    error_t err = thread_join(current_process, (int) ebx, (u32*) ecx);
+    asm("mov %0, %%eax ; mov %0, %%ecx"::"g"(err):"%eax", "%ecx");
+}
+
+/*
+* Set the TLS base of the calling thread ; returns the selector to load in gs
+*/
+void syscall_set_tls(u32 ebx, u32 ecx, u32 edx)
+{
+    thread_set_tls(current_process->active_thread, ebx);
+    asm("mov %0, %%eax ; mov %1, %%ecx"::"N"(GDT_TLS_SELECTOR), "N"(ERROR_NONE):"%eax", "%ecx");
+}
+
 void syscall_ioctl(u32 ebx, u32 ecx, u32 edx)
 {
     //kprintf("%lSYS_IOCTL(%u, 0x%X, 0x%X)\n", 3, ebx, ecx, edx);
@@ -791,20 +904,30 @@ void syscall_ioctl(u32 ebx, u32 ecx, u32 edx)
 __asm__(".global syscall_fork \n \
 syscall_fork: \n \
 pushl %esp /* push esp to be restored later on the forked process */ \n \
-pushl current_process /* push current process as fork() argument */ \n \
+call get_current_cpu \n \
+pushl (%eax) /* push current process as fork() argument */ \n \
 call fork /* call fork() */ \n \
 addl $0x8, %esp /* clean esp after fork() call */ \n \
+testl %eax, %eax /* no process was created */ \n \
+jz 1f \n \
 movl 0x34(%eax), %eax /* return new process pid */ \n \
+xorl %ecx, %ecx /* ERROR_NONE */ \n \
+ret \n \
+1: \n \
+movl $-1, %eax /* PROCESS_INVALID_PID */ \n \
+movl $" SYSCALL_STR(ERROR_BUSY) ", %ecx /* no pid left */ \n \
 ret");
 
 int fork_ret()
 {
+    asm("mov %0, %%ecx"::"N"(ERROR_NONE):"%ecx");
     return 0;
 }
 
 static bool ptr_validate(u32 ptr, u32* page_directory)
 {
     if(ptr >= 0xC0000000) return false;
-    if(!is_mapped(ptr, page_directory)) return false;
+    //pages of the memory mappings are only mapped on the first access
+    if((!is_mapped(ptr, page_directory)) && (!mmap_contains(current_process, ptr))) return false;
     return true;
 }
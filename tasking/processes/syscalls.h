@@ -17,6 +17,10 @@
 #define SYSCALL_READDIR 14
 #define SYSCALL_OPENIO 15
 #define SYSCALL_DUP 16
+#define SYSCALL_FSYNC 18
+#define SYSCALL_SYNC 19
+#define SYSCALL_FTRUNCATE 20
+#define SYSCALL_GETDENTS 21
 
 #define SYSCALL_FORK 31
 #define SYSCALL_EXIT 32
@@ -28,18 +32,73 @@
 #define SYSCALL_SIGACTION 38
 #define SYSCALL_SIGRET 39
 #define SYSCALL_SBRK 40
+#define SYSCALL_TIMES 41
+#define SYSCALL_GETRUSAGE 42
+#define SYSCALL_FUTEX 43
+#define SYSCALL_THREAD_CREATE 44
+#define SYSCALL_THREAD_EXIT 45
+#define SYSCALL_THREAD_JOIN 46
+#define SYSCALL_SET_TLS 47
+#define SYSCALL_WAITID 48
+#define SYSCALL_SIGPROCMASK 49
+#define SYSCALL_MMAP 50
+#define SYSCALL_MUNMAP 52
+#define SYSCALL_MSYNC 53
+#define SYSCALL_MADVISE 54
 
 //SYSCALL_FINFO values
 #define VK_FINFO_DEVICE_TYPE 1
 #define VK_FINFO_PATH 2
 #define VK_NOT_A_DEVICE 1
 
+//SYSCALL_WAIT / SYSCALL_WAITID values
+#define VK_WNOHANG 1 //don't block if no child exited
+#define VK_WNOWAIT 2 //leave the child waitable (waitid only)
+#define VK_P_ALL 0
+#define VK_P_PID 1
+#define VK_P_PGID 2
+#define VK_CLD_EXITED 1
+#define VK_CLD_KILLED 2
+
+//SYSCALL_SIGPROCMASK values
+#define VK_SIG_BLOCK 0
+#define VK_SIG_UNBLOCK 1
+#define VK_SIG_SETMASK 2
+
 //SYSCALL_GETPINFO / SYSCALL_SETPINFO values
 #define VK_PINFO_PID 1
 #define VK_PINFO_PPID 2
 #define VK_PINFO_GID 4
 #define VK_PINFO_WORKING_DIRECTORY 3
 
+//SYSCALL_TIMES values
+#define VK_CLOCKS_PER_SEC 1000
+
+//SYSCALL_GETRUSAGE values
+#define VK_RUSAGE_SELF 0
+#define VK_RUSAGE_CHILDREN -1
+
+//SYSCALL_FUTEX values
+#define VK_FUTEX_WAIT 0
+#define VK_FUTEX_WAKE 1
+#define VK_FUTEX_REQUEUE 2
+
+//SYSCALL_MMAP / SYSCALL_MSYNC / SYSCALL_MADVISE values
+#define VK_PROT_READ 1
+#define VK_PROT_WRITE 2
+#define VK_PROT_EXEC 4
+#define VK_MAP_SHARED 1 //writes go to the file
+#define VK_MAP_PRIVATE 2 //writes are copied on write, never reach the file
+#define VK_MAP_FIXED 0x10 //map exactly at addr, replacing the mappings there
+#define VK_MAP_ANONYMOUS 0x20 //zeroed memory, no file (private only)
+#define VK_MS_ASYNC 1
+#define VK_MS_SYNC 4
+#define VK_MADV_NORMAL 0
+#define VK_MADV_RANDOM 1
+#define VK_MADV_SEQUENTIAL 2
+#define VK_MADV_WILLNEED 3 //read the file pages ahead
+#define VK_MADV_DONTNEED 4 //drop the pages now (anonymous memory is freed, and reads as zeroes again)
+
 //SYSCALL_FSINFO values
 #define VK_FSINFO_MOUNTED_FS_NUMBER 1
 #define VK_FSINFO_MOUNTED_FS_ALL 2
@@ -61,6 +120,10 @@ void syscall_readdir(u32 ebx, u32 ecx, u32 edx);
 void syscall_openio(u32 ebx, u32 ecx, u32 edx);
 void syscall_dup(u32 ebx, u32 ecx, u32 edx);
 void syscall_fsinfo(u32 ebx, u32 ecx, u32 edx);
+void syscall_fsync(u32 ebx, u32 ecx, u32 edx);
+void syscall_sync(u32 ebx, u32 ecx, u32 edx);
+void syscall_ftruncate(u32 ebx, u32 ecx, u32 edx);
+void syscall_getdents(u32 ebx, u32 ecx, u32 edx);
 
 void syscall_fork(u32 ebx, u32 ecx, u32 edx);
 void syscall_exit(u32 ebx, u32 ecx, u32 edx);
@@ -72,6 +135,19 @@ void syscall_sig(u32 ebx, u32 ecx, u32 edx);
 void syscall_sigaction(u32 ebx, u32 ecx, u32 edx);
 void syscall_sigret(u32 ebx, u32 ecx, u32 edx);
 void syscall_sbrk(u32 ebx, u32 ecx, u32 edx);
+void syscall_times(u32 ebx, u32 ecx, u32 edx);
+void syscall_getrusage(u32 ebx, u32 ecx, u32 edx);
+void syscall_futex(u32 ebx, u32 ecx, u32 edx);
+void syscall_thread_create(u32 ebx, u32 ecx, u32 edx);
+void syscall_thread_exit(u32 ebx, u32 ecx, u32 edx);
+void syscall_thread_join(u32 ebx, u32 ecx, u32 edx);
+void syscall_set_tls(u32 ebx, u32 ecx, u32 edx);
+void syscall_waitid(u32 ebx, u32 ecx, u32 edx);
+void syscall_sigprocmask(u32 ebx, u32 ecx, u32 edx);
+void syscall_mmap(u32 ebx, u32 ecx, u32 edx);
+void syscall_munmap(u32 ebx, u32 ecx, u32 edx);
+void syscall_msync(u32 ebx, u32 ecx, u32 edx);
+void syscall_madvise(u32 ebx, u32 ecx, u32 edx);
 
 void syscall_ioctl(u32 ebx, u32 ecx, u32 edx);
 
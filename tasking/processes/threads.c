@@ -27,6 +27,7 @@ thread_t* init_thread()
     thread->base_kstack = (u32) kstack;
     
     thread->status = THREAD_STATUS_INIT;
+    thread->fpu_cpu = FPU_NO_CPU;
 
     return thread;
 }
@@ -46,6 +47,12 @@ void free_thread_memory(process_t* process, thread_t* thread)
         thread->base_stack = 0;
     }
 
+    fpu_release(thread);
+
+    //a thread killed while sleeping must not stay on a wait queue
+    wait_remove(&thread->wait);
+    wait_remove(&thread->sleep);
+
     /* we can't free kernel stack if we are on active thread of current process */
     if((process != current_process) | (thread != process->active_thread))
     {
@@ -57,6 +64,18 @@ void scheduler_remove_thread(process_t* process, thread_t* thread)
 {
     if(process->status != PROCESS_STATUS_RUNNING) return;
 
+    //critical section, we don't want the process to be scheduled from here
+    u32 flags = irq_save();
+    spin_lock(&process->lock);
+
+    /* the thread was woken up before it could sleep */
+    if(thread->status == THREAD_STATUS_RUNNING)
+    {
+        spin_unlock(&process->lock);
+        irq_restore(flags);
+        return;
+    }
+
     /* adding the thread to remove on waiting_threads list */
     list_entry_t** ptr = &process->waiting_threads;
     while(*ptr) ptr = &((*ptr)->next);
@@ -67,71 +86,230 @@ void scheduler_remove_thread(process_t* process, thread_t* thread)
     /* if currentprocess activethread, save context */
     if((process == current_process) && (thread == process->active_thread))
     {
-        asm("cli"); //critical section, we don't want the process to be scheduled from here
         thread_t* next = queue_take(process->running_threads);
+        /* if no more threads, the process is asleep (it won't be put back in queue) */
+        process->active_thread = next;
+        if(!next) process->status = PROCESS_STATUS_ASLEEP_THREADS;
+        spin_unlock(&process->lock);
 
-        __asm__ __volatile__("mov %%ebx, %0":"=m"(current_process->active_thread->gregs.ebx)::"%ebx");
-        __asm__ __volatile__("mov %%edi, %0":"=m"(current_process->active_thread->gregs.edi)::"%edi");
-        __asm__ __volatile__("mov %%esi, %0":"=m"(current_process->active_thread->gregs.esi)::"%esi");
-        __asm__ __volatile__("mov %%ebp, %0":"=m"(current_process->active_thread->ebp)::"%ebp");
+        __asm__ __volatile__("mov %%ebx, %0":"=m"(thread->gregs.ebx)::"%ebx");
+        __asm__ __volatile__("mov %%edi, %0":"=m"(thread->gregs.edi)::"%edi");
+        __asm__ __volatile__("mov %%esi, %0":"=m"(thread->gregs.esi)::"%esi");
+        __asm__ __volatile__("mov %%ebp, %0":"=m"(thread->ebp)::"%ebp");
         //save segment registers
-        __asm__ __volatile__ ("mov %%ds, %0 ; mov %%es, %1 ; mov %%fs, %2 ; mov %%gs, %3":"=m"(current_process->active_thread->sregs.ds), "=m"(current_process->active_thread->sregs.es), "=m"(current_process->active_thread->sregs.fs), "=m"(current_process->active_thread->sregs.gs));
+        __asm__ __volatile__ ("mov %%ds, %0 ; mov %%es, %1 ; mov %%fs, %2 ; mov %%gs, %3":"=m"(thread->sregs.ds), "=m"(thread->sregs.es), "=m"(thread->sregs.fs), "=m"(thread->sregs.gs));
         
         //cs/ss values are obvious cause we are in kernel context
-        current_process->active_thread->sregs.ss = 0x10;
-        current_process->active_thread->sregs.cs = 0x08;
+        thread->sregs.ss = 0x10;
+        thread->sregs.cs = 0x08;
 
         //set eip to the end of this void
-        current_process->active_thread->eip = (u32) &&srt_end;
-        __asm__ __volatile__("mov %%esp, %%eax":"=a"(current_process->active_thread->esp)::); //save esp at last moment
+        thread->eip = (u32) &&srt_end;
+        __asm__ __volatile__("mov %%esp, %%eax":"=a"(thread->esp)::); //save esp at last moment
     
-        /* if no more threads, remove process */
-        process->active_thread = next;
-        if(!next) 
-        {
-            process->status = PROCESS_STATUS_ASLEEP_THREADS;
-            scheduler_remove_process(process);
-        }
-        /* else schedule to that thread */
-        else
-        {
-            __asm__ __volatile__("jmp schedule_switch"::"a"(process->active_thread), "d"(process));
-        }
+        /* if no more threads, switch to another process */
+        process_t* nprocess = process;
+        if(!next) nprocess = scheduler_next_process(get_current_cpu(), &next);
+
+        /* schedule to that thread */
+        __asm__ __volatile__("jmp schedule_switch"::"a"(next), "d"(nprocess));
 
         srt_end: return;
     }
-    else queue_remove(process->running_threads, thread);
+    else 
+    {
+        queue_remove(process->running_threads, thread);
+        spin_unlock(&process->lock);
+        irq_restore(flags);
+    }
 }
 
 void scheduler_add_thread(process_t* process, thread_t* thread)
 {
-    if(thread->status == THREAD_STATUS_RUNNING) return;
+    spin_lock(&process->lock);
+    if(thread->status == THREAD_STATUS_RUNNING) {spin_unlock(&process->lock); return;}
+
+    /* the thread did not go to sleep yet : scheduler_remove_thread() will see the status and return */
+    if((thread->status != THREAD_STATUS_INIT) && (thread == process->active_thread))
+    {
+        thread->status = THREAD_STATUS_RUNNING;
+        spin_unlock(&process->lock);
+        return;
+    }
 
     if(thread->status != THREAD_STATUS_INIT)
     {
         /* remove thread from waiting list */
-        list_entry_t* ptr = process->waiting_threads;
-        list_entry_t* bef = 0;
-        while(ptr)
+        list_entry_t** ptr = &process->waiting_threads;
+        while(*ptr)
         {
-            if(ptr->element == thread)
+            if((*ptr)->element == thread)
             {
-                if(bef) bef->next = ptr->next;
-                else process->waiting_threads = 0;
-                kfree(ptr);
+                list_entry_t* to_free = *ptr;
+                *ptr = to_free->next;
+                kfree(to_free);
+                break;
             }
-            bef = ptr;
-            ptr = ptr->next;
+            ptr = &((*ptr)->next);
         }
     }
 
     /* if thread was the only thread of the process, waking up */
     thread->status = THREAD_STATUS_RUNNING;
-    if((!process->active_thread) && (process->status == PROCESS_STATUS_ASLEEP_THREADS))
+    bool wakeup = false;
+    if(!process->active_thread)
     {
         process->active_thread = thread;
-        scheduler_add_process(process);
+        wakeup = (process->status == PROCESS_STATUS_ASLEEP_THREADS);
     }
-    else if(!process->active_thread) process->active_thread = thread;
     else queue_add(process->running_threads, thread);
+    spin_unlock(&process->lock);
+
+    if(wakeup) scheduler_add_process(process);
+}
+
+/*
+* Map a user stack for a new thread, below the stacks already mapped (with a one page unmapped gap, to catch overflows)
+* Returns the base of the stack
+*/
+static u32 thread_map_stack(process_t* process)
+{
+    u32 base = 0xC0000000 - PROCESS_STACK_SIZE_DEFAULT;
+    while(1)
+    {
+        base -= PROCESS_STACK_SIZE_DEFAULT + 4096;
+
+        bool free = true;
+        u32 page;
+        for(page = base - 4096; page < base + PROCESS_STACK_SIZE_DEFAULT; page += 4096)
+            if(is_mapped(page, process->page_directory)) {free = false; break;}
+        if(free) break;
+    }
+
+    map_memory(PROCESS_STACK_SIZE_DEFAULT, base, process->page_directory);
+    return base;
+}
+
+/*
+* Create a new user thread in the (current) process, starting at 'entry' with 'arg' as argument
+* The entry function must not return (it must call thread_exit)
+* Returns the new thread id
+*/
+int thread_create(process_t* process, u32 entry, u32 arg, u32 tls_base)
+{
+    thread_t* thread = init_thread();
+    thread->base_stack = thread_map_stack(process);
+    thread->tls_base = tls_base;
+
+    //user stack : return address (none) then argument (the process address space is the current one)
+    u32* esp = (u32*) (thread->base_stack + PROCESS_STACK_SIZE_DEFAULT);
+    esp -= 2;
+    esp[0] = 0;
+    esp[1] = arg;
+    thread->esp = (u32) esp;
+    thread->eip = entry;
+
+    thread->sregs.cs = 0x1B;
+    thread->sregs.ds = thread->sregs.es = thread->sregs.fs = thread->sregs.ss = 0x23;
+    thread->sregs.gs = tls_base ? GDT_TLS_SELECTOR : 0x23;
+
+    spin_lock(&process->lock);
+    thread->tid = process->next_tid++;
+    thread->next_thread = process->threads;
+    process->threads = thread;
+    process->thread_count++;
+    spin_unlock(&process->lock);
+
+    scheduler_add_thread(process, thread);
+    return thread->tid;
+}
+
+/*
+* Terminate a thread of the (current) process, keeping 'value' for the thread that joins it
+* If it was the last thread of the process, the process exits
+*/
+void thread_exit(process_t* process, thread_t* thread, u32 value)
+{
+    //we must not be scheduled between becoming a zombie and switching out
+    u32 flags = irq_save();
+
+    spin_lock(&process->lock);
+    bool last = (process->thread_count == 1);
+    if(!last) process->thread_count--;
+    spin_unlock(&process->lock);
+
+    if(last)
+    {
+        irq_restore(flags);
+        exit_process(process, EXIT_CONDITION_USER | ((u8) value));
+        return;
+    }
+
+    thread->exit_value = value;
+    thread->status = THREAD_STATUS_ZOMBIE;
+    wake_up_all(&thread->join_queue);
+
+    //the thread is put on the waiting list until joined, and we switch to another thread/process
+    scheduler_remove_thread(process, thread);
+    irq_restore(flags);
+}
+
+/*
+* Wait for the thread 'tid' of the (current) process to exit, and free it
+*/
+error_t thread_join(process_t* process, int tid, u32* value)
+{
+    thread_t* self = process->active_thread;
+
+    spin_lock(&process->lock);
+    thread_t* thread = process->threads;
+    while(thread && (thread->tid != tid)) thread = thread->next_thread;
+    if((!thread) || (thread == self) || thread->joined) {spin_unlock(&process->lock); return ERROR_INVALID_TID;}
+    thread->joined = true;
+    spin_unlock(&process->lock);
+
+    while(1)
+    {
+        wait_prepare(&thread->join_queue, false, THREAD_STATUS_ASLEEP_JOIN);
+        if(thread->status == THREAD_STATUS_ZOMBIE) {wait_cancel(&thread->join_queue); break;}
+        wait_sleep();
+    }
+
+    if(value) *value = thread->exit_value;
+
+    //remove the thread from the process lists
+    spin_lock(&process->lock);
+    list_entry_t** ptr = &process->waiting_threads;
+    while(*ptr)
+    {
+        if((*ptr)->element == thread)
+        {
+            list_entry_t* to_free = *ptr;
+            *ptr = to_free->next;
+            kfree(to_free);
+            break;
+        }
+        ptr = &((*ptr)->next);
+    }
+    thread_t** tptr = &process->threads;
+    while(*tptr != thread) tptr = &((*tptr)->next_thread);
+    *tptr = thread->next_thread;
+    spin_unlock(&process->lock);
+
+    //the thread switched out for the last time when it became a zombie, its stacks are not used anymore
+    free_thread_memory(process, thread);
+    kfree(thread);
+    return ERROR_NONE;
+}
+
+/*
+* Set the TLS segment base of the current thread (the caller must then load GDT_TLS_SELECTOR in gs)
+*/
+void thread_set_tls(thread_t* thread, u32 tls_base)
+{
+    //we must not move to another cpu between the two
+    u32 flags = irq_save();
+    thread->tls_base = tls_base;
+    gdt_set_tls(get_current_cpu()->index, tls_base);
+    irq_restore(flags);
 }
@@ -0,0 +1,97 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "tasking/task.h"
+#include "time/time.h"
+
+/*
+* CPU time accounting : the time elapsed on a cpu is charged to the running thread (and its process) on every
+* transition (switch, syscall entry/exit, timer interrupt), in user or system time depending on the thread mode
+* The clock is the TSC when it is calibrated (microsecond precision), the PIT otherwise
+*/
+
+/*
+* Charge the time elapsed since the last charge to the thread running on the cpu (interrupts must be disabled)
+*/
+static void account_charge(cpu_t* cpu)
+{
+    u32 now = get_uptime_us();
+    u32 delta = now - cpu->account_stamp;
+    cpu->account_stamp = now;
+
+    thread_t* thread = cpu->account_thread;
+    process_t* process = cpu->current;
+    if(!thread || !process || (process == cpu->idle)) return;
+
+    if(cpu->account_user) {thread->utime += delta; process->utime += delta;}
+    else {thread->stime += delta; process->stime += delta;}
+}
+
+/*
+* Charge the time spent by the old thread, and start charging 'thread' (called by scheduler_switch_process(), before switching)
+*/
+void account_switch(cpu_t* cpu, thread_t* thread)
+{
+    account_charge(cpu);
+    cpu->account_thread = thread;
+    cpu->account_user = ((thread->sregs.cs & 3) == 3);
+}
+
+/*
+* Charge the time elapsed on the current cpu (called on timer interrupts, and before reading the counters)
+*/
+void account_update()
+{
+    u32 flags = irq_save();
+    account_charge(get_current_cpu());
+    irq_restore(flags);
+}
+
+/*
+* The current thread enters the kernel : charge the time spent in user mode (called by the syscall handler)
+*/
+void account_syscall_enter()
+{
+    u32 flags = irq_save();
+    cpu_t* cpu = get_current_cpu();
+    account_charge(cpu);
+    cpu->account_user = false;
+    irq_restore(flags);
+}
+
+/*
+* The current thread returns to user mode : charge the time spent in the kernel (called by the syscall handler)
+*/
+void account_syscall_exit()
+{
+    u32 flags = irq_save();
+    cpu_t* cpu = get_current_cpu();
+    account_charge(cpu);
+    cpu->account_user = true;
+    irq_restore(flags);
+}
+
+/*
+* Add the cpu time of a zombie child (and of its own waited children) to its parent (called by wait())
+* The child must be switched out of its cpu : its last time slice is charged on switch
+*/
+void account_reap(process_t* parent, process_t* child)
+{
+    while(child->on_cpu) asm volatile("pause":::"memory");
+
+    parent->cutime += child->utime + child->cutime;
+    parent->cstime += child->stime + child->cstime;
+}
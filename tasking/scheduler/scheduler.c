@@ -19,22 +19,25 @@
 #include "memory/mem.h"
 #include "cpu/cpu.h"
 #include "sync/sync.h"
+#include "time/time.h"
 
 bool scheduler_started = false;
-process_t* current_process = 0;
-queue_t* p_ready_queue = 0;
-list_entry_t* irq_list[21] = {0};
-dlist_entry_t* wait_list = 0;
-mutex_t* wait_mutex = 0;
+wait_queue_t irq_queues[21] = {{0}};
+wait_queue_t sleep_queue = {0}; //sorted by deadline
+
+#define SLEEP_NODE_THREAD(node) ((thread_t*) (((u8*) (node)) - __builtin_offsetof(thread_t, sleep)))
+
+#define SCHEDULER_BALANCE_US 550000 //load balancing every ~550 ms
+#define SCHEDULER_QUANTUM_US 20000 //time slice of a process, when the local APIC timer is used
 
 /*
 * Initializes the data structures needed by the scheduler
 */
 void scheduler_init()
 {
-    p_ready_queue = queue_init(10);
-    wait_mutex = kmalloc(sizeof(mutex_t));
-    memset(wait_mutex, 0, sizeof(mutex_t));
+    cpu_t* cpu = get_current_cpu();
+    cpu->ready_queue = queue_init(10);
+    cpu->switch_stack = ((u32) kmalloc(4096)) + 4096;
 }
 
 /*
@@ -44,18 +47,334 @@ void scheduler_start()
 {
     kprintf("Starting scheduler...");
     scheduler_started = true;
+    if(lapic_timer_frequency) scheduler_timer_arm(get_current_cpu());
     asm("sti");
     vga_text_okmsg();
 }
 
+/*
+* Get the number of processes a cpu has to run (queued + running)
+*/
+static u32 scheduler_cpu_weight(cpu_t* cpu)
+{
+    return cpu->load + ((cpu->current != cpu->idle) ? 1 : 0);
+}
+
+/*
+* Add a process at the end of the run queue of 'cpu'
+*/
+static void scheduler_enqueue_process(cpu_t* cpu, process_t* process)
+{
+    spin_lock(&cpu->queue_lock);
+    queue_add(cpu->ready_queue, process);
+    process->cpu = cpu->index;
+    process->queued = true;
+    cpu->load++;
+    spin_unlock(&cpu->queue_lock);
+
+    //if the cpu is idle, tell it to schedule now (its timer may be stopped)
+    if(cpu->current == cpu->idle) smp_reschedule(cpu);
+}
+
+/*
+* Put a process on the run queue of a cpu
+* We keep the process on the cpu it last ran on, unless another cpu is less loaded
+*/
+static void scheduler_put_process(process_t* process)
+{
+    cpu_t* cpu = &cpus[process->cpu];
+    if(!cpu->online) cpu = &cpus[0];
+    u32 i;
+    for(i = 0; i < cpu_count; i++)
+    {
+        if(cpus[i].online && (scheduler_cpu_weight(&cpus[i]) < scheduler_cpu_weight(cpu))) cpu = &cpus[i];
+    }
+
+    scheduler_enqueue_process(cpu, process);
+}
+
+/*
+* Take the first process on the run queue of a cpu
+*/
+static process_t* scheduler_dequeue_process(cpu_t* cpu)
+{
+    spin_lock(&cpu->queue_lock);
+    process_t* tr = queue_take(cpu->ready_queue);
+    if(tr) {tr->queued = false; cpu->load--;}
+    spin_unlock(&cpu->queue_lock);
+    return tr;
+}
+
+/*
+* Take the next process to run on a cpu
+* If the cpu run queue is empty, steal a process from the busiest cpu
+*/
+static process_t* scheduler_take_process(cpu_t* cpu)
+{
+    process_t* tr = scheduler_dequeue_process(cpu);
+    if(!tr && smp_enabled)
+    {
+        cpu_t* busiest = 0;
+        u32 i;
+        for(i = 0; i < cpu_count; i++)
+        {
+            if((&cpus[i] == cpu) || !cpus[i].online || !cpus[i].load) continue;
+            if(!busiest || (cpus[i].load > busiest->load)) busiest = &cpus[i];
+        }
+        if(busiest) tr = scheduler_dequeue_process(busiest);
+    }
+    if(tr) tr->cpu = cpu->index;
+    return tr;
+}
+
+/*
+* Periodic load balancing : move a process from the busiest cpu to the least loaded one (called by schedule(), on the BSP)
+*/
+void scheduler_balance()
+{
+    static u32 last_balance = 0;
+    if(!smp_enabled) return;
+    u32 now = get_uptime_us();
+    if(time_before(now, last_balance + SCHEDULER_BALANCE_US)) return;
+    last_balance = now;
+
+    cpu_t* busiest = &cpus[0];
+    cpu_t* idlest = &cpus[0];
+    u32 i;
+    for(i = 1; i < cpu_count; i++)
+    {
+        if(!cpus[i].online) continue;
+        if(scheduler_cpu_weight(&cpus[i]) > scheduler_cpu_weight(busiest)) busiest = &cpus[i];
+        if(scheduler_cpu_weight(&cpus[i]) < scheduler_cpu_weight(idlest)) idlest = &cpus[i];
+    }
+
+    //moving a process is only worth it if it really balances the load
+    if(scheduler_cpu_weight(busiest) < scheduler_cpu_weight(idlest) + 2) return;
+
+    process_t* process = scheduler_dequeue_process(busiest);
+    if(process) scheduler_enqueue_process(idlest, process);
+}
+
+/*
+* Rotate the threads of a process : the active thread goes back in queue, and the next one is returned (0 if there is none)
+*/
+static thread_t* scheduler_take_thread(process_t* process)
+{
+    spin_lock(&process->lock);
+    thread_t* tr = queue_take(process->running_threads);
+    if(tr && process->active_thread && (process->active_thread->status == THREAD_STATUS_RUNNING)) queue_add(process->running_threads, process->active_thread);
+    spin_unlock(&process->lock);
+    return tr;
+}
+
+/*
+* Choose the next process/thread to run on the cpu (called by schedule())
+* Returns 0 if the cpu must keep running the same thread
+*/
+process_t* scheduler_pick_next(cpu_t* cpu, thread_t** thread)
+{
+    process_t* current = cpu->current;
+
+    //the thread is in a non-preemptible kernel section : it will switch on preempt_enable()
+    if(current && (current != cpu->idle) && current->active_thread && current->active_thread->preempt_count)
+    {
+        cpu->need_resched = true;
+        return 0;
+    }
+    cpu->need_resched = false;
+
+    process_t* next = scheduler_take_process(cpu);
+
+    if(!next)
+    {
+        if(current == cpu->idle) return 0;
+
+        //the current process was stopped/put to sleep by another cpu : run idle process
+        if(current->status != PROCESS_STATUS_RUNNING)
+        {
+            *thread = cpu->idle->active_thread;
+            return cpu->idle;
+        }
+
+        //no other process is ready, switch to another thread of the current process if there is one
+        *thread = scheduler_take_thread(current);
+        if(!*thread) return 0;
+        return current;
+    }
+
+    //if the new process has only one thread, we take back the active thread
+    *thread = scheduler_take_thread(next);
+    if(!*thread) *thread = next->active_thread;
+    return next;
+}
+
+/*
+* Get the process/thread a cpu must switch to when its current process stops running
+*/
+process_t* scheduler_next_process(cpu_t* cpu, thread_t** thread)
+{
+    process_t* tr = scheduler_take_process(cpu);
+    if(!tr) {*thread = cpu->idle->active_thread; return cpu->idle;}
+
+    *thread = scheduler_take_thread(tr);
+    if(!*thread) *thread = tr->active_thread;
+    return tr;
+}
+
+/*
+* Switch the current process/thread of the cpu (called by schedule_switch, on the cpu switch stack)
+* The old process context is saved, so it can be put back in queue (if it is still running)
+*/
+void scheduler_switch_process(cpu_t* cpu, process_t* process, thread_t* thread)
+{
+    process_t* old = cpu->current;
+    account_switch(cpu, thread);
+
+    process->active_thread = thread;
+    process->on_cpu = true;
+    cpu->current = process;
+    fpu_switch(cpu, thread);
+    //the TLS segment is reloaded with the thread segment registers
+    gdt_set_tls(cpu->index, thread->tls_base);
+
+    if(old && (old != process) && (old != cpu->idle))
+    {
+        //we are not on the kernel stack of the exited process anymore, we can free it
+        if(old->status == PROCESS_STATUS_ZOMBIE) kfree((void*) old->active_thread->base_kstack);
+
+        spin_lock(&old->lock);
+        bool zombie = (old->status == PROCESS_STATUS_ZOMBIE);
+        if(!zombie) old->on_cpu = false;
+        bool requeue = (old->status == PROCESS_STATUS_RUNNING);
+        spin_unlock(&old->lock);
+        if(requeue) scheduler_put_process(old);
+        //wait() frees a zombie once it sees it off the cpu : this must be our last access to it
+        if(zombie) {asm volatile("":::"memory"); old->on_cpu = false;}
+    }
+
+    signal_switch_exit(process, thread);
+}
+
+/*
+* Forbid the timer to switch away from the current thread (kernel code that can't be moved but must not mask interrupts)
+* Calls can nest ; the thread must not sleep before preempt_enable()
+*/
+void preempt_disable()
+{
+    process_t* process = current_process;
+    if(process && process->active_thread) process->active_thread->preempt_count++;
+}
+
+/*
+* Allow preemption again, switching now if a switch was refused meanwhile
+*/
+void preempt_enable()
+{
+    process_t* process = current_process;
+    if((!process) || (!process->active_thread)) return;
+    if(--process->active_thread->preempt_count) return;
+    if(get_current_cpu()->need_resched) cond_resched();
+}
+
+/*
+* Preemption point for long kernel loops : give the cpu to another thread if one is waiting
+* (does nothing with interrupts masked or preemption disabled)
+*/
+void cond_resched()
+{
+    if(!scheduler_started) return;
+    u32 flags = irq_save();
+    cpu_t* cpu = get_current_cpu();
+    process_t* process = cpu->current;
+    bool resched = (process != cpu->idle) && (!process->active_thread->preempt_count) && (cpu->need_resched || cpu->load);
+    irq_restore(flags);
+    if((!resched) || (!(flags & 0x200))) return;
+
+    //enter the scheduler as the reschedule IPI does (its EOI is harmless : no interrupt is in service here)
+    asm volatile("int %0"::"N"(IPI_SCHEDULE_VECTOR):"memory");
+}
+
+/*
+* Timer work of the scheduler (called by schedule() and schedule_ipi(), before choosing the next process)
+* Sleeping processes and load balancing are handled by the BSP only
+*/
+void scheduler_tick(u32 pit)
+{
+    account_update();
+    if(get_current_cpu()->index) return;
+
+    //the PIT only ticks if the local APIC timer is not used ; then the BSP tells the other cpus to schedule too
+    if(pit) {time_pit_tick(); smp_broadcast_schedule();}
+
+    scheduler_sleep_update();
+    scheduler_balance();
+}
+
+/*
+* Convert microseconds to local APIC timer ticks
+*/
+static u32 scheduler_us_to_lapic(u32 us)
+{
+    u32 lo, hi, q, divisor = 1000;
+    asm("mull %3":"=a"(lo), "=d"(hi):"a"(us), "rm"(lapic_timer_frequency));
+    if(hi >= divisor) return 0xFFFFFFFF;
+    asm("divl %2":"=a"(q), "+d"(hi):"rm"(divisor), "0"(lo));
+    return q ? q : 1;
+}
+
+/*
+* Program the local APIC timer of the cpu for the next scheduler event :
+* the end of the current process quantum, or the next sleeping process to wake up (on the BSP)
+* If the cpu is idle with nothing to wait for, the timer is stopped
+*/
+void scheduler_timer_arm(cpu_t* cpu)
+{
+    bool armed = false;
+    u32 next_us = 0;
+
+    if(cpu->current != cpu->idle) {next_us = SCHEDULER_QUANTUM_US; armed = true;}
+    else if(cpu->load) {next_us = 0; armed = true;}
+
+    if(!cpu->index && sleep_queue.head)
+    {
+        spin_lock(&sleep_queue.lock);
+        if(sleep_queue.head)
+        {
+            u32 deadline = SLEEP_NODE_THREAD(sleep_queue.head)->sleep_deadline;
+            u32 now = get_uptime_us();
+            u32 delay = time_before(now, deadline) ? (deadline - now) : 0;
+            if(!armed || (delay < next_us)) next_us = delay;
+            armed = true;
+        }
+        spin_unlock(&sleep_queue.lock);
+    }
+
+    lapic_timer_oneshot(armed ? scheduler_us_to_lapic(next_us) : 0);
+}
+
+/*
+* Tell the interrupt controllers that the interrupt that called the scheduler was handled, and program the next timer interrupt
+*/
+void scheduler_end(cpu_t* cpu)
+{
+    if(lapic_base) lapic_eoi();
+    if(lapic_timer_frequency) scheduler_timer_arm(cpu);
+    else if(!cpu->index) outb(0x20, 0x20);
+}
+
 /*
 * Add a process to the scheduler
 */
 void scheduler_add_process(process_t* process)
 {
-    if((process != idle_process) && (process->status == PROCESS_STATUS_RUNNING)) return;
+    spin_lock(&process->lock);
+    if(process->status == PROCESS_STATUS_RUNNING) {spin_unlock(&process->lock); return;}
     process->status = PROCESS_STATUS_RUNNING;
-    queue_add(p_ready_queue, process);
+    //if the process is still running on a cpu (being switched out), that cpu will put it back in queue
+    bool put = !process->on_cpu;
+    spin_unlock(&process->lock);
+
+    if(put) scheduler_put_process(process);
 }
 
 /*
@@ -65,14 +384,19 @@ void scheduler_remove_process(process_t* process)
 {
     if(current_process == process)
     {
-        process_t* tswitch = queue_take(p_ready_queue);
-        if(!tswitch) tswitch = idle_process;
+        asm("cli"); //critical section, we don't want the process to be scheduled from here
+
+        //the process must not be put back in queue when switched out
+        spin_lock(&process->lock);
+        if(process->status == PROCESS_STATUS_RUNNING) process->status = PROCESS_STATUS_ASLEEP_THREADS;
+        spin_unlock(&process->lock);
+
+        thread_t* tthread = 0;
+        process_t* tswitch = scheduler_next_process(get_current_cpu(), &tthread);
 
         //if no active thread, the thread was already removed before
         if(current_process->active_thread)
         {
-            asm("cli"); //critical section, we don't want the process to be scheduled from here
-            
             //this method was called by this process to pause himself
             //once he returns active, the context must be the end of this void
             //so we can just save the current context with eip = end of scheduler_remove_process
@@ -98,165 +422,153 @@ void scheduler_remove_process(process_t* process)
         }
         
         /* we directly jump to the part of schedule function that switch processes */
-        __asm__ __volatile__("jmp schedule_switch"::"a"(tswitch->active_thread), "d"(tswitch));
+        __asm__ __volatile__("jmp schedule_switch"::"a"(tthread), "d"(tswitch));
 
         rmv: return;
     }
-    else queue_remove(p_ready_queue, process);
+    else
+    {
+        //remove the process from the run queue it is on (if it is running on another cpu, it won't be put back in queue)
+        while(process->queued)
+        {
+            cpu_t* cpu = &cpus[process->cpu];
+            spin_lock(&cpu->queue_lock);
+            if(process->queued && (process->cpu == cpu->index))
+            {
+                queue_remove(cpu->ready_queue, process);
+                process->queued = false;
+                cpu->load--;
+            }
+            spin_unlock(&cpu->queue_lock);
+        }
+    }
 }
 
 /*
 * Put a process to sleep, either for an ammount of time or to wait an IRQ
 * valid 'sleep_reason' are : SLEEP_WAIT_IRQ, SLEEP_TIME
+* The thread is linked (by the nodes embedded in it) to the sleep queue and/or the irq queue, so nothing is allocated
+* Lock order is sleep_queue, then irq queue ; when both a timeout and an irq are awaited, the one that unlinks the thread
+* from the irq queue is the one that wakes it up
 */
 void scheduler_wait_thread(process_t* process, thread_t* thread, u8 sleep_reason, u16 sleep_data, u16 wait_time)
 {
-    while(mutex_lock(wait_mutex) != ERROR_NONE) mutex_wait(wait_mutex);
+    bool timed = wait_time && ((sleep_reason == SLEEP_WAIT_IRQ) | (sleep_reason == SLEEP_TIME));
+    bool irq = (sleep_data <= 20) && (sleep_reason == SLEEP_WAIT_IRQ);
+    if(!timed && !irq) return;
 
-    /* if we need to sleep a certain ammount of time */
-    dlist_entry_t* wait_entry = 0;
-    if(wait_time && ((sleep_reason == SLEEP_WAIT_IRQ) | (sleep_reason == SLEEP_TIME)))
-    {
-        dlist_entry_t* ptr = wait_list;
-        dlist_entry_t* last = 0;
-        u32 cumulated_time = wait_time;
+    spin_lock(&sleep_queue.lock);
 
-        /* we have to calculate the right place of this process in the list by calculating cumulated time */
-        while(ptr && cumulated_time)
-        {
-            //getting the time of this list element
-            u32 element_time = ((u32*)ptr->element)[1];
-            //if the cumulated time of this list element is less than our process, we break : the entry needs to be right before that
-            if(cumulated_time < element_time) break;
-            //recalculate cumulated time of our process
-            cumulated_time -= element_time; 
-            //iterate through the list
-            last = ptr;
-            ptr = ptr->next;
-        }
+    //thread status is set before linking : a waker can't see the thread before it is marked asleep
+    thread->status = irq ? THREAD_STATUS_ASLEEP_IRQ : THREAD_STATUS_ASLEEP_TIME;
+    thread->sleep_reason = irq ? SLEEP_WAIT_IRQ : SLEEP_TIME;
 
-        //found a place in the list, allocate entry and put it
-        wait_entry = kmalloc(sizeof(dlist_entry_t));
-        if(!last) {wait_list = wait_entry; ptr = 0;}
-        else {last->next = wait_entry;}
-        wait_entry->next = ptr;
-        wait_entry->prev = last;
-
-        //allocate space for time/process and put it into the entry
-        uintptr_t* element = kmalloc(sizeof(uintptr_t)*3);
-        element[0] = (uintptr_t) process;
-        element[1] = wait_time;
-        element[2] = (uintptr_t) thread;
-        wait_entry->element = element;
-
-        //set thread status
-        thread->status = THREAD_STATUS_ASLEEP_TIME;
+    /* if we need to sleep a certain ammount of time */
+    bool kick_bsp = false;
+    if(timed)
+    {
+        u32 deadline = get_uptime_us() + ((u32) wait_time)*1000;
+        thread->sleep_deadline = deadline;
+        thread->sleep.process = process;
+        thread->sleep.exclusive = false;
+
+        /* the queue is sorted by deadline : the node needs to be right before the first one that expires after us */
+        wait_node_t* ptr = sleep_queue.head;
+        while(ptr && !time_before(deadline, SLEEP_NODE_THREAD(ptr)->sleep_deadline)) ptr = ptr->next;
+        wait_link(&sleep_queue, &thread->sleep, ptr);
+
+        //the BSP wakes up sleeping processes : if we are the next one and it could be idle/waiting for a later deadline, tell it to re-program its timer
+        if((sleep_queue.head == &thread->sleep) && lapic_timer_frequency && get_current_cpu()->index) kick_bsp = true;
     }
 
     /* if we need to wait for an irq */
-    if((sleep_data <= 20) && (sleep_reason == SLEEP_WAIT_IRQ))
+    if(irq)
     {
-        //pointer to the list
-        list_entry_t** ptr = &irq_list[sleep_data];
-        //while there are elements in the list, we iterate through
-        while(*ptr) ptr = &((*ptr)->next);
-        //we allocate space and set entry data (our process)
-        (*ptr) = kmalloc(sizeof(list_entry_t));
-        (*ptr)->next = 0;
-        u32* element = kmalloc(sizeof(u32)*3);
-        element[0] = (uintptr_t) process;
-        element[1] = (uintptr_t) wait_entry;
-        element[2] = (uintptr_t) thread;
-        (*ptr)->element = element;
-
-        //set thread status
-        thread->status = THREAD_STATUS_ASLEEP_IRQ;
+        wait_queue_t* queue = &irq_queues[sleep_data];
+        thread->wait.process = process;
+        thread->wait.exclusive = false;
+        spin_lock(&queue->lock);
+        wait_link(queue, &thread->wait, 0);
+        spin_unlock(&queue->lock);
     }
 
-    mutex_unlock(wait_mutex);
+    spin_unlock(&sleep_queue.lock);
+    if(kick_bsp) smp_reschedule(&cpus[0]);
     scheduler_remove_thread(process, thread);
+
+    //we were woken up either by the timer or by the irq : leave the other queue
+    wait_remove(&thread->sleep);
+    wait_remove(&thread->wait);
 }
 
 /*
-* Update the wait_list of processes, to decrease elapsed time (called by schedule())
+* Wake up the processes of the sleep queue whose deadline has passed (called by scheduler_tick(), on the BSP)
 */
 void scheduler_sleep_update()
 {
-    //u32 esi = 0; asm("mov %%esi, %%eax":"=a"(esi));
-    //u32 edi = 0; asm("mov %%edi, %%eax":"=a"(edi));
-    //if(esi != 0x0 || current_process->active_thread->gregs.esi != 0x0) kprintf("%lschedule ; esi = 0x%X (current_process->esi = 0x%X)\n edi = 0x%X (current_process->edi = 0x%X)\n", 3, esi, current_process->active_thread->gregs.esi, edi, current_process->active_thread->gregs.edi);
-
-    //check if there are processes on the list
-    if(!wait_list) return;
-    if(mutex_lock(wait_mutex) != ERROR_NONE) return;
-
-    dlist_entry_t* ptr = wait_list;
-    u32* element = ptr->element;
-    //remove 55 ms to the top element (schedule is executed ~ every 55 ms)
-    if(element[1] > 55) element[1] -= 55;
-    //one element as reach 0, put it back in queue
-    else
-    {
-        wait_list = 0;
-        do
-        {
-            scheduler_add_thread((process_t*) element[0], (thread_t*) element[2]);
+    //check if there are processes on the queue
+    if(!sleep_queue.head) return;
 
-            dlist_entry_t* to_free = ptr;
-            ptr = ptr->next;
-            wait_list = ptr;
-            kfree(to_free);
+    wait_node_t* woken = 0;
+    spin_lock(&sleep_queue.lock);
 
-            if(!ptr) break;
+    u32 now = get_uptime_us();
+    while(sleep_queue.head)
+    {
+        wait_node_t* node = sleep_queue.head;
+        thread_t* thread = SLEEP_NODE_THREAD(node);
+        if(time_before(now, thread->sleep_deadline)) break;
+        wait_unlink(&sleep_queue, node);
 
-            element = ptr->element;
-        }
-        while(!element[1]); //while the elements have a value of 0, we add them on queue
+        //if the irq came first, its worker already owns the wakeup
+        if((thread->sleep_reason == SLEEP_WAIT_IRQ) && !wait_remove(&thread->wait)) continue;
+
+        node->next = woken;
+        woken = node;
     }
 
-    mutex_unlock(wait_mutex);
+    spin_unlock(&sleep_queue.lock);
+
+    while(woken)
+    {
+        wait_node_t* next = woken->next;
+        scheduler_add_thread(woken->process, SLEEP_NODE_THREAD(woken));
+        woken = next;
+    }
 }
 
+static volatile u32 irq_pending = 0;
+static void scheduler_irq_work(void* data);
+static work_t irq_work = WORK_INIT(scheduler_irq_work, 0);
+
 /*
 * Wake up every process that needed to be on irq x (called by every irq)
-* TODO : better algo (use double ptrs)
+* The wait lists are walked later by the irq worker, to keep the irq short
 */
 void scheduler_irq_wakeup(u32 irq)
 {
-    if(!irq_list[irq]) return;
+    if(!irq_queues[irq].head) return;
+    atomic_or(&irq_pending, 1u << irq);
+    queue_irq_work(&irq_work);
+}
 
-    /* we need to remove/free every element of the list and add every process to the scheduler */
-    while(mutex_lock(wait_mutex) != ERROR_NONE) mutex_wait(wait_mutex);
-    u32* element = irq_list[irq]->element;
+/*
+* Wake up every process that needed to be on irq x
+*/
+static void scheduler_irq_wake(u32 irq)
+{
+    wake_up_all(&irq_queues[irq]);
+}
 
-    if(element[1])
-    {
-        dlist_entry_t* wlist_entry = (dlist_entry_t*) element[1];
-        if(wlist_entry == wait_list) wait_list = wlist_entry->next;
-        if(wlist_entry->prev) wlist_entry->prev->next = wlist_entry->next;
-        if(wlist_entry->next) wlist_entry->next->prev = wlist_entry->prev;
-        kfree(wlist_entry->element); kfree(wlist_entry);
-    }
-    scheduler_add_thread((process_t*) element[0], (thread_t*) element[2]);
-    list_entry_t* ptr = irq_list[irq]->next;
-    kfree(irq_list[irq]->element); kfree(irq_list[irq]); irq_list[irq] = 0;
-    while(ptr)
-    {
-        element = ptr->element;
-        if(element[1])
-        {
-            dlist_entry_t* wlist_entry = (dlist_entry_t*) element[1];
-            if(wlist_entry == wait_list) wait_list = wlist_entry->next;
-            else if(wlist_entry->prev) wlist_entry->prev->next = wlist_entry->next;
-            if(wlist_entry->next) wlist_entry->next->prev = wlist_entry->prev;
-            kfree(wlist_entry->element); kfree(wlist_entry);
-        }
-        scheduler_add_thread((process_t*) element[0], (thread_t*) element[2]);
-        list_entry_t* to_free = ptr;
-        ptr = ptr->next;
-        kfree(to_free->element);
-        kfree(to_free);
-    }
+/*
+* Wake up the processes waiting on the irqs that fired since the last run (run by the irq worker)
+*/
+static void scheduler_irq_work(void* data)
+{
+    (void) data;
+    u32 pending = atomic_xchg(&irq_pending, 0);
 
-    mutex_unlock(wait_mutex);
+    u32 irq;
+    for(irq = 0; irq <= 20; irq++)
+        if(pending & (1u << irq)) scheduler_irq_wake(irq);
 }
@@ -17,67 +17,66 @@
 
 # SCHEDULER (assembly because we need it optimized/we have to get to the lowest possible level)
 
-.extern current_process
-.extern p_ready_queue
-.extern queue_take
-.extern idle_process
-.extern current_page_directory
-.extern scheduler_sleep_update
-.extern handle_signals
-.extern TSS
+.extern get_current_cpu
+.extern scheduler_pick_next
+.extern scheduler_switch_process
+.extern scheduler_end
+.extern scheduler_tick
+.extern signal_interrupt_exit
+
+# offsets in cpu_t (cpu/cpu.h)
+.equ CPU_CURRENT_PROCESS, 0x0
+.equ CPU_IDLE_PROCESS, 0x4
+.equ CPU_TSS, 0x8
+.equ CPU_SWITCH_STACK, 0xC
+.equ CPU_PAGE_DIRECTORY, 0x10
 
 .global schedule
+.global schedule_ipi
 .global schedule_switch
 schedule:
     /* save interrupt context */
     pushal
 
-    /* call sleep update to update time of sleeping processes */
-    call scheduler_sleep_update
-
-    /* call handle_signals to handle every incoming process signal */
-    call handle_signals
-
-    /* call queue_take to get the next processus (in edx) */
-    pushl p_ready_queue
-    call queue_take
+    /* scheduler_tick(1) : clock tick from the PIT (updates sleeping processes, handles signals, ...) */
+    pushl $0x1
+    call scheduler_tick
     add $0x4, %esp
-    mov %eax, %edx
+    jmp schedule_common
 
-    /* if !edx, and no next thread, we return */
-    movl current_process, %ebx
-
-    test %edx, %edx
-    jnz get_next_thread # we have a process switch to do
+    /* reschedule IPI, or local APIC timer */
+schedule_ipi:
+    pushal
 
-    /* get old process new thread in eax */
-    pushl 0x4(%ebx)
-    call queue_take
+    pushl $0x0
+    call scheduler_tick
     add $0x4, %esp
 
-    test %eax, %eax
-    jz schedule_pop # if zero we have no more processes and no more threads
-    
-    mov %ebx, %edx # we don't switch processes, just threads
-    jmp schedule_save
+    schedule_common:
+    /* get current cpu in edi */
+    call get_current_cpu
+    mov %eax, %edi
 
-    /* if we are switching processes, get new process new thread in eax */
-    get_next_thread:
-    pushl 0x4(%edx)
-    call queue_take
-    add $0x4, %esp
-    test %eax, %eax
-    jnz schedule_save # there is another thread, we'll switch to that
+    /* call scheduler_pick_next(cpu, &thread) to get the next process (in edx) and thread (in eax) */
+    subl $0x4, %esp
+    pushl %esp
+    pushl %edi
+    call scheduler_pick_next
+    add $0x8, %esp
+    mov %eax, %edx
+    popl %eax
 
-    /* if new process has only one thread, we take back the active thread in eax */
-    old_thread:
-    mov (%edx), %eax
+    /* if !edx, we keep the same thread and we return */
+    test %edx, %edx
+    jz schedule_pop
+
+    movl CPU_CURRENT_PROCESS(%edi), %ebx
 
     schedule_save:
     /* if(current process && current_process != idle_process) we save current process context */
     test %ebx, %ebx
     je schedule_switch
-    cmp %ebx, idle_process
+    cmp %ebx, CPU_IDLE_PROCESS(%edi)
     je schedule_switch
 
     movl (%ebx), %ecx # move active thread in ecx
@@ -125,18 +124,30 @@ schedule:
     mov %fs, 0x20(%ecx)
     mov %gs, 0x24(%ecx)
 
-    /* put the process back in queue */
-    cmp %edx, %ebx # if we are not switching process, just go to switch
-    je schedule_switch
-
-    pushl %ebx
-    pushl p_ready_queue
-    call queue_add
-    add $0x8, %esp
-
+    /* eax = thread to switch to ; edx = process to switch to */
     schedule_switch:
-    movl %edx, current_process # switch current_process
-    movl %eax, (%edx) # switch active_thread
+    /* get current cpu in edi (we can be jumped to from C code) */
+    pushl %edx
+    pushl %eax
+    call get_current_cpu
+    mov %eax, %edi
+    popl %eax
+    popl %edx
+
+    /*
+    * from here, we don't use the old thread stack anymore (another cpu could take back the thread) : use the cpu switch stack
+    * scheduler_switch_process(cpu, process, thread) switches current_process/active_thread and puts the old process back in queue
+    */
+    movl CPU_SWITCH_STACK(%edi), %esp
+    pushl %eax
+    pushl %edx
+    pushl %eax
+    pushl %edx
+    pushl %edi
+    call scheduler_switch_process
+    add $0xC, %esp
+    popl %edx
+    popl %eax
 
     /* restore segment registers */
     mov 0x18(%eax), %ds
@@ -146,14 +157,14 @@ schedule:
 
     /* restore page directory */
     movl 0x10(%edx), %esi
-    leal 0x40000000(%esi), %edi
-    movl %edi, %cr3
-    movl %esi, current_page_directory
+    leal 0x40000000(%esi), %ebx
+    movl %ebx, %cr3
+    movl %esi, CPU_PAGE_DIRECTORY(%edi)
 
     /* restore TSS.esp0 (to match process kstack, usefull on a syscall / interrupt) */
     movl 0x3C(%eax), %esi
-    movl $TSS, %edi
-    movl %esi, 0x4(%edi)
+    movl CPU_TSS(%edi), %ebx
+    movl %esi, 0x4(%ebx)
 
     /*
     * if process was in usermode, we push esp and ss (and let iret do the job)
@@ -178,6 +189,13 @@ schedule:
     push 0x2C(%eax) # push cs
     push 0x30(%eax) # push eip
 
+    /* tell the interrupt controllers that we have handled interrupt, and program the next timer interrupt */
+    pushl %eax
+    pushl %edi
+    call scheduler_end
+    add $0x4, %esp
+    popl %eax
+
     /* restore general registers */
     movl (%eax), %edi # edi
     movl 0x4(%eax), %esi # esi
@@ -190,14 +208,17 @@ schedule:
     jmp schedule_end
 
     schedule_pop:
+    /* the interrupted thread keeps running : deliver its pending signals if it goes back to user mode */
+    pushl %esp
+    call signal_interrupt_exit
+    add $0x4, %esp
+
+    /* tell the interrupt controllers that we have handled interrupt, and program the next timer interrupt */
+    pushl %edi
+    call scheduler_end
+    add $0x4, %esp
     popal
 
     schedule_end:
-    /* tell the pic that we have handled interrupt */
-    push %ax
-    mov $0x20, %al
-    out %al, $0x20 
-    pop %ax
-
     sti
     iret
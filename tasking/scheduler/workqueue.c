@@ -0,0 +1,184 @@
+/*  
+    This file is part of VK.
+    Copyright (C) 2018 Valentin Haudiquet
+
+    VK is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2.
+
+    VK is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with VK.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tasking/task.h"
+#include "sync/sync.h"
+
+/*
+* Workqueues : work is queued from any context (including interrupt handlers), and run later by a pool of kernel threads
+* A work item is never run by two workers at the same time : if it is queued while running, it will be run again after
+* Works that wait for the disk (readahead, writeback, eviction) go to their own pool (queue_io_work()),
+* so that they can't keep the shared workers busy while the other works wait
+* The irq wakeup work has a worker of its own (queue_irq_work()) : every other work can end up waiting for an irq
+*/
+
+#define IO_WORKERS 2 //workers of the io pool
+
+typedef struct worker
+{
+    process_t* process;
+    thread_t* thread;
+    struct workqueue* queue;
+    struct worker* next_idle;
+} worker_t;
+
+typedef struct workqueue
+{
+    work_t* head;
+    work_t* tail;
+    worker_t* idle_workers;
+    spinlock_t lock;
+} workqueue_t;
+
+static workqueue_t kernel_queue = {0};
+static workqueue_t io_queue = {0};
+static workqueue_t irq_queue = {0};
+
+static void worker_main(void* arg);
+
+/*
+* Start 'count' workers running the works of the queue
+*/
+static void workqueue_start(workqueue_t* queue, u32 count)
+{
+    u32 i;
+    for(i = 0; i < count; i++)
+    {
+        worker_t* worker = kmalloc(sizeof(worker_t));
+        worker->next_idle = 0;
+        worker->queue = queue;
+        worker->process = create_kernel_process(worker_main, worker);
+        worker->thread = worker->process->active_thread;
+    }
+}
+
+/*
+* Create the worker pools (called by kmain(), once the cpus are started)
+*/
+void workqueue_init()
+{
+    kprintf("Starting kernel workers...");
+
+    //one worker per cpu, and one more so that a sleeping work does not block the others
+    workqueue_start(&kernel_queue, cpu_count + 1);
+    workqueue_start(&io_queue, IO_WORKERS);
+    workqueue_start(&irq_queue, 1);
+
+    vga_text_okmsg();
+}
+
+/*
+* Append a work to the queue (queue lock must be held)
+*/
+static void work_append(workqueue_t* queue, work_t* work)
+{
+    spin_assert_held(&queue->lock);
+    work->next = 0;
+    if(queue->tail) queue->tail->next = work;
+    else queue->head = work;
+    queue->tail = work;
+}
+
+/*
+* Queue a work on the queue, waking up an idle worker of it
+*/
+static bool workqueue_queue(workqueue_t* queue, work_t* work)
+{
+    spin_lock(&queue->lock);
+    if(work->pending) {spin_unlock(&queue->lock); return false;}
+    work->pending = true;
+
+    //if the work is running, the worker running it will run it again
+    worker_t* worker = 0;
+    if(!work->running)
+    {
+        work_append(queue, work);
+        worker = queue->idle_workers;
+        if(worker) queue->idle_workers = worker->next_idle;
+    }
+    spin_unlock(&queue->lock);
+
+    if(worker) scheduler_add_thread(worker->process, worker->thread);
+    return true;
+}
+
+/*
+* Queue a work to be run by a worker (can be called from any context)
+* Returns false if the work was already pending
+*/
+bool queue_work(work_t* work)
+{
+    return workqueue_queue(&kernel_queue, work);
+}
+
+/*
+* Queue a work that waits for the disk, to be run by a worker of the io pool (can be called from any context)
+* A work must always be queued on the same pool
+* Returns false if the work was already pending
+*/
+bool queue_io_work(work_t* work)
+{
+    return workqueue_queue(&io_queue, work);
+}
+
+/*
+* Queue the work waking up the irq waiters, to be run by the irq worker (called by the irq handlers)
+* Returns false if the work was already pending
+*/
+bool queue_irq_work(work_t* work)
+{
+    return workqueue_queue(&irq_queue, work);
+}
+
+/*
+* Main loop of a worker : run queued works, and sleep when there are none
+*/
+static void worker_main(void* arg)
+{
+    worker_t* worker = arg;
+    workqueue_t* queue = worker->queue;
+
+    while(1)
+    {
+        spin_lock(&queue->lock);
+        work_t* work = queue->head;
+        if(work)
+        {
+            queue->head = work->next;
+            if(!queue->head) queue->tail = 0;
+            work->pending = false;
+            work->running = true;
+        }
+        else
+        {
+            //going to sleep : if queue_work() wakes us before we do, scheduler_remove_thread() will return immediately
+            worker->thread->status = THREAD_STATUS_ASLEEP_WORK;
+            worker->next_idle = queue->idle_workers;
+            queue->idle_workers = worker;
+        }
+        spin_unlock(&queue->lock);
+
+        if(!work) {scheduler_remove_thread(worker->process, worker->thread); continue;}
+
+        work->func(work->data);
+
+        spin_lock(&queue->lock);
+        work->running = false;
+        if(work->pending) work_append(queue, work);
+        spin_unlock(&queue->lock);
+    }
+}
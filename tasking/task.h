@@ -22,6 +22,8 @@
 #include "filesystem/fs.h"
 #include "io/io.h"
 #include "processes/signal.h"
+#include "cpu/cpu.h"
+#include "sync/sync.h"
 
 //ELF loading
 error_t elf_check(fd_t* file);
@@ -37,9 +39,12 @@ void* elf_load(fd_t* file, u32* page_directory, list_entry_t* data_loc, u32* dat
 #define THREAD_STATUS_RUNNING 1
 #define THREAD_STATUS_ASLEEP_TIME 2
 #define THREAD_STATUS_ASLEEP_IRQ 3
+#define THREAD_STATUS_ASLEEP_JOIN 4
 #define THREAD_STATUS_ASLEEP_IO 5
 #define THREAD_STATUS_ASLEEP_CHILD 6
 #define THREAD_STATUS_ASLEEP_MUTEX 7
+#define THREAD_STATUS_ASLEEP_WORK 8
+#define THREAD_STATUS_ASLEEP_FUTEX 9
 #define THREAD_STATUS_ZOMBIE 10
 
 //Process groups and sessions
@@ -57,9 +62,10 @@ typedef struct pgroup
 } pgroup_t;
 
 //Signals
-void signals_init();
+typedef u32 sigset_t; //one bit per signal number
 void send_signal(int pid, int sig);
 void send_signal_to_group(int gid, int sig);
+void handle_signals();
 
 //Processes
 typedef struct THREAD
@@ -74,7 +80,46 @@ typedef struct THREAD
     u32 base_stack;
     u32 base_kstack;
     u32 status;
+    //FPU/SSE state (allocated on first use)
+    void* fpu_state;
+    u32 fpu_cpu; //index of the cpu the state was last loaded on
+    //cpu time used (microseconds)
+    u64 utime;
+    u64 stime;
+    //wait queue nodes (generic wait queues / scheduler sleep queue)
+    wait_node_t wait;
+    wait_node_t sleep;
+    u32 sleep_deadline; //uptime (microseconds) at which the thread must be woken up
+    u8 sleep_reason;
+    u32 futex_key; //physical address of the futex the thread waits on
+    //user threads
+    int tid; //thread id (unique in the process, 0 for the main thread)
+    struct THREAD* next_thread; //next thread of the process (threads list)
+    u32 exit_value;
+    bool joined; //a thread is already joining this one
+    wait_queue_t join_queue;
+    u32 tls_base; //base of the TLS segment (GDT_TLS_SELECTOR)
+    //signals
+    sigset_t sigpending; //sent to this thread
+    sigset_t sigblocked;
+    u32 sigreturn; //user address of the signal frame to restore (set by sigret)
+    int sigfault; //signal raised by the fault being handled (delivered before returning to the faulting instruction)
+    u32 preempt_count; //the timer can't switch away from the thread kernel code while non zero
 } __attribute__((packed)) thread_t;
+
+//memory mappings (memory/mmap.c)
+typedef struct vm_area
+{
+    u32 start; //page aligned
+    u32 end; //first address after the area
+    u32 prot; //VK_PROT_*
+    u32 flags; //VK_MAP_*
+    fd_t* file; //mapped file (the area holds an instance), 0 for anonymous memory
+    u64 offset; //offset in the file of the first page
+    radix_tree_t pages; //cache pages mapped by the area, indexed by virtual page number
+    struct vm_area* next; //areas are sorted by address
+} vm_area_t;
+
 typedef struct PROCESS
 {
     //threads
@@ -101,14 +146,48 @@ typedef struct PROCESS
     pgroup_t* group;
     psession_t* session;
     u32 status;
-    list_entry_t* children;
+    struct PROCESS* children; //first child (linked through sibling_next/sibling_prev)
     struct PROCESS* parent;
     //signals
     void* signal_handlers[NSIG];
     //current directory
     char current_dir[100];
+    //smp
+    u32 cpu; //index of the cpu the process is queued on / last ran on
+    bool on_cpu; //the process is running on a cpu (its context is not saved yet)
+    bool queued; //the process is on a cpu run queue
+    spinlock_t lock; //protects status and threads lists
+    //cpu time used by the threads, and by the waited children (microseconds)
+    u64 utime;
+    u64 stime;
+    u64 cutime;
+    u64 cstime;
+    //every thread of the process (running, asleep or zombie)
+    thread_t* threads;
+    u32 thread_count; //number of threads that did not exit
+    int next_tid;
+    struct PROCESS* pid_next; //next process in the same pid hash bucket
+    //children that exited and were not waited yet (oldest first), and threads waiting for them
+    spinlock_t children_lock; //protects children, zombies, and the sibling/zombie links of the children
+    struct PROCESS* sibling_next;
+    struct PROCESS* sibling_prev;
+    struct PROCESS* zombies;
+    struct PROCESS* zombies_tail;
+    struct PROCESS* zombie_next;
+    struct PROCESS* zombie_prev;
+    u32 exited_children; //bumped by every child exit (so that a waiter can't miss one)
+    wait_queue_t child_queue;
+    //signals sent to the process (taken by the first thread that does not block them)
+    sigset_t sigpending;
+    sigset_t sigdefault; //signals waiting for their default action (run by the signal worker)
+    struct PROCESS* signal_next;
+    bool signal_queued;
+    //memory mappings
+    vm_area_t* mmaps;
+    mutex_t mmap_lock; //protects the areas, and serializes the faults on them
 } __attribute__((packed)) process_t;
 
+#define PID_MAX 32768
 #define PROCESS_INVALID_PID -1
 #define PROCESS_KERNEL_PID -2
 #define PROCESS_IDLE_PID -3
@@ -124,12 +203,23 @@ error_t spawn_init_process();
 void free_process_memory(process_t* process);
 error_t load_executable(process_t* process, fd_t* executable, int argc, char** argv, char** env, int envc);
 void exit_process(process_t* process, u32 exitcode);
+error_t process_wait(process_t* process, u32 idtype, int id, u32 options, int* pid, u32* status);
 u32 sbrk(process_t* process, u32 incr);
+u32 mmap(process_t* process, u32 addr, u32 length, u32 prot, u32 flags, fd_t* file, u32 offset, error_t* err);
+error_t munmap(process_t* process, u32 addr, u32 length);
+error_t msync(process_t* process, u32 addr, u32 length, u32 flags);
+error_t madvise(process_t* process, u32 addr, u32 length, u32 advice);
+bool mmap_fault(process_t* process, u32 address, bool write, bool user);
+bool mmap_contains(process_t* process, u32 address);
+void mmap_fork(process_t* parent, process_t* child);
+void mmap_release(process_t* process);
 process_t* fork(process_t* process, u32 old_esp);
 int fork_ret();
 
-extern process_t** processes;
-extern u32 processes_size;
+int pid_alloc(process_t* process);
+void pid_free(process_t* process);
+process_t* get_process(int pid);
+void pid_for_each(void (*action)(process_t* process, void* arg), void* arg);
 
 void groups_init();
 pgroup_t* get_group(int gid);
@@ -138,26 +228,57 @@ extern pgroup_t* groups;
 extern u32 groups_number;
 
 extern process_t* kernel_process;
-extern process_t* idle_process;
+#define idle_process (get_current_cpu()->idle) //idle process of the current cpu
 process_t* init_idle_process();
 process_t* init_kernel_process();
+process_t* create_kernel_process(void (*entry)(void*), void* arg);
+
+void signal_cancel(process_t* process);
+void signal_switch_exit(process_t* process, thread_t* thread);
+void signal_fault_exit(void* frame);
+sigset_t signal_mask(thread_t* thread, u32 how, sigset_t set);
 
 //THREADS
 thread_t* init_thread();
 void free_thread_memory(process_t* process, thread_t* thread);
 void scheduler_remove_thread(process_t* process, thread_t* thread);
 void scheduler_add_thread(process_t* process, thread_t* thread);
+int thread_create(process_t* process, u32 entry, u32 arg, u32 tls_base);
+void thread_exit(process_t* process, thread_t* thread, u32 value);
+error_t thread_join(process_t* process, int tid, u32* value);
+void thread_set_tls(thread_t* thread, u32 tls_base);
 
 //SCHEDULER
 extern bool scheduler_started;
-extern process_t* current_process;
+#define current_process (get_current_cpu()->current) //process running on the current cpu
 void scheduler_init();
 void scheduler_start();
 void schedule();
+void schedule_ipi();
+
+//kernel preemption
+void preempt_disable();
+void preempt_enable();
+void cond_resched();
 
 //add/remove from queue
 void scheduler_add_process(process_t* process);
 void scheduler_remove_process(process_t* process);
+process_t* scheduler_next_process(cpu_t* cpu, thread_t** thread);
+void scheduler_balance();
+
+//timer
+void scheduler_tick(u32 pit);
+void scheduler_timer_arm(cpu_t* cpu);
+void scheduler_end(cpu_t* cpu);
+void scheduler_sleep_update();
+
+//cpu time accounting
+void account_switch(cpu_t* cpu, thread_t* thread);
+void account_update();
+void account_syscall_enter();
+void account_syscall_exit();
+void account_reap(process_t* parent, process_t* child);
 
 //sleep/awake
 #define SLEEP_WAIT_IRQ 1
@@ -168,4 +289,20 @@ void scheduler_remove_process(process_t* process);
 void scheduler_wait_thread(process_t* process, thread_t* thread, u8 sleep_reason, u16 sleep_data, u16 sleep_data_2);
 void scheduler_irq_wakeup(u32 irq);
 
+//WORKQUEUES (deferred work, run by pools of kernel threads)
+typedef struct work
+{
+    void (*func)(void* data);
+    void* data;
+    volatile bool pending; //the work is queued, or has to be run again
+    volatile bool running; //a worker is running the work
+    struct work* next;
+} work_t;
+#define WORK_INIT(f, d) {(f), (d), false, false, 0}
+
+void workqueue_init();
+bool queue_work(work_t* work);
+bool queue_io_work(work_t* work);
+bool queue_irq_work(work_t* work);
+
 #endif
\ No newline at end of file
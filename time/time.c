@@ -182,3 +182,55 @@ time_t get_current_time_utc()
     cmos_time_t* ct = get_cmos_time();
     return convert_to_std_time(ct->seconds, ct->minutes, ct->hours, ct->monthday, ct->month, ct->year);
 }
+
+u32 tsc_per_us = 0;
+static u32 pit_clock_us = 0;
+
+/*
+* Get the time elapsed since boot, in microseconds
+*/
+u32 get_uptime_us()
+{
+    if(!tsc_per_us) return pit_clock_us;
+
+    u64 tsc;
+    asm volatile("rdtsc":"=A"(tsc));
+    return time_div64(tsc, tsc_per_us, 0);
+}
+
+/*
+* Get the time elapsed since boot, in milliseconds (wraps after ~49 days)
+*/
+u32 get_uptime_ms()
+{
+    if(!tsc_per_us) return pit_clock_us/1000;
+
+    u64 tsc;
+    asm volatile("rdtsc":"=A"(tsc));
+    return time_div64(tsc, tsc_per_us*1000, 0);
+}
+
+/*
+* Divide a 64 bits value by a 32 bits one (the kernel is not linked with libgcc)
+* Only the low part of the quotient is returned ; the remainder is stored in 'rem' if it is not null
+*/
+u32 time_div64(u64 value, u32 divisor, u32* rem)
+{
+    u32 hi = (u32) (value >> 32);
+    u32 lo = (u32) value;
+
+    //two steps division : the high part first, so that the quotient of the second one fits in 32 bits
+    u32 r = hi % divisor;
+    u32 q;
+    asm("divl %2":"=a"(q), "+d"(r):"rm"(divisor), "0"(lo));
+    if(rem) *rem = r;
+    return q;
+}
+
+/*
+* Advance the clock by one PIT tick (called by the scheduler when the TSC is not used)
+*/
+void time_pit_tick()
+{
+    pit_clock_us += PIT_TICK_US;
+}
@@ -8,4 +8,13 @@ time_t convert_to_std_time(u8 seconds, u8 minutes, u8 hours, u8 day, u8 month, u
 void convert_to_readable_time(time_t time, u8* seconds, u8* minutes, u8* hour, u8* day, u8* month, u8* year);
 time_t get_current_time_utc();
 
+//monotonic clock (microseconds since boot) : it wraps after ~71 minutes, so compare values with time_before()
+#define time_before(a, b) (((int32_t) ((a) - (b))) < 0)
+#define PIT_TICK_US 54925 //the PIT is not programmed, it ticks at ~18.2 Hz
+extern u32 tsc_per_us; //TSC frequency (0 : not calibrated, the clock is advanced by the PIT)
+u32 get_uptime_us();
+u32 get_uptime_ms();
+u32 time_div64(u64 value, u32 divisor, u32* rem);
+void time_pit_tick();
+
 #endif
\ No newline at end of file
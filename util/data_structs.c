@@ -174,3 +174,111 @@ void list_copy(list_entry_t* dest_list, list_entry_t* src_list, u32 size, u32 el
     before->next = 0;
     kfree(dest_list);
 }
+
+//RADIX TREES
+static radix_node_t* radix_node_alloc()
+{
+    radix_node_t* tr = 
+    #ifdef MEMLEAK_DBG
+    kmalloc(sizeof(radix_node_t), "radix tree node");
+    #else
+    kmalloc(sizeof(radix_node_t));
+    #endif
+    memset(tr, 0, sizeof(radix_node_t));
+    return tr;
+}
+
+//true if 'index' is out of the range covered by a tree of 'height' levels
+static inline bool radix_tree_too_small(u32 height, u32 index)
+{
+    if(height >= RADIX_TREE_MAX_HEIGHT) return false;
+    return (index >> (height*RADIX_TREE_SHIFT)) != 0;
+}
+
+void* radix_tree_lookup(radix_tree_t* tree, u32 index)
+{
+    if((!tree->height) || radix_tree_too_small(tree->height, index)) return 0;
+
+    radix_node_t* node = tree->root;
+    u32 level = tree->height-1;
+    while(level)
+    {
+        node = node->slots[(index >> (level*RADIX_TREE_SHIFT)) & RADIX_TREE_MASK];
+        if(!node) return 0;
+        level--;
+    }
+    return node->slots[index & RADIX_TREE_MASK];
+}
+
+/*
+* Insert 'item' at 'index' ; returns false if the slot is already used
+*/
+bool radix_tree_insert(radix_tree_t* tree, u32 index, void* item)
+{
+    if(!tree->height) {tree->root = radix_node_alloc(); tree->height = 1;}
+
+    //grow the tree from the top until the index fits
+    while(radix_tree_too_small(tree->height, index))
+    {
+        radix_node_t* root = radix_node_alloc();
+        root->slots[0] = tree->root;
+        root->count = 1;
+        tree->root = root;
+        tree->height++;
+    }
+
+    radix_node_t* node = tree->root;
+    u32 level = tree->height-1;
+    while(level)
+    {
+        u32 slot = (index >> (level*RADIX_TREE_SHIFT)) & RADIX_TREE_MASK;
+        if(!node->slots[slot]) {node->slots[slot] = radix_node_alloc(); node->count++;}
+        node = node->slots[slot];
+        level--;
+    }
+
+    u32 slot = index & RADIX_TREE_MASK;
+    if(node->slots[slot]) return false;
+    node->slots[slot] = item;
+    node->count++;
+    return true;
+}
+
+/*
+* Remove the item at 'index' (returned, 0 if there was none), freeing the nodes that become empty
+*/
+void* radix_tree_delete(radix_tree_t* tree, u32 index)
+{
+    if((!tree->height) || radix_tree_too_small(tree->height, index)) return 0;
+
+    radix_node_t* path[RADIX_TREE_MAX_HEIGHT];
+    radix_node_t* node = tree->root;
+    u32 level = tree->height-1;
+    u32 depth = 0;
+    while(level)
+    {
+        path[depth++] = node;
+        node = node->slots[(index >> (level*RADIX_TREE_SHIFT)) & RADIX_TREE_MASK];
+        if(!node) return 0;
+        level--;
+    }
+
+    void* tr = node->slots[index & RADIX_TREE_MASK];
+    if(!tr) return 0;
+    node->slots[index & RADIX_TREE_MASK] = 0;
+    node->count--;
+
+    //walk back up, unlinking empty nodes from their parent
+    while(!node->count)
+    {
+        kfree(node);
+        if(!depth) {tree->root = 0; tree->height = 0; break;}
+        depth--;
+        level++;
+        node = path[depth];
+        node->slots[(index >> (level*RADIX_TREE_SHIFT)) & RADIX_TREE_MASK] = 0;
+        node->count--;
+    }
+
+    return tr;
+}
@@ -110,4 +110,25 @@ void* stack_take(stack_t* stack);
 void* stack_look(stack_t* stack, u32 position);
 void stack_remove(stack_t* stack, void* element);
 
+//RADIX TREES (sparse arrays of pointers indexed by a u32, RADIX_TREE_SLOTS children per level)
+#define RADIX_TREE_SHIFT 6
+#define RADIX_TREE_SLOTS (1 << RADIX_TREE_SHIFT)
+#define RADIX_TREE_MASK (RADIX_TREE_SLOTS-1)
+#define RADIX_TREE_MAX_HEIGHT 6 //6*6 bits covers the whole u32 range
+typedef struct radix_node
+{
+    void* slots[RADIX_TREE_SLOTS];
+    u32 count; //used slots
+} radix_node_t;
+
+typedef struct radix_tree
+{
+    radix_node_t* root;
+    u32 height; //0 : empty tree
+} radix_tree_t;
+
+void* radix_tree_lookup(radix_tree_t* tree, u32 index);
+bool radix_tree_insert(radix_tree_t* tree, u32 index, void* item);
+void* radix_tree_delete(radix_tree_t* tree, u32 index);
+
 #endif
@@ -74,6 +74,7 @@ bool vga_setup(void)
 
     vga_text_enable_cursor();
 
+    lock_set_class(&screen_mutex, "screen");
     kprintf("%lVGA display setup done\n", 1);
     return true;
 }